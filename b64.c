@@ -0,0 +1,445 @@
+/*
+// Base64 and PEM armor handling for the hot paths, so requests go
+// straight from text to d2i_* and certificates from i2d_* to text
+// without the PEM reader/writer and their BIOs. The SIMD block coders
+// follow Wojciech Mula's and Alfred Klomp's published algorithms.
+// https://www.rfc-editor.org/rfc/rfc7468
+// http://0x80.pl/notesen/2016-01-17-sse-base64-decoding.html
+// https://github.com/aklomp/base64
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define B64_X86 1
+#include <immintrin.h>
+#endif
+
+#include "b64.h"
+
+static const char b64_alphabet[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* 0-63 for the alphabet, B64_SKIP for line breaks and blanks */
+#define B64_SKIP 0x40
+#define B64_BAD  0x80
+
+static const unsigned char b64_value[256] = {
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x40, 0x40, 0x80, 0x80, 0x40, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x40, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x3e, 0x80, 0x80, 0x80, 0x3f,
+	0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+	0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+};
+
+/* ------------------------------------------------------------ *
+ * A block coder turns dec_in characters into dec_in / 4 * 3    *
+ * bytes, or enc_in bytes into enc_in / 3 * 4 characters while  *
+ * reading up to enc_read bytes. dec returns 0 when a character *
+ * is outside the alphabet and leaves that block to the scalar  *
+ * loop.                                                        *
+ * -------------------------------------------------------------*/
+struct b64_coder {
+	const char *name;
+	size_t dec_in;
+	int (*dec)(const char *in, unsigned char *out);
+	size_t enc_in;
+	size_t enc_read;
+	void (*enc)(const unsigned char *in, char *out);
+};
+
+static const struct b64_coder b64_scalar = { "scalar", 0, NULL, 0, 0, NULL };
+
+#ifdef B64_X86
+
+__attribute__((target("ssse3")))
+static int b64_dec_ssse3(const char *in, unsigned char *out) {
+	const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_2f = _mm_set1_epi8(0x2f);
+
+	__m128i str = _mm_loadu_si128((const __m128i *) in);
+	__m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+	__m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+	__m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+	__m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+	if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0) {
+		return 0;
+	}
+
+	__m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+	__m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+	str = _mm_add_epi8(str, roll);
+
+	// pack four 6-bit values per dword into three bytes
+	str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+	str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+	str = _mm_shuffle_epi8(str, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+			-1, -1, -1, -1));
+
+	unsigned char block[16];
+	_mm_storeu_si128((__m128i *) block, str);
+	memcpy(out, block, 12);
+	return 1;
+}
+
+__attribute__((target("ssse3")))
+static void b64_enc_ssse3(const unsigned char *in, char *out) {
+	__m128i str = _mm_loadu_si128((const __m128i *) in);
+
+	// spread three bytes over four 6-bit lanes per dword
+	str = _mm_shuffle_epi8(str, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	__m128i t0 = _mm_and_si128(str, _mm_set1_epi32(0x0fc0fc00));
+	__m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	__m128i t2 = _mm_and_si128(str, _mm_set1_epi32(0x003f03f0));
+	__m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	str = _mm_or_si128(t1, t3);
+
+	// 0-63 to the alphabet by range offsets
+	const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4,
+			-19, -16, 0, 0);
+	__m128i idx = _mm_subs_epu8(str, _mm_set1_epi8(51));
+	idx = _mm_sub_epi8(idx, _mm_cmpgt_epi8(str, _mm_set1_epi8(25)));
+	str = _mm_add_epi8(str, _mm_shuffle_epi8(lut, idx));
+
+	_mm_storeu_si128((__m128i *) out, str);
+}
+
+static const struct b64_coder b64_ssse3 = { "ssse3", 16, b64_dec_ssse3, 12, 16, b64_enc_ssse3 };
+
+__attribute__((target("avx2")))
+static int b64_dec_avx2(const char *in, unsigned char *out) {
+	const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0,
+			0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+
+	__m256i str = _mm256_loadu_si256((const __m256i *) in);
+	__m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+	__m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+	__m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+	__m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+	if (! _mm256_testz_si256(lo, hi)) {
+		return 0;
+	}
+
+	__m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+	__m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+	str = _mm256_add_epi8(str, roll);
+
+	str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+	str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+	str = _mm256_shuffle_epi8(str, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+			-1, -1, -1, -1, 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+	// close the gap between the two 12-byte lanes
+	str = _mm256_permutevar8x32_epi32(str, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+
+	unsigned char block[32];
+	_mm256_storeu_si256((__m256i *) block, str);
+	memcpy(out, block, 24);
+	return 1;
+}
+
+__attribute__((target("avx2")))
+static void b64_enc_avx2(const unsigned char *in, char *out) {
+	__m256i str = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) in)),
+			_mm_loadu_si128((const __m128i *) (in + 12)), 1);
+
+	str = _mm256_shuffle_epi8(str, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+			10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	__m256i t0 = _mm256_and_si256(str, _mm256_set1_epi32(0x0fc0fc00));
+	__m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+	__m256i t2 = _mm256_and_si256(str, _mm256_set1_epi32(0x003f03f0));
+	__m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+	str = _mm256_or_si256(t1, t3);
+
+	const __m256i lut = _mm256_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4,
+			-19, -16, 0, 0, 65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+	__m256i idx = _mm256_subs_epu8(str, _mm256_set1_epi8(51));
+	idx = _mm256_sub_epi8(idx, _mm256_cmpgt_epi8(str, _mm256_set1_epi8(25)));
+	str = _mm256_add_epi8(str, _mm256_shuffle_epi8(lut, idx));
+
+	_mm256_storeu_si256((__m256i *) out, str);
+}
+
+static const struct b64_coder b64_avx2 = { "avx2", 32, b64_dec_avx2, 24, 28, b64_enc_avx2 };
+
+#endif
+
+static const struct b64_coder *b64_coder;
+
+static const struct b64_coder *b64_pick(void) {
+	const struct b64_coder *coder = __atomic_load_n(&b64_coder, __ATOMIC_ACQUIRE);
+	if (coder != NULL) {
+		return coder;
+	}
+	coder = &b64_scalar;
+#ifdef B64_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		coder = &b64_avx2;
+	} else if (__builtin_cpu_supports("ssse3")) {
+		coder = &b64_ssse3;
+	}
+#endif
+	// racing first callers all pick the same one
+	__atomic_store_n(&b64_coder, coder, __ATOMIC_RELEASE);
+	return coder;
+}
+
+const char *b64_impl(void) {
+	return b64_pick()->name;
+}
+
+int b64_use(const char *name) {
+	const struct b64_coder *coder = NULL;
+
+	if (strcmp(name, "scalar") == 0) {
+		coder = &b64_scalar;
+	}
+#ifdef B64_X86
+	__builtin_cpu_init();
+	if (strcmp(name, "ssse3") == 0 && __builtin_cpu_supports("ssse3")) {
+		coder = &b64_ssse3;
+	}
+	if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+		coder = &b64_avx2;
+	}
+#endif
+	if (coder == NULL) {
+		return 0;
+	}
+	__atomic_store_n(&b64_coder, coder, __ATOMIC_RELEASE);
+	return 1;
+}
+
+long b64_decode(const char *in, size_t len, unsigned char *out) {
+	const struct b64_coder *coder = b64_pick();
+	unsigned char *start = out;
+	unsigned int acc = 0;
+	int have = 0, pad = 0;
+
+	for (size_t idx = 0; idx < len; ) {
+		// whole blocks between line breaks go to the vector coder
+		if (coder->dec != NULL && have == 0 && pad == 0 && len - idx >= coder->dec_in &&
+				coder->dec(in + idx, out)) {
+			idx += coder->dec_in;
+			out += coder->dec_in / 4 * 3;
+			continue;
+		}
+		// then whole quads, before falling back to one character at a time
+		if (have == 0 && pad == 0 && len - idx >= 4) {
+			unsigned char v0 = b64_value[(unsigned char) in[idx]];
+			unsigned char v1 = b64_value[(unsigned char) in[idx + 1]];
+			unsigned char v2 = b64_value[(unsigned char) in[idx + 2]];
+			unsigned char v3 = b64_value[(unsigned char) in[idx + 3]];
+			if (((v0 | v1 | v2 | v3) & (B64_SKIP | B64_BAD)) == 0) {
+				unsigned int quad = v0 << 18 | v1 << 12 | v2 << 6 | v3;
+				*out++ = quad >> 16;
+				*out++ = quad >> 8;
+				*out++ = quad;
+				idx += 4;
+				continue;
+			}
+		}
+
+		unsigned char v = b64_value[(unsigned char) in[idx]];
+		char c = in[idx++];
+		if (v == B64_SKIP) {
+			continue;
+		}
+		if (c == '=') {
+			pad++;
+			continue;
+		}
+		// data after padding, or outside the alphabet
+		if (v == B64_BAD || pad > 0) {
+			return -1;
+		}
+		acc = acc << 6 | v;
+		if (++have == 4) {
+			*out++ = acc >> 16;
+			*out++ = acc >> 8;
+			*out++ = acc;
+			acc = 0;
+			have = 0;
+		}
+	}
+
+	switch (have) {
+	case 0:
+		return pad == 0 ? out - start : -1;
+	case 2:
+		if (pad > 2) {
+			return -1;
+		}
+		*out++ = acc >> 4;
+		return out - start;
+	case 3:
+		if (pad > 1) {
+			return -1;
+		}
+		*out++ = acc >> 10;
+		*out++ = acc >> 2;
+		return out - start;
+	default:
+		return -1;
+	}
+}
+
+/* readable: bytes that may be loaded from in, at least len */
+static size_t b64_encode_run(const struct b64_coder *coder, const unsigned char *in, size_t len,
+		size_t readable, char *out) {
+	char *start = out;
+
+	while (coder->enc != NULL && len >= coder->enc_in && readable >= coder->enc_read) {
+		coder->enc(in, out);
+		in += coder->enc_in;
+		out += coder->enc_in / 3 * 4;
+		len -= coder->enc_in;
+		readable -= coder->enc_in;
+	}
+	for (; len >= 3; in += 3, len -= 3) {
+		unsigned int acc = in[0] << 16 | in[1] << 8 | in[2];
+		*out++ = b64_alphabet[acc >> 18];
+		*out++ = b64_alphabet[(acc >> 12) & 0x3f];
+		*out++ = b64_alphabet[(acc >> 6) & 0x3f];
+		*out++ = b64_alphabet[acc & 0x3f];
+	}
+	if (len > 0) {
+		unsigned int acc = in[0] << 16 | (len > 1 ? in[1] << 8 : 0);
+		*out++ = b64_alphabet[acc >> 18];
+		*out++ = b64_alphabet[(acc >> 12) & 0x3f];
+		*out++ = len > 1 ? b64_alphabet[(acc >> 6) & 0x3f] : '=';
+		*out++ = '=';
+	}
+	return out - start;
+}
+
+size_t b64_encode(const unsigned char *in, size_t len, char *out) {
+	return b64_encode_run(b64_pick(), in, len, len, out);
+}
+
+/* ------------------------------------------------------------ *
+ * Line "-----<what> <label>-----", any label when label is     *
+ * NULL; *found and *found_len name the label.                  *
+ * -------------------------------------------------------------*/
+static const char *pem_line(const char *from, const char *end, const char *what,
+		const char *label, size_t label_len, const char **found, size_t *found_len) {
+	size_t what_len = strlen(what);
+
+	for (const char *p = from; p < end; ) {
+		const char *eol = memchr(p, '\n', end - p);
+		const char *line_end = eol != NULL ? eol : end;
+		const char *name = p + 6 + what_len;
+
+		if ((size_t) (line_end - p) >= 6 + what_len + 5 && memcmp(p, "-----", 5) == 0 &&
+				memcmp(p + 5, what, what_len) == 0 && p[5 + what_len] == ' ') {
+			const char *name_end = memmem(name, line_end - name, "-----", 5);
+			if (name_end != NULL && (label == NULL ||
+					((size_t) (name_end - name) == label_len && memcmp(name, label, label_len) == 0))) {
+				*found = name;
+				*found_len = name_end - name;
+				return p;
+			}
+		}
+		if (eol == NULL) {
+			break;
+		}
+		p = eol + 1;
+	}
+	return NULL;
+}
+
+int pem_next(const char *pem, const char *end, const char *label, struct pem_block *block) {
+	const char *found;
+	size_t found_len;
+
+	const char *begin = pem_line(pem, end, "BEGIN", label, label != NULL ? strlen(label) : 0,
+			&block->label, &block->label_len);
+	if (begin == NULL) {
+		return 0;
+	}
+	const char *data = memchr(begin, '\n', end - begin);
+	if (data == NULL) {
+		return 0;
+	}
+	data++;
+	const char *stop = pem_line(data, end, "END", block->label, block->label_len,
+			&found, &found_len);
+	if (stop == NULL) {
+		return 0;
+	}
+
+	// encapsulated headers (Proc-Type and friends) need the real reader
+	int headers = memchr(data, ':', stop - data) != NULL;
+	block->body = headers ? NULL : data;
+	block->body_len = headers ? 0 : (size_t) (stop - data);
+
+	const char *nl = memchr(stop, '\n', end - stop);
+	block->next = nl != NULL ? nl + 1 : end;
+	return 1;
+}
+
+int pem_is(const struct pem_block *block, const char *label) {
+	return block->label_len == strlen(label) && memcmp(block->label, label, block->label_len) == 0;
+}
+
+int pem_decode(const struct pem_block *block, struct der *out) {
+	out->len = 0;
+	if (block->body == NULL || ! der_reserve(out, B64_DECODED_MAX(block->body_len))) {
+		return 0;
+	}
+	long len = b64_decode(block->body, block->body_len, out->buf);
+	if (len <= 0) {
+		return 0;
+	}
+	out->len = len;
+	return 1;
+}
+
+void pem_encode(struct der *out, const char *label, const unsigned char *data, size_t len) {
+	const struct b64_coder *coder = b64_pick();
+	size_t label_len = strlen(label);
+
+	if (! der_reserve(out, PEM_ENCODED_MAX(label_len, len))) {
+		return;
+	}
+	char *p = (char *) out->buf + out->len;
+	p += sprintf(p, "-----BEGIN %s-----\n", label);
+	// 48 bytes make one 64 column line
+	for (size_t off = 0; off < len; off += 48) {
+		p += b64_encode_run(coder, data + off, len - off < 48 ? len - off : 48, len - off, p);
+		*p++ = '\n';
+	}
+	p += sprintf(p, "-----END %s-----\n", label);
+	out->len = (unsigned char *) p - out->buf;
+}
@@ -0,0 +1,53 @@
+#ifndef LUA_OPENSSL_B64_H
+#define LUA_OPENSSL_B64_H
+
+#include <stddef.h>
+
+#include "der.h"
+
+/* bytes needed to decode len characters of base64 */
+#define B64_DECODED_MAX(len) ((len) / 4 * 3 + 3)
+/* characters needed to encode len bytes, unwrapped */
+#define B64_ENCODED_LEN(len) (((len) + 2) / 3 * 4)
+/* room pem_encode() wants for len bytes under a label of label_len */
+#define PEM_ENCODED_MAX(label_len, len) \
+	(2 * ((label_len) + 20) + B64_ENCODED_LEN(len) + ((len) + 47) / 48)
+
+/* ------------------------------------------------------------ *
+ * Base64 without BIO chains. The SSSE3 or AVX2 block coders    *
+ * are picked on first use from what the CPU supports; the      *
+ * scalar one finishes every tail. Line breaks are skipped on   *
+ * decode and anything else outside the alphabet fails it.      *
+ * -------------------------------------------------------------*/
+
+/* bytes written to out, or -1 on malformed input */
+long b64_decode(const char *in, size_t len, unsigned char *out);
+/* characters written to out, B64_ENCODED_LEN(len) */
+size_t b64_encode(const unsigned char *in, size_t len, char *out);
+
+/* "avx2", "ssse3" or "scalar"; b64_use() is 0 when unsupported here */
+const char *b64_impl(void);
+int b64_use(const char *name);
+
+/* ------------------------------------------------------------ *
+ * One "-----BEGIN label-----" block of a PEM text. body is     *
+ * NULL when the block carries encapsulated headers, which only *
+ * the PEM reader understands.                                  *
+ * -------------------------------------------------------------*/
+struct pem_block {
+	const char *label;
+	size_t label_len;
+	const char *body;
+	size_t body_len;
+	const char *next;	/* just past the END line */
+};
+
+/* the first block at or after pem with the given label (any when NULL) */
+int pem_next(const char *pem, const char *end, const char *label, struct pem_block *block);
+int pem_is(const struct pem_block *block, const char *label);
+/* the block's DER, replacing what out held */
+int pem_decode(const struct pem_block *block, struct der *out);
+/* appends label and DER as PEM with 64 column lines, as OpenSSL writes it */
+void pem_encode(struct der *out, const char *label, const unsigned char *data, size_t len);
+
+#endif
@@ -0,0 +1,554 @@
+/* ------------------------------------------------------------ *
+ * Benchmarks of the signing engine, without Lua in the way.    *
+ *   ./bench fork [workers]  first signature latency of forked  *
+ *                           workers, cold and preforked        *
+ *   ./bench startup [runs]  library init to first signature,   *
+ *                           eager init_crypto() and lazy init; *
+ *                           the engine is linked in, so        *
+ *                           loading core.so and require are    *
+ *                           not part of it: startup.lua times  *
+ *                           those                              *
+ *   ./bench decode [count]  CSR decoding: PEM BIO, base64 into *
+ *                           d2i, and the in-place walk         *
+ *   ./bench sign [threads] [count]  requests signed per second *
+ *                           through X509_REQ and spliced       *
+ *   ./bench b64 [kbytes]    base64 and certificate PEM output, *
+ *                           OpenSSL against each codec         *
+ *   ./bench remote [count] [signerd]  in-process signing       *
+ *                           against the pipelined Unix socket  *
+ *                           signer, at several concurrencies   *
+ *   ./bench issue [threads] [count]  the request's key issued  *
+ *                           from a CSR and from its bare SPKI  *
+ *   ./bench cross [count]   one request under two CAs: two     *
+ *                           ca_sign_pem() calls, sign_multi()  *
+ * -------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+#include "b64.h"
+#include "ca.h"
+#include "csr.h"
+#include "fixtures.h"
+#include "pool.h"
+#include "sign.h"
+#include "signer.h"
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, double *ms, int count) {
+	double sum = 0;
+	qsort(ms, count, sizeof(ms[0]), cmp_double);
+	for (int idx = 0; idx < count; idx++) {
+		sum += ms[idx];
+	}
+	printf("%-10s n=%d avg=%.2fms p50=%.2fms max=%.2fms\n",
+			name, count, sum / count, ms[count / 2], ms[count - 1]);
+}
+
+/* sign one request with ca, return ms since start (taken pre-fork) */
+static double sign_once(struct ca *ca, uint64_t start) {
+	const char *why = NULL;
+	X509_REQ *req = ca != NULL ? ca_read_req(csr, sizeof(csr) - 1) : NULL;
+	X509 *crt = req != NULL ? ca_issue(ca, req, NULL, &why) : NULL;
+	double ms = crt != NULL ? (pool_now() - start) / 1e6 : -1;
+
+	X509_free(crt);
+	X509_REQ_free(req);
+	ca_unref(ca);
+	return ms;
+}
+
+static struct ca *load_ca(void) {
+	return ca_new(key, sizeof(key) - 1, ca_crt, sizeof(ca_crt) - 1, "replace_me");
+}
+
+static double cold_child(uint64_t start) {
+	return sign_once(load_ca(), start);
+}
+
+static double preforked_child(uint64_t start) {
+	ca_postfork();
+	return sign_once(ca_lookup("bench"), start);
+}
+
+/* what init_crypto() used to do before anything else */
+static double eager_child(uint64_t start) {
+	OpenSSL_add_all_algorithms();
+	ERR_load_crypto_strings();
+	return sign_once(load_ca(), start);
+}
+
+/* workers run at once when parallel, else one after the other */
+static int run_workers(const char *name, double (*child)(uint64_t), int workers, int parallel) {
+	double *ms = calloc(workers, sizeof(*ms));
+	int fds[2], failed = 0;
+
+	if (ms == NULL || pipe(fds) != 0) {
+		free(ms);
+		return 1;
+	}
+	for (int idx = 0; idx < workers; idx++) {
+		uint64_t start = pool_now();
+		pid_t pid = fork();
+		if (pid == 0) {
+			double elapsed = child(start);
+			_exit(write(fds[1], &elapsed, sizeof(elapsed)) == sizeof(elapsed) ? 0 : 1);
+		}
+		if (pid < 0) {
+			perror("fork");
+			workers = idx;
+			break;
+		}
+		if (! parallel) {
+			waitpid(pid, NULL, 0);
+		}
+	}
+	close(fds[1]);
+
+	int got = 0;
+	while (got < workers && read(fds[0], &ms[got], sizeof(ms[0])) == sizeof(ms[0])) {
+		failed += ms[got] < 0;
+		got++;
+	}
+	close(fds[0]);
+	while (wait(NULL) > 0) {
+	}
+
+	if (got == 0 || failed > 0) {
+		fprintf(stderr, "%s: %d of %d workers failed to sign\n", name, workers - got + failed, workers);
+		free(ms);
+		return 1;
+	}
+	report(name, ms, got);
+	free(ms);
+	return 0;
+}
+
+static int bench_fork(int workers) {
+	// cold first: the master must not have touched OpenSSL yet
+	int rc = run_workers("cold", cold_child, workers, 1);
+
+	struct ca *ca = load_ca();
+	if (ca == NULL || ! ca_register("bench", ca)) {
+		return 1;
+	}
+	ca_unref(ca);
+	ca_prefork();
+	rc |= run_workers("preforked", preforked_child, workers, 1);
+
+	ca_unregister("bench");
+	return rc;
+}
+
+/* the master never touches OpenSSL, so every child starts fresh;
+ * timed from fork() to the first certificate, with no dlopen() or
+ * luaopen_core() in the window */
+static int bench_startup(int runs) {
+	int rc = run_workers("eager", eager_child, runs, 0);
+	rc |= run_workers("lazy", cold_child, runs, 0);
+	return rc;
+}
+
+static void report_rate(const char *name, uint64_t start, long ops) {
+	double secs = (pool_now() - start) / 1e9;
+	printf("%-10s n=%ld %.0f/s %.2fus/op\n", name, ops, ops / secs, secs * 1e6 / ops);
+}
+
+/* PEM_read_bio_X509_REQ, the way requests used to be read */
+static X509_REQ *read_req_bio(const char *pem, size_t len) {
+	BIO *bio = BIO_new_mem_buf(pem, len);
+	X509_REQ *req = bio != NULL ? PEM_read_bio_X509_REQ(bio, NULL, NULL, NULL) : NULL;
+	BIO_free(bio);
+	return req;
+}
+
+static int bench_decode(long count) {
+	X509_REQ *(*readers[])(const char *, size_t) = { read_req_bio, ca_read_req };
+	const char *names[] = { "pem-bio", "fast" };
+
+	ca_init();
+	for (int idx = 0; idx < 2; idx++) {
+		uint64_t start = pool_now();
+		for (long op = 0; op < count; op++) {
+			X509_REQ *req = readers[idx](csr, sizeof(csr) - 1);
+			if (req == NULL) {
+				return 1;
+			}
+			X509_REQ_free(req);
+		}
+		report_rate(names[idx], start, count);
+	}
+
+	uint64_t start = pool_now();
+	for (long op = 0; op < count; op++) {
+		struct csr req;
+		csr_init(&req);
+		int ok = csr_parse(&req, csr, sizeof(csr) - 1);
+		csr_free(&req);
+		if (! ok) {
+			return 1;
+		}
+	}
+	report_rate("in-place", start, count);
+	return 0;
+}
+
+#define SIGN_REQ	0	/* X509_REQ and ca_issue() */
+#define SIGN_PEM	1	/* ca_sign_pem(), spliced */
+#define SIGN_SPKI	2	/* ca_identity_pem(), no request at all */
+
+struct sign_worker {
+	pthread_t thread;
+	struct ca *ca;
+	int mode;
+	long count;
+	long failed;
+	const char *spki;
+	size_t spki_len;
+};
+
+static void *sign_worker_run(void *arg) {
+	struct sign_worker *worker = arg;
+	const char *why = NULL;
+	char serial[2 * CA_SERIAL_MAX + 1];
+	struct der pem;
+
+	static const struct csr_attr subject[] = { { NID_commonName, "workload", 8 } };
+	static const struct csr_san san[] = { { GEN_DNS, "workload.example", 16 } };
+	static const struct csr_identity id = { subject, 1, san, 1 };
+
+	for (long op = 0; op < worker->count; op++) {
+		der_init(&pem);
+		if (worker->mode == SIGN_PEM) {
+			worker->failed += ! ca_sign_pem(worker->ca, csr, sizeof(csr) - 1, NULL, &pem, serial, &why);
+		} else if (worker->mode == SIGN_SPKI) {
+			worker->failed += ! ca_identity_pem(worker->ca, worker->spki, worker->spki_len, &id, NULL,
+					&pem, serial, &why);
+		} else {
+			X509_REQ *req = ca_read_req(csr, sizeof(csr) - 1);
+			X509 *crt = req != NULL ? ca_issue(worker->ca, req, NULL, &why) : NULL;
+			worker->failed += crt == NULL || ! ca_crt_pem(crt, &pem);
+			X509_free(crt);
+			X509_REQ_free(req);
+		}
+		der_free(&pem);
+	}
+	return NULL;
+}
+
+/* threads each signing their share of count; failures returned */
+static long run_sign_workers(const char *name, struct ca *ca, int mode, int threads, long count,
+		const char *spki, size_t spki_len) {
+	struct sign_worker *workers = calloc(threads, sizeof(*workers));
+	long failed = 0;
+
+	if (workers == NULL) {
+		return count;
+	}
+	uint64_t start = pool_now();
+	for (int idx = 0; idx < threads; idx++) {
+		workers[idx].ca = ca;
+		workers[idx].mode = mode;
+		workers[idx].spki = spki;
+		workers[idx].spki_len = spki_len;
+		workers[idx].count = count / threads;
+		pthread_create(&workers[idx].thread, NULL, sign_worker_run, &workers[idx]);
+	}
+	for (int idx = 0; idx < threads; idx++) {
+		pthread_join(workers[idx].thread, NULL);
+		failed += workers[idx].failed;
+	}
+	report_rate(name, start, count / threads * threads);
+	free(workers);
+	return failed;
+}
+
+static int bench_sign(int threads, long count) {
+	struct ca *ca = load_ca();
+	long failed = 0;
+
+	if (ca == NULL) {
+		return 1;
+	}
+	ca_warm(ca);
+	failed += run_sign_workers("sign-req", ca, SIGN_REQ, threads, count, NULL, 0);
+	failed += run_sign_workers("sign-pem", ca, SIGN_PEM, threads, count, NULL, 0);
+	ca_unref(ca);
+	return failed > 0;
+}
+
+/* the same key with and without the request around it */
+static int bench_issue(int threads, long count) {
+	struct ca *ca = load_ca();
+	struct csr req;
+	long failed = 0;
+
+	csr_init(&req);
+	if (ca == NULL || ! csr_parse(&req, csr, sizeof(csr) - 1)) {
+		return 1;
+	}
+	ca_warm(ca);
+	failed += run_sign_workers("sign-pem", ca, SIGN_PEM, threads, count, NULL, 0);
+	failed += run_sign_workers("issue-spki", ca, SIGN_SPKI, threads, count,
+			(const char *) req.spki.tlv, req.spki.tlv_len);
+	csr_free(&req);
+	ca_unref(ca);
+	return failed > 0;
+}
+
+/* cross-signing from one caller: in turn on this thread, then
+ * parsed and verified once with the pool signing alongside */
+static int bench_cross(long count) {
+	struct ca *cas[2] = { load_ca(), load_ca() };
+	struct sign_multi_result results[2];
+	char serial[2 * CA_SERIAL_MAX + 1];
+	const char *why;
+	struct der pem;
+	long failed = 0;
+
+	if (cas[0] == NULL || cas[1] == NULL) {
+		return 1;
+	}
+	ca_warm(cas[0]);
+	ca_warm(cas[1]);
+	der_init(&pem);
+
+	uint64_t start = pool_now();
+	for (long idx = 0; idx < count; idx++) {
+		for (int ca = 0; ca < 2; ca++) {
+			pem.len = 0;
+			failed += ! ca_sign_pem(cas[ca], csr, sizeof(csr) - 1, NULL, &pem, serial, &why);
+		}
+	}
+	report_rate("sign-pem-x2", start, count);
+
+	start = pool_now();
+	for (long idx = 0; idx < count; idx++) {
+		failed += 2 - sign_multi(cas, 2, csr, sizeof(csr) - 1, NULL, results);
+		der_free(&results[0].pem);
+		der_free(&results[1].pem);
+	}
+	report_rate("sign-multi", start, count);
+
+	der_free(&pem);
+	ca_unref(cas[0]);
+	ca_unref(cas[1]);
+	if (failed > 0) {
+		fprintf(stderr, "%ld signatures failed\n", failed);
+	}
+	return failed > 0;
+}
+
+/* signerd on a scratch socket, holding the fixture key */
+static pid_t start_signer(const char *signerd, const char *sock, const char *keyfile) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		execl(signerd, signerd, sock, keyfile, "replace_me", (char *) NULL);
+		perror(signerd);
+		_exit(127);
+	}
+	return pid;
+}
+
+static struct ca_backend *connect_signer(const char *sock, pid_t pid) {
+	for (int tries = 0; tries < 200; tries++) {
+		if (access(sock, F_OK) == 0) {
+			struct ca_backend *backend = signer_connect(sock, 10000);
+			if (backend != NULL) {
+				return backend;
+			}
+		}
+		if (waitpid(pid, NULL, WNOHANG) == pid) {
+			break;
+		}
+		usleep(10000);
+	}
+	return NULL;
+}
+
+static int bench_remote(long count, const char *signerd) {
+	static const int levels[] = { 1, 4, 16, 64 };
+	char keyfile[] = "/tmp/bench-key-XXXXXX";
+	char sock[64];
+	struct signer_stats before, after;
+	long failed = 0;
+
+	int fd = mkstemp(keyfile);
+	if (fd < 0 || write(fd, key, sizeof(key) - 1) != (ssize_t) (sizeof(key) - 1)) {
+		perror("bench key");
+		return 1;
+	}
+	close(fd);
+	snprintf(sock, sizeof(sock), "/tmp/bench-signer-%d.sock", (int) getpid());
+
+	pid_t pid = start_signer(signerd, sock, keyfile);
+	struct ca_backend *backend = pid > 0 ? connect_signer(sock, pid) : NULL;
+	struct ca *local = load_ca();
+	struct ca *remote = backend != NULL ? ca_new_backend(ca_crt, sizeof(ca_crt) - 1, backend) : NULL;
+	if (local == NULL || remote == NULL) {
+		failed = 1;
+		goto __done;
+	}
+
+	ca_warm(local);
+	ca_warm(remote);
+	for (size_t idx = 0; idx < sizeof(levels) / sizeof(levels[0]); idx++) {
+		char name[32];
+		snprintf(name, sizeof(name), "local-%d", levels[idx]);
+		failed += run_sign_workers(name, local, SIGN_PEM, levels[idx], count, NULL, 0);
+
+		signer_get_stats(remote->backend, &before);
+		snprintf(name, sizeof(name), "remote-%d", levels[idx]);
+		failed += run_sign_workers(name, remote, SIGN_PEM, levels[idx], count, NULL, 0);
+		signer_get_stats(remote->backend, &after);
+		uint64_t writes = after.writes - before.writes;
+		if (writes > 0) {
+			printf("%-10s %.1f requests/write\n", "", (double) (after.requests - before.requests) / writes);
+		}
+	}
+
+__done:
+	ca_unref(remote);
+	ca_unref(local);
+	if (pid > 0) {
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+	unlink(sock);
+	unlink(keyfile);
+	return failed > 0;
+}
+
+/* PEM_write_bio_X509, the way certificates used to be written */
+static int crt_pem_bio(X509 *crt, struct der *out) {
+	BIO *bio = BIO_new(BIO_s_mem());
+	BUF_MEM *bptr;
+
+	if (bio == NULL || ! PEM_write_bio_X509(bio, crt)) {
+		BIO_free(bio);
+		return 0;
+	}
+	BIO_get_mem_ptr(bio, &bptr);
+	der_put(out, bptr->data, bptr->length);
+	BIO_free(bio);
+	return 1;
+}
+
+static int bench_b64(size_t kbytes) {
+	static const char *const coders[] = { "scalar", "ssse3", "avx2" };
+	size_t len = kbytes * 1024, rounds = 64 * 1024 * 1024 / (len + 1) + 1;
+	unsigned char *data = malloc(len + 16);
+	char *text = malloc(B64_ENCODED_LEN(len) + 16);
+	char name[32];
+	const char *why = NULL;
+	struct der pem;
+
+	if (data == NULL || text == NULL) {
+		free(data);
+		free(text);
+		return 1;
+	}
+	for (size_t idx = 0; idx < len; idx++) {
+		data[idx] = idx * 2654435761u >> 13;
+	}
+
+	uint64_t start = pool_now();
+	for (size_t round = 0; round < rounds; round++) {
+		EVP_EncodeBlock((unsigned char *) text, data, len);
+	}
+	report_rate("enc-evp", start, rounds);
+	start = pool_now();
+	for (size_t round = 0; round < rounds; round++) {
+		EVP_DecodeBlock(data, (unsigned char *) text, B64_ENCODED_LEN(len));
+	}
+	report_rate("dec-evp", start, rounds);
+
+	for (size_t idx = 0; idx < sizeof(coders) / sizeof(coders[0]); idx++) {
+		if (! b64_use(coders[idx])) {
+			continue;
+		}
+		snprintf(name, sizeof(name), "enc-%s", coders[idx]);
+		start = pool_now();
+		for (size_t round = 0; round < rounds; round++) {
+			b64_encode(data, len, text);
+		}
+		report_rate(name, start, rounds);
+		snprintf(name, sizeof(name), "dec-%s", coders[idx]);
+		start = pool_now();
+		for (size_t round = 0; round < rounds; round++) {
+			b64_decode(text, B64_ENCODED_LEN(len), data);
+		}
+		report_rate(name, start, rounds);
+	}
+
+	// one issued certificate, out as PEM
+	struct ca *ca = load_ca();
+	X509_REQ *req = ca != NULL ? ca_read_req(csr, sizeof(csr) - 1) : NULL;
+	X509 *crt = req != NULL ? ca_issue(ca, req, NULL, &why) : NULL;
+	if (crt != NULL) {
+		int (*writers[])(X509 *, struct der *) = { crt_pem_bio, ca_crt_pem };
+		const char *names[] = { "pem-bio", "pem-fast" };
+		for (int idx = 0; idx < 2; idx++) {
+			start = pool_now();
+			for (long op = 0; op < 100000; op++) {
+				der_init(&pem);
+				writers[idx](crt, &pem);
+				der_free(&pem);
+			}
+			report_rate(names[idx], start, 100000);
+		}
+	}
+
+	X509_free(crt);
+	X509_REQ_free(req);
+	ca_unref(ca);
+	free(data);
+	free(text);
+	return crt == NULL;
+}
+
+int main(int argc, char **argv) {
+	if (argc > 1 && strcmp(argv[1], "fork") == 0) {
+		return bench_fork(argc > 2 ? atoi(argv[2]) : 16);
+	}
+	if (argc > 1 && strcmp(argv[1], "startup") == 0) {
+		return bench_startup(argc > 2 ? atoi(argv[2]) : 20);
+	}
+	if (argc > 1 && strcmp(argv[1], "decode") == 0) {
+		return bench_decode(argc > 2 ? atol(argv[2]) : 100000);
+	}
+	if (argc > 1 && strcmp(argv[1], "sign") == 0) {
+		return bench_sign(argc > 2 ? atoi(argv[2]) : 4, argc > 3 ? atol(argv[3]) : 20000);
+	}
+	if (argc > 1 && strcmp(argv[1], "b64") == 0) {
+		return bench_b64(argc > 2 ? atol(argv[2]) : 64);
+	}
+	if (argc > 1 && strcmp(argv[1], "remote") == 0) {
+		return bench_remote(argc > 2 ? atol(argv[2]) : 20000, argc > 3 ? argv[3] : "./signerd");
+	}
+	if (argc > 1 && strcmp(argv[1], "issue") == 0) {
+		return bench_issue(argc > 2 ? atoi(argv[2]) : 4, argc > 3 ? atol(argv[3]) : 20000);
+	}
+	if (argc > 1 && strcmp(argv[1], "cross") == 0) {
+		return bench_cross(argc > 2 ? atol(argv[2]) : 5000);
+	}
+	fprintf(stderr, "usage: %s fork [workers] | startup [runs] | decode [count]"
+			" | sign [threads] [count] | b64 [kbytes] | remote [count] [signerd]"
+			" | issue [threads] [count] | cross [count]\n", argv[0]);
+	return 2;
+}
@@ -0,0 +1,1669 @@
+/*
+// Issuing CA handle shared by the Lua binding and the C callers.
+// http://fm4dd.com/openssl/certcreate.htm
+// https://www.openssl.org/docs/man1.1.1/man3/EVP_DigestSignInit.html
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/rsa.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+
+#include "b64.h"
+#include "ca.h"
+#include "crl.h"
+#include "csr.h"
+#include "ocsp.h"
+#include "policy.h"
+#include "pool.h"
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+/* ------------------------------------------------------------ *
+ * Fetched once from the default library context. EVP_sha256() *
+ * and friends look their implementation up on every use; an   *
+ * explicitly fetched EVP_MD doesn't, and holding the          *
+ * signatures keeps them in the method cache.                   *
+ * -------------------------------------------------------------*/
+static EVP_MD *fetched_sha1;
+static EVP_MD *fetched_sha256;
+static EVP_SIGNATURE *fetched_sigs[4];
+
+static void ca_prefetch(void) {
+	static const char *const sigs[] = { "RSA", "ECDSA", "ED25519", "ED448" };
+
+	fetched_sha1 = EVP_MD_fetch(NULL, "SHA1", NULL);
+	fetched_sha256 = EVP_MD_fetch(NULL, "SHA256", NULL);
+	for (size_t idx = 0; idx < sizeof(sigs) / sizeof(sigs[0]); idx++) {
+		fetched_sigs[idx] = EVP_SIGNATURE_fetch(NULL, sigs[idx], NULL);
+	}
+	// a provider without one of them is not an error yet
+	ERR_clear_error();
+}
+#endif
+
+/* ------------------------------------------------------------ *
+ * fork() clones only the calling thread: a lock another thread *
+ * held is inherited locked. Every CA, CRL and OCSP lock is     *
+ * taken across the fork instead, in their nesting order, and   *
+ * before the pools' handler takes its own.                     *
+ * -------------------------------------------------------------*/
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ca *live;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void ca_atfork_prepare(void) {
+	pthread_mutex_lock(&live_lock);
+	pthread_mutex_lock(&registry_lock);
+	for (struct ca *ca = live; ca != NULL; ca = ca->live_next) {
+		pthread_mutex_lock(&ca->lock);
+		if (ca->crl != NULL) {
+			pthread_mutex_lock(&ca->crl->lock);
+		}
+		if (ca->ocsp != NULL) {
+			pthread_mutex_lock(&ca->ocsp->write_lock);
+		}
+	}
+}
+
+static void ca_atfork_parent(void) {
+	for (struct ca *ca = live; ca != NULL; ca = ca->live_next) {
+		if (ca->ocsp != NULL) {
+			pthread_mutex_unlock(&ca->ocsp->write_lock);
+		}
+		if (ca->crl != NULL) {
+			pthread_mutex_unlock(&ca->crl->lock);
+		}
+		pthread_mutex_unlock(&ca->lock);
+	}
+	pthread_mutex_unlock(&registry_lock);
+	pthread_mutex_unlock(&live_lock);
+}
+
+static void ca_atfork_child(void) {
+	for (struct ca *ca = live; ca != NULL; ca = ca->live_next) {
+		if (ca->ocsp != NULL) {
+			ocsp_forked(ca->ocsp);
+			pthread_mutex_init(&ca->ocsp->write_lock, NULL);
+		}
+		if (ca->crl != NULL) {
+			pthread_mutex_init(&ca->crl->lock, NULL);
+		}
+		pthread_mutex_init(&ca->lock, NULL);
+	}
+	pthread_mutex_init(&registry_lock, NULL);
+	pthread_mutex_init(&live_lock, NULL);
+}
+
+static void ca_init_once(void) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	// openssl.cnf is never needed here and reading it dominates startup;
+	// error strings wait for the first error
+	OPENSSL_init_crypto(OPENSSL_INIT_NO_LOAD_CONFIG |
+			OPENSSL_INIT_ADD_ALL_CIPHERS | OPENSSL_INIT_ADD_ALL_DIGESTS, NULL);
+#else
+	OpenSSL_add_all_algorithms();
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	ca_prefetch();
+#endif
+	pool_atfork();
+	pthread_atfork(ca_atfork_prepare, ca_atfork_parent, ca_atfork_child);
+}
+
+const EVP_MD *ca_sha1(void) {
+	ca_init();
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	if (fetched_sha1 != NULL) {
+		return fetched_sha1;
+	}
+#endif
+	return EVP_sha1();
+}
+
+const EVP_MD *ca_sha256(void) {
+	ca_init();
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	if (fetched_sha256 != NULL) {
+		return fetched_sha256;
+	}
+#endif
+	return EVP_sha256();
+}
+
+void ca_init(void) {
+	pthread_once(&init_once, ca_init_once);
+}
+
+void ca_load_error_strings(void) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL);
+#else
+	static pthread_once_t strings_once = PTHREAD_ONCE_INIT;
+	pthread_once(&strings_once, ERR_load_crypto_strings);
+#endif
+}
+
+int ca_preload(const char *name) {
+	ca_init();
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	// fetched methods stay cached in the default library context
+	int found = 0;
+	EVP_MD *md = EVP_MD_fetch(NULL, name, NULL);
+	EVP_CIPHER *cipher = EVP_CIPHER_fetch(NULL, name, NULL);
+	EVP_KEYMGMT *keymgmt = EVP_KEYMGMT_fetch(NULL, name, NULL);
+	EVP_SIGNATURE *signature = EVP_SIGNATURE_fetch(NULL, name, NULL);
+
+	found = md != NULL || cipher != NULL || keymgmt != NULL || signature != NULL;
+	EVP_MD_free(md);
+	EVP_CIPHER_free(cipher);
+	EVP_KEYMGMT_free(keymgmt);
+	EVP_SIGNATURE_free(signature);
+	// misses leave unsupported-algorithm errors behind
+	ERR_clear_error();
+	return found;
+#else
+	return EVP_get_digestbyname(name) != NULL || EVP_get_cipherbyname(name) != NULL ||
+			EVP_PKEY_asn1_find_str(NULL, name, -1) != NULL;
+#endif
+}
+
+void err_descr_to_stderr(const char *err_patern) {
+	char buffer[120];
+	ca_load_error_strings();
+	ERR_error_string(ERR_get_error(), buffer);
+	fprintf(stderr, "%s due to: %s\n", err_patern, buffer);
+	// drop the rest of the queue so failed calls don't pile it up
+	ERR_clear_error();
+}
+
+/* PEM callback: hand out the configured password, never prompt */
+static int ca_password_cb(char *buf, int size, int rwflag, void *u) {
+	if (u == NULL) {
+		return 0;
+	}
+	int len = strlen((const char *) u);
+	if (len > size) {
+		len = size;
+	}
+	memcpy(buf, u, len);
+	return len;
+}
+
+/* ------------------------------------------------------------ *
+ * Encodings derived from key and certificate, computed once.   *
+ * EdDSA signs the TBS itself, so its CAs have no digest.       *
+ * -------------------------------------------------------------*/
+static int ca_prepare(struct ca *ca) {
+	unsigned char *p = NULL;
+	int len;
+
+	switch (EVP_PKEY_base_id(ca->key)) {
+	case EVP_PKEY_ED25519:
+	case EVP_PKEY_ED448: ca->md = NULL; break;
+	default: ca->md = ca_sha256(); break;
+	}
+
+	if ((len = i2d_X509_NAME(X509_get_subject_name(ca->crt), &p)) <= 0) {
+		err_descr_to_stderr("Error encoding CA subject name");
+		return 0;
+	}
+	ca->issuer_der = p;
+	ca->issuer_len = len;
+
+	// EdDSA's signature algorithm is its key algorithm, not in the xref table
+	int sig_nid = ca->md == NULL ? EVP_PKEY_base_id(ca->key) : NID_undef;
+	if (ca->md != NULL && ! OBJ_find_sigid_by_algs(&sig_nid, EVP_MD_type(ca->md), EVP_PKEY_base_id(ca->key))) {
+		fprintf(stderr, "No signature algorithm for this CA key and digest\n");
+		return 0;
+	}
+	X509_ALGOR *alg = X509_ALGOR_new();
+	if (alg == NULL) {
+		err_descr_to_stderr("Error allocating algorithm identifier");
+		return 0;
+	}
+	int ptype = EVP_PKEY_base_id(ca->key) == EVP_PKEY_RSA ? V_ASN1_NULL : V_ASN1_UNDEF;
+	X509_ALGOR_set0(alg, OBJ_nid2obj(sig_nid), ptype, NULL);
+	p = NULL;
+	len = i2d_X509_ALGOR(alg, &p);
+	X509_ALGOR_free(alg);
+	if (len <= 0) {
+		err_descr_to_stderr("Error encoding signature algorithm");
+		return 0;
+	}
+	ca->sigalg_der = p;
+	ca->sigalg_len = len;
+
+	const ASN1_OCTET_STRING *skid = X509_get0_subject_key_id(ca->crt);
+	if (skid != NULL && skid->length <= (int) sizeof(ca->keyid)) {
+		memcpy(ca->keyid, skid->data, skid->length);
+		ca->keyid_len = skid->length;
+	} else {
+		unsigned int mdlen = 0;
+		if (! X509_pubkey_digest(ca->crt, ca_sha1(), ca->keyid, &mdlen)) {
+			err_descr_to_stderr("Error hashing CA public key");
+			return 0;
+		}
+		ca->keyid_len = mdlen;
+	}
+
+	return 1;
+}
+
+/* generous enough for any legitimate request */
+const struct ca_admission ca_default_admission = {
+	.max_csr_bytes = 64 * 1024,
+	.key_types = CA_KEY_RSA | CA_KEY_EC | CA_KEY_ED25519 | CA_KEY_ED448,
+	.rsa_max_bits = 8192,
+	.san_max = 100,
+	.name_max = 255,
+};
+
+static struct ca *ca_alloc(void) {
+	ca_init();
+	struct ca *ca = calloc(1, sizeof(*ca));
+	if (ca == NULL) {
+		fprintf(stderr, "Error allocating CA handle\n");
+		return NULL;
+	}
+	ca->refs = 1;
+	ca->admission = ca_default_admission;
+	pthread_mutex_init(&ca->lock, NULL);
+
+	pthread_mutex_lock(&live_lock);
+	if ((ca->live_next = live) != NULL) {
+		live->live_prev = ca;
+	}
+	live = ca;
+	pthread_mutex_unlock(&live_lock);
+	return ca;
+}
+
+static int ca_load_crt(struct ca *ca, const char *crt, size_t crt_len) {
+	BIO *crtbio = BIO_new_mem_buf(crt, crt_len);
+	if (crtbio == NULL || ! (ca->crt = PEM_read_bio_X509(crtbio, NULL, NULL, NULL))) {
+		err_descr_to_stderr("Error can't read CA certificate into memory");
+		BIO_free(crtbio);
+		return 0;
+	}
+	BIO_free(crtbio);
+	return 1;
+}
+
+struct ca *ca_new(const char *key, size_t key_len, const char *crt, size_t crt_len,
+		const char *password) {
+	struct ca *ca = ca_alloc();
+	if (ca == NULL) {
+		return NULL;
+	}
+
+	BIO *keybio = BIO_new_mem_buf(key, key_len);
+	if (keybio == NULL ||
+			! (ca->key = PEM_read_bio_PrivateKey(keybio, NULL, ca_password_cb, (void *) password))) {
+		err_descr_to_stderr("Failed to load CA private key");
+		BIO_free(keybio);
+		goto __error;
+	}
+	BIO_free(keybio);
+
+	if (! ca_load_crt(ca, crt, crt_len)) {
+		goto __error;
+	}
+	// everything issued names the certificate, so the key must be its
+	if (X509_check_private_key(ca->crt, ca->key) != 1) {
+		err_descr_to_stderr("Error CA private key doesn't match the CA certificate");
+		goto __error;
+	}
+	if (! ca_prepare(ca)) {
+		goto __error;
+	}
+	return ca;
+
+__error:
+	ca_unref(ca);
+	return NULL;
+}
+
+struct ca *ca_new_backend(const char *crt, size_t crt_len, struct ca_backend *backend) {
+	struct ca *ca = ca_alloc();
+	if (ca == NULL) {
+		backend->release(backend);
+		return NULL;
+	}
+	ca->backend = backend;
+
+	if (! ca_load_crt(ca, crt, crt_len)) {
+		goto __error;
+	}
+	// sizes and algorithm identifiers come from the public key
+	if (! (ca->key = X509_get_pubkey(ca->crt))) {
+		err_descr_to_stderr("Error reading CA public key");
+		goto __error;
+	}
+	if (! ca_prepare(ca)) {
+		goto __error;
+	}
+	if (ca->md == NULL) {
+		fprintf(stderr, "A signing backend signs digests, which an EdDSA CA key can't use\n");
+		goto __error;
+	}
+	return ca;
+
+__error:
+	ca_unref(ca);
+	return NULL;
+}
+
+struct ca *ca_new_public(const char *crt, size_t crt_len) {
+	struct ca *ca = ca_alloc();
+	if (ca == NULL) {
+		return NULL;
+	}
+	ca->key_elsewhere = 1;
+	if (! ca_load_crt(ca, crt, crt_len)) {
+		goto __error;
+	}
+	if (! (ca->key = X509_get_pubkey(ca->crt))) {
+		err_descr_to_stderr("Error reading CA public key");
+		goto __error;
+	}
+	if (! ca_prepare(ca)) {
+		goto __error;
+	}
+	return ca;
+
+__error:
+	ca_unref(ca);
+	return NULL;
+}
+
+struct ca *ca_ref(struct ca *ca) {
+	__atomic_add_fetch(&ca->refs, 1, __ATOMIC_RELAXED);
+	return ca;
+}
+
+void ca_unref(struct ca *ca) {
+	if (ca == NULL || __atomic_sub_fetch(&ca->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&live_lock);
+	if (ca->live_next != NULL) {
+		ca->live_next->live_prev = ca->live_prev;
+	}
+	*(ca->live_prev != NULL ? &ca->live_prev->live_next : &live) = ca->live_next;
+	pthread_mutex_unlock(&live_lock);
+
+	if (ca->ocsp != NULL) {
+		ocsp_free(ca->ocsp);
+	}
+	if (ca->crl != NULL) {
+		crl_free(ca->crl);
+	}
+	policy_unref(ca->policy);
+	OPENSSL_free(ca->issuer_der);
+	OPENSSL_free(ca->sigalg_der);
+	X509_free(ca->crt);
+	EVP_PKEY_free(ca->key);
+	if (ca->backend != NULL) {
+		ca->backend->release(ca->backend);
+	}
+	pthread_mutex_destroy(&ca->lock);
+	free(ca);
+}
+
+struct ca_entry {
+	char *name;
+	struct ca *ca;
+	struct ca_entry *next;
+};
+
+static struct ca_entry *registry;
+
+/* registry_lock held */
+static struct ca_entry **ca_find(const char *name) {
+	struct ca_entry **entry = &registry;
+	while (*entry != NULL && strcmp((*entry)->name, name) != 0) {
+		entry = &(*entry)->next;
+	}
+	return entry;
+}
+
+int ca_register(const char *name, struct ca *ca) {
+	struct ca *old = NULL;
+
+	pthread_mutex_lock(&registry_lock);
+	struct ca_entry **entry = ca_find(name);
+	if (*entry != NULL) {
+		old = (*entry)->ca;
+	} else {
+		struct ca_entry *fresh = calloc(1, sizeof(*fresh));
+		if (fresh == NULL || ! (fresh->name = strdup(name))) {
+			pthread_mutex_unlock(&registry_lock);
+			free(fresh);
+			return 0;
+		}
+		*entry = fresh;
+	}
+	(*entry)->ca = ca_ref(ca);
+	pthread_mutex_unlock(&registry_lock);
+
+	ca_unref(old);
+	return 1;
+}
+
+struct ca *ca_lookup(const char *name) {
+	pthread_mutex_lock(&registry_lock);
+	struct ca_entry *entry = *ca_find(name);
+	struct ca *ca = entry != NULL ? ca_ref(entry->ca) : NULL;
+	pthread_mutex_unlock(&registry_lock);
+	return ca;
+}
+
+int ca_unregister(const char *name) {
+	pthread_mutex_lock(&registry_lock);
+	struct ca_entry **entry = ca_find(name);
+	struct ca_entry *found = *entry;
+	if (found != NULL) {
+		*entry = found->next;
+	}
+	pthread_mutex_unlock(&registry_lock);
+
+	if (found == NULL) {
+		return 0;
+	}
+	ca_unref(found->ca);
+	free(found->name);
+	free(found);
+	return 1;
+}
+
+int ca_warm(struct ca *ca) {
+	static const unsigned char probe[] = { 0x30, 0x00 };
+	struct der out;
+
+	der_init(&out);
+	int rc = ca_sign_tbs(ca, probe, sizeof(probe), &out);
+	der_free(&out);
+	return rc;
+}
+
+int ca_prefork(void) {
+	int warmed = 0;
+
+	pthread_mutex_lock(&registry_lock);
+	for (struct ca_entry *entry = registry; entry != NULL; entry = entry->next) {
+		warmed += ca_warm(entry->ca);
+	}
+	pthread_mutex_unlock(&registry_lock);
+
+	pool_prefork();
+	return warmed;
+}
+
+void ca_postfork(void) {
+	// OpenSSL notices the new pid too, but only on its next reseed check
+	RAND_poll();
+}
+
+/* base64 straight into d2i, no PEM reader or BIO */
+static X509_REQ *ca_decode_req(const struct pem_block *block) {
+	X509_REQ *certreq = NULL;
+	struct der der;
+
+	der_init(&der);
+	if (! pem_decode(block, &der)) {
+		fprintf(stderr, "Error can't read X509 request data into memory due to: bad base64\n");
+	} else {
+		const unsigned char *p = der.buf;
+		if (! (certreq = d2i_X509_REQ(NULL, &p, der.len))) {
+			err_descr_to_stderr("Error can't read X509 request data into memory");
+		}
+	}
+	der_free(&der);
+	return certreq;
+}
+
+/* ---------------------------------------------------------- *
+ * Load the request data in a x509_REQ struct, through a BIO  *
+ * only when the PEM armor is more than the plain kind.       *
+ * ---------------------------------------------------------- */
+X509_REQ *ca_read_req(const char *pem, size_t len) {
+	X509_REQ *certreq = NULL;
+	struct pem_block block;
+
+	ca_init();
+	if (pem_next(pem, pem + len, NULL, &block) && block.body != NULL &&
+			(pem_is(&block, "CERTIFICATE REQUEST") || pem_is(&block, "NEW CERTIFICATE REQUEST"))) {
+		return ca_decode_req(&block);
+	}
+
+	BIO *reqbio = BIO_new_mem_buf(pem, len);
+	if (reqbio == NULL || ! (certreq = PEM_read_bio_X509_REQ(reqbio, NULL, NULL, NULL))) {
+		err_descr_to_stderr("Error can't read X509 request data into memory");
+	}
+	BIO_free(reqbio);
+	return certreq;
+}
+
+void ca_set_admission(struct ca *ca, const struct ca_admission *admission) {
+	pthread_mutex_lock(&ca->lock);
+	ca->admission = *admission;
+	pthread_mutex_unlock(&ca->lock);
+}
+
+void ca_get_admission(struct ca *ca, struct ca_admission *admission) {
+	pthread_mutex_lock(&ca->lock);
+	*admission = ca->admission;
+	pthread_mutex_unlock(&ca->lock);
+}
+
+/* counts the rejection, always returns 0 */
+static int ca_reject(uint64_t *counter, const char **why, const char *reason) {
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+	*why = reason;
+	return 0;
+}
+
+/* only decodes: the key is looked at, never used */
+static int ca_admit_key(struct ca_stats *stats, const struct ca_admission *lim, EVP_PKEY *pkey, const char **why) {
+	unsigned type;
+
+	if (pkey == NULL) {
+		ERR_clear_error();
+		return ca_reject(&stats->rejected_key, why, "Request public key can't be decoded");
+	}
+	switch (EVP_PKEY_base_id(pkey)) {
+	case EVP_PKEY_RSA:
+	case EVP_PKEY_RSA_PSS: type = CA_KEY_RSA; break;
+	case EVP_PKEY_EC: type = CA_KEY_EC; break;
+	case EVP_PKEY_ED25519: type = CA_KEY_ED25519; break;
+	case EVP_PKEY_ED448: type = CA_KEY_ED448; break;
+	default: type = 0; break;
+	}
+	if (lim->key_types != 0 && ! (lim->key_types & type)) {
+		return ca_reject(&stats->rejected_key, why, "Request key algorithm not admitted");
+	}
+	if (type == CA_KEY_RSA && lim->rsa_max_bits > 0 && EVP_PKEY_bits(pkey) > lim->rsa_max_bits) {
+		return ca_reject(&stats->rejected_key, why, "Request RSA key too large");
+	}
+	return 1;
+}
+
+/* ------------------------------------------------------------ *
+ * RFC 5280 4.2: no extension twice. Checked whatever the       *
+ * limits, since X509V3_get_d2i() gives NULL for a repeated     *
+ * extension and the names in it would reach neither the       *
+ * limits nor the policy. In-place requests that repeat one     *
+ * fail csr_parse() and end up here as well.                    *
+ * -------------------------------------------------------------*/
+static int ca_admit_extensions(struct ca_stats *stats, X509_REQ *certreq, const char **why) {
+	STACK_OF(X509_EXTENSION) *exts = X509_REQ_get_extensions(certreq);
+	int count = sk_X509_EXTENSION_num(exts);
+	int ok = 1;
+
+	if (count > CSR_EXTENSIONS_MAX) {
+		ok = ca_reject(&stats->rejected_parse, why, "Request has too many extensions");
+	}
+	for (int idx = 1; ok && idx < count; idx++) {
+		const ASN1_OBJECT *obj = X509_EXTENSION_get_object(sk_X509_EXTENSION_value(exts, idx));
+		for (int prev = 0; ok && prev < idx; prev++) {
+			if (OBJ_cmp(obj, X509_EXTENSION_get_object(sk_X509_EXTENSION_value(exts, prev))) != 0) {
+				continue;
+			}
+			ok = OBJ_obj2nid(obj) == NID_subject_alt_name
+				? ca_reject(&stats->rejected_sans, why, "Request repeats the subjectAltName extension")
+				: ca_reject(&stats->rejected_parse, why, "Request repeats an extension");
+		}
+	}
+	sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);
+	return ok;
+}
+
+/* the request is certreq, or csr when that is NULL */
+static int ca_admit_names(struct ca_stats *stats, const struct ca_admission *lim, X509_REQ *certreq,
+		struct csr *csr, const char **why) {
+	X509_NAME *name = NULL;
+	if (lim->name_max > 0) {
+		name = certreq != NULL ? X509_REQ_get_subject_name(certreq) : csr_name(csr);
+	}
+	for (int idx = 0; lim->name_max > 0 && idx < X509_NAME_entry_count(name); idx++) {
+		ASN1_STRING *value = X509_NAME_ENTRY_get_data(X509_NAME_get_entry(name, idx));
+		if (ASN1_STRING_length(value) > lim->name_max) {
+			return ca_reject(&stats->rejected_name, why, "Request subject attribute too long");
+		}
+	}
+
+	if (lim->san_max <= 0 && lim->name_max <= 0) {
+		return 1;
+	}
+	GENERAL_NAMES *names;
+	int crit;
+	if (certreq != NULL) {
+		STACK_OF(X509_EXTENSION) *exts = X509_REQ_get_extensions(certreq);
+		names = X509V3_get_d2i(exts, NID_subject_alt_name, &crit, NULL);
+		sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);
+	} else {
+		names = X509V3_get_d2i(csr_extensions(csr), NID_subject_alt_name, &crit, NULL);
+	}
+	ERR_clear_error();
+
+	int ok = 1;
+	if (names == NULL && crit != -1) {
+		// a repeat is caught earlier; this is a SAN that doesn't decode
+		ok = ca_reject(&stats->rejected_sans, why, "Request subjectAltName can't be decoded");
+	}
+	if (ok && lim->san_max > 0 && sk_GENERAL_NAME_num(names) > lim->san_max) {
+		ok = ca_reject(&stats->rejected_sans, why, "Request has too many subjectAltNames");
+	}
+	for (int idx = 0; ok && lim->name_max > 0 && idx < sk_GENERAL_NAME_num(names); idx++) {
+		int type;
+		const ASN1_STRING *value = GENERAL_NAME_get0_value(sk_GENERAL_NAME_value(names, idx), &type);
+		if ((type == GEN_DNS || type == GEN_EMAIL || type == GEN_URI)
+				&& ASN1_STRING_length(value) > lim->name_max) {
+			ok = ca_reject(&stats->rejected_name, why, "Request subjectAltName too long");
+		}
+	}
+	GENERAL_NAMES_free(names);
+	return ok;
+}
+
+X509_REQ *ca_admit(const struct ca_admission *lim, struct ca_stats *stats,
+		const char *pem, size_t len, const char **why) {
+	if (lim->max_csr_bytes > 0 && len > lim->max_csr_bytes) {
+		ca_reject(&stats->rejected_size, why, "Request exceeds the size limit");
+		return NULL;
+	}
+	X509_REQ *certreq = ca_read_req(pem, len);
+	if (certreq == NULL) {
+		ca_reject(&stats->rejected_parse, why, "can't read X509 request");
+		return NULL;
+	}
+	if (! ca_admit_extensions(stats, certreq, why) || ! ca_admit_key(stats, lim, X509_REQ_get0_pubkey(certreq), why)
+			|| ! ca_admit_names(stats, lim, certreq, NULL, why)) {
+		X509_REQ_free(certreq);
+		return NULL;
+	}
+	__atomic_add_fetch(&stats->admitted, 1, __ATOMIC_RELAXED);
+	return certreq;
+}
+
+X509_REQ *ca_admit_req(struct ca *ca, const char *pem, size_t len, const char **why) {
+	struct ca_admission lim;
+	ca_get_admission(ca, &lim);
+	return ca_admit(&lim, &ca->stats, pem, len, why);
+}
+
+/* magnitude without leading zeros, as an ASN1_INTEGER would hold it */
+static size_t ca_random_serial_bytes(unsigned char mag[CA_SERIAL_RANDOM]) {
+	if (RAND_bytes(mag, CA_SERIAL_RANDOM) != 1) {
+		return 0;
+	}
+	mag[0] &= 0x7f;
+
+	size_t skip = 0;
+	while (skip < CA_SERIAL_RANDOM - 1 && mag[skip] == 0) {
+		skip++;
+	}
+	memmove(mag, mag + skip, CA_SERIAL_RANDOM - skip);
+	return CA_SERIAL_RANDOM - skip;
+}
+
+static ASN1_INTEGER *ca_random_serial(void) {
+	unsigned char mag[CA_SERIAL_RANDOM];
+	size_t len = ca_random_serial_bytes(mag);
+	if (len == 0) {
+		return NULL;
+	}
+
+	BIGNUM *bn = BN_bin2bn(mag, len, NULL);
+	ASN1_INTEGER *serial = bn != NULL ? BN_to_ASN1_INTEGER(bn, NULL) : NULL;
+	BN_free(bn);
+	return serial;
+}
+
+void ca_set_policy(struct ca *ca, struct policy *policy) {
+	if (policy != NULL) {
+		policy_ref(policy);
+	}
+	pthread_mutex_lock(&ca->lock);
+	struct policy *old = ca->policy;
+	ca->policy = policy;
+	pthread_mutex_unlock(&ca->lock);
+	policy_unref(old);
+}
+
+/* *why points at a per-thread buffer, valid until the next call;
+ * the request is certreq, or csr when that is NULL */
+static int ca_check_policy(struct ca *ca, X509_REQ *certreq, struct csr *csr, const char **why) {
+	static __thread char policy_why[POLICY_WHY_MAX];
+
+	pthread_mutex_lock(&ca->lock);
+	struct policy *policy = ca->policy != NULL ? policy_ref(ca->policy) : NULL;
+	pthread_mutex_unlock(&ca->lock);
+	if (policy == NULL) {
+		return 1;
+	}
+
+	int ok;
+	if (certreq != NULL) {
+		ok = policy_check(policy, certreq, policy_why, sizeof(policy_why));
+	} else if (csr->exts.tlv != NULL && csr_extensions(csr) == NULL) {
+		// extensions that don't decode must not pass for none
+		snprintf(policy_why, sizeof(policy_why), "request extensions can't be decoded");
+		ok = 0;
+	} else {
+		ok = policy_check_parts(policy, csr->pkey, csr_name(csr), csr_extensions(csr),
+				policy_why, sizeof(policy_why));
+	}
+	policy_unref(policy);
+	if (!ok) {
+		__atomic_add_fetch(&ca->stats.rejected_policy, 1, __ATOMIC_RELAXED);
+		*why = policy_why;
+	}
+	return ok;
+}
+
+/* ------------------------------------------------------------ *
+ * Copy the request's SubjectPublicKeyInfo as it was encoded.   *
+ * X509_set_pubkey() would encode the key again, which on       *
+ * OpenSSL 3 goes through an encoder lookup per certificate.    *
+ * -------------------------------------------------------------*/
+static int ca_copy_pubkey(X509 *newcert, X509_REQ *certreq) {
+	ASN1_OBJECT *alg_obj;
+	const unsigned char *bits;
+	int bits_len, ptype;
+	const void *pval;
+	X509_ALGOR *alg;
+
+	X509_PUBKEY *src = X509_REQ_get_X509_PUBKEY(certreq);
+	if (src == NULL || ! X509_PUBKEY_get0_param(&alg_obj, &bits, &bits_len, &alg, src)) {
+		return 0;
+	}
+	X509_ALGOR_get0(NULL, &ptype, &pval, alg);
+
+	void *param = NULL;
+	if (ptype == V_ASN1_OBJECT) {
+		param = OBJ_dup(pval);
+	} else if (ptype != V_ASN1_UNDEF && ptype != V_ASN1_NULL) {
+		param = ASN1_STRING_dup(pval);
+	}
+	ASN1_OBJECT *obj = OBJ_dup(alg_obj);
+	unsigned char *enc = OPENSSL_memdup(bits, bits_len);
+	if (obj == NULL || enc == NULL || (param == NULL && pval != NULL && ptype != V_ASN1_NULL) ||
+			! X509_PUBKEY_set0_param(X509_get_X509_PUBKEY(newcert), obj, ptype, param, enc, bits_len)) {
+		ASN1_OBJECT_free(obj);
+		OPENSSL_free(enc);
+		if (ptype == V_ASN1_OBJECT) {
+			ASN1_OBJECT_free(param);
+		} else {
+			ASN1_STRING_free(param);
+		}
+		return 0;
+	}
+	return 1;
+}
+
+X509 *ca_issue(struct ca *ca, X509_REQ *certreq, const ASN1_INTEGER *serial, const char **why) {
+	X509 *newcert = NULL;
+	EVP_PKEY *req_pubkey = NULL;
+	ASN1_INTEGER *aserial = NULL;
+	X509_NAME *name;
+
+	if (ca->key_elsewhere) {
+		*why = CA_WHY_KEY_ELSEWHERE;
+		return NULL;
+	}
+	// policy first: it is cheap and spares the signature checks
+	if (! ca_check_policy(ca, certreq, NULL, why)) {
+		return NULL;
+	}
+
+	// create certificate
+	/* --------------------------------------------------------- *
+	 * Build Certificate with data from request                  *
+	 * ----------------------------------------------------------*/
+	if (! (newcert = X509_new())) {
+		*why = "Error creating new X509 object";
+		goto __error;
+	}
+
+	if (X509_set_version(newcert, 2) != 1) {
+		*why = "Error setting certificate version";
+		goto __error;
+	}
+
+	if (serial == NULL && ! (serial = aserial = ca_random_serial())) {
+		*why = "Error generating serial number";
+		goto __error;
+	}
+	if (! X509_set_serialNumber(newcert, (ASN1_INTEGER *) serial)) {
+		*why = "Error setting serial number of the certificate";
+		goto __error;
+	}
+
+	/* --------------------------------------------------------- *
+	 * Extract the subject name from the request                 *
+	 * ----------------------------------------------------------*/
+	if (! (name = X509_REQ_get_subject_name(certreq))) {
+		*why = "Error getting subject from cert request";
+		goto __error;
+	}
+
+	/* --------------------------------------------------------- *
+	 * Set the new certificate subject name                      *
+	 * ----------------------------------------------------------*/
+	if (X509_set_subject_name(newcert, name) != 1) {
+		*why = "Error setting subject name of certificate";
+		goto __error;
+	}
+
+	/* --------------------------------------------------------- *
+	 * Set the new certificate issuer name from the CA subject   *
+	 * ----------------------------------------------------------*/
+	if (X509_set_issuer_name(newcert, X509_get_subject_name(ca->crt)) != 1) {
+		*why = "Error setting issuer name of certificate";
+		goto __error;
+	}
+
+	/* --------------------------------------------------------- *
+	 * Extract the public key data from the request              *
+	 * ----------------------------------------------------------*/
+	if (! (req_pubkey=X509_REQ_get_pubkey(certreq))) {
+		*why = "Error unpacking public key from request";
+		goto __error;
+	}
+
+	/* --------------------------------------------------------- *
+	 * Optionally: Use the public key to verify the signature    *
+	 * ----------------------------------------------------------*/
+	if (X509_REQ_verify(certreq, req_pubkey) != 1) {
+		*why = "Error verifying signature on request";
+		goto __error;
+	}
+
+	/* --------------------------------------------------------- *
+	 * Set the new certificate public key                        *
+	 * ----------------------------------------------------------*/
+	if (! ca_copy_pubkey(newcert, certreq)) {
+		*why = "Error setting public key of certificate";
+		goto __error;
+	}
+
+	/* ---------------------------------------------------------- *
+	 * Set X509V3 start date (now) and expiration date (+365 days)*
+	 * -----------------------------------------------------------*/
+	if (! (X509_gmtime_adj(X509_get_notBefore(newcert),0))) {
+		*why = "Error setting start time";
+		goto __error;
+	}
+
+	long valid_secs = 31536000;
+
+	if(! (X509_gmtime_adj(X509_get_notAfter(newcert), valid_secs))) {
+		*why = "Error setting expiration time";
+		goto __error;
+	}
+
+	/* ----------------------------------------------------------- *
+	 * Sign new certificate with CA's private key                  *
+	 * ------------------------------------------------------------*/
+	if (! X509_sign(newcert, ca->key, ca->md)) {
+		*why = "Error signing the new certificate";
+		goto __error;
+	}
+
+	ASN1_INTEGER_free(aserial);
+	EVP_PKEY_free(req_pubkey);
+	return newcert;
+
+__error:
+	err_descr_to_stderr(*why);
+	ASN1_INTEGER_free(aserial);
+	EVP_PKEY_free(req_pubkey);
+	X509_free(newcert);
+	return NULL;
+}
+
+const struct ca_profile ca_default_profile = {
+	.lifetime = 31536000,
+	.backdate = 0,
+	.copy_extensions = 0,
+};
+
+void ca_request_init(struct ca_request *request) {
+	memset(request, 0, sizeof(*request));
+	csr_init(&request->csr);
+}
+
+int ca_request_admit(struct ca_request *request, const struct ca_admission *lim, struct ca_stats *stats,
+		const char *pem, size_t len, const char **why) {
+	ca_request_init(request);
+
+	if (lim->max_csr_bytes > 0 && len > lim->max_csr_bytes) {
+		return ca_reject(&stats->rejected_size, why, "Request exceeds the size limit");
+	}
+	if (! csr_parse(&request->csr, pem, len)) {
+		// PEM headers, RSA-PSS and the like: through X509_REQ
+		request->req = ca_admit(lim, stats, pem, len, why);
+		return request->req != NULL;
+	}
+	if (! ca_admit_key(stats, lim, request->csr.pkey, why) || ! ca_admit_names(stats, lim, NULL, &request->csr, why)) {
+		return 0;
+	}
+	__atomic_add_fetch(&stats->admitted, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+const struct ca_profile ca_renew_profile = {
+	.lifetime = 31536000,
+	.backdate = 0,
+	.copy_extensions = 1,
+};
+
+/* ------------------------------------------------------------ *
+ * The certificate stands in for the request: it proves the key *
+ * was vetted once, so its own signature, by this CA, is what   *
+ * gets checked instead of a proof of possession.               *
+ * -------------------------------------------------------------*/
+int ca_request_renew(struct ca *ca, struct ca_request *request, const char *crt, size_t len,
+		long grace, const char **why) {
+	struct ca_admission lim;
+	struct csr *csr = &request->csr;
+	struct crl *crl;
+	time_t when;
+	int reason;
+
+	ca_get_admission(ca, &lim);
+	ca_request_init(request);
+
+	if (lim.max_csr_bytes > 0 && len > lim.max_csr_bytes) {
+		return ca_reject(&ca->stats.rejected_size, why, "Certificate exceeds the size limit");
+	}
+	if (! csr_parse_crt(csr, crt, len)) {
+		return ca_reject(&ca->stats.rejected_parse, why, "can't read certificate");
+	}
+	if (csr->issuer.tlv_len != ca->issuer_len || memcmp(csr->issuer.tlv, ca->issuer_der, ca->issuer_len) != 0
+			|| csr->sig_alg.tlv_len != ca->sigalg_len
+			|| memcmp(csr->sig_alg.tlv, ca->sigalg_der, ca->sigalg_len) != 0) {
+		return ca_reject(&ca->stats.rejected_renew, why, "not issued by this CA");
+	}
+
+	EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+	int ok = mdctx != NULL
+		&& EVP_DigestVerifyInit(mdctx, NULL, ca->md, NULL, X509_get0_pubkey(ca->crt)) == 1
+		&& EVP_DigestVerify(mdctx, csr->sig.data + 1, csr->sig.len - 1, csr->info.tlv, csr->info.tlv_len) == 1;
+	EVP_MD_CTX_free(mdctx);
+	if (! ok) {
+		ERR_clear_error();
+		return ca_reject(&ca->stats.rejected_renew, why, "signature doesn't verify");
+	}
+
+	const unsigned char *p = csr->not_after.tlv;
+	ASN1_TIME *not_after = d2i_ASN1_TIME(NULL, &p, csr->not_after.tlv_len);
+	ok = not_after != NULL && ASN1_TIME_cmp_time_t(not_after, time(NULL) - grace) >= 0;
+	ASN1_TIME_free(not_after);
+	if (! ok) {
+		ERR_clear_error();
+		return ca_reject(&ca->stats.rejected_renew, why, "expired");
+	}
+	// the CRL is keyed by magnitude, as an ASN1_INTEGER holds it
+	const unsigned char *serial = csr->serial.data;
+	size_t serial_len = csr->serial.len;
+	if (serial_len > 1 && serial[0] == 0) {
+		serial++;
+		serial_len--;
+	}
+	if (serial_len > CA_SERIAL_MAX || (crl = ca_crl(ca)) == NULL) {
+		return ca_reject(&ca->stats.rejected_renew, why, "can't check revocation");
+	}
+	if (crl_status(crl, serial, serial_len, &when, &reason)) {
+		return ca_reject(&ca->stats.rejected_renew, why, "revoked");
+	}
+
+	// limits tightened since the first issue still apply
+	if (! ca_admit_key(&ca->stats, &lim, csr->pkey, why) || ! ca_admit_names(&ca->stats, &lim, NULL, csr, why)) {
+		return 0;
+	}
+	__atomic_add_fetch(&ca->stats.admitted, 1, __ATOMIC_RELAXED);
+
+	request->subject_der = csr->subject.tlv;
+	request->subject_len = csr->subject.tlv_len;
+	request->spki_der = csr->spki.tlv;
+	request->spki_len = csr->spki.tlv_len;
+	request->exts_der = csr->exts.tlv;
+	request->exts_len = csr->exts.tlv_len;
+	request->verified = 1;
+	return 1;
+}
+
+/* ------------------------------------------------------------ *
+ * The caller vouches for the key holder, so there is nothing   *
+ * to verify: the admission limits are checked on the identity  *
+ * as given, before anything is encoded or decoded.             *
+ * -------------------------------------------------------------*/
+int ca_request_identity(struct ca *ca, struct ca_request *request, const char *spki, size_t len,
+		const struct csr_identity *id, const char **why) {
+	struct ca_admission lim;
+	struct csr *csr = &request->csr;
+
+	ca_get_admission(ca, &lim);
+	ca_request_init(request);
+
+	if (lim.max_csr_bytes > 0 && len > lim.max_csr_bytes) {
+		return ca_reject(&ca->stats.rejected_size, why, "Public key exceeds the size limit");
+	}
+	if (lim.san_max > 0 && id->san_count > (size_t) lim.san_max) {
+		return ca_reject(&ca->stats.rejected_sans, why, "Identity has too many subjectAltNames");
+	}
+	for (size_t idx = 0; lim.name_max > 0 && idx < id->subject_count; idx++) {
+		if (id->subject[idx].len > (size_t) lim.name_max) {
+			return ca_reject(&ca->stats.rejected_name, why, "Identity subject attribute too long");
+		}
+	}
+	for (size_t idx = 0; lim.name_max > 0 && idx < id->san_count; idx++) {
+		if (id->san[idx].type != GEN_IPADD && id->san[idx].len > (size_t) lim.name_max) {
+			return ca_reject(&ca->stats.rejected_name, why, "Identity subjectAltName too long");
+		}
+	}
+	if (! csr_from_key(csr, spki, len, id)) {
+		return ca_reject(&ca->stats.rejected_parse, why, "can't read public key or identity");
+	}
+	if (! ca_admit_key(&ca->stats, &lim, csr->pkey, why)) {
+		return 0;
+	}
+	__atomic_add_fetch(&ca->stats.admitted, 1, __ATOMIC_RELAXED);
+
+	request->subject_der = csr->subject.tlv;
+	request->subject_len = csr->subject.tlv_len;
+	request->spki_der = csr->spki.tlv;
+	request->spki_len = csr->spki.tlv_len;
+	request->exts_der = csr->exts.tlv;
+	request->exts_len = csr->exts.tlv_len;
+	request->verified = 1;
+	return 1;
+}
+
+int ca_request_readmit(struct ca *ca, struct ca_request *request, size_t len, const char **why) {
+	struct ca_admission lim;
+
+	ca_get_admission(ca, &lim);
+	if (lim.max_csr_bytes > 0 && len > lim.max_csr_bytes) {
+		return ca_reject(&ca->stats.rejected_size, why, "Request exceeds the size limit");
+	}
+	EVP_PKEY *pkey = request->req != NULL ? X509_REQ_get0_pubkey(request->req) : request->csr.pkey;
+	if (! ca_admit_key(&ca->stats, &lim, pkey, why)
+			|| ! ca_admit_names(&ca->stats, &lim, request->req, &request->csr, why)) {
+		return 0;
+	}
+	__atomic_add_fetch(&ca->stats.admitted, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+void ca_request_free(struct ca_request *request) {
+	csr_free(&request->csr);
+	X509_REQ_free(request->req);
+	OPENSSL_free(request->subject);
+	OPENSSL_free(request->spki);
+	OPENSSL_free(request->exts);
+}
+
+/* ------------------------------------------------------------ *
+ * Signature check, once per request, and the encodings the     *
+ * certificate takes over: spans of the request as received, or *
+ * the X509_REQ's cached encodings when it took that route.     *
+ * -------------------------------------------------------------*/
+static int ca_request_verify(struct ca_request *request, const char **why) {
+	if (request->verified) {
+		return 1;
+	}
+	if (request->req == NULL) {
+		if (! csr_verify(&request->csr)) {
+			*why = "Error verifying signature on request";
+			err_descr_to_stderr(*why);
+			return 0;
+		}
+		request->subject_der = request->csr.subject.tlv;
+		request->subject_len = request->csr.subject.tlv_len;
+		request->spki_der = request->csr.spki.tlv;
+		request->spki_len = request->csr.spki.tlv_len;
+		request->exts_der = request->csr.exts.tlv;
+		request->exts_len = request->csr.exts.tlv_len;
+		request->verified = 1;
+		return 1;
+	}
+
+	EVP_PKEY *pkey = X509_REQ_get0_pubkey(request->req);
+	if (pkey == NULL || X509_REQ_verify(request->req, pkey) != 1) {
+		*why = "Error verifying signature on request";
+		err_descr_to_stderr(*why);
+		return 0;
+	}
+	int subject_len = i2d_X509_NAME(X509_REQ_get_subject_name(request->req), &request->subject);
+	int spki_len = i2d_X509_PUBKEY(X509_REQ_get_X509_PUBKEY(request->req), &request->spki);
+	int exts_len = 0;
+	STACK_OF(X509_EXTENSION) *exts = X509_REQ_get_extensions(request->req);
+	if (sk_X509_EXTENSION_num(exts) > 0) {
+		exts_len = i2d_X509_EXTENSIONS(exts, &request->exts);
+	}
+	sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);
+	if (subject_len <= 0 || spki_len <= 0 || exts_len < 0) {
+		*why = "Error encoding request subject and key";
+		err_descr_to_stderr(*why);
+		return 0;
+	}
+	request->subject_der = request->subject;
+	request->subject_len = subject_len;
+	request->spki_der = request->spki;
+	request->spki_len = spki_len;
+	request->exts_der = request->exts;
+	request->exts_len = exts_len;
+	request->verified = 1;
+	return 1;
+}
+
+int ca_request_share(struct ca_request *request, const char **why) {
+	if (! ca_request_verify(request, why)) {
+		return 0;
+	}
+	if (request->req == NULL) {
+		// decoded on first use and cached: do it before other threads look
+		csr_name(&request->csr);
+		csr_extensions(&request->csr);
+		ERR_clear_error();
+	}
+	return 1;
+}
+
+/* ------------------------------------------------------------ *
+ * What copy_extensions takes from a request: subjectAltName,   *
+ * extendedKeyUsage and keyUsage, as requested. Anything else,  *
+ * basicConstraints and nameConstraints above all, is left out. *
+ * A keyUsage asking for keyCertSign or cRLSign, or an          *
+ * extendedKeyUsage naming anything but serverAuth and          *
+ * clientAuth (OCSPSigning would make a delegated responder for *
+ * this CA), refuses the request: no requester gets to act for  *
+ * the CA.                                                      *
+ * -------------------------------------------------------------*/
+static const unsigned char OID_KEY_USAGE[] = { 0x55, 0x1d, 0x0f };
+static const unsigned char OID_SUBJECT_ALT_NAME[] = { 0x55, 0x1d, 0x11 };
+static const unsigned char OID_EXT_KEY_USAGE[] = { 0x55, 0x1d, 0x25 };
+static const unsigned char OID_KP_SERVER_AUTH[] = { 0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x03, 0x01 };
+static const unsigned char OID_KP_CLIENT_AUTH[] = { 0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x03, 0x02 };
+
+/* keyCertSign and cRLSign, bits 5 and 6 of the first byte */
+#define KEY_USAGE_CA_BITS 0x06
+
+static int ca_oid_is(const struct der_span *oid, const unsigned char *want, size_t want_len) {
+	return oid->len == want_len && memcmp(oid->data, want, want_len) == 0;
+}
+
+/* appends [3] with the copied ones to tbs, nothing when none are;
+ * 0 with *why on refusal */
+static int ca_copy_extensions(struct der *tbs, const unsigned char *exts, size_t len, const char **why) {
+	const unsigned char *p = exts, *end = exts + len;
+	struct der_span seq, ext, oid, part;
+	size_t tag = 0, inner = 0;
+	int copied = 0;
+
+	if (! der_expect(&p, end, DER_SEQUENCE, &seq) || p != end) {
+		goto __bad;
+	}
+	for (p = seq.data, end = p + seq.len; p < end; ) {
+		if (! der_expect(&p, end, DER_SEQUENCE, &ext)) {
+			goto __bad;
+		}
+		const unsigned char *q = ext.data, *ext_end = q + ext.len;
+		if (! der_expect(&q, ext_end, DER_OID, &oid)) {
+			goto __bad;
+		}
+		int key_usage = ca_oid_is(&oid, OID_KEY_USAGE, sizeof(OID_KEY_USAGE));
+		int ext_key_usage = ca_oid_is(&oid, OID_EXT_KEY_USAGE, sizeof(OID_EXT_KEY_USAGE));
+		if (! key_usage && ! ext_key_usage && ! ca_oid_is(&oid, OID_SUBJECT_ALT_NAME, sizeof(OID_SUBJECT_ALT_NAME))) {
+			continue;
+		}
+		// [critical BOOLEAN] OCTET STRING { value }
+		struct der_span value;
+		if ((q < ext_end && *q == DER_BOOLEAN && ! der_expect(&q, ext_end, DER_BOOLEAN, &part))
+				|| ! der_expect(&q, ext_end, DER_OCTET, &value)) {
+			goto __bad;
+		}
+		const unsigned char *r = value.data, *value_end = value.data + value.len;
+		if (key_usage) {
+			struct der_span bits;
+			if (! der_expect(&r, value_end, DER_BIT_STRING, &bits) || bits.len < 1) {
+				goto __bad;
+			}
+			if (bits.len > 1 && (bits.data[1] & KEY_USAGE_CA_BITS)) {
+				*why = "Request asks for keyCertSign or cRLSign";
+				return 0;
+			}
+		} else if (ext_key_usage) {
+			// SEQUENCE OF KeyPurposeId
+			struct der_span purposes, purpose;
+			if (! der_expect(&r, value_end, DER_SEQUENCE, &purposes)) {
+				goto __bad;
+			}
+			for (r = purposes.data; r < purposes.data + purposes.len; ) {
+				if (! der_expect(&r, purposes.data + purposes.len, DER_OID, &purpose)) {
+					goto __bad;
+				}
+				if (! ca_oid_is(&purpose, OID_KP_SERVER_AUTH, sizeof(OID_KP_SERVER_AUTH))
+						&& ! ca_oid_is(&purpose, OID_KP_CLIENT_AUTH, sizeof(OID_KP_CLIENT_AUTH))) {
+					*why = "Request asks for an extended key usage other than serverAuth or clientAuth";
+					return 0;
+				}
+			}
+		}
+		if (! copied++) {
+			tag = der_open(tbs, DER_CTX(3));
+			inner = der_open(tbs, DER_SEQUENCE);
+		}
+		der_put(tbs, ext.tlv, ext.tlv_len);
+	}
+	if (copied) {
+		der_close(tbs, inner);
+		der_close(tbs, tag);
+	}
+	return 1;
+
+__bad:
+	*why = "Request extensions can't be decoded";
+	return 0;
+}
+
+/* ------------------------------------------------------------ *
+ * TBSCertificate for an admitted request. The subject Name,    *
+ * SubjectPublicKeyInfo and, if the profile copies them, the    *
+ * admitted extensions are the request's own bytes; only the    *
+ * serial and validity are encoded per certificate.             *
+ * -------------------------------------------------------------*/
+static int ca_build_tbs(struct ca *ca, const struct ca_request *request, const struct ca_profile *profile,
+		const unsigned char *serial, size_t serial_len, struct der *tbs, const char **why) {
+	time_t now = time(NULL);
+	int exts = profile->copy_extensions && request->exts_len > 0;
+
+	der_reserve(tbs, ca->issuer_len + ca->sigalg_len + request->subject_len + request->spki_len
+			+ (exts ? request->exts_len : 0) + 96);
+	size_t seq = der_open(tbs, DER_SEQUENCE);
+	size_t version = der_open(tbs, DER_CTX(0));
+	der_uint(tbs, 2);
+	der_close(tbs, version);
+	der_uint_bytes(tbs, DER_INTEGER, serial, serial_len);
+	der_put(tbs, ca->sigalg_der, ca->sigalg_len);
+	der_put(tbs, ca->issuer_der, ca->issuer_len);
+	size_t validity = der_open(tbs, DER_SEQUENCE);
+	der_time(tbs, now - profile->backdate);
+	der_time(tbs, now + profile->lifetime);
+	der_close(tbs, validity);
+	der_put(tbs, request->subject_der, request->subject_len);
+	der_put(tbs, request->spki_der, request->spki_len);
+	if (exts && ! ca_copy_extensions(tbs, request->exts_der, request->exts_len, why)) {
+		return 0;
+	}
+	der_close(tbs, seq);
+	if (tbs->failed) {
+		*why = "Error encoding the new certificate";
+		return 0;
+	}
+	return 1;
+}
+
+int ca_prepare_tbs(struct ca *ca, struct ca_request *request, const struct ca_profile *profile,
+		const unsigned char *serial, size_t serial_len, struct der *tbs,
+		char serial_hex[2 * CA_SERIAL_MAX + 1], const char **why) {
+	unsigned char mag[CA_SERIAL_RANDOM];
+
+	// policy first: it is cheap and spares the signature checks
+	if (! ca_check_policy(ca, request->req, &request->csr, why) || ! ca_request_verify(request, why)) {
+		return 0;
+	}
+	if (serial == NULL) {
+		if ((serial_len = ca_random_serial_bytes(mag)) == 0) {
+			*why = "Error generating serial number";
+			err_descr_to_stderr(*why);
+			return 0;
+		}
+		serial = mag;
+	}
+	if (! ca_build_tbs(ca, request, profile != NULL ? profile : &ca_default_profile, serial, serial_len, tbs, why)) {
+		return 0;
+	}
+	ca_serial_to_hex(serial, serial_len, serial_hex);
+	return 1;
+}
+
+int ca_request_pem(struct ca *ca, struct ca_request *request, const struct ca_profile *profile,
+		struct der *out, char serial[2 * CA_SERIAL_MAX + 1], const char **why) {
+	struct der tbs, crt;
+	int ok = 0;
+
+	der_init(&tbs);
+	der_init(&crt);
+	if (ca->key_elsewhere) {
+		*why = CA_WHY_KEY_ELSEWHERE;
+		goto __done;
+	}
+	if (! ca_prepare_tbs(ca, request, profile, NULL, 0, &tbs, serial, why)) {
+		goto __done;
+	}
+	if (! ca_sign_tbs(ca, tbs.buf, tbs.len, &crt)) {
+		*why = "Error signing the new certificate";
+		goto __done;
+	}
+	pem_encode(out, "CERTIFICATE", crt.buf, crt.len);
+	if (out->failed) {
+		*why = "can't encode certificate";
+		goto __done;
+	}
+	ok = 1;
+
+__done:
+	der_free(&crt);
+	der_free(&tbs);
+	return ok;
+}
+
+int ca_sign_pem(struct ca *ca, const char *pem, size_t len, const struct ca_profile *profile,
+		struct der *out, char serial[2 * CA_SERIAL_MAX + 1], const char **why) {
+	struct ca_admission lim;
+	struct ca_request request;
+
+	ca_get_admission(ca, &lim);
+	if (! ca_request_admit(&request, &lim, &ca->stats, pem, len, why)) {
+		ca_request_free(&request);
+		return 0;
+	}
+	int ok = ca_request_pem(ca, &request, profile, out, serial, why);
+	ca_request_free(&request);
+	return ok;
+}
+
+int ca_renew_pem(struct ca *ca, const char *crt, size_t len, const struct ca_profile *profile, long grace,
+		struct der *out, char serial[2 * CA_SERIAL_MAX + 1], const char **why) {
+	struct ca_request request;
+
+	if (! ca_request_renew(ca, &request, crt, len, grace, why)) {
+		ca_request_free(&request);
+		return 0;
+	}
+	int ok = ca_request_pem(ca, &request, profile != NULL ? profile : &ca_renew_profile, out, serial, why);
+	ca_request_free(&request);
+	return ok;
+}
+
+int ca_identity_pem(struct ca *ca, const char *spki, size_t len, const struct csr_identity *id,
+		const struct ca_profile *profile, struct der *out, char serial[2 * CA_SERIAL_MAX + 1], const char **why) {
+	struct ca_request request;
+	struct ca_profile with_san = profile != NULL ? *profile : ca_default_profile;
+
+	if (! ca_request_identity(ca, &request, spki, len, id, why)) {
+		ca_request_free(&request);
+		return 0;
+	}
+	with_san.copy_extensions = 1;
+	int ok = ca_request_pem(ca, &request, &with_san, out, serial, why);
+	ca_request_free(&request);
+	return ok;
+}
+
+int ca_check_crt(struct ca *ca, X509 *crt, const char **why) {
+	const ASN1_INTEGER *serial = X509_get0_serialNumber(crt);
+	struct crl *crl;
+	time_t when;
+	int reason;
+
+	if (X509_check_issued(ca->crt, crt) != X509_V_OK) {
+		*why = "not issued by this CA";
+		return 0;
+	}
+	if (X509_verify(crt, X509_get0_pubkey(ca->crt)) != 1) {
+		ERR_clear_error();
+		*why = "signature doesn't verify";
+		return 0;
+	}
+	if (X509_cmp_current_time(X509_get0_notBefore(crt)) > 0) {
+		*why = "not yet valid";
+		return 0;
+	}
+	if (X509_cmp_current_time(X509_get0_notAfter(crt)) < 0) {
+		*why = "expired";
+		return 0;
+	}
+	if (serial->length > CA_SERIAL_MAX || (crl = ca_crl(ca)) == NULL) {
+		*why = "can't check revocation";
+		return 0;
+	}
+	if (crl_status(crl, serial->data, serial->length, &when, &reason)) {
+		*why = "revoked";
+		return 0;
+	}
+	return 1;
+}
+
+int ca_crt_pem(X509 *crt, struct der *out) {
+	struct der der;
+	unsigned char *p;
+
+	der_init(&der);
+	int len = i2d_X509(crt, NULL);
+	if (len <= 0 || ! der_reserve(&der, len)) {
+		err_descr_to_stderr("Error printing the signed certificate");
+		der_free(&der);
+		return 0;
+	}
+	p = der.buf;
+	der.len = i2d_X509(crt, &p);
+	pem_encode(out, "CERTIFICATE", der.buf, der.len);
+	der_free(&der);
+	return !out->failed;
+}
+
+/* ------------------------------------------------------------ *
+ * Sign DER we built ourselves and wrap it the way X509 and     *
+ * X509_CRL are wrapped: tbs, algorithm, BIT STRING signature   *
+ * -------------------------------------------------------------*/
+static int ca_wrap_tbs(struct ca *ca, const unsigned char *tbs, size_t tbs_len,
+		const unsigned char *sig, size_t sig_len, struct der *out) {
+	// BIT STRING content starts with the unused-bits count
+	static const unsigned char unused = 0;
+
+	der_reserve(out, tbs_len + ca->sigalg_len + sig_len + 16);
+	size_t seq = der_open(out, DER_SEQUENCE);
+	der_put(out, tbs, tbs_len);
+	der_put(out, ca->sigalg_der, ca->sigalg_len);
+	size_t bits = der_open(out, DER_BIT_STRING);
+	der_put(out, &unused, 1);
+	der_put(out, sig, sig_len);
+	der_close(out, bits);
+	der_close(out, seq);
+	return !out->failed;
+}
+
+/* the backend signs the digest, ca_finish_tbs() checks its work */
+static int ca_sign_tbs_backend(struct ca *ca, const unsigned char *tbs, size_t tbs_len, struct der *out) {
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len = 0;
+	size_t sig_len = EVP_PKEY_size(ca->key);
+	unsigned char *sig = OPENSSL_malloc(sig_len);
+	int rc = 0;
+
+	if (sig == NULL) {
+		fprintf(stderr, "Error allocating signature\n");
+		return 0;
+	}
+	if (ca_digest_tbs(ca, tbs, tbs_len, md, &md_len) &&
+			ca->backend->sign(ca->backend, md, md_len, sig, &sig_len)) {
+		rc = ca_finish_tbs(ca, tbs, tbs_len, sig, sig_len, out);
+		if (! rc && ! out->failed) {
+			fprintf(stderr, "Signature from the signing backend doesn't verify\n");
+		}
+	}
+	OPENSSL_free(sig);
+	return rc;
+}
+
+int ca_sign_tbs(struct ca *ca, const unsigned char *tbs, size_t tbs_len, struct der *out) {
+	int rc = 0;
+	size_t sig_len = 0;
+	unsigned char *sig = NULL;
+
+	if (ca->key_elsewhere) {
+		fprintf(stderr, "%s\n", CA_WHY_KEY_ELSEWHERE);
+		return 0;
+	}
+	if (ca->backend != NULL) {
+		return ca_sign_tbs_backend(ca, tbs, tbs_len, out);
+	}
+
+	// one-shot, the only way EdDSA signs
+	EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+	if (mdctx == NULL || EVP_DigestSignInit(mdctx, NULL, ca->md, NULL, ca->key) != 1) {
+		err_descr_to_stderr("Error initializing signature");
+		goto __error;
+	}
+	if (EVP_DigestSign(mdctx, NULL, &sig_len, tbs, tbs_len) != 1) {
+		err_descr_to_stderr("Error sizing the signature");
+		goto __error;
+	}
+	if ((sig = OPENSSL_malloc(sig_len)) == NULL) {
+		fprintf(stderr, "Error allocating signature\n");
+		goto __error;
+	}
+	if (EVP_DigestSign(mdctx, sig, &sig_len, tbs, tbs_len) != 1) {
+		err_descr_to_stderr("Error signing data");
+		goto __error;
+	}
+
+	rc = ca_wrap_tbs(ca, tbs, tbs_len, sig, sig_len, out);
+
+__error:
+	OPENSSL_free(sig);
+	EVP_MD_CTX_free(mdctx);
+	return rc;
+}
+
+int ca_digest_tbs(struct ca *ca, const unsigned char *tbs, size_t tbs_len,
+		unsigned char md[EVP_MAX_MD_SIZE], unsigned int *md_len) {
+	if (ca->md == NULL || EVP_Digest(tbs, tbs_len, md, md_len, ca->md, NULL) != 1) {
+		err_descr_to_stderr("Error hashing data to sign");
+		return 0;
+	}
+	return 1;
+}
+
+/* the signature is checked against the CA certificate's key first,
+ * so a confused signer can't produce a certificate that won't verify */
+int ca_finish_tbs(struct ca *ca, const unsigned char *tbs, size_t tbs_len,
+		const unsigned char *sig, size_t sig_len, struct der *out) {
+	EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+	int ok = mdctx != NULL
+		&& EVP_DigestVerifyInit(mdctx, NULL, ca->md, NULL, X509_get0_pubkey(ca->crt)) == 1
+		&& EVP_DigestVerify(mdctx, sig, sig_len, tbs, tbs_len) == 1;
+
+	EVP_MD_CTX_free(mdctx);
+	if (! ok) {
+		ERR_clear_error();
+		return 0;
+	}
+	return ca_wrap_tbs(ca, tbs, tbs_len, sig, sig_len, out);
+}
+
+int ca_sign_prepared(struct ca *ca, const unsigned char *data, size_t len, struct der *sig) {
+	size_t sig_len = EVP_PKEY_size(ca->key);
+	int ok;
+
+	if (ca->backend != NULL || ca->key_elsewhere || ! der_reserve(sig, sig_len)) {
+		return 0;
+	}
+	if (ca->md == NULL) {
+		EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+		ok = mdctx != NULL
+			&& EVP_DigestSignInit(mdctx, NULL, NULL, NULL, ca->key) == 1
+			&& EVP_DigestSign(mdctx, sig->buf + sig->len, &sig_len, data, len) == 1;
+		EVP_MD_CTX_free(mdctx);
+	} else {
+		// what signerd does with a digest off the socket
+		EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(ca->key, NULL);
+		ok = len == (size_t) EVP_MD_size(ca->md)
+			&& ctx != NULL
+			&& EVP_PKEY_sign_init(ctx) == 1
+			&& EVP_PKEY_CTX_set_signature_md(ctx, ca->md) == 1
+			&& EVP_PKEY_sign(ctx, sig->buf + sig->len, &sig_len, data, len) == 1;
+		EVP_PKEY_CTX_free(ctx);
+	}
+	if (! ok) {
+		ERR_clear_error();
+		return 0;
+	}
+	sig->len += sig_len;
+	return 1;
+}
+
+static int hexval(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/* ------------------------------------------------------------ *
+ * "0x1A2B", "1a:2b" or "1A2B" -> minimal big-endian magnitude  *
+ * -------------------------------------------------------------*/
+int ca_serial_from_hex(const char *hex, size_t len, unsigned char *out, size_t *out_len) {
+	unsigned char nibbles[2 * CA_SERIAL_MAX];
+	size_t count = 0;
+
+	if (len > 2 && hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X')) {
+		hex += 2;
+		len -= 2;
+	}
+	for (size_t idx = 0; idx < len; idx++) {
+		if (hex[idx] == ':') {
+			continue;
+		}
+		int v = hexval(hex[idx]);
+		if (v < 0) {
+			return 0;
+		}
+		if (v == 0 && count == 0) {
+			continue;
+		}
+		if (count == sizeof(nibbles)) {
+			return 0;
+		}
+		nibbles[count++] = v;
+	}
+
+	size_t bytes = (count + 1) / 2;
+	size_t n = 0;
+	if (count % 2) {
+		out[n++] = nibbles[0];
+	}
+	for (size_t idx = count % 2; idx < count; idx += 2) {
+		out[n++] = (nibbles[idx] << 4) | nibbles[idx + 1];
+	}
+	if (bytes == 0) {
+		out[0] = 0;
+		bytes = 1;
+	}
+	*out_len = bytes;
+	return 1;
+}
+
+void ca_serial_to_hex(const unsigned char *mag, size_t len, char *out) {
+	static const char digits[] = "0123456789ABCDEF";
+	for (size_t idx = 0; idx < len; idx++) {
+		out[2 * idx] = digits[mag[idx] >> 4];
+		out[2 * idx + 1] = digits[mag[idx] & 0x0f];
+	}
+	out[2 * len] = '\0';
+}
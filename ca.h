@@ -0,0 +1,297 @@
+#ifndef LUA_OPENSSL_CA_H
+#define LUA_OPENSSL_CA_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <openssl/x509.h>
+
+#include "csr.h"
+#include "der.h"
+
+/* longest serial number magnitude RFC 5280 allows */
+#define CA_SERIAL_MAX 20
+/* random serials: 16 bytes, top bit clear so they stay positive */
+#define CA_SERIAL_RANDOM 16
+
+struct crl;
+struct ocsp;
+struct policy;
+
+/* key algorithms admitted for signing */
+#define CA_KEY_RSA	0x01
+#define CA_KEY_EC	0x02
+#define CA_KEY_ED25519	0x04
+#define CA_KEY_ED448	0x08
+
+/* ------------------------------------------------------------ *
+ * Limits checked on a request before any public-key operation, *
+ * so oversized or abusive input is turned away for the cost of *
+ * a parse. 0 disables a limit.                                 *
+ * -------------------------------------------------------------*/
+struct ca_admission {
+	size_t max_csr_bytes;	/* raw input, PEM as received */
+	unsigned key_types;	/* CA_KEY_* mask */
+	int rsa_max_bits;
+	int san_max;		/* subjectAltName entries */
+	int name_max;		/* bytes in any subject attribute or SAN */
+};
+
+struct ca_stats {
+	uint64_t admitted;
+	uint64_t rejected_size;
+	uint64_t rejected_parse;
+	uint64_t rejected_key;
+	uint64_t rejected_sans;
+	uint64_t rejected_name;
+	uint64_t rejected_policy;
+	uint64_t rejected_renew;	/* another issuer's, forged, expired or revoked */
+};
+
+/* ------------------------------------------------------------ *
+ * Where signatures come from when the CA key is held outside   *
+ * this process. sign() gets the digest of a TBS under the CA   *
+ * hash and leaves the signature in sig, *sig_len being its     *
+ * room on entry; it is called from many threads at once.       *
+ * -------------------------------------------------------------*/
+struct ca_backend {
+	int (*sign)(struct ca_backend *backend, const unsigned char *md, size_t md_len,
+			unsigned char *sig, size_t *sig_len);
+	void (*release)(struct ca_backend *backend);
+};
+
+/* ------------------------------------------------------------ *
+ * A loaded issuing CA: private key, certificate and the        *
+ * encodings derived from them once, so signing paths only do   *
+ * the per-request work. Shared by refcount.                    *
+ * -------------------------------------------------------------*/
+struct ca {
+	int refs;
+	EVP_PKEY *key;		/* only the public half with a backend or key_elsewhere */
+	X509 *crt;
+	struct ca_backend *backend;	/* NULL: key signs in process */
+	int key_elsewhere;	/* certificate alone: prepare and finish only */
+	const EVP_MD *md;		/* NULL for EdDSA, which signs the TBS itself */
+
+	unsigned char *issuer_der;	/* CA subject Name */
+	size_t issuer_len;
+	unsigned char *sigalg_der;	/* AlgorithmIdentifier of key + md */
+	size_t sigalg_len;
+	unsigned char keyid[SHA_DIGEST_LENGTH];	/* for authorityKeyIdentifier */
+	size_t keyid_len;
+
+	pthread_mutex_t lock;	/* guards the lazily created members below */
+	struct crl *crl;
+	struct ocsp *ocsp;
+	struct policy *policy;	/* checked by ca_issue, may be NULL */
+	struct ca_admission admission;	/* guarded by lock */
+
+	struct ca_stats stats;	/* atomic counters */
+
+	struct ca *live_prev, *live_next;	/* every CA, for the fork handlers */
+};
+
+/* ------------------------------------------------------------ *
+ * One-time library setup that skips openssl.cnf. Constructors  *
+ * call it, so callers only use it to choose when it happens.   *
+ * Error strings are loaded on the first reported error.        *
+ * -------------------------------------------------------------*/
+void ca_init(void);
+void ca_load_error_strings(void);
+/* fetches a digest, cipher, key type or signature algorithm ahead
+ * of its first use; 0 when nothing goes by that name */
+int ca_preload(const char *name);
+
+/* digests fetched once on OpenSSL 3, the EVP_sha*() ones before it */
+const EVP_MD *ca_sha1(void);
+const EVP_MD *ca_sha256(void);
+
+void err_descr_to_stderr(const char *err_patern);
+
+struct ca *ca_new(const char *key, size_t key_len, const char *crt, size_t crt_len,
+		const char *password);
+/* ------------------------------------------------------------ *
+ * A CA whose certificates and CRLs are signed by backend,      *
+ * which the CA owns from here on, even when NULL is returned.  *
+ * What still needs the key in process, ca_issue() and OCSP     *
+ * responses, fails.                                            *
+ * -------------------------------------------------------------*/
+struct ca *ca_new_backend(const char *crt, size_t crt_len, struct ca_backend *backend);
+/* the certificate alone, for ca_prepare_tbs() and ca_finish_tbs() with
+ * the key in another process; anything that signs here fails with
+ * CA_WHY_KEY_ELSEWHERE */
+struct ca *ca_new_public(const char *crt, size_t crt_len);
+#define CA_WHY_KEY_ELSEWHERE "CA key is held elsewhere: use prepare and finish"
+
+struct ca *ca_ref(struct ca *ca);
+void ca_unref(struct ca *ca);
+
+/* ------------------------------------------------------------ *
+ * Process-wide registry, so every Lua state in the process     *
+ * signs with one loaded copy of a CA. The registry holds a     *
+ * reference; lookups return a new one.                         *
+ * -------------------------------------------------------------*/
+int ca_register(const char *name, struct ca *ca);
+struct ca *ca_lookup(const char *name);
+int ca_unregister(const char *name);
+
+/* ------------------------------------------------------------ *
+ * Preforking servers: ca_prefork() in the master warms every   *
+ * registered CA with one signature, so method tables and key   *
+ * precomputation are shared copy-on-write, and drains the      *
+ * worker pools. ca_postfork() in each child reseeds the DRBGs. *
+ * -------------------------------------------------------------*/
+int ca_warm(struct ca *ca);
+int ca_prefork(void);
+void ca_postfork(void);
+
+X509_REQ *ca_read_req(const char *pem, size_t len);
+
+extern const struct ca_admission ca_default_admission;
+
+/* ca_read_req behind admission limits; *why explains a NULL return */
+X509_REQ *ca_admit(const struct ca_admission *admission, struct ca_stats *stats,
+		const char *pem, size_t len, const char **why);
+
+void ca_set_admission(struct ca *ca, const struct ca_admission *admission);
+void ca_get_admission(struct ca *ca, struct ca_admission *admission);
+/* ca_admit with the CA's own limits and counters */
+X509_REQ *ca_admit_req(struct ca *ca, const char *pem, size_t len, const char **why);
+
+/* swaps the issuance policy (NULL for none), taking a reference */
+void ca_set_policy(struct ca *ca, struct policy *policy);
+
+/* serial NULL picks a fresh random one; *why explains a NULL return */
+X509 *ca_issue(struct ca *ca, X509_REQ *req, const ASN1_INTEGER *serial, const char **why);
+
+/* ------------------------------------------------------------ *
+ * What a certificate gets beyond the request's subject and key *
+ * -------------------------------------------------------------*/
+struct ca_profile {
+	long lifetime;		/* seconds from now to notAfter */
+	long backdate;		/* seconds notBefore lies in the past, for skewed clocks */
+	int copy_extensions;	/* the request's subjectAltName, extendedKeyUsage and keyUsage, unless they ask for CA powers */
+};
+
+/* 365 days from now, no extensions: what ca_issue has always made */
+extern const struct ca_profile ca_default_profile;
+
+/* ------------------------------------------------------------ *
+ * A request past admission. Plain PEM requests are parsed in   *
+ * place; the rest take the X509_REQ route. The parts below are *
+ * set once the signature has been checked.                     *
+ * -------------------------------------------------------------*/
+struct ca_request {
+	struct csr csr;
+	X509_REQ *req;		/* NULL when csr holds the request */
+
+	int verified;
+	const unsigned char *subject_der;
+	size_t subject_len;
+	const unsigned char *spki_der;
+	size_t spki_len;
+	const unsigned char *exts_der;	/* Extensions SEQUENCE, NULL if none */
+	size_t exts_len;
+	unsigned char *subject, *spki, *exts;	/* encodings owned on the X509_REQ route */
+};
+
+/* parse and admission limits, no CA key involved; free even on failure */
+void ca_request_init(struct ca_request *request);
+int ca_request_admit(struct ca_request *request, const struct ca_admission *lim, struct ca_stats *stats,
+		const char *pem, size_t len, const char **why);
+void ca_request_free(struct ca_request *request);
+
+/* ------------------------------------------------------------ *
+ * One request for several CAs, as when cross-signing: admitted *
+ * by the first, ca_request_readmit() checks it against each of *
+ * the others' limits without parsing it again. Then            *
+ * ca_request_share() verifies it once and decodes what policy  *
+ * checks look at, after which ca_request_pem() may run on it   *
+ * from several threads at once.                                *
+ * -------------------------------------------------------------*/
+int ca_request_readmit(struct ca *ca, struct ca_request *request, size_t len, const char **why);
+int ca_request_share(struct ca_request *request, const char **why);
+
+/* ------------------------------------------------------------ *
+ * Issuance in two halves, for keys held by another process:    *
+ * ca_prepare_tbs() checks policy and the request signature and *
+ * appends the TBSCertificate to tbs, ca_sign_tbs() or          *
+ * ca_finish_tbs() turn it into the certificate. serial NULL    *
+ * picks a random one; serial_hex gets it either way.           *
+ * -------------------------------------------------------------*/
+int ca_prepare_tbs(struct ca *ca, struct ca_request *request, const struct ca_profile *profile,
+		const unsigned char *serial, size_t serial_len, struct der *tbs,
+		char serial_hex[2 * CA_SERIAL_MAX + 1], const char **why);
+
+/* the CA digest of tbs, what a remote signer signs; 0 for EdDSA keys */
+int ca_digest_tbs(struct ca *ca, const unsigned char *tbs, size_t tbs_len,
+		unsigned char md[EVP_MAX_MD_SIZE], unsigned int *md_len);
+
+/* appends the certificate for a signature made elsewhere, 0 when it
+ * doesn't verify under the CA certificate */
+int ca_finish_tbs(struct ca *ca, const unsigned char *tbs, size_t tbs_len,
+		const unsigned char *sig, size_t sig_len, struct der *out);
+
+/* the key holder's half: appends the signature over what
+ * ca_digest_tbs() gave, or over the TBS itself for EdDSA; 0 when
+ * the key isn't held in process or data doesn't fit */
+int ca_sign_prepared(struct ca *ca, const unsigned char *data, size_t len, struct der *sig);
+
+/* ------------------------------------------------------------ *
+ * Both halves in one: PEM request in, PEM certificate appended *
+ * to out, with the CA's admission limits and policy. profile   *
+ * NULL is ca_default_profile. *why explains a 0 return.        *
+ * -------------------------------------------------------------*/
+int ca_sign_pem(struct ca *ca, const char *pem, size_t len, const struct ca_profile *profile,
+		struct der *out, char serial[2 * CA_SERIAL_MAX + 1], const char **why);
+/* the same for a request already admitted, which stays the caller's */
+int ca_request_pem(struct ca *ca, struct ca_request *request, const struct ca_profile *profile,
+		struct der *out, char serial[2 * CA_SERIAL_MAX + 1], const char **why);
+
+/* ------------------------------------------------------------ *
+ * Renewal without a CSR: a certificate this CA issued, PEM or  *
+ * DER, is admitted in place of a request when its signature    *
+ * verifies, it is not revoked and it expired no more than      *
+ * grace seconds ago. The new certificate keeps its subject,    *
+ * key and, under ca_renew_profile, its extensions; serial and  *
+ * validity are fresh.                                          *
+ * -------------------------------------------------------------*/
+extern const struct ca_profile ca_renew_profile;
+
+int ca_request_renew(struct ca *ca, struct ca_request *request, const char *crt, size_t len,
+		long grace, const char **why);
+/* ca_sign_pem() for renewals; profile NULL is ca_renew_profile */
+int ca_renew_pem(struct ca *ca, const char *crt, size_t len, const struct ca_profile *profile, long grace,
+		struct der *out, char serial[2 * CA_SERIAL_MAX + 1], const char **why);
+
+/* ------------------------------------------------------------ *
+ * Issuance without a request, for callers that authenticated   *
+ * the key holder themselves: the certificate is built from a   *
+ * SubjectPublicKeyInfo, PEM or DER, and an identity. Admission *
+ * limits and policy still apply. ca_identity_pem() always      *
+ * copies the identity's subjectAltName, whatever the profile's *
+ * copy_extensions says; it is the only extension there is.     *
+ * -------------------------------------------------------------*/
+int ca_request_identity(struct ca *ca, struct ca_request *request, const char *spki, size_t len,
+		const struct csr_identity *id, const char **why);
+int ca_identity_pem(struct ca *ca, const char *spki, size_t len, const struct csr_identity *id,
+		const struct ca_profile *profile, struct der *out, char serial[2 * CA_SERIAL_MAX + 1], const char **why);
+
+/* issued by ca, within its validity period and not on its CRL;
+ * *why explains a 0 return */
+int ca_check_crt(struct ca *ca, X509 *crt, const char **why);
+
+/* appends the certificate as PEM, 0 on failure */
+int ca_crt_pem(X509 *crt, struct der *out);
+
+/* appends SEQUENCE { tbs, signatureAlgorithm, signature } to out */
+int ca_sign_tbs(struct ca *ca, const unsigned char *tbs, size_t tbs_len, struct der *out);
+
+/* serial numbers as hex text <-> big-endian magnitude */
+int ca_serial_from_hex(const char *hex, size_t len, unsigned char *out, size_t *out_len);
+void ca_serial_to_hex(const unsigned char *mag, size_t len, char *out);
+
+#endif
@@ -0,0 +1,153 @@
+/*
+// Framing of the CA daemon protocol (cad.h) and the blocking client the
+// Lua module talks to cadd with. The daemon itself is cadd.c.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cad.h"
+
+static void put_u32(unsigned char *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+void cad_put_frame(struct der *out, uint32_t id, unsigned char op, unsigned char status,
+		const char *name, size_t name_len, const void *body, size_t len) {
+	unsigned char header[CAD_HEADER];
+
+	put_u32(header, name_len + len);
+	put_u32(header + 4, id);
+	header[8] = op;
+	header[9] = status;
+	header[10] = name_len >> 8;
+	header[11] = name_len;
+	der_reserve(out, sizeof(header) + name_len + len);
+	der_put(out, header, sizeof(header));
+	der_put(out, name, name_len);
+	der_put(out, body, len);
+}
+
+size_t cad_get_frame(const unsigned char *buf, size_t len, struct cad_frame *frame) {
+	if (len < CAD_HEADER) {
+		return 0;
+	}
+	size_t payload = get_u32(buf);
+	size_t name_len = (size_t) buf[10] << 8 | buf[11];
+	if (payload > CAD_PAYLOAD_MAX || name_len > payload) {
+		return CAD_FRAME_BAD;
+	}
+	if (len < CAD_HEADER + payload) {
+		return 0;
+	}
+	frame->id = get_u32(buf + 4);
+	frame->op = buf[8];
+	frame->status = buf[9];
+	frame->name = (const char *) buf + CAD_HEADER;
+	frame->name_len = name_len;
+	frame->body = buf + CAD_HEADER + name_len;
+	frame->len = payload - name_len;
+	return CAD_HEADER + payload;
+}
+
+int cad_client_open(struct cad_client *client, const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	memset(client, 0, sizeof(*client));
+	der_init(&client->in);
+	client->fd = -1;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return 0;
+	}
+	strcpy(addr.sun_path, path);
+	client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (client->fd < 0 || connect(client->fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		int err = errno;
+		cad_client_close(client);
+		errno = err;
+		return 0;
+	}
+	return 1;
+}
+
+void cad_client_close(struct cad_client *client) {
+	if (client->fd >= 0) {
+		close(client->fd);
+		client->fd = -1;
+	}
+	der_free(&client->in);
+	client->taken = 0;
+}
+
+int cad_client_send(struct cad_client *client, const struct der *frames) {
+	const unsigned char *p = frames->buf;
+	size_t left = frames->len;
+
+	if (frames->failed) {
+		errno = ENOMEM;
+		return 0;
+	}
+	while (left > 0) {
+		ssize_t n = send(client->fd, p, left, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return 0;
+		}
+		p += n;
+		left -= n;
+	}
+	return 1;
+}
+
+int cad_client_next(struct cad_client *client, struct cad_frame *frame) {
+	struct der *in = &client->in;
+
+	// the previous reply is no longer needed
+	if (client->taken > 0) {
+		memmove(in->buf, in->buf + client->taken, in->len - client->taken);
+		in->len -= client->taken;
+		client->taken = 0;
+	}
+
+	for (;;) {
+		size_t used = cad_get_frame(in->buf, in->len, frame);
+		if (used == CAD_FRAME_BAD) {
+			errno = EPROTO;
+			return 0;
+		}
+		if (used > 0) {
+			client->taken = used;
+			return 1;
+		}
+		if (! der_reserve(in, 64 * 1024)) {
+			errno = ENOMEM;
+			return 0;
+		}
+		ssize_t n = read(client->fd, in->buf + in->len, in->cap - in->len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			if (n == 0) {
+				errno = ECONNRESET;
+			}
+			return 0;
+		}
+		in->len += n;
+	}
+}
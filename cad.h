@@ -0,0 +1,76 @@
+#ifndef LUA_OPENSSL_CAD_H
+#define LUA_OPENSSL_CAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "der.h"
+
+/* ------------------------------------------------------------ *
+ * Framing of the CA daemon (cadd) socket. Every frame is a     *
+ * 12-byte header and a payload, integers big-endian:           *
+ *   u32 len     payload bytes                                  *
+ *   u32 id      chosen by the client, echoed in the reply      *
+ *   u8  op      CAD_OP_*                                       *
+ *   u8  status  0 in requests, CAD_* in replies                *
+ *   u16 name    bytes of CA name the payload starts with       *
+ * Request bodies, after the CA name:                           *
+ *   sign    PEM request                                        *
+ *   verify  PEM or DER certificate                             *
+ *   revoke  u8 CRLReason (0xff: none), serial magnitude        *
+ * Replies carry no name. A sign reply is u8 n, n hex digits    *
+ * of serial, PEM certificate; a failed reply is the reason.    *
+ * Requests are pipelined, replies come back as they finish.    *
+ * -------------------------------------------------------------*/
+#define CAD_HEADER	12
+#define CAD_PAYLOAD_MAX	(1024 * 1024)
+
+#define CAD_OP_SIGN	1
+#define CAD_OP_VERIFY	2
+#define CAD_OP_REVOKE	3
+
+#define CAD_OK		0
+#define CAD_EFAIL	1	/* refused, payload says why */
+#define CAD_ENOCA	2	/* no CA of that name */
+#define CAD_EBUSY	3	/* work queue full, try later */
+#define CAD_EBADOP	4
+
+#define CAD_NO_REASON	0xff
+
+struct cad_frame {
+	uint32_t id;
+	unsigned char op;
+	unsigned char status;
+	const char *name;
+	size_t name_len;
+	const unsigned char *body;
+	size_t len;		/* body only */
+};
+
+/* marks a frame no peer should send: oversized or inconsistent */
+#define CAD_FRAME_BAD ((size_t) -1)
+
+void cad_put_frame(struct der *out, uint32_t id, unsigned char op, unsigned char status,
+		const char *name, size_t name_len, const void *body, size_t len);
+/* bytes of the frame at buf, 0 until it is all there, or CAD_FRAME_BAD */
+size_t cad_get_frame(const unsigned char *buf, size_t len, struct cad_frame *frame);
+
+/* ------------------------------------------------------------ *
+ * Blocking client on one connection. Frames are sent as built  *
+ * by cad_put_frame(), any number at once; cad_client_next()    *
+ * returns replies in arrival order, each valid until the next  *
+ * call.                                                        *
+ * -------------------------------------------------------------*/
+struct cad_client {
+	int fd;
+	uint32_t next_id;
+	struct der in;		/* replies read, from taken on not handed out */
+	size_t taken;
+};
+
+int cad_client_open(struct cad_client *client, const char *path);
+void cad_client_close(struct cad_client *client);
+int cad_client_send(struct cad_client *client, const struct der *frames);
+int cad_client_next(struct cad_client *client, struct cad_frame *frame);
+
+#endif
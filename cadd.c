@@ -0,0 +1,523 @@
+/*
+// CA daemon: CA handles loaded once and served over a Unix socket in the
+// framing of cad.h, so services that aren't Lua issue exactly as ca:sign
+// does. One epoll loop does all the socket I/O; signing, verification and
+// revocation run on the signing pool, any number in flight per
+// connection, and the replies that finish together go out in one write.
+//   cadd [-m mode] <socket> <name>=<key.pem>:<crt.pem>[:password] ...
+// Anyone who can connect can issue, so the socket is created 0600, or
+// with the octal mode given, say 0660 for a group of client services.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/x509.h>
+
+#include "ca.h"
+#include "cad.h"
+#include "crl.h"
+#include "pool.h"
+#include "store.h"
+
+/* bytes asked of each read() */
+#define CADD_READ_CHUNK (64 * 1024)
+
+/* ------------------------------------------------------------ *
+ * Backpressure: past either limit a connection is not read     *
+ * until its jobs finish and its replies drain, so a client     *
+ * that pipelines without reading can't make the daemon buffer  *
+ * without bound. Frames already read wait in conn->in.         *
+ * -------------------------------------------------------------*/
+#define CADD_OUT_MAX (4 * 1024 * 1024)	/* reply bytes not yet written */
+#define CADD_INFLIGHT_MAX 256		/* jobs on the pool */
+
+struct conn {
+	int refs;		/* the loop's, the ready list's, each job's */
+	int fd;			/* -1 once the loop has closed it */
+	struct der in;		/* loop only */
+	int writing;		/* EPOLLOUT armed, loop only */
+	int paused;		/* EPOLLIN dropped, loop only */
+	int inflight;		/* jobs not yet replied to */
+	struct conn *next_closed;	/* loop only */
+
+	pthread_mutex_t lock;	/* guards what follows */
+	struct der out;		/* replies not yet written */
+	int ready;		/* on the ready list */
+	struct conn *next_ready;
+};
+
+struct cad_job {
+	struct conn *conn;
+	uint32_t id;
+	unsigned char op;
+	char name[256];
+	size_t len;
+	unsigned char body[];
+};
+
+static int epfd, evfd, lfd;
+
+/* closed during this round of events, released after it: a later
+ * event of the same round may still name them */
+static struct conn *closed;
+
+/* connections with replies to write, handed from workers to the loop */
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct conn *ready;
+
+static void conn_unref(struct conn *conn) {
+	if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+	der_free(&conn->in);
+	der_free(&conn->out);
+	pthread_mutex_destroy(&conn->lock);
+	free(conn);
+}
+
+static void conn_reply(struct conn *conn, uint32_t id, unsigned char op, unsigned char status,
+		const void *body, size_t len) {
+	int wake = 0;
+
+	pthread_mutex_lock(&conn->lock);
+	if (conn->fd >= 0) {
+		cad_put_frame(&conn->out, id, op, status, NULL, 0, body, len);
+		if (! conn->ready) {
+			conn->ready = 1;
+			__atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+			pthread_mutex_lock(&ready_lock);
+			conn->next_ready = ready;
+			wake = ready == NULL;
+			ready = conn;
+			pthread_mutex_unlock(&ready_lock);
+		}
+	}
+	pthread_mutex_unlock(&conn->lock);
+	if (wake) {
+		uint64_t one = 1;
+		if (write(evfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+			perror("eventfd");
+		}
+	}
+}
+
+static void job_sign(struct ca *ca, struct cad_job *job, struct der *reply, const char **why) {
+	char serial[2 * CA_SERIAL_MAX + 1];
+	struct der pem;
+
+	der_init(&pem);
+	if (ca_sign_pem(ca, (const char *) job->body, job->len, NULL, &pem, serial, why)) {
+		unsigned char n = strlen(serial);
+		der_put(reply, &n, 1);
+		der_put(reply, serial, n);
+		der_put(reply, pem.buf, pem.len);
+	}
+	der_free(&pem);
+}
+
+static void job_verify(struct ca *ca, struct cad_job *job, const char **why) {
+	STACK_OF(X509) *untrusted = NULL;
+	X509 *crt = NULL;
+
+	if (! store_parse_chain((const char *) job->body, job->len, &crt, &untrusted)) {
+		ERR_clear_error();
+		*why = "can't read certificate";
+	} else {
+		ca_check_crt(ca, crt, why);
+	}
+	sk_X509_pop_free(untrusted, X509_free);
+	X509_free(crt);
+}
+
+static void job_revoke(struct ca *ca, struct cad_job *job, const char **why) {
+	struct crl *crl = ca_crl(ca);
+	int reason = job->len > 0 && job->body[0] != CAD_NO_REASON ? job->body[0] : CRL_REASON_NONE;
+
+	if (job->len < 2 || job->len > 1 + CA_SERIAL_MAX) {
+		*why = "bad serial number";
+	} else if (reason != CRL_REASON_NONE && crl_reason_name(reason) == NULL) {
+		*why = "unknown CRL reason";
+	} else if (crl == NULL || ! crl_revoke(crl, job->body + 1, job->len - 1, time(NULL), reason)) {
+		*why = "can't revoke serial";
+	}
+}
+
+static void job_run(void *arg) {
+	struct cad_job *job = arg;
+	unsigned char status = CAD_OK;
+	const char *why = NULL;
+	struct der reply;
+
+	der_init(&reply);
+	struct ca *ca = ca_lookup(job->name);
+	if (ca == NULL) {
+		status = CAD_ENOCA;
+		why = "no CA of that name";
+	} else if (job->op == CAD_OP_SIGN) {
+		job_sign(ca, job, &reply, &why);
+	} else if (job->op == CAD_OP_VERIFY) {
+		job_verify(ca, job, &why);
+	} else {
+		job_revoke(ca, job, &why);
+	}
+	ca_unref(ca);
+	// before the reply, so the flush it triggers sees the room
+	__atomic_sub_fetch(&job->conn->inflight, 1, __ATOMIC_RELAXED);
+
+	if (why == NULL && reply.failed) {
+		why = "out of memory";
+	}
+	if (why != NULL) {
+		conn_reply(job->conn, job->id, job->op, status != CAD_OK ? status : CAD_EFAIL, why, strlen(why));
+	} else {
+		conn_reply(job->conn, job->id, job->op, CAD_OK, reply.buf, reply.len);
+	}
+	der_free(&reply);
+	conn_unref(job->conn);
+	free(job);
+}
+
+static void conn_close(struct conn *conn) {
+	epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	pthread_mutex_lock(&conn->lock);
+	close(conn->fd);
+	conn->fd = -1;
+	pthread_mutex_unlock(&conn->lock);
+	conn->next_closed = closed;
+	closed = conn;
+}
+
+/* loop thread; 0 when the peer broke the protocol */
+static int conn_dispatch(struct conn *conn, const struct cad_frame *frame) {
+	static const char busy[] = "signing queue full";
+	static const char badop[] = "unknown operation";
+
+	if (frame->op != CAD_OP_SIGN && frame->op != CAD_OP_VERIFY && frame->op != CAD_OP_REVOKE) {
+		conn_reply(conn, frame->id, frame->op, CAD_EBADOP, badop, sizeof(badop) - 1);
+		return 1;
+	}
+	struct cad_job *job = malloc(sizeof(*job) + frame->len);
+	if (job == NULL || frame->name_len >= sizeof(job->name)) {
+		free(job);
+		return 0;
+	}
+	job->conn = conn;
+	job->id = frame->id;
+	job->op = frame->op;
+	memcpy(job->name, frame->name, frame->name_len);
+	job->name[frame->name_len] = '\0';
+	job->len = frame->len;
+	memcpy(job->body, frame->body, frame->len);
+
+	__atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&conn->inflight, 1, __ATOMIC_RELAXED);
+	if (! pool_submit_ex(pool_sign(), job_run, NULL, job, POOL_LANE_NORMAL, 0)) {
+		__atomic_sub_fetch(&conn->inflight, 1, __ATOMIC_RELAXED);
+		conn_unref(conn);
+		free(job);
+		conn_reply(conn, frame->id, frame->op, CAD_EBUSY, busy, sizeof(busy) - 1);
+	}
+	return 1;
+}
+
+/* loop thread: over a backpressure limit */
+static int conn_full(struct conn *conn) {
+	pthread_mutex_lock(&conn->lock);
+	int full = conn->out.len >= CADD_OUT_MAX;
+	pthread_mutex_unlock(&conn->lock);
+	return full || __atomic_load_n(&conn->inflight, __ATOMIC_RELAXED) >= CADD_INFLIGHT_MAX;
+}
+
+/* loop thread */
+static void conn_arm(struct conn *conn, int writing, int paused) {
+	if (writing == conn->writing && paused == conn->paused) {
+		return;
+	}
+	struct epoll_event ev = { .events = (paused ? 0 : EPOLLIN) | (writing ? EPOLLOUT : 0), .data.ptr = conn };
+	epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+	conn->writing = writing;
+	conn->paused = paused;
+}
+
+/* loop thread: dispatches the frames read so far, stopping at a
+ * limit; 0 when the connection was closed */
+static int conn_parse(struct conn *conn) {
+	struct cad_frame frame;
+	size_t off = 0, used;
+	int full = 0;
+
+	while (! (full = conn_full(conn)) && (used = cad_get_frame(conn->in.buf + off, conn->in.len - off, &frame)) > 0) {
+		if (used == CAD_FRAME_BAD || ! conn_dispatch(conn, &frame)) {
+			conn_close(conn);
+			return 0;
+		}
+		off += used;
+	}
+	memmove(conn->in.buf, conn->in.buf + off, conn->in.len - off);
+	conn->in.len -= off;
+	if (full) {
+		conn_arm(conn, conn->writing, 1);
+	}
+	return 1;
+}
+
+static void conn_read(struct conn *conn) {
+	while (! conn->paused) {
+		if (! der_reserve(&conn->in, CADD_READ_CHUNK)) {
+			conn_close(conn);
+			return;
+		}
+		ssize_t n = read(conn->fd, conn->in.buf + conn->in.len, conn->in.cap - conn->in.len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && errno == EAGAIN) {
+			return;
+		}
+		if (n <= 0) {
+			conn_close(conn);
+			return;
+		}
+		conn->in.len += n;
+		if (! conn_parse(conn)) {
+			return;
+		}
+	}
+}
+
+/* loop thread: as much of out as the socket takes, then reading
+ * resumes if the connection is back under its limits */
+static void conn_flush(struct conn *conn) {
+	int broken = 0, pending;
+
+	pthread_mutex_lock(&conn->lock);
+	while (conn->fd >= 0 && conn->out.len > 0) {
+		ssize_t n = send(conn->fd, conn->out.buf, conn->out.len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && errno == EAGAIN) {
+			break;
+		}
+		if (n <= 0) {
+			broken = 1;
+			break;
+		}
+		memmove(conn->out.buf, conn->out.buf + n, conn->out.len - n);
+		conn->out.len -= n;
+	}
+	if (conn->out.failed) {
+		broken = 1;
+	}
+	pending = conn->out.len > 0;
+	pthread_mutex_unlock(&conn->lock);
+
+	if (conn->fd < 0) {
+		return;
+	}
+	if (broken) {
+		conn_close(conn);
+		return;
+	}
+	int paused = conn_full(conn);
+	conn_arm(conn, pending, paused);
+	// frames read before the pause get no new EPOLLIN of their own
+	if (! paused && conn->in.len > 0) {
+		conn_parse(conn);
+	}
+}
+
+static void flush_ready(void) {
+	uint64_t count;
+	if (read(evfd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		perror("eventfd");
+	}
+
+	pthread_mutex_lock(&ready_lock);
+	struct conn *conn = ready;
+	ready = NULL;
+	pthread_mutex_unlock(&ready_lock);
+
+	while (conn != NULL) {
+		struct conn *next = conn->next_ready;
+		pthread_mutex_lock(&conn->lock);
+		conn->ready = 0;
+		pthread_mutex_unlock(&conn->lock);
+		conn_flush(conn);
+		conn_unref(conn);
+		conn = next;
+	}
+}
+
+static void accept_all(void) {
+	for (;;) {
+		int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+				perror("accept");
+			}
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			return;
+		}
+		struct conn *conn = calloc(1, sizeof(*conn));
+		if (conn == NULL) {
+			close(fd);
+			continue;
+		}
+		conn->refs = 1;
+		conn->fd = fd;
+		der_init(&conn->in);
+		der_init(&conn->out);
+		pthread_mutex_init(&conn->lock, NULL);
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+			perror("epoll_ctl");
+			conn->fd = -1;
+			close(fd);
+			conn_unref(conn);
+		}
+	}
+}
+
+static char *read_file(const char *path, size_t *len) {
+	FILE *fp = fopen(path, "rb");
+	char *buf = NULL;
+	long size;
+
+	if (fp != NULL && fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 &&
+			fseek(fp, 0, SEEK_SET) == 0 && (buf = malloc(size + 1)) != NULL) {
+		*len = fread(buf, 1, size, fp);
+		buf[*len] = '\0';
+	}
+	if (fp != NULL) {
+		fclose(fp);
+	}
+	return buf;
+}
+
+/* name=key.pem:crt.pem[:password] */
+static int load_ca(char *spec) {
+	char *name = spec, *key_path = strchr(spec, '='), *crt_path, *password;
+	size_t key_len = 0, crt_len = 0;
+
+	if (key_path == NULL || ! (crt_path = strchr(key_path + 1, ':'))) {
+		fprintf(stderr, "bad CA %s, want name=key.pem:crt.pem[:password]\n", spec);
+		return 0;
+	}
+	*key_path++ = '\0';
+	*crt_path++ = '\0';
+	if ((password = strchr(crt_path, ':')) != NULL) {
+		*password++ = '\0';
+	}
+
+	char *key = read_file(key_path, &key_len);
+	char *crt = read_file(crt_path, &crt_len);
+	struct ca *ca = key != NULL && crt != NULL
+		? ca_new(key, key_len, crt, crt_len, password != NULL ? password : "replace_me") : NULL;
+	free(key);
+	free(crt);
+	if (ca == NULL || ! ca_register(name, ca)) {
+		fprintf(stderr, "Can't load CA %s\n", name);
+		ca_unref(ca);
+		return 0;
+	}
+	ca_unref(ca);
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	const char *prog = argv[0];
+	mode_t mode = 0600;
+
+	if (argc > 2 && strcmp(argv[1], "-m") == 0) {
+		char *end;
+		long value = strtol(argv[2], &end, 8);
+		if (*argv[2] == '\0' || *end != '\0' || value < 0 || value > 0777) {
+			fprintf(stderr, "Bad socket mode %s\n", argv[2]);
+			return 2;
+		}
+		mode = value;
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s [-m mode] <socket> <name>=<key.pem>:<crt.pem>[:password] ...\n", prog);
+		return 2;
+	}
+	for (int idx = 2; idx < argc; idx++) {
+		if (! load_ca(argv[idx])) {
+			return 1;
+		}
+	}
+	if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long\n");
+		return 1;
+	}
+	strcpy(addr.sun_path, argv[1]);
+	unlink(argv[1]);
+
+	lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	// created owner-only, so nobody connects before the chmod
+	mode_t umasked = umask(0177);
+	int bound = lfd >= 0 && bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+	umask(umasked);
+	if (! bound || chmod(argv[1], mode) != 0 || listen(lfd, 128) != 0 || epfd < 0 || evfd < 0) {
+		fprintf(stderr, "Can't listen on %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &lfd };
+	epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+	ev.data.ptr = &evfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, evfd, &ev);
+
+	for (;;) {
+		struct epoll_event events[64];
+		int n = epoll_wait(epfd, events, 64, -1);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			return 1;
+		}
+		for (int idx = 0; idx < n; idx++) {
+			if (events[idx].data.ptr == &lfd) {
+				accept_all();
+			} else if (events[idx].data.ptr == &evfd) {
+				flush_ready();
+			} else {
+				struct conn *conn = events[idx].data.ptr;
+				if (conn->fd >= 0 && events[idx].events & EPOLLOUT) {
+					conn_flush(conn);
+				}
+				if (conn->fd >= 0 && conn->paused && events[idx].events & (EPOLLHUP | EPOLLERR)) {
+					// nobody left to read the replies
+					conn_close(conn);
+				} else if (conn->fd >= 0 && events[idx].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+					conn_read(conn);
+				}
+			}
+		}
+		while (closed != NULL) {
+			struct conn *conn = closed;
+			closed = conn->next_closed;
+			conn_unref(conn);
+		}
+	}
+}
@@ -0,0 +1,69 @@
+/*
+// C ABI of core.so for LuaJIT FFI: the same CA handles the Lua binding
+// uses, with certificates written straight into the caller's buffer.
+// https://luajit.org/ext_ffi_api.html
+*/
+
+#define _GNU_SOURCE
+
+#include <openssl/err.h>
+
+#include "b64.h"
+#include "ca.h"
+#include "capi.h"
+
+/* what core_ca_sign() did, added to core.memstats() */
+static size_t capi_signs;
+static size_t capi_sign_errors;
+
+struct ca *core_ca_new(const char *key, size_t key_len, const char *crt, size_t crt_len,
+		const char *password) {
+	return ca_new(key, key_len, crt, crt_len, password != NULL ? password : "replace_me");
+}
+
+struct ca *core_ca_get(const char *name) {
+	return ca_lookup(name);
+}
+
+void core_ca_free(struct ca *ca) {
+	ca_unref(ca);
+}
+
+/* ------------------------------------------------------------ *
+ * The certificate carries the request's subject and key, so    *
+ * its DER is bounded by the request's plus what the CA adds:   *
+ * issuer, two algorithm identifiers, signature, serial,        *
+ * validity and headers.                                        *
+ * -------------------------------------------------------------*/
+size_t core_ca_sign_size(const struct ca *ca, size_t csr_len) {
+	size_t der_len = B64_DECODED_MAX(csr_len) + ca->issuer_len + 2 * ca->sigalg_len
+		+ EVP_PKEY_size(ca->key) + 128;
+	return PEM_ENCODED_MAX(sizeof("CERTIFICATE") - 1, der_len);
+}
+
+size_t core_ca_sign(struct ca *ca, const char *csr, size_t csr_len, char *out, size_t out_len,
+		char *serial, const char **why) {
+	char hex[CORE_SERIAL_HEX];
+	const char *reason = NULL;
+	struct der pem;
+
+	der_wrap(&pem, out, out_len);
+	if (! ca_sign_pem(ca, csr, csr_len, NULL, &pem, serial != NULL ? serial : hex, &reason)) {
+		__atomic_add_fetch(&capi_sign_errors, 1, __ATOMIC_RELAXED);
+		ERR_clear_error();
+		if (pem.failed) {
+			reason = "output buffer too small";
+		}
+		if (why != NULL) {
+			*why = reason != NULL ? reason : "signing failed";
+		}
+		return 0;
+	}
+	__atomic_add_fetch(&capi_signs, 1, __ATOMIC_RELAXED);
+	return pem.len;
+}
+
+void core_ca_sign_counts(size_t *signs, size_t *errors) {
+	*signs = __atomic_load_n(&capi_signs, __ATOMIC_RELAXED);
+	*errors = __atomic_load_n(&capi_sign_errors, __ATOMIC_RELAXED);
+}
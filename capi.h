@@ -0,0 +1,41 @@
+#ifndef LUA_OPENSSL_CAPI_H
+#define LUA_OPENSSL_CAPI_H
+
+#include <stddef.h>
+
+/* ------------------------------------------------------------ *
+ * Plain C entry points exported from core.so, for LuaJIT FFI   *
+ * and C callers: no lua_State and no Lua strings, the caller   *
+ * owns every buffer. openssl.lua carries the matching cdef,    *
+ * keep the two in step.                                        *
+ * -------------------------------------------------------------*/
+
+struct ca;
+
+/* serial numbers come back as hex, up to 40 digits and a NUL */
+#define CORE_SERIAL_HEX 41
+
+/* a new CA reference, NULL when key or certificate don't load */
+struct ca *core_ca_new(const char *key, size_t key_len, const char *crt, size_t crt_len,
+		const char *password);
+/* a reference to the CA registered under name, or NULL */
+struct ca *core_ca_get(const char *name);
+void core_ca_free(struct ca *ca);
+
+/* bytes core_ca_sign() may write for a request of csr_len bytes */
+size_t core_ca_sign_size(const struct ca *ca, size_t csr_len);
+
+/* ------------------------------------------------------------ *
+ * Signs a PEM request into out, as ca:sign() does. Returns the *
+ * PEM length, or 0 with the reason in *why. serial, when not   *
+ * NULL, receives CORE_SERIAL_HEX bytes. An out smaller than    *
+ * core_ca_sign_size() may fail after the serial was spent.     *
+ * -------------------------------------------------------------*/
+size_t core_ca_sign(struct ca *ca, const char *csr, size_t csr_len, char *out, size_t out_len,
+		char *serial, const char **why);
+
+/* certificates core_ca_sign() issued and refused, which
+ * core.memstats() adds to signs and sign_errors; not for FFI */
+void core_ca_sign_counts(size_t *signs, size_t *errors);
+
+#endif
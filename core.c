@@ -19,11 +19,15 @@
 #define LUA_LIB
 #define _GNU_SOURCE
 
+#include <arpa/inet.h>
+#include <assert.h>
 #include <errno.h>
 #include <lauxlib.h>
 #include <lua.h>
+#include <malloc.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <openssl/rsa.h>
 #include <openssl/pem.h>
@@ -31,12 +35,37 @@
 #include <openssl/err.h>
 #include <openssl/buffer.h>
 
+#include "b64.h"
+#include "ca.h"
+#include "cad.h"
+#include "capi.h"
+#include "crl.h"
+#include "mint.h"
+#include "ocsp.h"
+#include "policy.h"
+#include "pool.h"
+#include "sign.h"
+#include "signer.h"
+#include "store.h"
+
 #if LUA_VERSION_NUM < 502
 #define luaL_newlib(L,l) (lua_newtable(L), luaL_register(L,NULL,l))
 #define luaL_setfuncs(L,l,n) (assert(n==0), luaL_register(L,NULL,l))
 #define luaL_checkunsigned(L,n) luaL_checknumber(L,n)
 #endif
 
+#if LUA_VERSION_NUM >= 502
+#define lua_objlen(L,i) lua_rawlen(L,i)
+#endif
+
+#if LUA_VERSION_NUM >= 504
+#define resume_thread(L,co,n) lua_resume(co, L, n, &(int){0})
+#elif LUA_VERSION_NUM >= 502
+#define resume_thread(L,co,n) lua_resume(co, L, n)
+#else
+#define resume_thread(L,co,n) lua_resume(co, n)
+#endif
+
 #if LUA_VERSION_NUM >= 503
 #ifndef luaL_checkunsigned
 #define luaL_checkunsigned(L,n) ((lua_Unsigned)luaL_checkinteger(L,n))
@@ -58,29 +87,137 @@
 /* Max Lua arguments for function */
 #define MAXVARS 200
 
-void err_descr_to_stderr(const char *err_patern) {
-	char buffer[120];
-	ERR_error_string(ERR_get_error(), buffer);
-	fprintf(stderr, "%s due to: %s\n", err_patern, buffer);
+/* Module memory and call counters, exported by core.memstats() */
+static struct {
+	int tracking;
+	size_t allocs;
+	size_t frees;
+	size_t live_bytes;
+	size_t peak_bytes;
+	size_t signs;
+	size_t sign_errors;
+	size_t rejected;
+} memstats;
+
+#define STAT_ADD(f, n) __atomic_add_fetch(&memstats.f, (n), __ATOMIC_RELAXED)
+#define STAT_SUB(f, n) __atomic_sub_fetch(&memstats.f, (n), __ATOMIC_RELAXED)
+#define STAT_GET(f) __atomic_load_n(&memstats.f, __ATOMIC_RELAXED)
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static void memstats_grow(size_t n) {
+	size_t live = STAT_ADD(live_bytes, n);
+	size_t peak = STAT_GET(peak_bytes);
+	while (live > peak && !__atomic_compare_exchange_n(&memstats.peak_bytes,
+			&peak, live, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void *memstats_malloc(size_t num, const char *file, int line) {
+	void *ptr = malloc(num);
+	if (ptr != NULL) {
+		STAT_ADD(allocs, 1);
+		memstats_grow(malloc_usable_size(ptr));
+	}
+	return ptr;
+}
+
+static void memstats_free(void *addr, const char *file, int line) {
+	if (addr != NULL) {
+		STAT_ADD(frees, 1);
+		STAT_SUB(live_bytes, malloc_usable_size(addr));
+	}
+	free(addr);
+}
+
+static void *memstats_realloc(void *addr, size_t num, const char *file, int line) {
+	// realloc(ptr, 0) frees: count it as one rather than read NULL as failure
+	if (addr != NULL && num == 0) {
+		memstats_free(addr, file, line);
+		return NULL;
+	}
+	size_t old = addr != NULL ? malloc_usable_size(addr) : 0;
+	void *ptr = realloc(addr, num);
+	if (ptr == NULL) {
+		return NULL;
+	}
+	if (addr == NULL) {
+		STAT_ADD(allocs, 1);
+	}
+	STAT_SUB(live_bytes, old);
+	memstats_grow(malloc_usable_size(ptr));
+	return ptr;
+}
+#endif
+
+/* ------------------------------------------------------------ *
+ * Route libcrypto allocations through the counters. OpenSSL    *
+ * only accepts this before its first allocation, so when some  *
+ * other module got there first memstats.tracking stays 0.      *
+ * -------------------------------------------------------------*/
+static void memstats_install(void) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	if (!memstats.tracking) {
+		memstats.tracking = CRYPTO_set_mem_functions(memstats_malloc,
+				memstats_realloc, memstats_free);
+	}
+#endif
 }
 
+/* ------------------------------------------------------------ *
+ * core.init_crypto([{warm = {names}, errors = bool}]) -> true  *
+ * Setup runs once on first use anyway; calling this moves it,  *
+ * the first fetch of the warm algorithms ("SHA256", "RSA",     *
+ * "ECDSA", ...) and optionally the error strings up front.     *
+ * -------------------------------------------------------------*/
 int init_crypto(lua_State *L) {
-	unsigned int argc = lua_gettop(L);
-	if (argc > 0) {
-		fprintf(stderr, "you must not pass arguments\n");
-		return 0;
+	ca_init();
+	if (lua_isnoneornil(L, 1)) {
+		lua_pushboolean(L, 1);
+		return 1;
 	}
+	luaL_checktype(L, 1, LUA_TTABLE);
 
-	OpenSSL_add_all_algorithms();
-	ERR_load_BIO_strings();
-	ERR_load_crypto_strings();
+	lua_getfield(L, 1, "errors");
+	if (lua_toboolean(L, -1)) {
+		ca_load_error_strings();
+	}
+	lua_pop(L, 1);
 
-	return 0;
+	lua_getfield(L, 1, "warm");
+	if (! lua_isnil(L, -1)) {
+		luaL_argcheck(L, lua_istable(L, -1), 1, "warm must be a list of algorithm names");
+		int count = lua_objlen(L, -1);
+		for (int idx = 1; idx <= count; idx++) {
+			lua_rawgeti(L, -1, idx);
+			const char *name = lua_tostring(L, -1);
+			luaL_argcheck(L, name != NULL, 1, "warm must be a list of algorithm names");
+			if (! ca_preload(name)) {
+				lua_pushnil(L);
+				lua_pushfstring(L, "unknown algorithm %s", name);
+				return 2;
+			}
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+
+	lua_pushboolean(L, 1);
+	return 1;
 }
 
 int csr_crt(lua_State *L) {
 	uint rc = 0;
 
+	struct ca *ca = NULL;
+	struct ca_request request;
+	struct der tbs, der, pem;
+	char serial[2 * CA_SERIAL_MAX + 1];
+	const char *why = NULL;
+
+	ca_request_init(&request);
+	der_init(&tbs);
+	der_init(&der);
+	der_init(&pem);
+
 	unsigned int argc = lua_gettop(L);
 	if (argc < 3) {
 		fprintf(stderr, "you must pass one argument: (priv_key, csr)!\n");
@@ -121,211 +258,2879 @@ int csr_crt(lua_State *L) {
 	}
 
 
-	// load pkey
+	// load csr, turning abusive ones away before the CA key is even loaded
+	struct ca_stats admission_stats = { 0 };
+	if (! ca_request_admit(&request, &ca_default_admission, &admission_stats, csr, csr_len, &why)) {
+		STAT_ADD(rejected, 1);
+		fprintf(stderr, "%s\n", why);
+		goto __error;
+	}
+
+	// load pkey and pca
 	char *password = "replace_me";
-	BIO *pkeybio = BIO_new_mem_buf(pkey, pkey_len);
-	RSA *rsa = PEM_read_bio_RSAPrivateKey(pkeybio, NULL, NULL, password);
-	if (rsa == NULL) {
-		err_descr_to_stderr("Failed to create key bio");
+	if (! (ca = ca_new(pkey, pkey_len, crt, crt_len, password))) {
+		goto __error;
+	}
+
+	// one-shot certificates keep their historical serial of 0
+	static const unsigned char serial_zero = 0;
+	if (! ca_prepare_tbs(ca, &request, NULL, &serial_zero, 1, &tbs, serial, &why)) {
+		goto __error;
+	}
+	if (! ca_sign_tbs(ca, tbs.buf, tbs.len, &der)) {
+		err_descr_to_stderr("Error signing the new certificate");
 		goto __error;
 	}
 
-	// 4. set public key of x509 req
-	EVP_PKEY *pKey = EVP_PKEY_new();
-	EVP_PKEY_assign_RSA(pKey, rsa);
+	pem_encode(&pem, "CERTIFICATE", der.buf, der.len);
+	if (! pem.failed) {
+		lua_pushlstring(L, (const char *) pem.buf, pem.len);
+		rc = 1;
+	}
+
+__error:
+	if (rc == 1) {
+		STAT_ADD(signs, 1);
+	} else {
+		STAT_ADD(sign_errors, 1);
+	}
 
+	der_free(&pem);
+	der_free(&der);
+	der_free(&tbs);
+	ca_request_free(&request);
+	ca_unref(ca);
 
-	// load pca
-	BIO *cacertbio = BIO_new_mem_buf(crt, crt_len);
-	X509 *cacert = PEM_read_bio_X509(cacertbio, NULL, NULL, NULL);
+	return rc;
+}
 
-	// load csr
-	/* ---------------------------------------------------------- *
-	 * Load the request data in a BIO, then in a x509_REQ struct. *
-	 * ---------------------------------------------------------- */
-	BIO *reqbio = BIO_new_mem_buf(csr, csr_len);
-	X509_REQ *certreq = NULL;
-	if (! (certreq = PEM_read_bio_X509_REQ(reqbio, NULL, NULL, NULL))) {
-		err_descr_to_stderr("Error can't read X509 request data into memory");
-		goto __error;
+#define CA_MT   "openssl.ca"
+#define CRL_MT  "openssl.crl"
+#define OCSP_MT "openssl.ocsp"
+#define STORE_MT "openssl.store"
+#define CERT_MT "openssl.cert"
+#define CSR_MT "openssl.csr"
+#define POLICY_MT "openssl.policy"
+#define JOB_MT "openssl.sign_job"
+#define COALESCE_MT "openssl.coalescer"
+#define BUFFER_MT "openssl.buffer"
+#define CAD_MT "openssl.cad"
+#define MINT_MT "openssl.mint"
+/* registry table, weak keys: CA userdata -> its coalescer */
+#define COALESCE_KEY "openssl.coalescers"
+
+static int push_error(lua_State *L, const char *why) {
+	lua_pushnil(L);
+	lua_pushstring(L, why);
+	return 2;
+}
+
+static struct ca *check_ca(lua_State *L, int idx) {
+	struct ca *ca = lua_unboxpointer(L, idx, CA_MT);
+	luaL_argcheck(L, ca != NULL, idx, "CA handle already released");
+	return ca;
+}
+
+/* serial as hex string ("0x1F", "1f:2a") or non-negative number */
+static size_t check_serial(lua_State *L, int idx, unsigned char *out) {
+	size_t len = 0;
+	if (lua_type(L, idx) == LUA_TNUMBER) {
+		lua_Number n = lua_tonumber(L, idx);
+		luaL_argcheck(L, n >= 0 && n < 9007199254740992.0, idx, "serial out of range");
+		uint64_t v = n;
+		for (int shift = 56; shift >= 0; shift -= 8) {
+			out[len++] = v >> shift;
+		}
+		return len;
 	}
 
-	// create certificate
-	/* --------------------------------------------------------- *
-	 * Build Certificate with data from request                  *
-	 * ----------------------------------------------------------*/
-	X509 *newcert = NULL;
-	if (! (newcert=X509_new())) {
-		err_descr_to_stderr("Error creating new X509 object");
-		goto __error;
+	size_t hex_len;
+	const char *hex = luaL_checklstring(L, idx, &hex_len);
+	luaL_argcheck(L, ca_serial_from_hex(hex, hex_len, out, &len), idx, "bad serial number");
+	return len;
+}
+
+static void push_serial(lua_State *L, const ASN1_INTEGER *serial) {
+	char hex[2 * CA_SERIAL_MAX + 1];
+	size_t len = serial->length < CA_SERIAL_MAX ? serial->length : CA_SERIAL_MAX;
+	ca_serial_to_hex(serial->data, len, hex);
+	lua_pushstring(L, hex);
+}
+
+static void push_ca(lua_State *L, struct ca *ca) {
+	lua_boxpointer(L, ca);
+	luaL_getmetatable(L, CA_MT);
+	lua_setmetatable(L, -2);
+}
+
+/* ------------------------------------------------------------ *
+ * core.ca_new(priv_key, crt [, password]) -> CA handle         *
+ * Key and certificate are parsed once; ca:sign(csr) then only  *
+ * does the per-request work of csr_crt. nil when they don't    *
+ * load or the key isn't the certificate's.                     *
+ * -------------------------------------------------------------*/
+int ca_new_lua(lua_State *L) {
+	size_t pkey_len, crt_len;
+	const char *pkey = luaL_checklstring(L, 1, &pkey_len);
+	const char *crt = luaL_checklstring(L, 2, &crt_len);
+	const char *password = luaL_optstring(L, 3, "replace_me");
+
+	struct ca *ca = ca_new(pkey, pkey_len, crt, crt_len, password);
+	if (ca == NULL) {
+		return push_error(L, "can't load CA key and certificate");
 	}
+	push_ca(L, ca);
+	return 1;
+}
 
-	if (X509_set_version(newcert, 2) != 1) {
-		err_descr_to_stderr("Error setting certificate version");
-		goto __error;
+/* ------------------------------------------------------------ *
+ * core.ca_remote(crt, socket_path [, timeout_ms]) -> CA handle *
+ * A CA whose key stays with the signer listening on the Unix   *
+ * socket (signer.h, signerd). Signing calls from every thread  *
+ * share one pipelined connection; sign_async keeps several of  *
+ * them in flight. OCSP needs the key in process and fails.     *
+ * -------------------------------------------------------------*/
+int ca_remote_lua(lua_State *L) {
+	size_t crt_len;
+	const char *crt = luaL_checklstring(L, 1, &crt_len);
+	const char *path = luaL_checkstring(L, 2);
+	int timeout_ms = (int) luaL_optinteger(L, 3, 10000);
+	luaL_argcheck(L, timeout_ms >= 0, 3, "negative timeout");
+
+	struct ca_backend *backend = signer_connect(path, timeout_ms);
+	if (backend == NULL) {
+		return push_error(L, "can't connect to the signer");
 	}
+	struct ca *ca = ca_new_backend(crt, crt_len, backend);
+	if (ca == NULL) {
+		return push_error(L, "can't load CA certificate");
+	}
+	push_ca(L, ca);
+	return 1;
+}
 
-	if (X509_set_pubkey(newcert, pKey) != 1) {
-		err_descr_to_stderr("X509_set_pubkey");
-		goto __error;
+/* ------------------------------------------------------------ *
+ * core.ca_public(crt) -> CA handle                             *
+ * The certificate alone, for a CA key kept in a separate       *
+ * signing process: ca:prepare and ca:finish work, with the     *
+ * signature made over there, and so do ca:verify and the       *
+ * admission and policy settings. Everything that signs here    *
+ * fails with "CA key is held elsewhere".                       *
+ * -------------------------------------------------------------*/
+int ca_public_lua(lua_State *L) {
+	size_t crt_len;
+	const char *crt = luaL_checklstring(L, 1, &crt_len);
+
+	struct ca *ca = ca_new_public(crt, crt_len);
+	if (ca == NULL) {
+		return push_error(L, "can't load CA certificate");
 	}
+	push_ca(L, ca);
+	return 1;
+}
 
-	ASN1_INTEGER  *aserial = NULL;
-	aserial=ASN1_INTEGER_new();
-	ASN1_INTEGER_set(aserial, 0);
-	if (! X509_set_serialNumber(newcert, aserial)) {
-		err_descr_to_stderr("Error setting serial number of the certificate");
-		goto __error;
+/* ------------------------------------------------------------ *
+ * core.ca_register(name, ca): publish a handle to every Lua    *
+ * state in the process; replaces any CA of the same name.      *
+ * core.ca_get(name) -> ca | nil, reason                        *
+ * core.ca_unregister(name) -> boolean                          *
+ * Handles from ca_get share the key, caches, CRL and OCSP      *
+ * state of the registered one: nothing is parsed again.        *
+ * -------------------------------------------------------------*/
+int ca_register_lua(lua_State *L) {
+	const char *name = luaL_checkstring(L, 1);
+	struct ca *ca = check_ca(L, 2);
+	if (! ca_register(name, ca)) {
+		return luaL_error(L, "can't register CA %s", name);
 	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
 
-	/* --------------------------------------------------------- *
-	 * Extract the subject name from the request                 *
-	 * ----------------------------------------------------------*/
-	X509_NAME *name;
-	if (! (name = X509_REQ_get_subject_name(certreq))) {
-		err_descr_to_stderr("Error getting subject from cert request");
-		goto __error;
+int ca_get_lua(lua_State *L) {
+	const char *name = luaL_checkstring(L, 1);
+	struct ca *ca = ca_lookup(name);
+	if (ca == NULL) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "no CA registered as %s", name);
+		return 2;
 	}
+	push_ca(L, ca);
+	return 1;
+}
 
-	/* --------------------------------------------------------- *
-	 * Set the new certificate subject name                      *
-	 * ----------------------------------------------------------*/
-	if (X509_set_subject_name(newcert, name) != 1) {
-		err_descr_to_stderr("Error setting subject name of certificate");
-		goto __error;
+int ca_unregister_lua(lua_State *L) {
+	lua_pushboolean(L, ca_unregister(luaL_checkstring(L, 1)));
+	return 1;
+}
+
+static int ca_gc(lua_State *L) {
+	void **box = checkudata(L, 1, CA_MT);
+	ca_unref(*box);
+	*box = NULL;
+	return 0;
+}
+
+/* ca:sign(csr) -> crt, serial | nil, reason */
+struct coalescer;
+static struct coalescer *get_coalescer(lua_State *L, int ca_idx);
+static int coalesce_sign(lua_State *L, struct coalescer *co, const char *csr, size_t csr_len);
+
+static int ca_sign_lua(lua_State *L) {
+	struct ca *ca = check_ca(L, 1);
+	size_t csr_len;
+	const char *csr = luaL_checklstring(L, 2, &csr_len);
+	const char *why = NULL;
+	struct coalescer *co;
+	int rc;
+
+	// coroutines of a coalescing CA queue up and yield, see ca:coalesce
+	int main_thread = lua_pushthread(L);
+	lua_pop(L, 1);
+	if (!main_thread && (co = get_coalescer(L, 1)) != NULL) {
+		return coalesce_sign(L, co, csr, csr_len);
 	}
 
-	/* --------------------------------------------------------- *
-	 * Extract the subject name from the signing CA cert         *
-	 * ----------------------------------------------------------*/
-	if (! (name = X509_get_subject_name(cacert))) {
-		err_descr_to_stderr("Error getting subject from CA certificate");
-		goto __error;
+	struct der pem;
+	char serial[2 * CA_SERIAL_MAX + 1];
+
+	der_init(&pem);
+	if (ca_sign_pem(ca, csr, csr_len, NULL, &pem, serial, &why)) {
+		lua_pushlstring(L, (const char *) pem.buf, pem.len);
+		lua_pushstring(L, serial);
+		STAT_ADD(signs, 1);
+		rc = 2;
+	} else {
+		STAT_ADD(sign_errors, 1);
+		rc = push_error(L, why);
 	}
+	der_free(&pem);
+	return rc;
+}
 
-	/* --------------------------------------------------------- *
-	 * Set the new certificate issuer name                       *
-	 * ----------------------------------------------------------*/
-	if (X509_set_issuer_name(newcert, name) != 1) {
-		err_descr_to_stderr("Error setting issuer name of certificate");
-		goto __error;
+/* ------------------------------------------------------------ *
+ * core.buffer([size]) -> reusable byte buffer. Certificates    *
+ * signed into it are appended in place; the bytes only become  *
+ * a Lua string if buf:tostring() is asked for.                 *
+ * buf:len(), buf:clear(), buf:write(fd) -> bytes | nil, reason *
+ * -------------------------------------------------------------*/
+static struct der *check_buffer(lua_State *L, int idx) {
+	return luaL_checkudata(L, idx, BUFFER_MT);
+}
+
+/* the buffer at idx, or NULL; Lua 5.1 has no luaL_testudata */
+static struct der *test_buffer(lua_State *L, int idx) {
+	struct der *buf = lua_touserdata(L, idx);
+	if (buf == NULL || ! lua_getmetatable(L, idx)) {
+		return NULL;
 	}
+	luaL_getmetatable(L, BUFFER_MT);
+	int is_buffer = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return is_buffer ? buf : NULL;
+}
 
-	/* --------------------------------------------------------- *
-	 * Extract the public key data from the request              *
-	 * ----------------------------------------------------------*/
-	EVP_PKEY *req_pubkey;
-	if (! (req_pubkey=X509_REQ_get_pubkey(certreq))) {
-		err_descr_to_stderr("Error unpacking public key from request");
-		goto __error;
+static int buffer_new_lua(lua_State *L) {
+	lua_Integer size = luaL_optinteger(L, 1, 0);
+	luaL_argcheck(L, size >= 0, 1, "size must not be negative");
+
+	struct der *buf = lua_newuserdata(L, sizeof(*buf));
+	der_init(buf);
+	luaL_getmetatable(L, BUFFER_MT);
+	lua_setmetatable(L, -2);
+	if (size > 0 && ! der_reserve(buf, size)) {
+		return luaL_error(L, "can't allocate %d bytes", (int) size);
 	}
+	return 1;
+}
 
-	/* --------------------------------------------------------- *
-	 * Optionally: Use the public key to verify the signature    *
-	 * ----------------------------------------------------------*/
-	if (X509_REQ_verify(certreq, req_pubkey) != 1) {
-		err_descr_to_stderr("Error verifying signature on request");
-		goto __error;
+static int buffer_len_lua(lua_State *L) {
+	lua_pushinteger(L, check_buffer(L, 1)->len);
+	return 1;
+}
+
+static int buffer_tostring_lua(lua_State *L) {
+	struct der *buf = check_buffer(L, 1);
+	lua_pushlstring(L, (const char *) buf->buf, buf->len);
+	return 1;
+}
+
+/* keeps the allocation for the next round */
+static int buffer_clear_lua(lua_State *L) {
+	struct der *buf = check_buffer(L, 1);
+	buf->len = 0;
+	buf->failed = 0;
+	return 0;
+}
+
+static int buffer_gc(lua_State *L) {
+	der_free(check_buffer(L, 1));
+	return 0;
+}
+
+/* the whole of data to fd, retrying short and interrupted writes */
+static int write_all(int fd, const unsigned char *data, size_t len) {
+	while (len > 0) {
+		ssize_t done = write(fd, data, len);
+		if (done < 0 && errno == EINTR) {
+			continue;
+		}
+		if (done <= 0) {
+			return 0;
+		}
+		data += done;
+		len -= done;
 	}
+	return 1;
+}
 
-	/* --------------------------------------------------------- *
-	 * Set the new certificate public key                        *
-	 * ----------------------------------------------------------*/
-	if (X509_set_pubkey(newcert, req_pubkey) != 1) {
-		err_descr_to_stderr("Error setting public key of certificate");
-		goto __error;
+static int push_errno(lua_State *L, const char *what) {
+	lua_pushnil(L);
+	lua_pushfstring(L, "%s: %s", what, strerror(errno));
+	return 2;
+}
+
+static int buffer_write_lua(lua_State *L) {
+	struct der *buf = check_buffer(L, 1);
+	int fd = (int) luaL_checkinteger(L, 2);
+
+	if (! write_all(fd, buf->buf, buf->len)) {
+		return push_errno(L, "write");
 	}
+	lua_pushinteger(L, buf->len);
+	return 1;
+}
 
-	/* ---------------------------------------------------------- *
-	 * Set X509V3 start date (now) and expiration date (+365 days)*
-	 * -----------------------------------------------------------*/
-	if (! (X509_gmtime_adj(X509_get_notBefore(newcert),0))) {
-		err_descr_to_stderr("Error setting start time");
-		goto __error;
+/* ca:sign_into(csr, buf) -> bytes appended, serial | nil, reason */
+static int ca_sign_into_lua(lua_State *L) {
+	struct ca *ca = check_ca(L, 1);
+	size_t csr_len;
+	const char *csr = luaL_checklstring(L, 2, &csr_len);
+	struct der *buf = check_buffer(L, 3);
+	char serial[2 * CA_SERIAL_MAX + 1];
+	const char *why = NULL;
+	size_t start = buf->len;
+
+	if (! ca_sign_pem(ca, csr, csr_len, NULL, buf, serial, &why)) {
+		// a failed append leaves the buffer as it was
+		buf->len = start;
+		buf->failed = 0;
+		STAT_ADD(sign_errors, 1);
+		return push_error(L, why);
 	}
+	STAT_ADD(signs, 1);
+	lua_pushinteger(L, buf->len - start);
+	lua_pushstring(L, serial);
+	return 2;
+}
 
-	long valid_secs = 31536000;
+/* ca:sign_to_fd(csr, fd) -> bytes written, serial | nil, reason */
+static int ca_sign_to_fd_lua(lua_State *L) {
+	struct ca *ca = check_ca(L, 1);
+	size_t csr_len;
+	const char *csr = luaL_checklstring(L, 2, &csr_len);
+	int fd = (int) luaL_checkinteger(L, 3);
+	char serial[2 * CA_SERIAL_MAX + 1];
+	const char *why = NULL;
+	struct der pem;
+	int rc;
 
-	if(! (X509_gmtime_adj(X509_get_notAfter(newcert), valid_secs))) {
-		err_descr_to_stderr("Error setting expiration time");
-		goto __error;
+	der_init(&pem);
+	if (! ca_sign_pem(ca, csr, csr_len, NULL, &pem, serial, &why)) {
+		STAT_ADD(sign_errors, 1);
+		rc = push_error(L, why);
+	} else if (! write_all(fd, pem.buf, pem.len)) {
+		// issued but not delivered: still a failed call
+		STAT_ADD(sign_errors, 1);
+		rc = push_errno(L, "write");
+	} else {
+		STAT_ADD(signs, 1);
+		lua_pushinteger(L, pem.len);
+		lua_pushstring(L, serial);
+		rc = 2;
 	}
+	der_free(&pem);
+	return rc;
+}
 
-	/* ----------------------------------------------------------- *
-	 * Add X509V3 extensions                                       *
-	 * ------------------------------------------------------------*/
-	X509V3_CTX                   ctx;
-	X509V3_set_ctx(&ctx, cacert, newcert, NULL, NULL, 0);
-	// X509_EXTENSION *ext;
+/* ------------------------------------------------------------ *
+ * Issuance profile {lifetime = secs, backdate = secs,          *
+ * copy_extensions = bool}; nil or absent fields keep the       *
+ * defaults of ca:sign, 365 days and no extensions. Copying     *
+ * takes subjectAltName, extendedKeyUsage and keyUsage only,    *
+ * and refuses a keyUsage with keyCertSign or cRLSign and an    *
+ * extendedKeyUsage beyond serverAuth and clientAuth.           *
+ * -------------------------------------------------------------*/
+static void check_profile(lua_State *L, int idx, struct ca_profile *profile) {
+	*profile = ca_default_profile;
+	if (lua_isnoneornil(L, idx)) {
+		return;
+	}
+	luaL_checktype(L, idx, LUA_TTABLE);
 
-	/* ----------------------------------------------------------- *
-	 * Set digest type, sign new certificate with CA's private key *
-	 * ------------------------------------------------------------*/
-	EVP_MD                       const *digest = NULL;
-	digest = EVP_sha256();
+	lua_getfield(L, idx, "lifetime");
+	profile->lifetime = luaL_optnumber(L, -1, profile->lifetime);
+	lua_getfield(L, idx, "backdate");
+	profile->backdate = luaL_optnumber(L, -1, profile->backdate);
+	lua_getfield(L, idx, "copy_extensions");
+	profile->copy_extensions = lua_isnil(L, -1) ? profile->copy_extensions : lua_toboolean(L, -1);
+	lua_pop(L, 3);
+	luaL_argcheck(L, profile->lifetime > 0 && profile->backdate >= 0, idx,
+			"lifetime must be positive and backdate not negative");
+}
 
-	if (! X509_sign(newcert, pKey, digest)) {
-		err_descr_to_stderr("Error signing the new certificate");
-		goto __error;
+/* ------------------------------------------------------------ *
+ * ca:renew(crt [, opts]) -> crt, serial | nil, reason          *
+ * A certificate this CA issued is signed again with a fresh    *
+ * serial and validity, keeping its subject, key and (unless    *
+ * copy_extensions = false) extensions; no CSR is involved.     *
+ * opts is a profile plus grace, seconds a certificate may be   *
+ * expired and still renewed (0), and either into, a buffer the *
+ * certificate is appended to, or fd, a descriptor it is        *
+ * written to; both return bytes, serial like ca:sign_into and  *
+ * ca:sign_to_fd. ca:renew_async queues a renewal instead.      *
+ * -------------------------------------------------------------*/
+
+/* the profile and grace of the renewal options at idx */
+static void check_renew_opts(lua_State *L, int idx, struct ca_profile *profile, long *grace) {
+	check_profile(L, idx, profile);
+	profile->copy_extensions = ca_renew_profile.copy_extensions;
+	*grace = 0;
+	if (lua_istable(L, idx)) {
+		lua_getfield(L, idx, "copy_extensions");
+		profile->copy_extensions = lua_isnil(L, -1) ? profile->copy_extensions : lua_toboolean(L, -1);
+		lua_getfield(L, idx, "grace");
+		*grace = luaL_optnumber(L, -1, 0);
+		lua_pop(L, 2);
+		luaL_argcheck(L, *grace >= 0, idx, "grace must not be negative");
 	}
+}
 
-	/* ------------------------------------------------------------ *
-	 *  print the certificate                                       *
-	 * -------------------------------------------------------------*/
-	BIO  *outbio = BIO_new(BIO_s_mem());
-	if (! PEM_write_bio_X509(outbio, newcert)) {
-		err_descr_to_stderr("Error printing the signed certificate");
-		goto __error;
+static int ca_renew_lua(lua_State *L) {
+	struct ca *ca = check_ca(L, 1);
+	size_t crt_len;
+	const char *crt = luaL_checklstring(L, 2, &crt_len);
+	struct ca_profile profile;
+	struct der *into = NULL;
+	int fd = -1;
+	long grace;
+	char serial[2 * CA_SERIAL_MAX + 1];
+	const char *why = NULL;
+	struct der pem;
+	int rc;
+
+	check_renew_opts(L, 3, &profile, &grace);
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "into");
+		if (! lua_isnil(L, -1)) {
+			into = test_buffer(L, -1);
+			luaL_argcheck(L, into != NULL, 3, "into must be a buffer");
+		}
+		lua_getfield(L, 3, "fd");
+		fd = (int) luaL_optinteger(L, -1, -1);
+		lua_pop(L, 2);
+		luaL_argcheck(L, into == NULL || fd < 0, 3, "into and fd are exclusive");
 	}
 
-	BUF_MEM *bptr;
-	BIO_get_mem_ptr(outbio, &bptr);
-	lua_pushlstring(L, bptr->data, bptr->length + 1);
-	BUF_MEM_free(bptr);
+	if (into != NULL) {
+		size_t start = into->len;
+		if (! ca_renew_pem(ca, crt, crt_len, &profile, grace, into, serial, &why)) {
+			into->len = start;
+			into->failed = 0;
+			STAT_ADD(sign_errors, 1);
+			return push_error(L, why);
+		}
+		STAT_ADD(signs, 1);
+		lua_pushinteger(L, into->len - start);
+		lua_pushstring(L, serial);
+		return 2;
+	}
 
-	// all ok set RC to 1
-	rc = 1;
+	der_init(&pem);
+	if (! ca_renew_pem(ca, crt, crt_len, &profile, grace, &pem, serial, &why)) {
+		STAT_ADD(sign_errors, 1);
+		rc = push_error(L, why);
+	} else if (fd >= 0 && ! write_all(fd, pem.buf, pem.len)) {
+		STAT_ADD(sign_errors, 1);
+		rc = push_errno(L, "write");
+	} else {
+		STAT_ADD(signs, 1);
+		if (fd >= 0) {
+			lua_pushinteger(L, pem.len);
+		} else {
+			lua_pushlstring(L, (const char *) pem.buf, pem.len);
+		}
+		lua_pushstring(L, serial);
+		rc = 2;
+	}
+	der_free(&pem);
+	return rc;
+}
 
-__error:
-	// private key and buffer free
-	if (pkeybio != NULL) {
-		BIO_free_all(pkeybio);
+/* ------------------------------------------------------------ *
+ * ca:issue(spki, identity [, profile]) -> crt, serial          *
+ *                                        | nil, reason         *
+ * A certificate for a key the caller has already authenticated *
+ * the holder of, with no CSR to parse or verify. spki is a PEM *
+ * PUBLIC KEY or its DER; identity is                           *
+ *   subject = {{"CN", "svc"}, {"O", "acme"}, ...}  in order    *
+ *   dns, email, uri, ip = {...}                    SANs        *
+ * Attribute names are anything OBJ_txt2nid knows.              *
+ * -------------------------------------------------------------*/
+#define IDENTITY_SUBJECT_MAX	32
+#define IDENTITY_SAN_MAX	128
+
+struct identity {
+	struct csr_identity id;
+	struct csr_attr subject[IDENTITY_SUBJECT_MAX];
+	struct csr_san san[IDENTITY_SAN_MAX];
+	unsigned char ip[IDENTITY_SAN_MAX][16];
+};
+
+/* strings only: they stay alive in the identity table once popped */
+static void identity_sans(lua_State *L, int idx, const char *field, int type, struct identity *ident) {
+	lua_getfield(L, idx, field);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return;
+	}
+	luaL_argcheck(L, lua_istable(L, -1), idx, "SAN lists must be tables");
+	for (size_t n = 1; n <= lua_objlen(L, -1); n++) {
+		struct csr_san *san = &ident->san[ident->id.san_count];
+		luaL_argcheck(L, ident->id.san_count < IDENTITY_SAN_MAX, idx, "too many subjectAltNames");
+		lua_rawgeti(L, -1, n);
+		luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, idx, "subjectAltNames must be strings");
+		san->type = type;
+		san->value = lua_tolstring(L, -1, &san->len);
+		if (type == GEN_IPADD) {
+			unsigned char *ip = ident->ip[ident->id.san_count];
+			if (inet_pton(AF_INET, san->value, ip) == 1) {
+				san->len = 4;
+			} else if (inet_pton(AF_INET6, san->value, ip) == 1) {
+				san->len = 16;
+			} else {
+				luaL_argerror(L, idx, "bad IP address");
+			}
+			san->value = ip;
+		}
+		lua_pop(L, 1);
+		ident->id.san_count++;
+	}
+	lua_pop(L, 1);
+}
+
+static void check_identity(lua_State *L, int idx, struct identity *ident) {
+	luaL_checktype(L, idx, LUA_TTABLE);
+	memset(&ident->id, 0, sizeof(ident->id));
+	ident->id.subject = ident->subject;
+	ident->id.san = ident->san;
+
+	lua_getfield(L, idx, "subject");
+	if (! lua_isnil(L, -1)) {
+		luaL_argcheck(L, lua_istable(L, -1), idx, "subject must be a list of {name, value}");
+		for (size_t n = 1; n <= lua_objlen(L, -1); n++) {
+			struct csr_attr *attr = &ident->subject[ident->id.subject_count];
+			luaL_argcheck(L, ident->id.subject_count < IDENTITY_SUBJECT_MAX, idx, "too many subject attributes");
+			lua_rawgeti(L, -1, n);
+			luaL_argcheck(L, lua_istable(L, -1), idx, "subject must be a list of {name, value}");
+			lua_rawgeti(L, -1, 1);
+			lua_rawgeti(L, -2, 2);
+			luaL_argcheck(L, lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TSTRING, idx,
+					"subject must be a list of {name, value}");
+			if ((attr->nid = OBJ_txt2nid(lua_tostring(L, -2))) == NID_undef) {
+				ERR_clear_error();
+				luaL_argerror(L, idx, lua_pushfstring(L, "unknown attribute %s", lua_tostring(L, -2)));
+			}
+			attr->value = lua_tolstring(L, -1, &attr->len);
+			lua_pop(L, 3);
+			ident->id.subject_count++;
+		}
+	}
+	lua_pop(L, 1);
+
+	identity_sans(L, idx, "dns", GEN_DNS, ident);
+	identity_sans(L, idx, "email", GEN_EMAIL, ident);
+	identity_sans(L, idx, "uri", GEN_URI, ident);
+	identity_sans(L, idx, "ip", GEN_IPADD, ident);
+}
+
+static int ca_issue_lua(lua_State *L) {
+	struct ca *ca = check_ca(L, 1);
+	size_t spki_len;
+	const char *spki = luaL_checklstring(L, 2, &spki_len);
+	struct identity ident;
+	struct ca_profile profile;
+	char serial[2 * CA_SERIAL_MAX + 1];
+	const char *why = NULL;
+	struct der pem;
+	int rc;
+
+	check_identity(L, 3, &ident);
+	check_profile(L, 4, &profile);
+
+	der_init(&pem);
+	if (ca_identity_pem(ca, spki, spki_len, &ident.id, &profile, &pem, serial, &why)) {
+		lua_pushlstring(L, (const char *) pem.buf, pem.len);
+		lua_pushstring(L, serial);
+		STAT_ADD(signs, 1);
+		rc = 2;
+	} else {
+		STAT_ADD(sign_errors, 1);
+		rc = push_error(L, why);
+	}
+	der_free(&pem);
+	return rc;
+}
+
+/* ------------------------------------------------------------ *
+ * core.sign_multi(csr, {ca, ...} [, profile]) -> crts, serials *
+ * Cross-signing: the request is parsed and verified once and   *
+ * signed under every CA, in parallel on the signing pool.      *
+ * crts[i] is the certificate from the i-th CA, or false with   *
+ * serials[i] the reason. The first CA's admission limits       *
+ * decide whether the request is read at all.                   *
+ * -------------------------------------------------------------*/
+static int sign_multi_lua(lua_State *L) {
+	size_t csr_len;
+	const char *csr = luaL_checklstring(L, 1, &csr_len);
+	struct ca_profile profile;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	check_profile(L, 3, &profile);
+	size_t count = lua_objlen(L, 2);
+	luaL_argcheck(L, count > 0, 2, "no CA to sign under");
+
+	// userdata, so a bad entry raising an error leaks nothing
+	struct ca **cas = lua_newuserdata(L, count * sizeof(*cas));
+	struct sign_multi_result *results = lua_newuserdata(L, count * sizeof(*results));
+	for (size_t idx = 0; idx < count; idx++) {
+		lua_rawgeti(L, 2, idx + 1);
+		void **box = lua_touserdata(L, -1);
+		int is_ca = box != NULL && lua_getmetatable(L, -1);
+		if (is_ca) {
+			luaL_getmetatable(L, CA_MT);
+			is_ca = lua_rawequal(L, -1, -2);
+			lua_pop(L, 2);
+		}
+		if (! is_ca || (cas[idx] = *box) == NULL) {
+			return luaL_argerror(L, 2, "live CA handles expected");
+		}
+		lua_pop(L, 1);
 	}
-	if (pKey != NULL) {
-		EVP_PKEY_free(pKey);
+
+	size_t signed_count = sign_multi(cas, count, csr, csr_len, &profile, results);
+	STAT_ADD(signs, signed_count);
+	STAT_ADD(sign_errors, count - signed_count);
+
+	lua_createtable(L, count, 0);
+	lua_createtable(L, count, 0);
+	for (size_t idx = 0; idx < count; idx++) {
+		struct sign_multi_result *result = &results[idx];
+		if (result->ok) {
+			lua_pushlstring(L, (const char *) result->pem.buf, result->pem.len);
+			lua_pushstring(L, result->serial);
+		} else {
+			lua_pushboolean(L, 0);
+			lua_pushstring(L, result->why);
+		}
+		der_free(&result->pem);
+		lua_rawseti(L, -3, idx + 1);
+		lua_rawseti(L, -3, idx + 1);
 	}
+	return 2;
+}
+
+/* ------------------------------------------------------------ *
+ * ca:mint(identity [, opts]) -> mint | nil, reason             *
+ * Key and certificate pairs for identity, as ca:issue takes    *
+ * it, minted ahead by a background thread. opts is a profile   *
+ * plus depth = 8 pairs kept ready, key = "ec" | "ed25519" |    *
+ * "rsa" with bits (256 / 2048), and refresh, seconds before    *
+ * notAfter a ready pair is replaced (lifetime / 4).            *
+ * mint:take() -> key, crt, serial | nil, reason                *
+ *   a ready pair, or one minted on the spot when none is       *
+ * mint:stats() -> {depth, target, oldest_age, hits, misses,    *
+ *   hit_rate, minted, discarded, errors, last_error}           *
+ * mint:close()                                                 *
+ * -------------------------------------------------------------*/
+static const char *const mint_key_names[] = { "ec", "ed25519", "rsa", NULL };
 
-	// CA certificate, CA pub key and buffer free
-	if (cacertbio != NULL) {
-		BIO_free_all(cacertbio);
+static int opt_field_option(lua_State *L, int idx, const char *field, int def, const char *const names[]);
+
+static int ca_mint_lua(lua_State *L) {
+	struct ca *ca = check_ca(L, 1);
+	struct identity ident;
+	struct ca_profile profile;
+	struct mint_opts opts = { .depth = 8, .key_type = MINT_KEY_EC, .bits = 0, .refresh = -1 };
+	const char *why = NULL;
+
+	check_identity(L, 2, &ident);
+	check_profile(L, 3, &profile);
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "depth");
+		lua_Integer depth = luaL_optinteger(L, -1, opts.depth);
+		lua_getfield(L, 3, "bits");
+		opts.bits = luaL_optinteger(L, -1, 0);
+		lua_getfield(L, 3, "refresh");
+		opts.refresh = luaL_optnumber(L, -1, -1);
+		lua_pop(L, 3);
+		luaL_argcheck(L, depth > 0, 3, "depth must be positive");
+		opts.depth = depth;
+		opts.key_type = opt_field_option(L, 3, "key", MINT_KEY_EC, mint_key_names);
 	}
-	if (cacert != NULL) {
-		X509_free(cacert);
+	if (opts.bits == 0) {
+		opts.bits = opts.key_type == MINT_KEY_RSA ? 2048 : 256;
 	}
-	if (req_pubkey != NULL) {
-		EVP_PKEY_free(req_pubkey);
+	luaL_argcheck(L, opts.key_type != MINT_KEY_EC || opts.bits == 256 || opts.bits == 384 || opts.bits == 521,
+			3, "EC keys are 256, 384 or 521 bits");
+	if (opts.refresh < 0) {
+		opts.refresh = profile.lifetime / 4;
+	}
+
+	struct mint *mint = mint_new(ca, &ident.id, &profile, &opts, &why);
+	if (mint == NULL) {
+		return push_error(L, why);
 	}
+	lua_boxpointer(L, mint);
+	luaL_getmetatable(L, MINT_MT);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static struct mint *check_mint(lua_State *L, int idx) {
+	struct mint *mint = lua_unboxpointer(L, idx, MINT_MT);
+	luaL_argcheck(L, mint != NULL, idx, "mint already closed");
+	return mint;
+}
 
-	// CSR and buffer free
-	if (reqbio != NULL) {
-		BIO_free_all(reqbio);
+static int mint_close_lua(lua_State *L) {
+	void **box = checkudata(L, 1, MINT_MT);
+	if (*box != NULL) {
+		mint_free(*box);
+		*box = NULL;
 	}
-	if (certreq != NULL) {
-		X509_REQ_free(certreq);
+	return 0;
+}
+
+static int mint_take_lua(lua_State *L) {
+	struct mint *mint = check_mint(L, 1);
+	const char *why = NULL;
+
+	struct mint_item *item = mint_take(mint, &why);
+	if (item == NULL) {
+		return push_error(L, why);
 	}
+	lua_pushlstring(L, item->pem, item->key_len);
+	lua_pushlstring(L, item->pem + item->key_len, item->crt_len);
+	lua_pushstring(L, item->serial);
+	mint_item_free(item);
+	return 3;
+}
 
-	if (newcert != NULL) {
-		// signed CRT free
-		X509_free(newcert);
+static int mint_stats_lua(lua_State *L) {
+	struct mint *mint = check_mint(L, 1);
+	struct mint_stats stats;
+
+	mint_get_stats(mint, &stats);
+	lua_createtable(L, 0, 10);
+	lua_pushinteger(L, stats.depth);
+	lua_setfield(L, -2, "depth");
+	lua_pushinteger(L, mint->opts.depth);
+	lua_setfield(L, -2, "target");
+	lua_pushnumber(L, stats.oldest != 0 ? difftime(time(NULL), stats.oldest) : 0);
+	lua_setfield(L, -2, "oldest_age");
+	lua_pushnumber(L, stats.hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushnumber(L, stats.misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushnumber(L, stats.hits + stats.misses > 0 ? (double) stats.hits / (stats.hits + stats.misses) : 0);
+	lua_setfield(L, -2, "hit_rate");
+	lua_pushnumber(L, stats.minted);
+	lua_setfield(L, -2, "minted");
+	lua_pushnumber(L, stats.discarded);
+	lua_setfield(L, -2, "discarded");
+	lua_pushnumber(L, stats.errors);
+	lua_setfield(L, -2, "errors");
+	lua_pushstring(L, stats.last_error);
+	lua_setfield(L, -2, "last_error");
+	return 1;
+}
+
+/* ------------------------------------------------------------ *
+ * ca:prepare(csr [, profile]) -> tbs, digest, serial           *
+ * ca:finish(tbs, signature) -> crt | nil, reason               *
+ * ca:signature(digest | tbs) -> signature | nil, reason        *
+ * ca:sign split in two for a CA key held elsewhere: prepare    *
+ * does the admission, policy, request checks and encoding,     *
+ * the key holder signs digest (or tbs, for EdDSA, where digest *
+ * is nil) and finish wraps its signature into the PEM          *
+ * certificate, once it verifies under the CA certificate.      *
+ * ca:signature is the key holder's side, on its own handle.    *
+ * -------------------------------------------------------------*/
+static int ca_prepare_lua(lua_State *L) {
+	struct ca *ca = check_ca(L, 1);
+	size_t csr_len;
+	const char *csr = luaL_checklstring(L, 2, &csr_len);
+	struct ca_profile profile;
+	struct ca_admission lim;
+	struct ca_request request;
+	char serial[2 * CA_SERIAL_MAX + 1];
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len = 0;
+	const char *why = NULL;
+	struct der tbs;
+	int rc;
+
+	check_profile(L, 3, &profile);
+	ca_get_admission(ca, &lim);
+	der_init(&tbs);
+	if (! ca_request_admit(&request, &lim, &ca->stats, csr, csr_len, &why) ||
+			! ca_prepare_tbs(ca, &request, &profile, NULL, 0, &tbs, serial, &why)) {
+		rc = push_error(L, why);
+	} else {
+		lua_pushlstring(L, (const char *) tbs.buf, tbs.len);
+		if (ca->md != NULL && ca_digest_tbs(ca, tbs.buf, tbs.len, md, &md_len)) {
+			lua_pushlstring(L, (const char *) md, md_len);
+		} else {
+			lua_pushnil(L);
+		}
+		lua_pushstring(L, serial);
+		rc = 3;
 	}
+	der_free(&tbs);
+	ca_request_free(&request);
+	return rc;
+}
 
-	if (outbio != NULL) {
-		BIO_free_all(outbio);
+static int ca_finish_lua(lua_State *L) {
+	struct ca *ca = check_ca(L, 1);
+	size_t tbs_len, sig_len;
+	const unsigned char *tbs = (const unsigned char *) luaL_checklstring(L, 2, &tbs_len);
+	const unsigned char *sig = (const unsigned char *) luaL_checklstring(L, 3, &sig_len);
+	struct der der, pem;
+	int rc;
+
+	der_init(&der);
+	der_init(&pem);
+	if (! ca_finish_tbs(ca, tbs, tbs_len, sig, sig_len, &der)) {
+		STAT_ADD(sign_errors, 1);
+		rc = push_error(L, "signature doesn't verify under the CA certificate");
+	} else {
+		pem_encode(&pem, "CERTIFICATE", der.buf, der.len);
+		if (pem.failed) {
+			STAT_ADD(sign_errors, 1);
+			rc = push_error(L, "can't encode certificate");
+		} else {
+			STAT_ADD(signs, 1);
+			lua_pushlstring(L, (const char *) pem.buf, pem.len);
+			rc = 1;
+		}
 	}
+	der_free(&pem);
+	der_free(&der);
+	return rc;
+}
+
+static int ca_signature_lua(lua_State *L) {
+	struct ca *ca = check_ca(L, 1);
+	size_t len;
+	const unsigned char *data = (const unsigned char *) luaL_checklstring(L, 2, &len);
+	struct der sig;
+	int rc;
 
+	der_init(&sig);
+	if (! ca_sign_prepared(ca, data, len, &sig)) {
+		rc = push_error(L, "can't sign with this CA key");
+	} else {
+		lua_pushlstring(L, (const char *) sig.buf, sig.len);
+		rc = 1;
+	}
+	der_free(&sig);
 	return rc;
 }
 
+/* ca:crl() -> the CA's CRL builder */
+static int ca_crl_lua(lua_State *L) {
+	struct ca *ca = check_ca(L, 1);
+	if (ca_crl(ca) == NULL) {
+		return luaL_error(L, "can't allocate CRL");
+	}
+	lua_boxpointer(L, ca_ref(ca));
+	luaL_getmetatable(L, CRL_MT);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static struct ca *check_crl(lua_State *L, int idx) {
+	struct ca *ca = lua_unboxpointer(L, idx, CRL_MT);
+	luaL_argcheck(L, ca != NULL, idx, "CRL already released");
+	return ca;
+}
+
+static int crl_gc(lua_State *L) {
+	void **box = checkudata(L, 1, CRL_MT);
+	ca_unref(*box);
+	*box = NULL;
+	return 0;
+}
+
+static int check_reason(lua_State *L, int idx, int def) {
+	if (lua_isnoneornil(L, idx)) {
+		return def;
+	}
+	if (lua_type(L, idx) == LUA_TNUMBER) {
+		int code = lua_tointeger(L, idx);
+		luaL_argcheck(L, crl_reason_name(code) != NULL, idx, "unknown CRL reason");
+		return code;
+	}
+	int code = crl_reason_code(luaL_checkstring(L, idx));
+	luaL_argcheck(L, code >= 0 && code != CRL_REASON_REMOVE, idx, "unknown CRL reason");
+	return code;
+}
+
+/* crl:revoke(serial [, time [, reason]]) -> true */
+static int crl_revoke_lua(lua_State *L) {
+	struct ca *ca = check_crl(L, 1);
+	unsigned char serial[CA_SERIAL_MAX];
+	size_t len = check_serial(L, 2, serial);
+	time_t when = luaL_optnumber(L, 3, time(NULL));
+	int reason = check_reason(L, 4, CRL_REASON_NONE);
+
+	if (! crl_revoke(ca->crl, serial, len, when, reason)) {
+		return push_error(L, "can't revoke serial");
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/* crl:unrevoke(serial) -> true if a certificateHold was released */
+static int crl_unrevoke_lua(lua_State *L) {
+	struct ca *ca = check_crl(L, 1);
+	unsigned char serial[CA_SERIAL_MAX];
+	size_t len = check_serial(L, 2, serial);
+	lua_pushboolean(L, crl_unrevoke(ca->crl, serial, len));
+	return 1;
+}
+
+/* crl:status(serial) -> revoked, time, reason */
+static int crl_status_lua(lua_State *L) {
+	struct ca *ca = check_crl(L, 1);
+	unsigned char serial[CA_SERIAL_MAX];
+	size_t len = check_serial(L, 2, serial);
+	time_t when;
+	int reason;
+
+	if (! crl_status(ca->crl, serial, len, &when, &reason)) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	lua_pushboolean(L, 1);
+	lua_pushnumber(L, when);
+	if (reason == CRL_REASON_NONE) {
+		lua_pushnil(L);
+	} else {
+		lua_pushstring(L, crl_reason_name(reason));
+	}
+	return 3;
+}
+
+static int crl_count_lua(lua_State *L) {
+	struct ca *ca = check_crl(L, 1);
+	lua_pushnumber(L, crl_count(ca->crl));
+	return 1;
+}
+
+/* ------------------------------------------------------------ *
+ * crl:full([opts]) / crl:delta([opts]) -> crl, number          *
+ * opts.next_update seconds until nextUpdate (default 7 days),  *
+ * opts.der = true returns DER instead of PEM                   *
+ * -------------------------------------------------------------*/
+static int crl_publish(lua_State *L, int delta) {
+	struct ca *ca = check_crl(L, 1);
+	long next_update = 7 * 24 * 3600;
+	int der_out = 0;
+	uint64_t number = 0;
+	const char *why = NULL;
+	struct der out;
+
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "next_update");
+		next_update = luaL_optnumber(L, -1, next_update);
+		lua_getfield(L, 2, "der");
+		der_out = lua_toboolean(L, -1);
+		lua_pop(L, 2);
+	}
+
+	der_init(&out);
+	if (! crl_build(ca, ca->crl, delta, time(NULL), next_update, &out, &number, &why)) {
+		der_free(&out);
+		return push_error(L, why);
+	}
+
+	if (der_out) {
+		lua_pushlstring(L, (const char *) out.buf, out.len);
+	} else {
+		struct der pem;
+		der_init(&pem);
+		pem_encode(&pem, "X509 CRL", out.buf, out.len);
+		if (pem.failed) {
+			der_free(&out);
+			return push_error(L, "can't encode CRL");
+		}
+		lua_pushlstring(L, (const char *) pem.buf, pem.len);
+		der_free(&pem);
+	}
+	der_free(&out);
+	lua_pushnumber(L, number);
+	return 2;
+}
+
+static int crl_full_lua(lua_State *L) {
+	return crl_publish(L, 0);
+}
+
+static int crl_delta_lua(lua_State *L) {
+	return crl_publish(L, 1);
+}
+
+/* ------------------------------------------------------------ *
+ * ca:ocsp([opts]) -> the CA's OCSP responder                   *
+ * opts.validity seconds between thisUpdate and nextUpdate      *
+ * (default 4 days), opts.refresh_before how long before        *
+ * nextUpdate refresh() re-signs (default half the validity),   *
+ * opts.max_entries CertIDs cached at most (65536), half of     *
+ * them for answers to misses.                                  *
+ * Options only apply when the responder is first created.      *
+ * -------------------------------------------------------------*/
+static int ca_ocsp_lua(lua_State *L) {
+	struct ca *ca = check_ca(L, 1);
+	long validity = 4 * 24 * 3600;
+	long refresh_before = -1;
+	lua_Number max_entries = OCSP_MAX_ENTRIES;
+
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "validity");
+		validity = luaL_optnumber(L, -1, validity);
+		lua_getfield(L, 2, "refresh_before");
+		refresh_before = luaL_optnumber(L, -1, -1);
+		lua_getfield(L, 2, "max_entries");
+		max_entries = luaL_optnumber(L, -1, max_entries);
+		lua_pop(L, 3);
+		luaL_argcheck(L, max_entries >= 0, 2, "max_entries must not be negative");
+	}
+	if (refresh_before < 0) {
+		refresh_before = validity / 2;
+	}
+
+	if (ca_ocsp(ca, validity, refresh_before, (size_t) max_entries) == NULL) {
+		return luaL_error(L, "can't create OCSP responder");
+	}
+	lua_boxpointer(L, ca_ref(ca));
+	luaL_getmetatable(L, OCSP_MT);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static struct ocsp *check_ocsp(lua_State *L, int idx) {
+	struct ca *ca = lua_unboxpointer(L, idx, OCSP_MT);
+	luaL_argcheck(L, ca != NULL, idx, "OCSP responder already released");
+	return ca->ocsp;
+}
+
+static int ocsp_gc(lua_State *L) {
+	void **box = checkudata(L, 1, OCSP_MT);
+	ca_unref(*box);
+	*box = NULL;
+	return 0;
+}
+
+static const char *const ocsp_answers[] = {
+	"good", "revoked", "unknown", "malformed", "unauthorized", "error", NULL
+};
+
+/* ocsp:respond(der_request) -> der_response, status, cached */
+static int ocsp_respond_lua(lua_State *L) {
+	struct ocsp *ocsp = check_ocsp(L, 1);
+	size_t req_len;
+	const char *req = luaL_checklstring(L, 2, &req_len);
+	int cached = 0;
+	struct der out;
+
+	der_init(&out);
+	int answer = ocsp_respond(ocsp, (const unsigned char *) req, req_len, &out, &cached);
+	if (out.failed) {
+		der_free(&out);
+		return luaL_error(L, "out of memory");
+	}
+	lua_pushlstring(L, (const char *) out.buf, out.len);
+	lua_pushstring(L, ocsp_answers[answer]);
+	lua_pushboolean(L, cached);
+	der_free(&out);
+	return 3;
+}
+
+static int check_ocsp_hash(lua_State *L, int idx) {
+	static const char *const hashes[] = { "sha1", "sha256", NULL };
+	return luaL_checkoption(L, idx, "sha1", hashes);
+}
+
+/* ------------------------------------------------------------ *
+ * ocsp:presign({serial, ...} [, "sha1"|"sha256"]) -> queued    *
+ * Signs the responses on the worker pool in the background.    *
+ * -------------------------------------------------------------*/
+static int ocsp_presign_lua(lua_State *L) {
+	struct ocsp *ocsp = check_ocsp(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	int hash = check_ocsp_hash(L, 3);
+	size_t count = lua_objlen(L, 2);
+
+	unsigned char (*serials)[CA_SERIAL_MAX] = lua_newuserdata(L, count * CA_SERIAL_MAX + 1);
+	size_t *lens = lua_newuserdata(L, count * sizeof(size_t) + 1);
+	for (size_t idx = 0; idx < count; idx++) {
+		lua_rawgeti(L, 2, idx + 1);
+		lens[idx] = check_serial(L, -1, serials[idx]);
+		lua_pop(L, 1);
+	}
+
+	lua_pushnumber(L, ocsp_presign(ocsp, (const unsigned char (*)[CA_SERIAL_MAX]) serials, lens, count, hash));
+	return 1;
+}
+
+/* ocsp:refresh() -> number of expiring or stale responses queued */
+static int ocsp_refresh_lua(lua_State *L) {
+	struct ocsp *ocsp = check_ocsp(L, 1);
+	lua_pushnumber(L, ocsp_refresh(ocsp));
+	return 1;
+}
+
+static int ocsp_stats_lua(lua_State *L) {
+	struct ocsp *ocsp = check_ocsp(L, 1);
+	lua_createtable(L, 0, 7);
+	pthread_mutex_lock(&ocsp->write_lock);
+	lua_pushnumber(L, ocsp->count);
+	lua_setfield(L, -2, "entries");
+	lua_pushnumber(L, ocsp->pending);
+	lua_setfield(L, -2, "pending");
+	pthread_mutex_unlock(&ocsp->write_lock);
+	lua_pushnumber(L, __atomic_load_n(&ocsp->hits, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "hits");
+	lua_pushnumber(L, __atomic_load_n(&ocsp->misses, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "misses");
+	lua_pushnumber(L, __atomic_load_n(&ocsp->uncached, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "uncached");
+	lua_pushnumber(L, __atomic_load_n(&ocsp->signs, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "signs");
+	lua_pushnumber(L, __atomic_load_n(&ocsp->batches, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "batches");
+	return 1;
+}
+
+static const struct luaL_Reg OCSPMethods[] = {
+	{"respond", ocsp_respond_lua},
+	{"presign", ocsp_presign_lua},
+	{"refresh", ocsp_refresh_lua},
+	{"stats", ocsp_stats_lua},
+	{"__gc", ocsp_gc},
+	{NULL, NULL}
+};
+
+/* ------------------------------------------------------------ *
+ * core.new_store(bundle [, opts]) -> store                     *
+ * bundle: PEM with the trusted certificates and optional CRLs  *
+ * opts.cache: remember up to that many verification results,   *
+ * each for at most opts.ttl seconds (default 300)              *
+ * -------------------------------------------------------------*/
+int new_store_lua(lua_State *L) {
+	size_t len;
+	const char *bundle = luaL_checklstring(L, 1, &len);
+	lua_Integer entries = 0;
+	long ttl = 300;
+
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "cache");
+		entries = luaL_optinteger(L, -1, 0);
+		lua_getfield(L, 2, "ttl");
+		ttl = luaL_optnumber(L, -1, ttl);
+		lua_pop(L, 2);
+		luaL_argcheck(L, entries >= 0 && ttl > 0, 2, "cache and ttl must be positive");
+	}
+
+	struct store *store = store_new(bundle, len);
+	if (store == NULL) {
+		return push_error(L, "can't build store from bundle");
+	}
+	if (entries > 0 && ! store_cache_enable(store, entries, ttl)) {
+		store_unref(store);
+		return push_error(L, "can't allocate verification cache");
+	}
+	lua_boxpointer(L, store);
+	luaL_getmetatable(L, STORE_MT);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static struct store *check_store(lua_State *L, int idx) {
+	struct store *store = lua_unboxpointer(L, idx, STORE_MT);
+	luaL_argcheck(L, store != NULL, idx, "store already released");
+	return store;
+}
+
+static int store_gc(lua_State *L) {
+	void **box = checkudata(L, 1, STORE_MT);
+	store_unref(*box);
+	*box = NULL;
+	return 0;
+}
+
+static void check_verify_opts(lua_State *L, int idx, struct store_opts *opts) {
+	memset(opts, 0, sizeof(*opts));
+	if (lua_isnoneornil(L, idx)) {
+		return;
+	}
+	luaL_checktype(L, idx, LUA_TTABLE);
+
+	lua_getfield(L, idx, "time");
+	opts->at = luaL_optnumber(L, -1, 0);
+	lua_getfield(L, idx, "depth");
+	opts->depth = luaL_optinteger(L, -1, 0);
+	lua_getfield(L, idx, "purpose");
+	if (!lua_isnil(L, -1)) {
+		int purpose = X509_PURPOSE_get_by_sname((char *) luaL_checkstring(L, -1));
+		luaL_argcheck(L, purpose >= 0, idx, "unknown purpose");
+		opts->purpose = X509_PURPOSE_get_id(X509_PURPOSE_get0(purpose));
+	}
+	lua_getfield(L, idx, "crl_check");
+	if (lua_type(L, -1) == LUA_TSTRING) {
+		luaL_argcheck(L, strcmp(lua_tostring(L, -1), "all") == 0, idx, "crl_check must be true or \"all\"");
+		opts->crl_check = 2;
+	} else {
+		opts->crl_check = lua_toboolean(L, -1);
+	}
+	lua_getfield(L, idx, "host");
+	// lua_tostring would convert a number into a string only the stack holds
+	luaL_argcheck(L, lua_isnil(L, -1) || lua_type(L, -1) == LUA_TSTRING, idx, "host must be a string");
+	opts->host = lua_tostring(L, -1);
+	// the strings stay referenced by the opts table
+	lua_pop(L, 5);
+}
+
+/* leaf and untrusted intermediates from a string or a table of strings;
+ * on failure *bad is the table index that didn't parse, 0 for none */
+static int check_chain(lua_State *L, int idx, X509 **leaf, STACK_OF(X509) **untrusted, size_t *bad) {
+	size_t len;
+	const char *data;
+
+	*bad = 0;
+	if (!lua_istable(L, idx)) {
+		data = luaL_checklstring(L, idx, &len);
+		return store_parse_chain(data, len, leaf, untrusted);
+	}
+
+	*leaf = NULL;
+	*untrusted = NULL;
+	for (size_t n = 1; n <= lua_objlen(L, idx); n++) {
+		X509 *first;
+		STACK_OF(X509) *rest;
+		lua_rawgeti(L, idx, n);
+		data = lua_type(L, -1) == LUA_TSTRING ? lua_tolstring(L, -1, &len) : NULL;
+		int ok = data != NULL && store_parse_chain(data, len, &first, &rest);
+		lua_pop(L, 1);
+		if (!ok) {
+			// a chain cut short would verify as something else
+			X509_free(*leaf);
+			*leaf = NULL;
+			*bad = n;
+			return 0;
+		}
+		if (*leaf == NULL) {
+			*leaf = first;
+			*untrusted = rest;
+			continue;
+		}
+		sk_X509_push(*untrusted, first);
+		while (sk_X509_num(rest) > 0) {
+			sk_X509_push(*untrusted, sk_X509_shift(rest));
+		}
+		sk_X509_free(rest);
+	}
+	return *leaf != NULL;
+}
+
+/* cache key over the chain exactly as presented */
+static int chain_key(lua_State *L, int idx, const struct store_opts *opts, unsigned char *key) {
+	if (!lua_istable(L, idx)) {
+		const char *part = lua_tostring(L, idx);
+		size_t len = lua_objlen(L, idx);
+		return part != NULL && store_key(opts, &part, &len, 1, key);
+	}
+
+	size_t count = lua_objlen(L, idx);
+	const char **parts = lua_newuserdata(L, count * (sizeof(*parts) + sizeof(size_t)));
+	size_t *lens = (size_t *) (parts + count);
+	for (size_t n = 0; n < count; n++) {
+		lua_rawgeti(L, idx, n + 1);
+		parts[n] = lua_type(L, -1) == LUA_TSTRING ? lua_tolstring(L, -1, &lens[n]) : NULL;
+		// the table keeps the string alive
+		lua_pop(L, 1);
+		if (parts[n] == NULL) {
+			lua_pop(L, 1);
+			return 0;
+		}
+	}
+	int rc = store_key(opts, parts, lens, count, key);
+	lua_pop(L, 1);
+	return rc;
+}
+
+/* ------------------------------------------------------------ *
+ * store:add(pem) -> count                                      *
+ * more trust anchors or CRLs (say from crl:full()); results    *
+ * cached before the change are dropped                         *
+ * -------------------------------------------------------------*/
+static int store_add_lua(lua_State *L) {
+	struct store *store = check_store(L, 1);
+	size_t len;
+	const char *pem = luaL_checklstring(L, 2, &len);
+
+	int added = store_add(store, pem, len);
+	if (added < 0) {
+		return push_error(L, "can't add bundle to store");
+	}
+	lua_pushinteger(L, added);
+	return 1;
+}
+
+static int store_stats_lua(lua_State *L) {
+	struct store *store = check_store(L, 1);
+	uint64_t hits, misses;
+	size_t entries;
+
+	store_cache_stats(store, &hits, &misses, &entries);
+	lua_createtable(L, 0, 4);
+	lua_pushnumber(L, entries);
+	lua_setfield(L, -2, "entries");
+	lua_pushnumber(L, hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushnumber(L, misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushnumber(L, __atomic_load_n(&store->generation, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "generation");
+	return 1;
+}
+
+/* ------------------------------------------------------------ *
+ * store:verify(cert_or_chain [, opts])                         *
+ *   -> true, chain_length | false, reason, code, depth         *
+ * cert_or_chain: PEM or DER, leaf first, then intermediates;   *
+ * or a table of such strings, all of which must parse.         *
+ * opts: time, depth, purpose ("sslclient", ...), host,         *
+ * crl_check (true for the leaf, "all" for the whole chain)     *
+ * -------------------------------------------------------------*/
+static int store_verify_lua(lua_State *L) {
+	struct store *store = check_store(L, 1);
+	struct store_opts opts;
+	struct store_result res;
+	X509 *leaf = NULL;
+	STACK_OF(X509) *untrusted = NULL;
+
+	unsigned char key[STORE_KEY_LEN];
+	int keyed = 0;
+
+	check_verify_opts(L, 3, &opts);
+	if (store->cache != NULL) {
+		keyed = chain_key(L, 2, &opts, key);
+	}
+
+	if (! keyed || ! store_lookup(store, key, &res)) {
+		size_t bad;
+		if (! check_chain(L, 2, &leaf, &untrusted, &bad)) {
+			sk_X509_pop_free(untrusted, X509_free);
+			if (bad == 0) {
+				return push_error(L, "can't parse certificate");
+			}
+			lua_pushfstring(L, "can't parse certificate %d of the chain", (int) bad);
+			return push_error(L, lua_tostring(L, -1));
+		}
+		store_verify(store, leaf, untrusted, &opts, keyed ? key : NULL, &res);
+		X509_free(leaf);
+		sk_X509_pop_free(untrusted, X509_free);
+	}
+
+	if (res.ok) {
+		lua_pushboolean(L, 1);
+		lua_pushinteger(L, res.chain_len);
+		return 2;
+	}
+	lua_pushboolean(L, 0);
+	lua_pushstring(L, X509_verify_cert_error_string(res.error));
+	lua_pushinteger(L, res.error);
+	lua_pushinteger(L, res.depth);
+	return 4;
+}
+
+static const struct luaL_Reg StoreMethods[] = {
+	{"verify", store_verify_lua},
+	{"add", store_add_lua},
+	{"stats", store_stats_lua},
+	{"__gc", store_gc},
+	{NULL, NULL}
+};
+
+/* ------------------------------------------------------------ *
+ * core.parse_cert(pem_or_der), core.parse_csr(pem_or_der)      *
+ * Only the ASN.1 parse happens up front: every field below is  *
+ * decoded when it is read, and again on each read.             *
+ * -------------------------------------------------------------*/
+static int is_pem(const char *data, size_t len) {
+	return len > 10 && memcmp(data, "-----BEGIN", 10) == 0;
+}
+
+/* DER of the leading PEM block when its armor is plain, else 0 */
+static int pem_der(const char *data, size_t len, struct der *der) {
+	struct pem_block block;
+
+	return pem_next(data, data + len, NULL, &block) && pem_decode(&block, der);
+}
+
+int parse_cert_lua(lua_State *L) {
+	size_t len;
+	const char *data = luaL_checklstring(L, 1, &len);
+	X509 *crt = NULL;
+	struct der der;
+
+	ca_init();
+	der_init(&der);
+	if (is_pem(data, len) && pem_der(data, len, &der)) {
+		const unsigned char *p = der.buf;
+		crt = d2i_X509(NULL, &p, der.len);
+	} else if (is_pem(data, len)) {
+		BIO *bio = BIO_new_mem_buf(data, len);
+		crt = bio != NULL ? PEM_read_bio_X509(bio, NULL, NULL, NULL) : NULL;
+		BIO_free(bio);
+	} else {
+		const unsigned char *p = (const unsigned char *) data;
+		crt = d2i_X509(NULL, &p, len);
+	}
+	der_free(&der);
+	if (crt == NULL) {
+		ERR_clear_error();
+		return push_error(L, "can't parse certificate");
+	}
+	lua_boxpointer(L, crt);
+	luaL_getmetatable(L, CERT_MT);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static X509_REQ *read_csr(const char *data, size_t len) {
+	X509_REQ *req = NULL;
+	struct der der;
+
+	ca_init();
+	der_init(&der);
+	if (is_pem(data, len) && pem_der(data, len, &der)) {
+		const unsigned char *p = der.buf;
+		req = d2i_X509_REQ(NULL, &p, der.len);
+	} else if (is_pem(data, len)) {
+		BIO *bio = BIO_new_mem_buf(data, len);
+		req = bio != NULL ? PEM_read_bio_X509_REQ(bio, NULL, NULL, NULL) : NULL;
+		BIO_free(bio);
+	} else {
+		const unsigned char *p = (const unsigned char *) data;
+		req = d2i_X509_REQ(NULL, &p, len);
+	}
+	der_free(&der);
+	if (req == NULL) {
+		ERR_clear_error();
+	}
+	return req;
+}
+
+int parse_csr_lua(lua_State *L) {
+	size_t len;
+	const char *data = luaL_checklstring(L, 1, &len);
+
+	X509_REQ *req = read_csr(data, len);
+	if (req == NULL) {
+		return push_error(L, "can't parse certificate request");
+	}
+	lua_boxpointer(L, req);
+	luaL_getmetatable(L, CSR_MT);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int cert_gc(lua_State *L) {
+	void **box = checkudata(L, 1, CERT_MT);
+	X509_free(*box);
+	*box = NULL;
+	return 0;
+}
+
+static int csr_gc(lua_State *L) {
+	void **box = checkudata(L, 1, CSR_MT);
+	X509_REQ_free(*box);
+	*box = NULL;
+	return 0;
+}
+
+/* one of the two is set */
+struct inspected {
+	X509 *crt;
+	X509_REQ *req;
+};
+
+static void push_name(lua_State *L, const X509_NAME *name) {
+	BIO *bio = BIO_new(BIO_s_mem());
+	BUF_MEM *bptr;
+	if (bio == NULL || X509_NAME_print_ex(bio, (X509_NAME *) name, 0, XN_FLAG_RFC2253) < 0) {
+		BIO_free(bio);
+		lua_pushnil(L);
+		return;
+	}
+	BIO_get_mem_ptr(bio, &bptr);
+	lua_pushlstring(L, bptr->data, bptr->length);
+	BIO_free(bio);
+}
+
+static const X509_NAME *subject_of(const struct inspected *obj) {
+	return obj->crt != NULL ? X509_get_subject_name(obj->crt) : X509_REQ_get_subject_name(obj->req);
+}
+
+static int field_subject(lua_State *L, const struct inspected *obj) {
+	push_name(L, subject_of(obj));
+	return 1;
+}
+
+/* last commonName in the subject */
+static int field_cn(lua_State *L, const struct inspected *obj) {
+	const X509_NAME *name = subject_of(obj);
+	int idx = -1, last = -1;
+	unsigned char *utf8;
+
+	while ((idx = X509_NAME_get_index_by_NID((X509_NAME *) name, NID_commonName, idx)) >= 0) {
+		last = idx;
+	}
+	X509_NAME_ENTRY *entry = last >= 0 ? X509_NAME_get_entry(name, last) : NULL;
+	int len = entry != NULL ? ASN1_STRING_to_UTF8(&utf8, X509_NAME_ENTRY_get_data(entry)) : -1;
+	if (len < 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushlstring(L, (const char *) utf8, len);
+	OPENSSL_free(utf8);
+	return 1;
+}
+
+static int field_issuer(lua_State *L, const struct inspected *obj) {
+	push_name(L, X509_get_issuer_name(obj->crt));
+	return 1;
+}
+
+static int field_serial(lua_State *L, const struct inspected *obj) {
+	push_serial(L, X509_get0_serialNumber(obj->crt));
+	return 1;
+}
+
+static void push_time(lua_State *L, const ASN1_TIME *t) {
+	struct tm tm;
+	if (t == NULL || ! ASN1_TIME_to_tm(t, &tm)) {
+		lua_pushnil(L);
+		return;
+	}
+	lua_pushnumber(L, timegm(&tm));
+}
+
+static int field_not_before(lua_State *L, const struct inspected *obj) {
+	push_time(L, X509_get0_notBefore(obj->crt));
+	return 1;
+}
+
+static int field_not_after(lua_State *L, const struct inspected *obj) {
+	push_time(L, X509_get0_notAfter(obj->crt));
+	return 1;
+}
+
+static EVP_PKEY *pubkey_of(const struct inspected *obj) {
+	return obj->crt != NULL ? X509_get0_pubkey(obj->crt) : X509_REQ_get0_pubkey(obj->req);
+}
+
+static int field_key_type(lua_State *L, const struct inspected *obj) {
+	EVP_PKEY *pkey = pubkey_of(obj);
+	const char *type = NULL;
+
+	switch (pkey != NULL ? EVP_PKEY_base_id(pkey) : NID_undef) {
+	case EVP_PKEY_RSA: type = "rsa"; break;
+	case EVP_PKEY_RSA_PSS: type = "rsa-pss"; break;
+	case EVP_PKEY_EC: type = "ec"; break;
+	case EVP_PKEY_DSA: type = "dsa"; break;
+	case EVP_PKEY_ED25519: type = "ed25519"; break;
+	case EVP_PKEY_ED448: type = "ed448"; break;
+	case NID_undef: break;
+	default: type = OBJ_nid2sn(EVP_PKEY_base_id(pkey)); break;
+	}
+	lua_pushstring(L, type);
+	return 1;
+}
+
+static int field_key_bits(lua_State *L, const struct inspected *obj) {
+	EVP_PKEY *pkey = pubkey_of(obj);
+	if (pkey == NULL) {
+		ERR_clear_error();
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushinteger(L, EVP_PKEY_bits(pkey));
+	return 1;
+}
+
+/* the request's extensions are a decoded copy the caller frees */
+static STACK_OF(X509_EXTENSION) *extensions_of(const struct inspected *obj) {
+	if (obj->crt != NULL) {
+		return (STACK_OF(X509_EXTENSION) *) X509_get0_extensions(obj->crt);
+	}
+	STACK_OF(X509_EXTENSION) *exts = X509_REQ_get_extensions(obj->req);
+	ERR_clear_error();
+	return exts;
+}
+
+static void extensions_done(const struct inspected *obj, STACK_OF(X509_EXTENSION) *exts) {
+	if (obj->req != NULL) {
+		sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);
+	}
+}
+
+/* name -> critical */
+static int field_extensions(lua_State *L, const struct inspected *obj) {
+	STACK_OF(X509_EXTENSION) *exts = extensions_of(obj);
+	char oid[80];
+
+	lua_createtable(L, 0, sk_X509_EXTENSION_num(exts));
+	for (int idx = 0; idx < sk_X509_EXTENSION_num(exts); idx++) {
+		X509_EXTENSION *ext = sk_X509_EXTENSION_value(exts, idx);
+		ASN1_OBJECT *obj_id = X509_EXTENSION_get_object(ext);
+		int nid = OBJ_obj2nid(obj_id);
+		if (nid != NID_undef) {
+			lua_pushstring(L, OBJ_nid2sn(nid));
+		} else {
+			OBJ_obj2txt(oid, sizeof(oid), obj_id, 1);
+			lua_pushstring(L, oid);
+		}
+		lua_pushboolean(L, X509_EXTENSION_get_critical(ext));
+		lua_settable(L, -3);
+	}
+	extensions_done(obj, exts);
+	return 1;
+}
+
+/* {"DNS:example.com", "IP:192.0.2.1", "email:a@example.com", "URI:..."} */
+static int field_san(lua_State *L, const struct inspected *obj) {
+	STACK_OF(X509_EXTENSION) *exts = extensions_of(obj);
+	GENERAL_NAMES *names = X509V3_get_d2i(exts, NID_subject_alt_name, NULL, NULL);
+	extensions_done(obj, exts);
+
+	lua_createtable(L, sk_GENERAL_NAME_num(names), 0);
+	for (int idx = 0; idx < sk_GENERAL_NAME_num(names); idx++) {
+		GENERAL_NAME *gen = sk_GENERAL_NAME_value(names, idx);
+		const ASN1_STRING *str = NULL;
+		const char *prefix = NULL;
+		int type;
+		const void *value = GENERAL_NAME_get0_value(gen, &type);
+
+		switch (type) {
+		case GEN_DNS: prefix = "DNS:"; str = value; break;
+		case GEN_EMAIL: prefix = "email:"; str = value; break;
+		case GEN_URI: prefix = "URI:"; str = value; break;
+		case GEN_IPADD: prefix = "IP:"; break;
+		default: continue;
+		}
+
+		if (type == GEN_IPADD) {
+			char text[INET6_ADDRSTRLEN];
+			int len = ASN1_STRING_length(value);
+			if ((len != 4 && len != 16) || ! inet_ntop(len == 4 ? AF_INET : AF_INET6,
+					ASN1_STRING_get0_data(value), text, sizeof(text))) {
+				continue;
+			}
+			lua_pushfstring(L, "%s%s", prefix, text);
+		} else {
+			lua_pushstring(L, prefix);
+			lua_pushlstring(L, (const char *) ASN1_STRING_get0_data(str), ASN1_STRING_length(str));
+			lua_concat(L, 2);
+		}
+		lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+	}
+	GENERAL_NAMES_free(names);
+	return 1;
+}
+
+struct field {
+	const char *name;
+	int (*push)(lua_State *L, const struct inspected *obj);
+};
+
+static const struct field CertFields[] = {
+	{"subject", field_subject},
+	{"cn", field_cn},
+	{"issuer", field_issuer},
+	{"serial", field_serial},
+	{"san", field_san},
+	{"key_type", field_key_type},
+	{"key_bits", field_key_bits},
+	{"extensions", field_extensions},
+	{"not_before", field_not_before},
+	{"not_after", field_not_after},
+	{NULL, NULL}
+};
+
+static const struct field CSRFields[] = {
+	{"subject", field_subject},
+	{"cn", field_cn},
+	{"san", field_san},
+	{"key_type", field_key_type},
+	{"key_bits", field_key_bits},
+	{"extensions", field_extensions},
+	{NULL, NULL}
+};
+
+static int push_field(lua_State *L, const struct field *fields, const struct inspected *obj) {
+	const char *name = lua_tostring(L, 2);
+	for (const struct field *f = fields; name != NULL && f->name != NULL; f++) {
+		if (strcmp(f->name, name) == 0) {
+			return f->push(L, obj);
+		}
+	}
+	lua_pushnil(L);
+	return 1;
+}
+
+static int cert_index(lua_State *L) {
+	struct inspected obj = { lua_unboxpointer(L, 1, CERT_MT), NULL };
+	luaL_argcheck(L, obj.crt != NULL, 1, "certificate already released");
+	return push_field(L, CertFields, &obj);
+}
+
+static int csr_index(lua_State *L) {
+	struct inspected obj = { NULL, lua_unboxpointer(L, 1, CSR_MT) };
+	luaL_argcheck(L, obj.req != NULL, 1, "request already released");
+	return push_field(L, CSRFields, &obj);
+}
+
+static const struct luaL_Reg CertMethods[] = {
+	{"__index", cert_index},
+	{"__gc", cert_gc},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg CSRMethods[] = {
+	{"__index", csr_index},
+	{"__gc", csr_gc},
+	{NULL, NULL}
+};
+
+/* ------------------------------------------------------------ *
+ * core.policy{...} -> policy                                   *
+ *   domains   = {"example.com", ...}  names at or below these  *
+ *   wildcard  = false                 allow "*." leftmost      *
+ *   ips       = {"10.0.0.0/8", ...}   allowed IP SAN ranges    *
+ *   emails    = {"example.com", ...}  email SAN domains        *
+ *   uris      = {"example.com", ...}  URI SAN hosts            *
+ *   check_cn  = true                  CN must pass like a SAN  *
+ *   rsa_min   = 2048, ec_min = 256    key size floors in bits  *
+ * Anything not allowed is rejected: no domains means no DNS    *
+ * names, no ips means no IP addresses, and so on. Keys other   *
+ * than RSA, EC, Ed25519 and Ed448 are refused.                 *
+ * -------------------------------------------------------------*/
+static int policy_list(lua_State *L, int idx, const char *field, struct policy *policy,
+		int (*add)(struct policy *, const char *)) {
+	lua_getfield(L, idx, field);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return 1;
+	}
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	for (size_t n = 1; n <= lua_objlen(L, -1); n++) {
+		lua_rawgeti(L, -1, n);
+		const char *value = lua_tostring(L, -1);
+		int ok = value != NULL && add(policy, value);
+		lua_pop(L, 1);
+		if (!ok) {
+			lua_pop(L, 1);
+			return 0;
+		}
+	}
+	lua_pop(L, 1);
+	return 1;
+}
+
+int policy_new_lua(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	lua_getfield(L, 1, "wildcard");
+	int wildcard = lua_toboolean(L, -1);
+	lua_getfield(L, 1, "check_cn");
+	int check_cn = lua_isnil(L, -1) || lua_toboolean(L, -1);
+	lua_getfield(L, 1, "rsa_min");
+	int rsa_min = luaL_optinteger(L, -1, 2048);
+	lua_getfield(L, 1, "ec_min");
+	int ec_min = luaL_optinteger(L, -1, 256);
+	lua_pop(L, 4);
+
+	struct policy *policy = policy_new(wildcard, check_cn, rsa_min, ec_min);
+	if (policy == NULL) {
+		return luaL_error(L, "can't allocate policy");
+	}
+	// box first so a bad entry below doesn't leak it
+	lua_boxpointer(L, policy);
+	luaL_getmetatable(L, POLICY_MT);
+	lua_setmetatable(L, -2);
+
+	if (! policy_list(L, 1, "domains", policy, policy_add_domain)) {
+		return push_error(L, "bad entry in policy domains");
+	}
+	if (! policy_list(L, 1, "ips", policy, policy_add_cidr)) {
+		return push_error(L, "bad entry in policy ips");
+	}
+	if (! policy_list(L, 1, "emails", policy, policy_add_email_domain)) {
+		return push_error(L, "bad entry in policy emails");
+	}
+	if (! policy_list(L, 1, "uris", policy, policy_add_uri_domain)) {
+		return push_error(L, "bad entry in policy uris");
+	}
+	return 1;
+}
+
+static struct policy *check_policy(lua_State *L, int idx) {
+	struct policy *policy = lua_unboxpointer(L, idx, POLICY_MT);
+	luaL_argcheck(L, policy != NULL, idx, "policy already released");
+	return policy;
+}
+
+static int policy_gc(lua_State *L) {
+	void **box = checkudata(L, 1, POLICY_MT);
+	policy_unref(*box);
+	*box = NULL;
+	return 0;
+}
+
+/* policy:check(csr) -> true | false, reason
+ * csr: PEM, DER or a core.parse_csr() object */
+static int policy_check_lua(lua_State *L) {
+	struct policy *policy = check_policy(L, 1);
+	char why[POLICY_WHY_MAX];
+	X509_REQ *req;
+	int ok;
+
+	if (lua_isuserdata(L, 2)) {
+		req = lua_unboxpointer(L, 2, CSR_MT);
+		luaL_argcheck(L, req != NULL, 2, "request already released");
+		ok = policy_check(policy, req, why, sizeof(why));
+	} else {
+		size_t len;
+		const char *data = luaL_checklstring(L, 2, &len);
+		if (! (req = read_csr(data, len))) {
+			return push_error(L, "can't parse certificate request");
+		}
+		ok = policy_check(policy, req, why, sizeof(why));
+		X509_REQ_free(req);
+	}
+
+	lua_pushboolean(L, ok);
+	if (ok) {
+		return 1;
+	}
+	lua_pushstring(L, why);
+	return 2;
+}
+
+/* ca:set_policy(policy | nil): checked by every later ca:sign */
+static int ca_set_policy_lua(lua_State *L) {
+	struct ca *ca = check_ca(L, 1);
+	ca_set_policy(ca, lua_isnoneornil(L, 2) ? NULL : check_policy(L, 2));
+	return 0;
+}
+
+static const struct luaL_Reg PolicyMethods[] = {
+	{"check", policy_check_lua},
+	{"__gc", policy_gc},
+	{NULL, NULL}
+};
+
+/* ------------------------------------------------------------ *
+ * ca:set_admission{max_csr_bytes, key_types, rsa_max_bits,     *
+ *                  san_max, name_max}                          *
+ * Limits checked before any public-key work in ca:sign. Fields *
+ * left out keep their value, 0 turns a limit off.              *
+ * key_types: {"rsa", "ec", "ed25519", "ed448"}                 *
+ * -------------------------------------------------------------*/
+static const char *const key_type_names[] = { "rsa", "ec", "ed25519", "ed448", NULL };
+
+static int ca_set_admission_lua(lua_State *L) {
+	struct ca *ca = check_ca(L, 1);
+	struct ca_admission lim;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	ca_get_admission(ca, &lim);
+
+	lua_getfield(L, 2, "max_csr_bytes");
+	lim.max_csr_bytes = luaL_optnumber(L, -1, lim.max_csr_bytes);
+	lua_getfield(L, 2, "rsa_max_bits");
+	lim.rsa_max_bits = luaL_optinteger(L, -1, lim.rsa_max_bits);
+	lua_getfield(L, 2, "san_max");
+	lim.san_max = luaL_optinteger(L, -1, lim.san_max);
+	lua_getfield(L, 2, "name_max");
+	lim.name_max = luaL_optinteger(L, -1, lim.name_max);
+	lua_pop(L, 4);
+
+	lua_getfield(L, 2, "key_types");
+	if (!lua_isnil(L, -1)) {
+		luaL_argcheck(L, lua_istable(L, -1), 2, "key_types must be a list");
+		lim.key_types = 0;
+		for (size_t n = 1; n <= lua_objlen(L, -1); n++) {
+			lua_rawgeti(L, -1, n);
+			const char *name = lua_tostring(L, -1);
+			int type = 0;
+			while (key_type_names[type] != NULL && (name == NULL || strcmp(key_type_names[type], name) != 0)) {
+				type++;
+			}
+			luaL_argcheck(L, key_type_names[type] != NULL, 2, "unknown key type in key_types");
+			lim.key_types |= 1u << type;
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+
+	ca_set_admission(ca, &lim);
+	return 0;
+}
+
+/* ca:stats() -> admission and policy counters */
+static int ca_stats_lua(lua_State *L) {
+	struct ca *ca = check_ca(L, 1);
+	const struct ca_stats *st = &ca->stats;
+	uint64_t size = __atomic_load_n(&st->rejected_size, __ATOMIC_RELAXED);
+	uint64_t parse = __atomic_load_n(&st->rejected_parse, __ATOMIC_RELAXED);
+	uint64_t key = __atomic_load_n(&st->rejected_key, __ATOMIC_RELAXED);
+	uint64_t sans = __atomic_load_n(&st->rejected_sans, __ATOMIC_RELAXED);
+	uint64_t name = __atomic_load_n(&st->rejected_name, __ATOMIC_RELAXED);
+	uint64_t renew = __atomic_load_n(&st->rejected_renew, __ATOMIC_RELAXED);
+
+	lua_createtable(L, 0, 9);
+	lua_pushnumber(L, __atomic_load_n(&st->admitted, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "admitted");
+	lua_pushnumber(L, size + parse + key + sans + name + renew);
+	lua_setfield(L, -2, "rejected");
+	lua_pushnumber(L, size);
+	lua_setfield(L, -2, "rejected_size");
+	lua_pushnumber(L, parse);
+	lua_setfield(L, -2, "rejected_parse");
+	lua_pushnumber(L, key);
+	lua_setfield(L, -2, "rejected_key");
+	lua_pushnumber(L, sans);
+	lua_setfield(L, -2, "rejected_sans");
+	lua_pushnumber(L, name);
+	lua_setfield(L, -2, "rejected_name");
+	lua_pushnumber(L, renew);
+	lua_setfield(L, -2, "rejected_renew");
+	lua_pushnumber(L, __atomic_load_n(&st->rejected_policy, __ATOMIC_RELAXED));
+	lua_setfield(L, -2, "rejected_policy");
+
+	struct signer_stats signer;
+	if (signer_get_stats(ca->backend, &signer)) {
+		lua_pushnumber(L, signer.requests);
+		lua_setfield(L, -2, "signer_requests");
+		lua_pushnumber(L, signer.writes);
+		lua_setfield(L, -2, "signer_writes");
+		lua_pushnumber(L, signer.failed);
+		lua_setfield(L, -2, "signer_failed");
+	}
+	return 1;
+}
+
+/* ------------------------------------------------------------ *
+ * ca:sign_async(csr [, opts]) -> job | nil, reason             *
+ * Queues the request on the bounded signing pool and returns   *
+ * at once. opts.deadline: seconds the job may wait for a       *
+ * worker before it is dropped unsigned; opts.priority "high"   *
+ * (renewals) is served before "normal" (new enrollments).      *
+ * ca:renew_async(crt [, opts]) is the same for ca:renew, with  *
+ * its options but into and fd, and priority "high" by default. *
+ * -------------------------------------------------------------*/
+static const char *const lane_names[] = { "high", "normal", NULL };
+
+/* index of opts[field] in names, def when absent */
+static int opt_field_option(lua_State *L, int idx, const char *field, int def, const char *const names[]) {
+	lua_getfield(L, idx, field);
+	const char *name = lua_tostring(L, -1);
+	if (name != NULL) {
+		for (def = 0; names[def] != NULL && strcmp(names[def], name) != 0; def++) {
+		}
+		luaL_argcheck(L, names[def] != NULL, idx, lua_pushfstring(L, "invalid %s '%s'", field, name));
+	}
+	lua_pop(L, 1);
+	return def;
+}
+
+/* deadline and priority of the options at idx */
+static void check_queue_opts(lua_State *L, int idx, int *lane, uint64_t *deadline) {
+	*deadline = 0;
+	if (!lua_isnoneornil(L, idx)) {
+		luaL_checktype(L, idx, LUA_TTABLE);
+		lua_getfield(L, idx, "deadline");
+		if (!lua_isnil(L, -1)) {
+			lua_Number secs = luaL_checknumber(L, -1);
+			luaL_argcheck(L, secs > 0, idx, "deadline must be positive");
+			*deadline = pool_now() + (uint64_t) (secs * 1e9);
+		}
+		lua_pop(L, 1);
+		*lane = opt_field_option(L, idx, "priority", *lane, lane_names);
+	}
+}
+
+/* queues job, consumed either way, and pushes its handle */
+static int push_submitted_job(lua_State *L, struct sign_job *job, int lane, uint64_t deadline) {
+	const char *why;
+
+	if (job == NULL) {
+		return push_error(L, "out of memory");
+	}
+	if (! sign_submit(job, lane, deadline, &why)) {
+		sign_job_unref(job);
+		return push_error(L, why);
+	}
+	lua_boxpointer(L, job);
+	luaL_getmetatable(L, JOB_MT);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int ca_sign_async_lua(lua_State *L) {
+	struct ca *ca = check_ca(L, 1);
+	size_t csr_len;
+	const char *csr = luaL_checklstring(L, 2, &csr_len);
+	int lane = POOL_LANE_NORMAL;
+	uint64_t deadline;
+
+	check_queue_opts(L, 3, &lane, &deadline);
+	return push_submitted_job(L, sign_job_new(ca, csr, csr_len), lane, deadline);
+}
+
+static int ca_renew_async_lua(lua_State *L) {
+	struct ca *ca = check_ca(L, 1);
+	size_t crt_len;
+	const char *crt = luaL_checklstring(L, 2, &crt_len);
+	int lane = POOL_LANE_HIGH;
+	uint64_t deadline;
+	struct ca_profile profile;
+	long grace;
+
+	check_queue_opts(L, 3, &lane, &deadline);
+	check_renew_opts(L, 3, &profile, &grace);
+	return push_submitted_job(L, sign_renew_job_new(ca, crt, crt_len, &profile, grace), lane, deadline);
+}
+
+static struct sign_job *check_job(lua_State *L, int idx) {
+	struct sign_job *job = lua_unboxpointer(L, idx, JOB_MT);
+	luaL_argcheck(L, job != NULL, idx, "sign job already released");
+	return job;
+}
+
+static int job_gc(lua_State *L) {
+	void **box = checkudata(L, 1, JOB_MT);
+	sign_job_unref(*box);
+	*box = NULL;
+	return 0;
+}
+
+/* pem, serial | nil, reason; call once done */
+static int push_job_result(lua_State *L, struct sign_job *job) {
+	if (job->pem == NULL) {
+		return push_error(L, job->why);
+	}
+	lua_pushlstring(L, job->pem, job->pem_len);
+	lua_pushstring(L, job->serial);
+	return 2;
+}
+
+/* job:done() -> boolean */
+static int job_done_lua(lua_State *L) {
+	lua_pushboolean(L, sign_job_done(check_job(L, 1)));
+	return 1;
+}
+
+/* job:result() -> pem, serial | nil, reason; "pending" until done */
+static int job_result_lua(lua_State *L) {
+	struct sign_job *job = check_job(L, 1);
+	if (! sign_job_done(job)) {
+		return push_error(L, "pending");
+	}
+	return push_job_result(L, job);
+}
+
+/* job:wait() -> pem, serial | nil, reason; blocks until done */
+static int job_wait_lua(lua_State *L) {
+	struct sign_job *job = check_job(L, 1);
+	sign_job_wait(job);
+	return push_job_result(L, job);
+}
+
+static const struct luaL_Reg JobMethods[] = {
+	{"done", job_done_lua},
+	{"result", job_result_lua},
+	{"wait", job_wait_lua},
+	{"__gc", job_gc},
+	{NULL, NULL}
+};
+
+/* ------------------------------------------------------------ *
+ * core.sign_queue([{limit = n}]) -> signing queue metrics      *
+ * limit bounds the queued jobs (0 = unbounded); past it        *
+ * ca:sign_async fails with "signing queue full".               *
+ * -------------------------------------------------------------*/
+int sign_queue_lua(lua_State *L) {
+	struct pool *pool = pool_sign();
+	struct pool_stats st;
+	size_t queued[POOL_LANES], limit;
+
+	if (pool == NULL) {
+		return luaL_error(L, "can't start signing pool");
+	}
+	if (!lua_isnoneornil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		lua_getfield(L, 1, "limit");
+		if (!lua_isnil(L, -1)) {
+			lua_Number n = luaL_checknumber(L, -1);
+			luaL_argcheck(L, n >= 0, 1, "limit must not be negative");
+			pool_set_limit(pool, n);
+		}
+		lua_pop(L, 1);
+	}
+
+	pool_get_stats(pool, &st, queued, &limit);
+	uint64_t dequeued = st.completed + st.expired;
+	lua_createtable(L, 0, 12);
+	lua_pushnumber(L, queued[POOL_LANE_HIGH] + queued[POOL_LANE_NORMAL]);
+	lua_setfield(L, -2, "queued");
+	lua_pushnumber(L, queued[POOL_LANE_HIGH]);
+	lua_setfield(L, -2, "queued_high");
+	lua_pushnumber(L, queued[POOL_LANE_NORMAL]);
+	lua_setfield(L, -2, "queued_normal");
+	lua_pushnumber(L, limit);
+	lua_setfield(L, -2, "limit");
+	lua_pushnumber(L, pool->nthreads);
+	lua_setfield(L, -2, "workers");
+	lua_pushnumber(L, st.submitted);
+	lua_setfield(L, -2, "submitted");
+	lua_pushnumber(L, st.completed);
+	lua_setfield(L, -2, "completed");
+	lua_pushnumber(L, st.expired);
+	lua_setfield(L, -2, "expired");
+	lua_pushnumber(L, st.shed);
+	lua_setfield(L, -2, "shed");
+	lua_pushnumber(L, dequeued ? st.wait_ns / dequeued / 1e6 : 0);
+	lua_setfield(L, -2, "wait_avg_ms");
+	lua_pushnumber(L, st.wait_max_ns / 1e6);
+	lua_setfield(L, -2, "wait_max_ms");
+	return 1;
+}
+
+/* ------------------------------------------------------------ *
+ * Coalescing: ca:coalesce{window_us = 200, max = 32} makes     *
+ * ca:sign called from a coroutine queue the request and yield. *
+ * Requests gathered within the window, or max of them, go to   *
+ * the signing pool as one batch; ca:tick() from the event loop *
+ * dispatches due batches and resumes each coroutine with its   *
+ * own pem, serial or nil, reason. Calls from the main thread   *
+ * sign synchronously as before. The yield crosses no C call    *
+ * boundary, so ca:sign must not run under pcall on Lua 5.1.    *
+ * -------------------------------------------------------------*/
+struct coalesce_item {
+	struct sign_job *job;
+	int thread;		/* registry ref of the waiting coroutine */
+};
+
+struct coalescer {
+	struct ca *ca;
+	uint64_t window_ns;
+	size_t max;
+	int resume;		/* registry ref of the resume hook, or LUA_NOREF */
+	uint64_t first_at;	/* when the oldest undispatched item came in */
+	size_t dispatched;	/* items[0..dispatched) are with the pool */
+	size_t count;
+	size_t cap;
+	struct coalesce_item *items;
+	uint64_t batches;
+	uint64_t coalesced;
+};
+
+/* the CA's coalescer on top of the stack, or NULL pushing nothing */
+static struct coalescer *get_coalescer(lua_State *L, int ca_idx) {
+	lua_getfield(L, LUA_REGISTRYINDEX, COALESCE_KEY);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return NULL;
+	}
+	lua_pushvalue(L, ca_idx);
+	lua_rawget(L, -2);
+	lua_remove(L, -2);
+	struct coalescer *co = lua_touserdata(L, -1);
+	if (co == NULL) {
+		lua_pop(L, 1);
+	}
+	return co;
+}
+
+/* hands the undispatched items to the pool as one batch */
+static void coalesce_dispatch(struct coalescer *co) {
+	size_t count = co->count - co->dispatched;
+	const char *why;
+
+	if (count == 0) {
+		return;
+	}
+	struct sign_job **jobs = malloc(count * sizeof(*jobs));
+	for (size_t idx = 0; jobs != NULL && idx < count; idx++) {
+		jobs[idx] = co->items[co->dispatched + idx].job;
+	}
+	if (jobs == NULL || ! sign_submit_batch(jobs, count, POOL_LANE_NORMAL, 0, &why)) {
+		for (size_t idx = co->dispatched; idx < co->count; idx++) {
+			sign_job_fail(co->items[idx].job, jobs == NULL ? "out of memory" : why);
+		}
+	} else {
+		co->batches++;
+		co->coalesced += count;
+	}
+	free(jobs);
+	co->dispatched = co->count;
+}
+
+/* puts finished items back in front, for the next tick to resume */
+static void coalesce_requeue(lua_State *L, struct coalescer *co, const struct coalesce_item *items, size_t count) {
+	if (co->count + count > co->cap) {
+		struct coalesce_item *grown = realloc(co->items, (co->count + count) * sizeof(*grown));
+		if (grown == NULL) {
+			// nowhere to keep them: the coroutines are abandoned
+			for (size_t idx = 0; idx < count; idx++) {
+				luaL_unref(L, LUA_REGISTRYINDEX, items[idx].thread);
+				sign_job_unref(items[idx].job);
+			}
+			return;
+		}
+		co->items = grown;
+		co->cap = co->count + count;
+	}
+	memmove(&co->items[count], &co->items[0], co->count * sizeof(co->items[0]));
+	memcpy(&co->items[0], items, count * sizeof(items[0]));
+	co->dispatched += count;
+	co->count += count;
+}
+
+/* ------------------------------------------------------------ *
+ * Resumes the coroutines whose job is done, returns how many.  *
+ * The finished items leave co->items before the first resume: *
+ * a coroutine or the hook may tick or flush this CA again, and *
+ * must find only what is still waiting.                        *
+ * -------------------------------------------------------------*/
+static int coalesce_resume(lua_State *L, struct coalescer *co, int wait) {
+	size_t kept = 0, ready = 0;
+
+	if (co->dispatched == 0) {
+		return 0;
+	}
+	// userdata: nothing to free if a resume raises
+	struct coalesce_item *done = lua_newuserdata(L, co->dispatched * sizeof(*done));
+	for (size_t idx = 0; idx < co->dispatched; idx++) {
+		struct coalesce_item item = co->items[idx];
+		if (wait) {
+			sign_job_wait(item.job);
+		} else if (! sign_job_done(item.job)) {
+			co->items[kept++] = item;
+			continue;
+		}
+		done[ready++] = item;
+	}
+	memmove(&co->items[kept], &co->items[co->dispatched], (co->count - co->dispatched) * sizeof(co->items[0]));
+	co->count -= co->dispatched - kept;
+	co->dispatched = kept;
+
+	for (size_t idx = 0; idx < ready; idx++) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, done[idx].thread);
+		lua_State *thread = lua_tothread(L, -1);
+		luaL_unref(L, LUA_REGISTRYINDEX, done[idx].thread);
+		int nres = push_job_result(thread, done[idx].job);
+		sign_job_unref(done[idx].job);
+
+		int status;
+		if (co->resume != LUA_NOREF) {
+			// hook(co, results...) lets the application's scheduler wake it
+			lua_rawgeti(L, LUA_REGISTRYINDEX, co->resume);
+			lua_pushvalue(L, -2);
+			lua_xmove(thread, L, nres);
+			if ((status = lua_pcall(L, nres + 1, 0, 0)) != 0) {
+				coalesce_requeue(L, co, &done[idx + 1], ready - idx - 1);
+				return lua_error(L);
+			}
+		} else if ((status = resume_thread(L, thread, nres)) != 0 && status != LUA_YIELD) {
+			// the rest wait for the next tick; then the coroutine's error
+			coalesce_requeue(L, co, &done[idx + 1], ready - idx - 1);
+			lua_xmove(thread, L, 1);
+			return lua_error(L);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	return ready;
+}
+
+/* ca:sign in coalescing mode, called from a coroutine */
+static int coalesce_sign(lua_State *L, struct coalescer *co, const char *csr, size_t csr_len) {
+	if (co->count == co->cap) {
+		size_t cap = co->cap ? co->cap * 2 : 32;
+		struct coalesce_item *items = realloc(co->items, cap * sizeof(*items));
+		if (items == NULL) {
+			return push_error(L, "out of memory");
+		}
+		co->items = items;
+		co->cap = cap;
+	}
+	struct sign_job *job = sign_job_new(co->ca, csr, csr_len);
+	if (job == NULL) {
+		return push_error(L, "out of memory");
+	}
+
+	lua_pushthread(L);
+	co->items[co->count].thread = luaL_ref(L, LUA_REGISTRYINDEX);
+	co->items[co->count].job = job;
+	if (co->count++ == co->dispatched) {
+		co->first_at = pool_now();
+	}
+	if (co->count - co->dispatched >= co->max) {
+		coalesce_dispatch(co);
+	}
+	return lua_yield(L, 0);
+}
+
+static int coalescer_gc(lua_State *L) {
+	struct coalescer *co = luaL_checkudata(L, 1, COALESCE_MT);
+	// waiting coroutines are abandoned with their coalescer
+	for (size_t idx = 0; idx < co->count; idx++) {
+		luaL_unref(L, LUA_REGISTRYINDEX, co->items[idx].thread);
+		sign_job_unref(co->items[idx].job);
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, co->resume);
+	free(co->items);
+	ca_unref(co->ca);
+	co->items = NULL;
+	co->count = co->dispatched = 0;
+	co->ca = NULL;
+	return 0;
+}
+
+/* ------------------------------------------------------------ *
+ * ca:coalesce{window_us, max [, resume]} | ca:coalesce(false)  *
+ * resume(co, ...) replaces coroutine.resume for schedulers     *
+ * that must wake their own coroutines. Turning it off flushes. *
+ * -------------------------------------------------------------*/
+static int ca_flush_lua(lua_State *L);
+
+static int ca_coalesce_lua(lua_State *L) {
+	struct ca *ca = check_ca(L, 1);
+
+	if (get_coalescer(L, 1) != NULL) {
+		// the old one finishes its work before it is replaced
+		lua_pop(L, 1);
+		lua_pushcfunction(L, ca_flush_lua);
+		lua_pushvalue(L, 1);
+		lua_call(L, 1, 0);
+	}
+
+	lua_getfield(L, LUA_REGISTRYINDEX, COALESCE_KEY);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_createtable(L, 0, 1);
+		lua_pushliteral(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, COALESCE_KEY);
+	}
+	lua_pushvalue(L, 1);
+
+	if (lua_isboolean(L, 2) && !lua_toboolean(L, 2)) {
+		lua_pushnil(L);
+		lua_rawset(L, -3);
+		return 0;
+	}
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_getfield(L, 2, "window_us");
+	lua_Number window = luaL_optnumber(L, -1, 200);
+	lua_getfield(L, 2, "max");
+	lua_Integer max = luaL_optinteger(L, -1, 32);
+	lua_pop(L, 2);
+	luaL_argcheck(L, window >= 0 && max > 0, 2, "window_us and max must be positive");
+
+	struct coalescer *co = lua_newuserdata(L, sizeof(*co));
+	memset(co, 0, sizeof(*co));
+	co->resume = LUA_NOREF;
+	co->window_ns = window * 1000;
+	co->max = max;
+	co->ca = ca_ref(ca);
+	luaL_getmetatable(L, COALESCE_MT);
+	lua_setmetatable(L, -2);
+
+	lua_getfield(L, 2, "resume");
+	if (!lua_isnil(L, -1)) {
+		luaL_checktype(L, -1, LUA_TFUNCTION);
+		co->resume = luaL_ref(L, LUA_REGISTRYINDEX);
+	} else {
+		lua_pop(L, 1);
+	}
+	lua_rawset(L, -3);
+	return 0;
+}
+
+/* ca:tick() -> resumed, seconds until the next batch is due | nil */
+static int ca_tick_lua(lua_State *L) {
+	check_ca(L, 1);
+	struct coalescer *co = get_coalescer(L, 1);
+	if (co == NULL) {
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+
+	if (co->count > co->dispatched && pool_now() - co->first_at >= co->window_ns) {
+		coalesce_dispatch(co);
+	}
+	lua_pushinteger(L, coalesce_resume(L, co, 0));
+	if (co->count == co->dispatched) {
+		return 1;
+	}
+	uint64_t elapsed = pool_now() - co->first_at;
+	lua_pushnumber(L, elapsed >= co->window_ns ? 0 : (co->window_ns - elapsed) / 1e9);
+	return 2;
+}
+
+/* ca:flush() -> resumed; dispatches now and waits for every job */
+static int ca_flush_lua(lua_State *L) {
+	check_ca(L, 1);
+	struct coalescer *co = get_coalescer(L, 1);
+	int resumed = 0;
+	// resumed coroutines may queue more
+	while (co != NULL && co->count > 0) {
+		coalesce_dispatch(co);
+		resumed += coalesce_resume(L, co, 1);
+	}
+	lua_pushinteger(L, resumed);
+	return 1;
+}
+
+/* ------------------------------------------------------------ *
+ * ca:verify(crt) -> true | nil, reason                         *
+ * Issued by this CA, within its validity and not revoked on    *
+ * its CRL. crt is PEM or DER.                                  *
+ * -------------------------------------------------------------*/
+static int ca_verify_lua(lua_State *L) {
+	struct ca *ca = check_ca(L, 1);
+	size_t len;
+	const char *data = luaL_checklstring(L, 2, &len);
+	STACK_OF(X509) *untrusted = NULL;
+	X509 *crt = NULL;
+	const char *why = NULL;
+
+	if (! store_parse_chain(data, len, &crt, &untrusted)) {
+		ERR_clear_error();
+		return push_error(L, "can't read certificate");
+	}
+	int ok = ca_check_crt(ca, crt, &why);
+	sk_X509_pop_free(untrusted, X509_free);
+	X509_free(crt);
+	if (! ok) {
+		return push_error(L, why);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/* ------------------------------------------------------------ *
+ * core.cad_connect(socket_path, ca_name) -> client | nil, why  *
+ * Thin client of the CA daemon (cadd), shaped like a CA handle *
+ * so callers can sign in process or through the daemon alike:  *
+ *   client:sign(csr) -> crt, serial | nil, reason              *
+ *   client:sign_many({csr, ...}) -> crts, serials              *
+ *   client:verify(crt) -> true | nil, reason                   *
+ *   client:revoke(serial [, reason]) -> true | nil, reason     *
+ * sign_many sends every request in one write and collects the  *
+ * replies as they come; a failed one is false in crts and its  *
+ * reason in serials. A broken connection is closed for good.   *
+ * -------------------------------------------------------------*/
+struct cad_handle {
+	struct cad_client client;
+	size_t name_len;
+	char name[256];
+};
+
+static struct cad_handle *check_cad(lua_State *L, int idx) {
+	struct cad_handle *cad = luaL_checkudata(L, idx, CAD_MT);
+	luaL_argcheck(L, cad->client.fd >= 0, idx, "CA daemon connection closed");
+	return cad;
+}
+
+static int cad_connect_lua(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	size_t name_len;
+	const char *name = luaL_checklstring(L, 2, &name_len);
+	luaL_argcheck(L, name_len < sizeof(((struct cad_handle *) NULL)->name), 2, "CA name too long");
+
+	struct cad_handle *cad = lua_newuserdata(L, sizeof(*cad));
+	memcpy(cad->name, name, name_len);
+	cad->name_len = name_len;
+	if (! cad_client_open(&cad->client, path)) {
+		return push_errno(L, "can't connect to the CA daemon");
+	}
+	luaL_getmetatable(L, CAD_MT);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+/* the transport failed: nothing more can be matched up on it */
+static int cad_broken(lua_State *L, struct cad_handle *cad) {
+	lua_pushnil(L);
+	lua_pushfstring(L, "CA daemon connection: %s", strerror(errno));
+	cad_client_close(&cad->client);
+	return 2;
+}
+
+/* sends count frames, ids from the returned one on, 0 on failure */
+static int cad_send(struct cad_handle *cad, unsigned char op, const void *const *bodies,
+		const size_t *lens, size_t count, uint32_t *first) {
+	struct der out;
+
+	der_init(&out);
+	*first = cad->client.next_id;
+	for (size_t idx = 0; idx < count; idx++) {
+		cad_put_frame(&out, cad->client.next_id++, op, 0, cad->name, cad->name_len, bodies[idx], lens[idx]);
+	}
+	int ok = cad_client_send(&cad->client, &out);
+	der_free(&out);
+	return ok;
+}
+
+/* one request, its reply in frame; pushes the error on failure */
+static int cad_call(lua_State *L, struct cad_handle *cad, unsigned char op, const void *body, size_t len,
+		struct cad_frame *frame) {
+	uint32_t id;
+
+	if (! cad_send(cad, op, &body, &len, 1, &id)) {
+		return cad_broken(L, cad);
+	}
+	do {
+		if (! cad_client_next(&cad->client, frame)) {
+			return cad_broken(L, cad);
+		}
+	} while (frame->id != id);
+	if (frame->status != CAD_OK) {
+		lua_pushnil(L);
+		lua_pushlstring(L, (const char *) frame->body, frame->len);
+		return 2;
+	}
+	return 0;
+}
+
+/* sign reply body: u8 n, serial hex, PEM */
+static void push_cad_signed(lua_State *L, const struct cad_frame *frame) {
+	size_t n = frame->len > 0 ? frame->body[0] : 0;
+	if (n + 1 > frame->len) {
+		n = frame->len > 0 ? frame->len - 1 : 0;
+	}
+	const unsigned char *pem = frame->body + 1 + n;
+	lua_pushlstring(L, (const char *) pem, frame->len - (pem - frame->body));
+	lua_pushlstring(L, (const char *) frame->body + 1, n);
+}
+
+static int cad_sign_lua(lua_State *L) {
+	struct cad_handle *cad = check_cad(L, 1);
+	size_t len;
+	const char *csr = luaL_checklstring(L, 2, &len);
+	struct cad_frame frame;
+
+	int rc = cad_call(L, cad, CAD_OP_SIGN, csr, len, &frame);
+	if (rc > 0) {
+		return rc;
+	}
+	push_cad_signed(L, &frame);
+	return 2;
+}
+
+static int cad_sign_many_lua(lua_State *L) {
+	struct cad_handle *cad = check_cad(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	size_t count = lua_objlen(L, 2);
+	const void **bodies = lua_newuserdata(L, count * (sizeof(*bodies) + sizeof(size_t)) + 1);
+	size_t *lens = (size_t *) (bodies + count);
+	uint32_t first;
+
+	for (size_t idx = 0; idx < count; idx++) {
+		lua_rawgeti(L, 2, idx + 1);
+		bodies[idx] = lua_tolstring(L, -1, &lens[idx]);
+		luaL_argcheck(L, bodies[idx] != NULL, 2, "requests must be strings");
+		lua_pop(L, 1);
+	}
+	if (! cad_send(cad, CAD_OP_SIGN, bodies, lens, count, &first)) {
+		return cad_broken(L, cad);
+	}
+
+	lua_createtable(L, count, 0);
+	lua_createtable(L, count, 0);
+	for (size_t done = 0; done < count; ) {
+		struct cad_frame frame;
+		if (! cad_client_next(&cad->client, &frame)) {
+			return cad_broken(L, cad);
+		}
+		uint32_t idx = frame.id - first;
+		if (idx >= count) {
+			continue;
+		}
+		if (frame.status == CAD_OK) {
+			push_cad_signed(L, &frame);
+		} else {
+			lua_pushboolean(L, 0);
+			lua_pushlstring(L, (const char *) frame.body, frame.len);
+		}
+		lua_rawseti(L, -3, idx + 1);
+		lua_rawseti(L, -3, idx + 1);
+		done++;
+	}
+	return 2;
+}
+
+static int cad_verify_lua(lua_State *L) {
+	struct cad_handle *cad = check_cad(L, 1);
+	size_t len;
+	const char *crt = luaL_checklstring(L, 2, &len);
+	struct cad_frame frame;
+
+	int rc = cad_call(L, cad, CAD_OP_VERIFY, crt, len, &frame);
+	if (rc > 0) {
+		return rc;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int cad_revoke_lua(lua_State *L) {
+	struct cad_handle *cad = check_cad(L, 1);
+	unsigned char body[1 + CA_SERIAL_MAX];
+	size_t len = check_serial(L, 2, body + 1);
+	int reason = check_reason(L, 3, CRL_REASON_NONE);
+	struct cad_frame frame;
+
+	body[0] = reason == CRL_REASON_NONE ? CAD_NO_REASON : reason;
+	int rc = cad_call(L, cad, CAD_OP_REVOKE, body, 1 + len, &frame);
+	if (rc > 0) {
+		return rc;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int cad_close_lua(lua_State *L) {
+	struct cad_handle *cad = luaL_checkudata(L, 1, CAD_MT);
+	cad_client_close(&cad->client);
+	return 0;
+}
+
+static const struct luaL_Reg MintMethods[] = {
+	{"take", mint_take_lua},
+	{"stats", mint_stats_lua},
+	{"close", mint_close_lua},
+	{"__gc", mint_close_lua},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg CoalescerMethods[] = {
+	{"__gc", coalescer_gc},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg CAMethods[] = {
+	{"sign", ca_sign_lua},
+	{"sign_into", ca_sign_into_lua},
+	{"sign_to_fd", ca_sign_to_fd_lua},
+	{"renew", ca_renew_lua},
+	{"issue", ca_issue_lua},
+	{"mint", ca_mint_lua},
+	{"prepare", ca_prepare_lua},
+	{"finish", ca_finish_lua},
+	{"signature", ca_signature_lua},
+	{"verify", ca_verify_lua},
+	{"crl", ca_crl_lua},
+	{"ocsp", ca_ocsp_lua},
+	{"set_policy", ca_set_policy_lua},
+	{"set_admission", ca_set_admission_lua},
+	{"sign_async", ca_sign_async_lua},
+	{"renew_async", ca_renew_async_lua},
+	{"coalesce", ca_coalesce_lua},
+	{"tick", ca_tick_lua},
+	{"flush", ca_flush_lua},
+	{"stats", ca_stats_lua},
+	{"__gc", ca_gc},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg CADMethods[] = {
+	{"sign", cad_sign_lua},
+	{"sign_many", cad_sign_many_lua},
+	{"verify", cad_verify_lua},
+	{"revoke", cad_revoke_lua},
+	{"close", cad_close_lua},
+	{"__gc", cad_close_lua},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg BufferMethods[] = {
+	{"len", buffer_len_lua},
+	{"tostring", buffer_tostring_lua},
+	{"clear", buffer_clear_lua},
+	{"write", buffer_write_lua},
+	{"__len", buffer_len_lua},
+	{"__tostring", buffer_tostring_lua},
+	{"__gc", buffer_gc},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg CRLMethods[] = {
+	{"revoke", crl_revoke_lua},
+	{"unrevoke", crl_unrevoke_lua},
+	{"status", crl_status_lua},
+	{"count", crl_count_lua},
+	{"full", crl_full_lua},
+	{"delta", crl_delta_lua},
+	{"__gc", crl_gc},
+	{NULL, NULL}
+};
+
+/* metatable that is also its own __index */
+static void new_class(lua_State *L, const char *name, const luaL_Reg *methods) {
+	luaL_newmetatable(L, name);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, methods, 0);
+	lua_pop(L, 1);
+}
+
+/* ------------------------------------------------------------ *
+ * core.prefork() -> count of CAs warmed; call in the master    *
+ * after registering the CAs and before forking the workers     *
+ * -------------------------------------------------------------*/
+static int prefork_lua(lua_State *L) {
+	ca_init();
+	lua_pushinteger(L, ca_prefork());
+	return 1;
+}
+
+/* core.postfork() -> true; call first thing in each worker */
+static int postfork_lua(lua_State *L) {
+	ca_postfork();
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/* ------------------------------------------------------------ *
+ * core.b64encode(data[, wrap]) -> base64, with a line break    *
+ * every 64 columns when wrap is true                           *
+ * -------------------------------------------------------------*/
+static int b64encode_lua(lua_State *L) {
+	size_t len;
+	const unsigned char *data = (const unsigned char *) luaL_checklstring(L, 1, &len);
+	int wrap = lua_toboolean(L, 2);
+
+	size_t out_len = B64_ENCODED_LEN(len) + (wrap ? (len + 47) / 48 : 0);
+	char *out = malloc(out_len + 1);
+	if (out == NULL) {
+		return push_error(L, "out of memory");
+	}
+	char *p = out;
+	if (wrap) {
+		for (size_t off = 0; off < len; off += 48) {
+			p += b64_encode(data + off, len - off < 48 ? len - off : 48, p);
+			*p++ = '\n';
+		}
+	} else {
+		p += b64_encode(data, len, p);
+	}
+	lua_pushlstring(L, out, p - out);
+	free(out);
+	return 1;
+}
+
+/* core.b64decode(text) -> data, line breaks allowed */
+static int b64decode_lua(lua_State *L) {
+	size_t len;
+	const char *text = luaL_checklstring(L, 1, &len);
+
+	unsigned char *out = malloc(B64_DECODED_MAX(len));
+	if (out == NULL) {
+		return push_error(L, "out of memory");
+	}
+	long out_len = b64_decode(text, len, out);
+	if (out_len < 0) {
+		free(out);
+		return push_error(L, "invalid base64");
+	}
+	lua_pushlstring(L, (const char *) out, out_len);
+	free(out);
+	return 1;
+}
+
+/* ------------------------------------------------------------ *
+ * core.b64codec([name]) -> the coder in use, "avx2", "ssse3"   *
+ * or "scalar"; with a name, switches to it first, or returns   *
+ * nil, message when this CPU or build lacks it                 *
+ * -------------------------------------------------------------*/
+static int b64codec_lua(lua_State *L) {
+	const char *name = luaL_optstring(L, 1, NULL);
+	if (name != NULL && ! b64_use(name)) {
+		return push_error(L, "base64 coder not supported here");
+	}
+	lua_pushstring(L, b64_impl());
+	return 1;
+}
+
+/* ------------------------------------------------------------ *
+ * core.memstats() -> table with libcrypto allocation counters  *
+ * and signing success/error counts, for soak and leak checks   *
+ * -------------------------------------------------------------*/
+int memstats_get(lua_State *L) {
+	size_t capi_signs, capi_sign_errors;
+	core_ca_sign_counts(&capi_signs, &capi_sign_errors);
+
+	lua_createtable(L, 0, 9);
+	lua_pushboolean(L, memstats.tracking);
+	lua_setfield(L, -2, "tracking");
+	lua_pushnumber(L, STAT_GET(allocs));
+	lua_setfield(L, -2, "allocs");
+	lua_pushnumber(L, STAT_GET(frees));
+	lua_setfield(L, -2, "frees");
+	lua_pushnumber(L, STAT_GET(allocs) - STAT_GET(frees));
+	lua_setfield(L, -2, "live_allocs");
+	lua_pushnumber(L, STAT_GET(live_bytes));
+	lua_setfield(L, -2, "live_bytes");
+	lua_pushnumber(L, STAT_GET(peak_bytes));
+	lua_setfield(L, -2, "peak_bytes");
+	lua_pushnumber(L, STAT_GET(signs) + capi_signs);
+	lua_setfield(L, -2, "signs");
+	lua_pushnumber(L, STAT_GET(sign_errors) + capi_sign_errors);
+	lua_setfield(L, -2, "sign_errors");
+	lua_pushnumber(L, STAT_GET(rejected));
+	lua_setfield(L, -2, "rejected");
+	return 1;
+}
+
 // Register library using this array
 static const struct luaL_Reg OpenSSLLib[] = {
 //    {"gen_rsa_key", gen_rsa_key},
@@ -333,11 +3138,44 @@ static const struct luaL_Reg OpenSSLLib[] = {
 //    {"gen_crt", gen_crt},
 	{"init_crypto", init_crypto},
     {"csr_crt", csr_crt},
+    {"memstats", memstats_get},
+    {"ca_new", ca_new_lua},
+    {"ca_remote", ca_remote_lua},
+    {"ca_public", ca_public_lua},
+    {"cad_connect", cad_connect_lua},
+    {"ca_register", ca_register_lua},
+    {"ca_get", ca_get_lua},
+    {"ca_unregister", ca_unregister_lua},
+    {"new_store", new_store_lua},
+    {"parse_cert", parse_cert_lua},
+    {"parse_csr", parse_csr_lua},
+    {"policy", policy_new_lua},
+    {"sign_queue", sign_queue_lua},
+    {"sign_multi", sign_multi_lua},
+    {"prefork", prefork_lua},
+    {"postfork", postfork_lua},
+    {"b64encode", b64encode_lua},
+    {"b64decode", b64decode_lua},
+    {"b64codec", b64codec_lua},
+    {"buffer", buffer_new_lua},
     {NULL, NULL}
 };
 
 // LUALIB_API int luaopen_openssl_core(lua_State *L) {
 LUALIB_API int luaopen_core(lua_State *L) {
+  memstats_install();
+  new_class(L, CA_MT, CAMethods);
+  new_class(L, CRL_MT, CRLMethods);
+  new_class(L, OCSP_MT, OCSPMethods);
+  new_class(L, STORE_MT, StoreMethods);
+  new_class(L, CERT_MT, CertMethods);
+  new_class(L, CSR_MT, CSRMethods);
+  new_class(L, POLICY_MT, PolicyMethods);
+  new_class(L, JOB_MT, JobMethods);
+  new_class(L, COALESCE_MT, CoalescerMethods);
+  new_class(L, BUFFER_MT, BufferMethods);
+  new_class(L, CAD_MT, CADMethods);
+  new_class(L, MINT_MT, MintMethods);
   luaL_newlib(L, OpenSSLLib);
   return 1;
 }
@@ -0,0 +1,361 @@
+/*
+// Incremental CRL builder: revoked serials live in one sorted array with
+// their revokedCertificates encoding cached, so a new CRL is a memcpy of
+// the cached entries plus one signature. Delta CRLs carry the entries
+// changed since the last full CRL (RFC 5280 5.2.4).
+// https://tools.ietf.org/html/rfc5280#section-5
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/err.h>
+
+#include "crl.h"
+
+static const unsigned char OID_AUTHORITY_KEY_ID[] = { 0x55, 0x1d, 0x23 };
+static const unsigned char OID_CRL_NUMBER[] = { 0x55, 0x1d, 0x14 };
+static const unsigned char OID_DELTA_CRL[] = { 0x55, 0x1d, 0x1b };
+static const unsigned char OID_REASON_CODE[] = { 0x55, 0x1d, 0x15 };
+
+static const char *const reason_names[] = {
+	"unspecified", "keyCompromise", "cACompromise", "affiliationChanged",
+	"superseded", "cessationOfOperation", "certificateHold", NULL,
+	"removeFromCRL", "privilegeWithdrawn", "aACompromise",
+};
+
+#define REASON_COUNT (sizeof(reason_names) / sizeof(reason_names[0]))
+
+int crl_reason_code(const char *name) {
+	for (size_t idx = 0; idx < REASON_COUNT; idx++) {
+		if (reason_names[idx] != NULL && strcmp(reason_names[idx], name) == 0) {
+			return idx;
+		}
+	}
+	return -2;
+}
+
+const char *crl_reason_name(int code) {
+	if (code < 0 || code >= (int) REASON_COUNT) {
+		return NULL;
+	}
+	return reason_names[code];
+}
+
+struct crl *crl_new(void) {
+	struct crl *crl = calloc(1, sizeof(*crl));
+	if (crl == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&crl->lock, NULL);
+	crl->number = 1;
+	return crl;
+}
+
+void crl_free(struct crl *crl) {
+	for (size_t idx = 0; idx < crl->count; idx++) {
+		free(crl->entries[idx].der);
+	}
+	free(crl->entries);
+	pthread_mutex_destroy(&crl->lock);
+	free(crl);
+}
+
+struct crl *ca_crl(struct ca *ca) {
+	pthread_mutex_lock(&ca->lock);
+	if (ca->crl == NULL) {
+		ca->crl = crl_new();
+	}
+	pthread_mutex_unlock(&ca->lock);
+	return ca->crl;
+}
+
+/* ------------------------------------------------------------ *
+ * Serials compare as unsigned numbers: strip leading zeros,    *
+ * then shorter is smaller and equal lengths compare bytewise.  *
+ * -------------------------------------------------------------*/
+static void serial_trim(const unsigned char **serial, size_t *len) {
+	while (*len > 1 && (*serial)[0] == 0) {
+		(*serial)++;
+		(*len)--;
+	}
+}
+
+static int serial_cmp(const struct crl_entry *e, const unsigned char *serial, size_t len) {
+	if (e->serial_len != len) {
+		return e->serial_len < len ? -1 : 1;
+	}
+	return memcmp(e->serial, serial, len);
+}
+
+/* index of serial, or -1 with *pos set to where it would go */
+static long crl_find(struct crl *crl, const unsigned char *serial, size_t len, size_t *pos) {
+	size_t lo = 0, hi = crl->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = serial_cmp(&crl->entries[mid], serial, len);
+		if (cmp == 0) {
+			*pos = mid;
+			return mid;
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	*pos = lo;
+	return -1;
+}
+
+/* called with crl->lock held, returns with it released */
+static void crl_unlock_changed(struct crl *crl, const unsigned char *serial, size_t len) {
+	void (*on_change)(void *, const unsigned char *, size_t) = crl->on_change;
+	void *arg = crl->on_change_arg;
+	pthread_mutex_unlock(&crl->lock);
+	if (on_change != NULL) {
+		on_change(arg, serial, len);
+	}
+}
+
+static void entry_changed(struct crl *crl, struct crl_entry *e) {
+	free(e->der);
+	e->der = NULL;
+	e->der_len = 0;
+	e->changed = crl->number;
+	crl->generation++;
+}
+
+int crl_revoke(struct crl *crl, const unsigned char *serial, size_t len, time_t when, int reason) {
+	size_t pos;
+
+	serial_trim(&serial, &len);
+	if (len == 0 || len > CA_SERIAL_MAX) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&crl->lock);
+	long found = crl_find(crl, serial, len, &pos);
+	if (found >= 0) {
+		struct crl_entry *e = &crl->entries[found];
+		if (e->removed || e->reason != reason || e->revoked_at != when) {
+			if (e->removed) {
+				crl->live++;
+			}
+			e->removed = 0;
+			e->reason = reason;
+			e->revoked_at = when;
+			entry_changed(crl, e);
+			crl_unlock_changed(crl, serial, len);
+			return 1;
+		}
+		pthread_mutex_unlock(&crl->lock);
+		return 1;
+	}
+
+	if (crl->count == crl->cap) {
+		size_t cap = crl->cap ? crl->cap * 2 : 1024;
+		struct crl_entry *entries = realloc(crl->entries, cap * sizeof(*entries));
+		if (entries == NULL) {
+			pthread_mutex_unlock(&crl->lock);
+			return 0;
+		}
+		crl->entries = entries;
+		crl->cap = cap;
+	}
+	memmove(&crl->entries[pos + 1], &crl->entries[pos], (crl->count - pos) * sizeof(crl->entries[0]));
+	crl->count++;
+	crl->live++;
+
+	struct crl_entry *e = &crl->entries[pos];
+	memset(e, 0, sizeof(*e));
+	memcpy(e->serial, serial, len);
+	e->serial_len = len;
+	e->reason = reason;
+	e->revoked_at = when;
+	entry_changed(crl, e);
+	crl_unlock_changed(crl, serial, len);
+	return 1;
+}
+
+int crl_unrevoke(struct crl *crl, const unsigned char *serial, size_t len) {
+	size_t pos;
+
+	serial_trim(&serial, &len);
+	pthread_mutex_lock(&crl->lock);
+	long found = crl_find(crl, serial, len, &pos);
+	if (found >= 0) {
+		struct crl_entry *e = &crl->entries[found];
+		if (!e->removed && e->reason == CRL_REASON_HOLD) {
+			e->removed = 1;
+			crl->live--;
+			entry_changed(crl, e);
+			crl_unlock_changed(crl, serial, len);
+			return 1;
+		}
+	}
+	pthread_mutex_unlock(&crl->lock);
+	return 0;
+}
+
+int crl_status(struct crl *crl, const unsigned char *serial, size_t len, time_t *when, int *reason) {
+	size_t pos;
+	int rc = 0;
+
+	serial_trim(&serial, &len);
+	pthread_mutex_lock(&crl->lock);
+	long found = crl_find(crl, serial, len, &pos);
+	if (found >= 0 && !crl->entries[found].removed) {
+		*when = crl->entries[found].revoked_at;
+		*reason = crl->entries[found].reason;
+		rc = 1;
+	}
+	pthread_mutex_unlock(&crl->lock);
+	return rc;
+}
+
+size_t crl_count(struct crl *crl) {
+	pthread_mutex_lock(&crl->lock);
+	size_t live = crl->live;
+	pthread_mutex_unlock(&crl->lock);
+	return live;
+}
+
+/* ------------------------------------------------------------ *
+ * revokedCertificates item, encoded once per entry state       *
+ * -------------------------------------------------------------*/
+static int entry_encode(struct crl_entry *e) {
+	struct der d;
+	int reason = e->removed ? CRL_REASON_REMOVE : e->reason;
+
+	der_init(&d);
+	der_reserve(&d, 48);
+	size_t seq = der_open(&d, DER_SEQUENCE);
+	der_uint_bytes(&d, DER_INTEGER, e->serial, e->serial_len);
+	der_time(&d, e->revoked_at);
+	if (reason != CRL_REASON_NONE) {
+		unsigned char code = reason;
+		size_t exts = der_open(&d, DER_SEQUENCE);
+		size_t ext = der_open(&d, DER_SEQUENCE);
+		der_tlv(&d, DER_OID, OID_REASON_CODE, sizeof(OID_REASON_CODE));
+		size_t val = der_open(&d, DER_OCTET);
+		der_tlv(&d, DER_ENUMERATED, &code, 1);
+		der_close(&d, val);
+		der_close(&d, ext);
+		der_close(&d, exts);
+	}
+	der_close(&d, seq);
+
+	if (d.failed) {
+		der_free(&d);
+		return 0;
+	}
+	e->der = d.buf;
+	e->der_len = d.len;
+	return 1;
+}
+
+static void put_number_ext(struct der *d, const unsigned char *oid, size_t oid_len,
+		int critical, uint64_t value) {
+	size_t ext = der_open(d, DER_SEQUENCE);
+	der_tlv(d, DER_OID, oid, oid_len);
+	if (critical) {
+		der_bool(d, 1);
+	}
+	size_t val = der_open(d, DER_OCTET);
+	der_uint(d, value);
+	der_close(d, val);
+	der_close(d, ext);
+}
+
+int crl_build(struct ca *ca, struct crl *crl, int delta, time_t this_update, long next_update,
+		struct der *out, uint64_t *number, const char **why) {
+	struct der tbs;
+	der_init(&tbs);
+
+	pthread_mutex_lock(&crl->lock);
+	if (delta && crl->base == 0) {
+		pthread_mutex_unlock(&crl->lock);
+		*why = "no full CRL issued yet to base a delta on";
+		return 0;
+	}
+
+	der_reserve(&tbs, crl->count * 48 + ca->issuer_len + ca->sigalg_len + 256);
+	size_t seq = der_open(&tbs, DER_SEQUENCE);
+	der_uint(&tbs, 1);
+	der_put(&tbs, ca->sigalg_der, ca->sigalg_len);
+	der_put(&tbs, ca->issuer_der, ca->issuer_len);
+	der_time(&tbs, this_update);
+	der_time(&tbs, this_update + next_update);
+
+	size_t list = der_open(&tbs, DER_SEQUENCE);
+	size_t listed = 0;
+	for (size_t idx = 0; idx < crl->count; idx++) {
+		struct crl_entry *e = &crl->entries[idx];
+		if (delta ? e->changed <= crl->base : e->removed) {
+			continue;
+		}
+		if (e->der == NULL && !entry_encode(e)) {
+			tbs.failed = 1;
+			break;
+		}
+		der_put(&tbs, e->der, e->der_len);
+		listed++;
+	}
+	if (listed > 0) {
+		der_close(&tbs, list);
+	} else {
+		// revokedCertificates is omitted when empty
+		tbs.len = list;
+	}
+
+	size_t exts_tag = der_open(&tbs, DER_CTX(0));
+	size_t exts = der_open(&tbs, DER_SEQUENCE);
+	size_t aki = der_open(&tbs, DER_SEQUENCE);
+	der_tlv(&tbs, DER_OID, OID_AUTHORITY_KEY_ID, sizeof(OID_AUTHORITY_KEY_ID));
+	size_t aki_val = der_open(&tbs, DER_OCTET);
+	size_t aki_seq = der_open(&tbs, DER_SEQUENCE);
+	der_tlv(&tbs, 0x80, ca->keyid, ca->keyid_len);
+	der_close(&tbs, aki_seq);
+	der_close(&tbs, aki_val);
+	der_close(&tbs, aki);
+	put_number_ext(&tbs, OID_CRL_NUMBER, sizeof(OID_CRL_NUMBER), 0, crl->number);
+	if (delta) {
+		put_number_ext(&tbs, OID_DELTA_CRL, sizeof(OID_DELTA_CRL), 1, crl->base);
+	}
+	der_close(&tbs, exts);
+	der_close(&tbs, exts_tag);
+	der_close(&tbs, seq);
+
+	if (tbs.failed) {
+		pthread_mutex_unlock(&crl->lock);
+		der_free(&tbs);
+		*why = "Error encoding CRL";
+		return 0;
+	}
+
+	*number = crl->number++;
+	if (!delta) {
+		// a full CRL supersedes every released hold
+		size_t kept = 0;
+		for (size_t idx = 0; idx < crl->count; idx++) {
+			if (crl->entries[idx].removed) {
+				free(crl->entries[idx].der);
+				continue;
+			}
+			crl->entries[kept++] = crl->entries[idx];
+		}
+		crl->count = kept;
+		crl->base = *number;
+	}
+	pthread_mutex_unlock(&crl->lock);
+
+	int rc = ca_sign_tbs(ca, tbs.buf, tbs.len, out);
+	der_free(&tbs);
+	if (!rc) {
+		*why = "Error signing CRL";
+	}
+	return rc;
+}
@@ -0,0 +1,67 @@
+#ifndef LUA_OPENSSL_CRL_H
+#define LUA_OPENSSL_CRL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "ca.h"
+#include "der.h"
+
+/* CRLReason values (RFC 5280 5.3.1), 7 is unused */
+#define CRL_REASON_NONE          -1
+#define CRL_REASON_HOLD           6
+#define CRL_REASON_REMOVE         8
+
+/* ------------------------------------------------------------ *
+ * One revoked serial. Entries are kept sorted by serial in a   *
+ * flat array; der caches the encoded revokedCertificates item  *
+ * until the entry changes.                                     *
+ * -------------------------------------------------------------*/
+struct crl_entry {
+	unsigned char serial[CA_SERIAL_MAX];
+	unsigned char serial_len;
+	signed char reason;
+	unsigned char removed;	/* hold released: only listed in deltas */
+	time_t revoked_at;
+	uint64_t changed;	/* number of the first CRL showing this state */
+	unsigned char *der;
+	size_t der_len;
+};
+
+struct crl {
+	pthread_mutex_t lock;
+	struct crl_entry *entries;
+	size_t count;
+	size_t cap;
+	size_t live;		/* entries that are not removed */
+	uint64_t number;	/* cRLNumber the next CRL will carry */
+	uint64_t base;		/* cRLNumber of the last full CRL, 0 if none */
+	uint64_t generation;	/* bumped on every revoke/unrevoke */
+
+	/* told about every serial whose status changed, outside the lock */
+	void (*on_change)(void *arg, const unsigned char *serial, size_t len);
+	void *on_change_arg;
+};
+
+struct crl *crl_new(void);
+void crl_free(struct crl *crl);
+
+/* the CA's CRL, created on first use */
+struct crl *ca_crl(struct ca *ca);
+
+int crl_revoke(struct crl *crl, const unsigned char *serial, size_t len, time_t when, int reason);
+/* releases a certificateHold; 0 if the serial was not on hold */
+int crl_unrevoke(struct crl *crl, const unsigned char *serial, size_t len);
+/* 1 and when/reason if serial is currently revoked */
+int crl_status(struct crl *crl, const unsigned char *serial, size_t len, time_t *when, int *reason);
+size_t crl_count(struct crl *crl);
+
+/* full (delta == 0) or delta CRL signed by ca, DER appended to out */
+int crl_build(struct ca *ca, struct crl *crl, int delta, time_t this_update, long next_update,
+		struct der *out, uint64_t *number, const char **why);
+
+int crl_reason_code(const char *name);
+const char *crl_reason_name(int code);
+
+#endif
@@ -0,0 +1,558 @@
+/*
+// Certification requests read in place: the DER is walked for the byte
+// ranges signing needs and nothing else is decoded, so the subject and
+// public key reach the certificate exactly as the requester encoded them.
+// https://www.rfc-editor.org/rfc/rfc2986
+*/
+
+#define _GNU_SOURCE
+
+#include <string.h>
+
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+
+#include "b64.h"
+#include "ca.h"
+#include "csr.h"
+
+static const unsigned char OID_RSA[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x01 };
+static const unsigned char OID_ED25519[] = { 0x2b, 0x65, 0x70 };
+static const unsigned char OID_ED448[] = { 0x2b, 0x65, 0x71 };
+static const unsigned char OID_EC[] = { 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02, 0x01 };
+static const unsigned char OID_P256[] = { 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07 };
+static const unsigned char OID_P384[] = { 0x2b, 0x81, 0x04, 0x00, 0x22 };
+static const unsigned char OID_P521[] = { 0x2b, 0x81, 0x04, 0x00, 0x23 };
+static const unsigned char OID_EXT_REQ[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x09, 0x0e };
+static const unsigned char OID_MS_EXT_REQ[] = { 0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x02, 0x01, 0x0e };
+
+static const unsigned char OID_SHA1_RSA[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x05 };
+static const unsigned char OID_SHA256_RSA[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x0b };
+static const unsigned char OID_SHA384_RSA[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x0c };
+static const unsigned char OID_SHA512_RSA[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x0d };
+static const unsigned char OID_SHA256_ECDSA[] = { 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x04, 0x03, 0x02 };
+static const unsigned char OID_SHA384_ECDSA[] = { 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x04, 0x03, 0x03 };
+static const unsigned char OID_SHA512_ECDSA[] = { 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x04, 0x03, 0x04 };
+
+/* signature algorithms verified here; RSA-PSS and the rest go to X509_REQ_verify */
+static const struct csr_alg {
+	const unsigned char *oid;
+	size_t oid_len;
+	int key;		/* EVP_PKEY_* the signer must hold */
+	int md;			/* NID_undef for the one-shot EdDSA */
+} csr_algs[] = {
+	{ OID_SHA256_RSA, sizeof(OID_SHA256_RSA), EVP_PKEY_RSA, NID_sha256 },
+	{ OID_SHA256_ECDSA, sizeof(OID_SHA256_ECDSA), EVP_PKEY_EC, NID_sha256 },
+	{ OID_ED25519, sizeof(OID_ED25519), EVP_PKEY_ED25519, NID_undef },
+	{ OID_SHA384_RSA, sizeof(OID_SHA384_RSA), EVP_PKEY_RSA, NID_sha384 },
+	{ OID_SHA512_RSA, sizeof(OID_SHA512_RSA), EVP_PKEY_RSA, NID_sha512 },
+	{ OID_SHA384_ECDSA, sizeof(OID_SHA384_ECDSA), EVP_PKEY_EC, NID_sha384 },
+	{ OID_SHA512_ECDSA, sizeof(OID_SHA512_ECDSA), EVP_PKEY_EC, NID_sha512 },
+	{ OID_ED448, sizeof(OID_ED448), EVP_PKEY_ED448, NID_undef },
+	{ OID_SHA1_RSA, sizeof(OID_SHA1_RSA), EVP_PKEY_RSA, NID_sha1 },
+};
+
+#define CSR_ALG_COUNT (sizeof(csr_algs) / sizeof(csr_algs[0]))
+
+static int oid_is(const struct der_span *oid, const unsigned char *want, size_t want_len) {
+	return oid->tag == DER_OID && oid->len == want_len && memcmp(oid->data, want, want_len) == 0;
+}
+
+void csr_init(struct csr *csr) {
+	memset(csr, 0, sizeof(*csr));
+	der_init(&csr->der);
+}
+
+void csr_free(struct csr *csr) {
+	EVP_PKEY_free(csr->pkey);
+	X509_NAME_free(csr->name);
+	sk_X509_EXTENSION_pop_free(csr->extensions, X509_EXTENSION_free);
+	der_free(&csr->der);
+	csr_init(csr);
+}
+
+/* Name ::= SEQUENCE OF SET OF SEQUENCE { type OID, value ANY } */
+static int walk_name(const struct der_span *name) {
+	const unsigned char *p = name->data, *end = p + name->len;
+	struct der_span rdn, atv, part;
+
+	while (p < end) {
+		if (! der_expect(&p, end, DER_SET, &rdn) || rdn.len == 0) {
+			return 0;
+		}
+		const unsigned char *q = rdn.data, *rdn_end = q + rdn.len;
+		while (q < rdn_end) {
+			if (! der_expect(&q, rdn_end, DER_SEQUENCE, &atv)) {
+				return 0;
+			}
+			const unsigned char *r = atv.data, *atv_end = r + atv.len;
+			if (! der_expect(&r, atv_end, DER_OID, &part) || ! der_read(&r, atv_end, &part) || r != atv_end) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/* Extensions ::= SEQUENCE OF SEQUENCE { extnID OID, critical BOOLEAN DEFAULT FALSE,
+ * extnValue OCTET STRING }, no extnID twice */
+static int walk_extensions(const struct der_span *exts) {
+	const unsigned char *p = exts->data, *end = p + exts->len;
+	struct der_span ext, oid[CSR_EXTENSIONS_MAX], part;
+	size_t count = 0;
+
+	while (p < end) {
+		if (count == CSR_EXTENSIONS_MAX || ! der_expect(&p, end, DER_SEQUENCE, &ext)) {
+			return 0;
+		}
+		const unsigned char *q = ext.data, *ext_end = q + ext.len;
+		if (! der_expect(&q, ext_end, DER_OID, &oid[count])
+				|| (q < ext_end && *q == DER_BOOLEAN && ! der_expect(&q, ext_end, DER_BOOLEAN, &part))
+				|| ! der_expect(&q, ext_end, DER_OCTET, &part) || q != ext_end) {
+			return 0;
+		}
+		for (size_t prev = 0; prev < count; prev++) {
+			if (oid_is(&oid[prev], oid[count].data, oid[count].len)) {
+				return 0;
+			}
+		}
+		count++;
+	}
+	return 1;
+}
+
+/* Attribute ::= SEQUENCE { type OID, values SET OF ANY }, keeping extensionRequest */
+static int walk_attributes(struct csr *csr, const struct der_span *attrs) {
+	const unsigned char *p = attrs->data, *end = p + attrs->len;
+	struct der_span attr, type, values, value;
+
+	while (p < end) {
+		if (! der_expect(&p, end, DER_SEQUENCE, &attr)) {
+			return 0;
+		}
+		const unsigned char *q = attr.data, *attr_end = q + attr.len;
+		if (! der_expect(&q, attr_end, DER_OID, &type) || ! der_expect(&q, attr_end, DER_SET, &values)
+				|| q != attr_end) {
+			return 0;
+		}
+		if (! oid_is(&type, OID_EXT_REQ, sizeof(OID_EXT_REQ))
+				&& ! oid_is(&type, OID_MS_EXT_REQ, sizeof(OID_MS_EXT_REQ))) {
+			continue;
+		}
+		// the first extension request wins, as with X509_REQ_get_extensions
+		q = values.data;
+		if (csr->exts.tlv == NULL && values.len > 0) {
+			if (! der_expect(&q, values.data + values.len, DER_SEQUENCE, &value) || ! walk_extensions(&value)) {
+				return 0;
+			}
+			csr->exts = value;
+		}
+	}
+	return 1;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+/* an EC point on one of the NIST curves, through the key manager
+ * alone; about a fifth of what the decoder route costs */
+static EVP_PKEY *decode_ec_key(const struct der_span *curve, const unsigned char *point, size_t len) {
+	const char *group;
+	if (oid_is(curve, OID_P256, sizeof(OID_P256))) {
+		group = "P-256";
+	} else if (oid_is(curve, OID_P384, sizeof(OID_P384))) {
+		group = "P-384";
+	} else if (oid_is(curve, OID_P521, sizeof(OID_P521))) {
+		group = "P-521";
+	} else {
+		return NULL;
+	}
+
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_construct_utf8_string(OSSL_PKEY_PARAM_GROUP_NAME, (char *) group, 0),
+		OSSL_PARAM_construct_octet_string(OSSL_PKEY_PARAM_PUB_KEY, (void *) point, len),
+		OSSL_PARAM_construct_end()
+	};
+	EVP_PKEY *pkey = NULL;
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_from_name(NULL, "EC", NULL);
+	if (ctx == NULL || EVP_PKEY_fromdata_init(ctx) != 1
+			|| EVP_PKEY_fromdata(ctx, &pkey, EVP_PKEY_PUBLIC_KEY, params) != 1) {
+		pkey = NULL;
+	}
+	EVP_PKEY_CTX_free(ctx);
+	return pkey;
+}
+#endif
+
+/* ------------------------------------------------------------ *
+ * The public key without the generic SPKI decoder: on OpenSSL  *
+ * 3 that goes through a provider decoder lookup per key, while *
+ * RSA and EdDSA keys can be built from their bits directly and *
+ * EC keys on a named curve from the point.                     *
+ * -------------------------------------------------------------*/
+static EVP_PKEY *decode_key(const struct der_span *spki) {
+	const unsigned char *p = spki->data, *end = p + spki->len;
+	struct der_span alg, oid, bits, param;
+
+	if (! der_expect(&p, end, DER_SEQUENCE, &alg) || ! der_expect(&p, end, DER_BIT_STRING, &bits)
+			|| p != end || bits.len < 1 || bits.data[0] != 0) {
+		return NULL;
+	}
+	const unsigned char *q = alg.data, *alg_end = q + alg.len;
+	if (! der_expect(&q, alg_end, DER_OID, &oid)) {
+		return NULL;
+	}
+	int has_param = q < alg_end;
+	if (has_param && (! der_read(&q, alg_end, &param) || q != alg_end)) {
+		return NULL;
+	}
+
+	const unsigned char *key = bits.data + 1;
+	size_t key_len = bits.len - 1;
+	EVP_PKEY *pkey = NULL;
+
+	if (oid_is(&oid, OID_RSA, sizeof(OID_RSA))) {
+		if (has_param && (param.tag != DER_NULL || param.len != 0)) {
+			return NULL;
+		}
+		pkey = d2i_PublicKey(EVP_PKEY_RSA, NULL, &key, key_len);
+		if (pkey != NULL && key != bits.data + bits.len) {
+			EVP_PKEY_free(pkey);
+			pkey = NULL;
+		}
+	} else if (oid_is(&oid, OID_ED25519, sizeof(OID_ED25519)) && ! has_param) {
+		pkey = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL, key, key_len);
+	} else if (oid_is(&oid, OID_ED448, sizeof(OID_ED448)) && ! has_param) {
+		pkey = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED448, NULL, key, key_len);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	} else if (oid_is(&oid, OID_EC, sizeof(OID_EC)) && has_param && param.tag == DER_OID
+			&& (pkey = decode_ec_key(&param, key, key_len)) != NULL) {
+		// explicit parameters and other curves fall through to the decoder
+#endif
+	} else {
+		const unsigned char *tlv = spki->tlv;
+		pkey = d2i_PUBKEY(NULL, &tlv, spki->tlv_len);
+	}
+	return pkey;
+}
+
+/* CertificationRequest ::= SEQUENCE { info, signatureAlgorithm, signature } */
+static int walk_request(struct csr *csr) {
+	const unsigned char *p = csr->der.buf, *end = p + csr->der.len;
+	struct der_span req, version, attrs, oid;
+
+	if (! der_expect(&p, end, DER_SEQUENCE, &req)) {
+		return 0;
+	}
+	p = req.data;
+	end = p + req.len;
+	if (! der_expect(&p, end, DER_SEQUENCE, &csr->info) || ! der_expect(&p, end, DER_SEQUENCE, &csr->sig_alg)
+			|| ! der_expect(&p, end, DER_BIT_STRING, &csr->sig) || p != end
+			|| csr->sig.len < 1 || csr->sig.data[0] != 0) {
+		return 0;
+	}
+
+	// CertificationRequestInfo ::= SEQUENCE { version, subject, subjectPKInfo, [0] attributes };
+	// version should be 0, but d2i_X509_REQ lets any small one through and so do we
+	p = csr->info.data;
+	end = p + csr->info.len;
+	if (! der_expect(&p, end, DER_INTEGER, &version) || version.len != 1 || (version.data[0] & 0x80)
+			|| ! der_expect(&p, end, DER_SEQUENCE, &csr->subject) || ! walk_name(&csr->subject)
+			|| ! der_expect(&p, end, DER_SEQUENCE, &csr->spki)
+			|| ! der_expect(&p, end, DER_CTX(0), &attrs) || p != end
+			|| ! walk_attributes(csr, &attrs)) {
+		return 0;
+	}
+
+	// AlgorithmIdentifier: a known OID, with NULL parameters allowed for RSA only
+	p = csr->sig_alg.data;
+	end = p + csr->sig_alg.len;
+	if (! der_expect(&p, end, DER_OID, &oid)) {
+		return 0;
+	}
+	for (size_t idx = 0; idx < CSR_ALG_COUNT; idx++) {
+		if (oid_is(&oid, csr_algs[idx].oid, csr_algs[idx].oid_len)) {
+			csr->alg = &csr_algs[idx];
+			break;
+		}
+	}
+	if (csr->alg == NULL || (p != end && ! (csr->alg->key == EVP_PKEY_RSA
+			&& end - p == 2 && p[0] == DER_NULL && p[1] == 0))) {
+		return 0;
+	}
+
+	if ((csr->pkey = decode_key(&csr->spki)) == NULL) {
+		return 0;
+	}
+	return EVP_PKEY_base_id(csr->pkey) == csr->alg->key;
+}
+
+int csr_parse(struct csr *csr, const char *pem, size_t len) {
+	struct pem_block block;
+
+	ca_init();
+	if (! pem_next(pem, pem + len, NULL, &block) || block.body == NULL ||
+			! (pem_is(&block, "CERTIFICATE REQUEST") || pem_is(&block, "NEW CERTIFICATE REQUEST"))) {
+		return 0;
+	}
+	if (! pem_decode(&block, &csr->der) || ! walk_request(csr)) {
+		ERR_clear_error();
+		return 0;
+	}
+	return 1;
+}
+
+/* Certificate ::= SEQUENCE { tbsCertificate, signatureAlgorithm, signature } */
+static int walk_certificate(struct csr *csr) {
+	const unsigned char *p = csr->der.buf, *end = p + csr->der.len;
+	struct der_span crt, version, tbs_alg, validity, not_before, ext;
+
+	if (! der_expect(&p, end, DER_SEQUENCE, &crt) || p != end) {
+		return 0;
+	}
+	p = crt.data;
+	end = p + crt.len;
+	if (! der_expect(&p, end, DER_SEQUENCE, &csr->info) || ! der_expect(&p, end, DER_SEQUENCE, &csr->sig_alg)
+			|| ! der_expect(&p, end, DER_BIT_STRING, &csr->sig) || p != end
+			|| csr->sig.len < 1 || csr->sig.data[0] != 0) {
+		return 0;
+	}
+
+	// TBSCertificate ::= SEQUENCE { [0] version, serialNumber, signature, issuer, validity,
+	//     subject, subjectPublicKeyInfo, [1] issuerUID, [2] subjectUID, [3] extensions }
+	p = csr->info.data;
+	end = p + csr->info.len;
+	if (p < end && *p == DER_CTX(0) && ! der_expect(&p, end, DER_CTX(0), &version)) {
+		return 0;
+	}
+	if (! der_expect(&p, end, DER_INTEGER, &csr->serial) || csr->serial.len == 0
+			|| ! der_expect(&p, end, DER_SEQUENCE, &tbs_alg)
+			|| ! der_expect(&p, end, DER_SEQUENCE, &csr->issuer) || ! walk_name(&csr->issuer)
+			|| ! der_expect(&p, end, DER_SEQUENCE, &validity)
+			|| ! der_expect(&p, end, DER_SEQUENCE, &csr->subject) || ! walk_name(&csr->subject)
+			|| ! der_expect(&p, end, DER_SEQUENCE, &csr->spki)) {
+		return 0;
+	}
+	// the signature algorithm is repeated inside what is signed
+	if (tbs_alg.tlv_len != csr->sig_alg.tlv_len || memcmp(tbs_alg.tlv, csr->sig_alg.tlv, tbs_alg.tlv_len) != 0) {
+		return 0;
+	}
+	const unsigned char *q = validity.data, *validity_end = q + validity.len;
+	if (! der_read(&q, validity_end, &not_before) || ! der_read(&q, validity_end, &csr->not_after)
+			|| q != validity_end
+			|| (csr->not_after.tag != DER_UTCTIME && csr->not_after.tag != DER_GENTIME)) {
+		return 0;
+	}
+	// unique identifiers are skipped, extensions kept as sent
+	while (p < end) {
+		if (! der_read(&p, end, &ext)) {
+			return 0;
+		}
+		if (ext.tag == DER_CTX(3)) {
+			q = ext.data;
+			if (! der_expect(&q, ext.data + ext.len, DER_SEQUENCE, &csr->exts) || q != ext.data + ext.len
+					|| ! walk_extensions(&csr->exts)) {
+				return 0;
+			}
+		}
+	}
+	return (csr->pkey = decode_key(&csr->spki)) != NULL;
+}
+
+int csr_parse_crt(struct csr *csr, const char *data, size_t len) {
+	struct pem_block block;
+
+	ca_init();
+	if (pem_next(data, data + len, "CERTIFICATE", &block)) {
+		if (block.body == NULL || ! pem_decode(&block, &csr->der)) {
+			return 0;
+		}
+	} else {
+		csr->der.len = 0;
+		der_put(&csr->der, data, len);
+	}
+	if (csr->der.failed || ! walk_certificate(csr)) {
+		ERR_clear_error();
+		return 0;
+	}
+	return 1;
+}
+
+static const unsigned char OID_SAN[] = { 0x55, 0x1d, 0x11 };
+
+/* RFC 5280 string types: PrintableString for countryName, IA5String
+ * where the attribute asks for it, UTF8String for the rest */
+static unsigned char attr_string_tag(int nid) {
+	switch (nid) {
+	case NID_countryName: return 0x13;
+	case NID_pkcs9_emailAddress:
+	case NID_domainComponent: return 0x16;
+	default: return 0x0c;
+	}
+}
+
+/* value fits the string type it is written as: countryName is two
+ * printable characters, IA5String ASCII */
+static int attr_string_ok(int nid, unsigned char tag, const unsigned char *value, size_t len) {
+	if (nid == NID_countryName && len != 2) {
+		return 0;
+	}
+	for (size_t idx = 0; idx < len; idx++) {
+		unsigned char c = value[idx];
+		if (tag == 0x16 && c >= 0x80) {
+			return 0;
+		}
+		int alnum = (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9');
+		if (tag == 0x13 && ! alnum && (c == 0 || strchr(" '()+,-./:=?", c) == NULL)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* GeneralName context tags, all primitive */
+static int san_tag(int type) {
+	switch (type) {
+	case GEN_EMAIL: return 0x81;
+	case GEN_DNS: return 0x82;
+	case GEN_URI: return 0x86;
+	case GEN_IPADD: return 0x87;
+	default: return 0;
+	}
+}
+
+static int put_name(struct der *out, const struct csr_identity *id) {
+	unsigned char oid[32], *p;
+
+	size_t name = der_open(out, DER_SEQUENCE);
+	for (size_t idx = 0; idx < id->subject_count; idx++) {
+		const struct csr_attr *attr = &id->subject[idx];
+		ASN1_OBJECT *obj = OBJ_nid2obj(attr->nid);
+		int oid_len = obj != NULL ? i2d_ASN1_OBJECT(obj, NULL) : 0;
+		unsigned char tag = attr_string_tag(attr->nid);
+		if (oid_len <= 0 || oid_len > (int) sizeof(oid) || attr->len == 0
+				|| ! attr_string_ok(attr->nid, tag, (const unsigned char *) attr->value, attr->len)) {
+			return 0;
+		}
+		p = oid;
+		i2d_ASN1_OBJECT(obj, &p);
+
+		size_t set = der_open(out, DER_SET);
+		size_t seq = der_open(out, DER_SEQUENCE);
+		der_put(out, oid, oid_len);
+		der_tlv(out, tag, attr->value, attr->len);
+		der_close(out, seq);
+		der_close(out, set);
+	}
+	der_close(out, name);
+	return 1;
+}
+
+/* Extensions with the one subjectAltName, critical for an empty subject */
+static int put_san(struct der *out, const struct csr_identity *id) {
+	size_t exts = der_open(out, DER_SEQUENCE);
+	size_t ext = der_open(out, DER_SEQUENCE);
+	der_tlv(out, DER_OID, OID_SAN, sizeof(OID_SAN));
+	if (id->subject_count == 0) {
+		der_bool(out, 1);
+	}
+	size_t octets = der_open(out, DER_OCTET);
+	size_t names = der_open(out, DER_SEQUENCE);
+	for (size_t idx = 0; idx < id->san_count; idx++) {
+		const struct csr_san *san = &id->san[idx];
+		int tag = san_tag(san->type);
+		if (tag == 0 || san->len == 0 || (san->type == GEN_IPADD && san->len != 4 && san->len != 16)
+				|| (san->type != GEN_IPADD && ! attr_string_ok(NID_undef, 0x16, san->value, san->len))) {
+			return 0;
+		}
+		der_tlv(out, tag, san->value, san->len);
+	}
+	der_close(out, names);
+	der_close(out, octets);
+	der_close(out, ext);
+	der_close(out, exts);
+	return 1;
+}
+
+int csr_from_key(struct csr *csr, const char *spki, size_t len, const struct csr_identity *id) {
+	struct pem_block block;
+	const unsigned char *p, *end;
+
+	ca_init();
+	if (id->subject_count == 0 && id->san_count == 0) {
+		return 0;
+	}
+	// the key, then the Name and Extensions encoded after it, spans set once nothing moves
+	if (pem_next(spki, spki + len, "PUBLIC KEY", &block)) {
+		if (block.body == NULL || ! pem_decode(&block, &csr->der)) {
+			return 0;
+		}
+	} else {
+		csr->der.len = 0;
+		der_put(&csr->der, spki, len);
+	}
+	size_t spki_end = csr->der.len;
+	if (! put_name(&csr->der, id) || (id->san_count > 0 && ! put_san(&csr->der, id)) || csr->der.failed) {
+		ERR_clear_error();
+		return 0;
+	}
+
+	p = csr->der.buf;
+	end = p + spki_end;
+	if (! der_expect(&p, end, DER_SEQUENCE, &csr->spki) || p != end) {
+		return 0;
+	}
+	end = csr->der.buf + csr->der.len;
+	if (! der_expect(&p, end, DER_SEQUENCE, &csr->subject)
+			|| (p < end && ! der_expect(&p, end, DER_SEQUENCE, &csr->exts))) {
+		return 0;
+	}
+	if ((csr->pkey = decode_key(&csr->spki)) == NULL) {
+		ERR_clear_error();
+		return 0;
+	}
+	return 1;
+}
+
+X509_NAME *csr_name(struct csr *csr) {
+	if (csr->name == NULL) {
+		const unsigned char *p = csr->subject.tlv;
+		if ((csr->name = d2i_X509_NAME(NULL, &p, csr->subject.tlv_len)) == NULL) {
+			ERR_clear_error();
+		}
+	}
+	return csr->name;
+}
+
+STACK_OF(X509_EXTENSION) *csr_extensions(struct csr *csr) {
+	if (csr->extensions == NULL && csr->exts.tlv != NULL) {
+		const unsigned char *p = csr->exts.tlv;
+		if ((csr->extensions = d2i_X509_EXTENSIONS(NULL, &p, csr->exts.tlv_len)) == NULL) {
+			ERR_clear_error();
+		}
+	}
+	return csr->extensions;
+}
+
+static const EVP_MD *csr_md(int nid) {
+	switch (nid) {
+	case NID_undef: return NULL;
+	case NID_sha1: return ca_sha1();
+	case NID_sha256: return ca_sha256();
+	default: return EVP_get_digestbynid(nid);
+	}
+}
+
+int csr_verify(struct csr *csr) {
+	EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+	int ok = mdctx != NULL
+		&& EVP_DigestVerifyInit(mdctx, NULL, csr_md(csr->alg->md), NULL, csr->pkey) == 1
+		&& EVP_DigestVerify(mdctx, csr->sig.data + 1, csr->sig.len - 1, csr->info.tlv, csr->info.tlv_len) == 1;
+
+	if (! ok) {
+		ERR_clear_error();
+	}
+	EVP_MD_CTX_free(mdctx);
+	return ok;
+}
@@ -0,0 +1,102 @@
+#ifndef LUA_OPENSSL_CSR_H
+#define LUA_OPENSSL_CSR_H
+
+#include <stddef.h>
+
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "der.h"
+
+struct csr_alg;
+
+/* extensions a request or certificate may carry; RFC 5280 4.2
+ * allows each extnID once, and a repeat is rejected outright */
+#define CSR_EXTENSIONS_MAX 64
+
+/* ------------------------------------------------------------ *
+ * A certification request walked in place. Only the parts     *
+ * signing needs are located, as byte ranges into the request's *
+ * own DER; the public key is the one thing decoded up front,   *
+ * the subject and extensions are decoded when first asked for. *
+ * -------------------------------------------------------------*/
+struct csr {
+	struct der der;			/* the request, the spans point into it */
+	struct der_span info;		/* CertificationRequestInfo, what is signed */
+	struct der_span subject;	/* Name */
+	struct der_span spki;		/* SubjectPublicKeyInfo */
+	struct der_span exts;		/* Extensions of extensionRequest, tlv NULL if none */
+	struct der_span sig_alg;	/* AlgorithmIdentifier */
+	struct der_span sig;		/* BIT STRING */
+	const struct csr_alg *alg;
+
+	/* certificates only, see csr_parse_crt() */
+	struct der_span serial;		/* INTEGER */
+	struct der_span issuer;		/* Name */
+	struct der_span not_after;	/* UTCTime or GeneralizedTime */
+
+	EVP_PKEY *pkey;
+	X509_NAME *name;
+	STACK_OF(X509_EXTENSION) *extensions;
+};
+
+void csr_init(struct csr *csr);
+void csr_free(struct csr *csr);
+
+/* ------------------------------------------------------------ *
+ * Parses a plain PEM request. 0 leaves it to ca_read_req():    *
+ * encapsulated headers, signature algorithms verified nowhere  *
+ * but X509_REQ_verify, and malformed input, which that route   *
+ * rejects with its usual messages.                             *
+ * -------------------------------------------------------------*/
+int csr_parse(struct csr *csr, const char *pem, size_t len);
+
+/* ------------------------------------------------------------ *
+ * A certificate, PEM or DER, walked the same way for renewal:  *
+ * info is the TBSCertificate, exts its Extensions and sig_alg  *
+ * the outer AlgorithmIdentifier. alg stays NULL, the issuer    *
+ * checks the signature with its own key.                       *
+ * -------------------------------------------------------------*/
+int csr_parse_crt(struct csr *csr, const char *data, size_t len);
+
+/* ------------------------------------------------------------ *
+ * Who a certificate is for when there is no request: subject   *
+ * attributes in order and subjectAltNames, values as given.    *
+ * SAN types are GEN_DNS, GEN_EMAIL, GEN_URI and GEN_IPADD, the *
+ * last with the 4 or 16 address bytes.                         *
+ * -------------------------------------------------------------*/
+struct csr_attr {
+	int nid;
+	const char *value;
+	size_t len;
+};
+
+struct csr_san {
+	int type;
+	const void *value;
+	size_t len;
+};
+
+struct csr_identity {
+	const struct csr_attr *subject;
+	size_t subject_count;
+	const struct csr_san *san;
+	size_t san_count;
+};
+
+/* ------------------------------------------------------------ *
+ * A request made up from a SubjectPublicKeyInfo, PEM or DER,   *
+ * and an identity: subject, spki and exts are filled as if     *
+ * parsed, nothing is signed, info and sig stay empty.          *
+ * -------------------------------------------------------------*/
+int csr_from_key(struct csr *csr, const char *spki, size_t len, const struct csr_identity *id);
+
+/* the subject and the requested extensions, NULL when absent or
+ * undecodable; owned by csr */
+X509_NAME *csr_name(struct csr *csr);
+STACK_OF(X509_EXTENSION) *csr_extensions(struct csr *csr);
+
+/* checks the signature over the CertificationRequestInfo as received */
+int csr_verify(struct csr *csr);
+
+#endif
@@ -0,0 +1,223 @@
+/*
+// Minimal DER writer for the structures the module builds by hand
+// (CRLs, to-be-signed certificates), so hot paths can splice cached
+// encodings together instead of round-tripping through ASN1_ITEMs,
+// and the matching in-place reader for what they splice in.
+// https://luca.ntop.org/Teaching/Appunti/asn1.html
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "der.h"
+
+void der_init(struct der *d) {
+	d->buf = NULL;
+	d->len = 0;
+	d->cap = 0;
+	d->failed = 0;
+	d->fixed = 0;
+}
+
+void der_wrap(struct der *d, void *buf, size_t cap) {
+	der_init(d);
+	d->buf = buf;
+	d->cap = cap;
+	d->fixed = 1;
+}
+
+void der_free(struct der *d) {
+	if (! d->fixed) {
+		free(d->buf);
+	}
+	der_init(d);
+}
+
+int der_reserve(struct der *d, size_t extra) {
+	if (d->failed) {
+		return 0;
+	}
+	if (d->len + extra <= d->cap) {
+		return 1;
+	}
+	if (d->fixed) {
+		d->failed = 1;
+		return 0;
+	}
+
+	size_t cap = d->cap ? d->cap : 256;
+	while (cap < d->len + extra) {
+		cap *= 2;
+	}
+	unsigned char *buf = realloc(d->buf, cap);
+	if (buf == NULL) {
+		d->failed = 1;
+		return 0;
+	}
+	d->buf = buf;
+	d->cap = cap;
+	return 1;
+}
+
+void der_put(struct der *d, const void *data, size_t len) {
+	if (len == 0 || !der_reserve(d, len)) {
+		return;
+	}
+	memcpy(d->buf + d->len, data, len);
+	d->len += len;
+}
+
+size_t der_header_len(size_t len) {
+	size_t n = 2;
+	if (len >= 0x80) {
+		for (; len > 0; len >>= 8) {
+			n++;
+		}
+	}
+	return n;
+}
+
+static size_t der_encode_header(unsigned char *out, unsigned char tag, size_t len) {
+	out[0] = tag;
+	if (len < 0x80) {
+		out[1] = len;
+		return 2;
+	}
+
+	size_t bytes = 0;
+	for (size_t rest = len; rest > 0; rest >>= 8) {
+		bytes++;
+	}
+	out[1] = 0x80 | bytes;
+	for (size_t idx = 0; idx < bytes; idx++) {
+		out[1 + bytes - idx] = len >> (8 * idx);
+	}
+	return 2 + bytes;
+}
+
+void der_tlv(struct der *d, unsigned char tag, const void *data, size_t len) {
+	unsigned char hdr[10];
+	size_t hlen = der_encode_header(hdr, tag, len);
+	if (!der_reserve(d, hlen + len)) {
+		return;
+	}
+	der_put(d, hdr, hlen);
+	der_put(d, data, len);
+}
+
+/* ------------------------------------------------------------ *
+ * Constructed values: room for the short header is kept at     *
+ * open time, and close() slides the content when the length    *
+ * turns out to need the long form.                             *
+ * -------------------------------------------------------------*/
+size_t der_open(struct der *d, unsigned char tag) {
+	size_t mark = d->len;
+	unsigned char hdr[2] = { tag, 0 };
+	der_put(d, hdr, 2);
+	return mark;
+}
+
+void der_close(struct der *d, size_t mark) {
+	if (d->failed) {
+		return;
+	}
+
+	size_t content = d->len - mark - 2;
+	unsigned char hdr[10];
+	size_t hlen = der_encode_header(hdr, d->buf[mark], content);
+	if (hlen > 2) {
+		if (!der_reserve(d, hlen - 2)) {
+			return;
+		}
+		memmove(d->buf + mark + hlen, d->buf + mark + 2, content);
+		d->len += hlen - 2;
+	}
+	memcpy(d->buf + mark, hdr, hlen);
+}
+
+void der_uint_bytes(struct der *d, unsigned char tag, const unsigned char *mag, size_t len) {
+	while (len > 1 && mag[0] == 0) {
+		mag++;
+		len--;
+	}
+
+	unsigned char hdr[11];
+	int pad = len == 0 || (mag[0] & 0x80);
+	size_t hlen = der_encode_header(hdr, tag, len + pad);
+	if (pad) {
+		hdr[hlen++] = 0;
+	}
+	if (!der_reserve(d, hlen + len)) {
+		return;
+	}
+	der_put(d, hdr, hlen);
+	der_put(d, mag, len);
+}
+
+void der_uint(struct der *d, uint64_t value) {
+	unsigned char mag[8];
+	for (int idx = 7; idx >= 0; idx--) {
+		mag[idx] = value & 0xff;
+		value >>= 8;
+	}
+	der_uint_bytes(d, DER_INTEGER, mag, sizeof(mag));
+}
+
+void der_bool(struct der *d, int value) {
+	unsigned char v = value ? 0xff : 0x00;
+	der_tlv(d, DER_BOOLEAN, &v, 1);
+}
+
+void der_time(struct der *d, time_t when) {
+	struct tm tm;
+	char buf[20];
+
+	gmtime_r(&when, &tm);
+	if (tm.tm_year + 1900 < 2050) {
+		strftime(buf, sizeof(buf), "%y%m%d%H%M%SZ", &tm);
+		der_tlv(d, DER_UTCTIME, buf, 13);
+	} else {
+		strftime(buf, sizeof(buf), "%Y%m%d%H%M%SZ", &tm);
+		der_tlv(d, DER_GENTIME, buf, 15);
+	}
+}
+
+int der_read(const unsigned char **p, const unsigned char *end, struct der_span *span) {
+	const unsigned char *at = *p;
+	if (end - at < 2 || (at[0] & 0x1f) == 0x1f) {
+		return 0;
+	}
+	span->tag = at[0];
+	span->tlv = at;
+
+	size_t len = at[1], hlen = 2;
+	if (len & 0x80) {
+		size_t count = len & 0x7f;
+		// indefinite, oversized and non-minimal lengths are BER only
+		if (count == 0 || count > sizeof(size_t) || (size_t) (end - at) < 2 + count || at[2] == 0) {
+			return 0;
+		}
+		len = 0;
+		for (size_t idx = 0; idx < count; idx++) {
+			len = len << 8 | at[2 + idx];
+		}
+		if (len < 0x80) {
+			return 0;
+		}
+		hlen += count;
+	}
+	if (len > (size_t) (end - at) - hlen) {
+		return 0;
+	}
+	span->data = at + hlen;
+	span->len = len;
+	span->tlv_len = hlen + len;
+	*p = at + span->tlv_len;
+	return 1;
+}
+
+int der_expect(const unsigned char **p, const unsigned char *end, unsigned char tag, struct der_span *span) {
+	return der_read(p, end, span) && span->tag == tag;
+}
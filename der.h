@@ -0,0 +1,77 @@
+#ifndef LUA_OPENSSL_DER_H
+#define LUA_OPENSSL_DER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* DER universal tags used by the hand-built structures */
+#define DER_BOOLEAN     0x01
+#define DER_INTEGER     0x02
+#define DER_BIT_STRING  0x03
+#define DER_OCTET       0x04
+#define DER_NULL        0x05
+#define DER_OID         0x06
+#define DER_ENUMERATED  0x0a
+#define DER_UTCTIME     0x17
+#define DER_GENTIME     0x18
+#define DER_SEQUENCE    0x30
+#define DER_SET         0x31
+#define DER_CTX(n)      (0xa0 | (n))
+
+/* ------------------------------------------------------------ *
+ * Growable output buffer. Any allocation failure latches       *
+ * `failed`, later writes become no-ops and the caller checks   *
+ * the flag once at the end.                                    *
+ * -------------------------------------------------------------*/
+struct der {
+	unsigned char *buf;
+	size_t len;
+	size_t cap;
+	int failed;
+	int fixed;	/* buf belongs to the caller and never grows */
+};
+
+void der_init(struct der *d);
+/* writes go to buf, up to cap bytes; running out latches failed */
+void der_wrap(struct der *d, void *buf, size_t cap);
+void der_free(struct der *d);
+int der_reserve(struct der *d, size_t extra);
+void der_put(struct der *d, const void *data, size_t len);
+
+/* a complete TLV with the given content */
+void der_tlv(struct der *d, unsigned char tag, const void *data, size_t len);
+
+/* open a constructed value; close it once its content is written */
+size_t der_open(struct der *d, unsigned char tag);
+void der_close(struct der *d, size_t mark);
+
+/* unsigned big-endian magnitude, written as a positive INTEGER */
+void der_uint_bytes(struct der *d, unsigned char tag, const unsigned char *mag, size_t len);
+void der_uint(struct der *d, uint64_t value);
+void der_bool(struct der *d, int value);
+/* UTCTime before 2050, GeneralizedTime after, as RFC 5280 asks */
+void der_time(struct der *d, time_t when);
+
+/* encoded header size for content of len bytes */
+size_t der_header_len(size_t len);
+
+/* ------------------------------------------------------------ *
+ * One value read in place: tlv covers header and content, data *
+ * the content alone. Both point into the input.                *
+ * -------------------------------------------------------------*/
+struct der_span {
+	unsigned char tag;
+	const unsigned char *tlv;
+	size_t tlv_len;
+	const unsigned char *data;
+	size_t len;
+};
+
+/* reads the value at *p and steps past it; 0 on anything but
+ * DER with a low tag number and a minimal definite length */
+int der_read(const unsigned char **p, const unsigned char *end, struct der_span *span);
+/* der_read that also wants the given tag */
+int der_expect(const unsigned char **p, const unsigned char *end, unsigned char tag, struct der_span *span);
+
+#endif
@@ -0,0 +1,301 @@
+/*
+// Pools of pre-minted key and certificate pairs for ephemeral identities:
+// a sidecar starting up takes a pair that was generated and signed ahead
+// of time instead of waiting for keygen plus a signature.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/buffer.h>
+#include <openssl/ec.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+#include "mint.h"
+
+/* back-off after a failed background mint, so a CA that started
+ * refusing the template isn't asked again in a tight loop */
+#define MINT_RETRY_SECS 1
+
+/* the template's attributes, SANs and bytes in one allocation */
+static int mint_copy_identity(struct csr_identity *copy, const struct csr_identity *id) {
+	size_t size = id->subject_count * sizeof(struct csr_attr) + id->san_count * sizeof(struct csr_san);
+	for (size_t idx = 0; idx < id->subject_count; idx++) {
+		size += id->subject[idx].len;
+	}
+	for (size_t idx = 0; idx < id->san_count; idx++) {
+		size += id->san[idx].len;
+	}
+
+	char *block = malloc(size > 0 ? size : 1);
+	if (block == NULL) {
+		return 0;
+	}
+	struct csr_attr *subject = (struct csr_attr *) block;
+	struct csr_san *san = (struct csr_san *) (subject + id->subject_count);
+	char *bytes = (char *) (san + id->san_count);
+
+	for (size_t idx = 0; idx < id->subject_count; idx++) {
+		subject[idx] = id->subject[idx];
+		subject[idx].value = memcpy(bytes, id->subject[idx].value, id->subject[idx].len);
+		bytes += id->subject[idx].len;
+	}
+	for (size_t idx = 0; idx < id->san_count; idx++) {
+		san[idx] = id->san[idx];
+		san[idx].value = memcpy(bytes, id->san[idx].value, id->san[idx].len);
+		bytes += id->san[idx].len;
+	}
+	copy->subject = subject;
+	copy->subject_count = id->subject_count;
+	copy->san = san;
+	copy->san_count = id->san_count;
+	return 1;
+}
+
+static EVP_PKEY *mint_keygen(const struct mint_opts *opts) {
+	int type = opts->key_type == MINT_KEY_RSA ? EVP_PKEY_RSA
+		: opts->key_type == MINT_KEY_ED25519 ? EVP_PKEY_ED25519 : EVP_PKEY_EC;
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(type, NULL);
+	EVP_PKEY *pkey = NULL;
+	int ok = ctx != NULL && EVP_PKEY_keygen_init(ctx) == 1;
+
+	if (ok && type == EVP_PKEY_EC) {
+		int nid = opts->bits == 384 ? NID_secp384r1 : opts->bits == 521 ? NID_secp521r1 : NID_X9_62_prime256v1;
+		ok = EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, nid) == 1;
+	} else if (ok && type == EVP_PKEY_RSA) {
+		ok = EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, opts->bits) == 1;
+	}
+	if (! ok || EVP_PKEY_keygen(ctx, &pkey) != 1) {
+		err_descr_to_stderr("Error generating key");
+		pkey = NULL;
+	}
+	EVP_PKEY_CTX_free(ctx);
+	return pkey;
+}
+
+/* a new pair, minted on the calling thread; *why explains NULL */
+static struct mint_item *mint_one(struct mint *mint, const char **why) {
+	struct mint_item *item = NULL;
+	unsigned char *spki = NULL;
+	char serial[2 * CA_SERIAL_MAX + 1];
+	struct der crt;
+	BIO *keybio = NULL;
+	char *key;
+	long key_len;
+
+	der_init(&crt);
+	EVP_PKEY *pkey = mint_keygen(&mint->opts);
+	int spki_len = pkey != NULL ? i2d_PUBKEY(pkey, &spki) : 0;
+	if (spki_len <= 0) {
+		*why = "Error generating key";
+		goto __done;
+	}
+	time_t now = time(NULL);
+	if (! ca_identity_pem(mint->ca, (const char *) spki, spki_len, &mint->id, &mint->profile,
+			&crt, serial, why)) {
+		goto __done;
+	}
+	if ((keybio = BIO_new(BIO_s_mem())) == NULL
+			|| ! PEM_write_bio_PrivateKey(keybio, pkey, NULL, NULL, 0, NULL, NULL)
+			|| (key_len = BIO_get_mem_data(keybio, &key)) <= 0) {
+		*why = "Error encoding private key";
+		err_descr_to_stderr(*why);
+		goto __done;
+	}
+	if ((item = malloc(sizeof(*item) + key_len + crt.len)) == NULL) {
+		*why = "Error allocating minted pair";
+		goto __done;
+	}
+	item->next = NULL;
+	item->minted = now;
+	item->stale_at = now + mint->profile.lifetime - mint->opts.refresh;
+	memcpy(item->serial, serial, sizeof(serial));
+	item->key_len = key_len;
+	item->crt_len = crt.len;
+	memcpy(item->pem, key, key_len);
+	memcpy(item->pem + key_len, crt.buf, crt.len);
+
+__done:
+	// the key bytes went through the BIO: wipe them with it
+	if (keybio != NULL) {
+		BUF_MEM *mem = NULL;
+		BIO_get_mem_ptr(keybio, &mem);
+		if (mem != NULL) {
+			OPENSSL_cleanse(mem->data, mem->length);
+		}
+	}
+	BIO_free(keybio);
+	OPENSSL_free(spki);
+	EVP_PKEY_free(pkey);
+	der_free(&crt);
+	return item;
+}
+
+void mint_item_free(struct mint_item *item) {
+	if (item != NULL) {
+		OPENSSL_cleanse(item->pem, item->key_len);
+		free(item);
+	}
+}
+
+/* lock held; items are in minting order, so the stale ones lead */
+static void mint_discard_stale(struct mint *mint, time_t now) {
+	while (mint->head != NULL && mint->head->stale_at <= now) {
+		struct mint_item *item = mint->head;
+		mint->head = item->next;
+		if (mint->head == NULL) {
+			mint->tail = NULL;
+		}
+		mint->stats.depth--;
+		mint->stats.discarded++;
+		mint_item_free(item);
+	}
+}
+
+/* lock held */
+static void mint_append(struct mint *mint, struct mint_item *item) {
+	if (mint->tail != NULL) {
+		mint->tail->next = item;
+	} else {
+		mint->head = item;
+	}
+	mint->tail = item;
+	mint->stats.depth++;
+}
+
+static void mint_wait(struct mint *mint, time_t secs) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += secs;
+	pthread_cond_timedwait(&mint->wake, &mint->lock, &deadline);
+}
+
+static void *mint_run(void *arg) {
+	struct mint *mint = arg;
+
+	pthread_mutex_lock(&mint->lock);
+	while (! mint->closing) {
+		time_t now = time(NULL);
+		mint_discard_stale(mint, now);
+		if (mint->stats.depth >= mint->opts.depth) {
+			// until the oldest goes stale, or a take makes room
+			mint_wait(mint, mint->head->stale_at - now);
+			continue;
+		}
+		pthread_mutex_unlock(&mint->lock);
+
+		const char *why = NULL;
+		struct mint_item *item = mint_one(mint, &why);
+
+		pthread_mutex_lock(&mint->lock);
+		if (item == NULL) {
+			mint->stats.errors++;
+			snprintf(mint->stats.last_error, sizeof(mint->stats.last_error), "%s",
+					why != NULL ? why : "Error minting");
+			mint_wait(mint, MINT_RETRY_SECS);
+			continue;
+		}
+		mint->stats.minted++;
+		mint_append(mint, item);
+	}
+	pthread_mutex_unlock(&mint->lock);
+	return NULL;
+}
+
+static void mint_release(struct mint *mint) {
+	while (mint->head != NULL) {
+		struct mint_item *item = mint->head;
+		mint->head = item->next;
+		mint_item_free(item);
+	}
+	pthread_cond_destroy(&mint->wake);
+	pthread_condattr_destroy(&mint->monotonic);
+	pthread_mutex_destroy(&mint->lock);
+	free((void *) mint->id.subject);
+	ca_unref(mint->ca);
+	free(mint);
+}
+
+struct mint *mint_new(struct ca *ca, const struct csr_identity *id, const struct ca_profile *profile,
+		const struct mint_opts *opts, const char **why) {
+	if (opts->depth == 0 || opts->refresh < 0 || opts->refresh >= profile->lifetime) {
+		*why = "depth must be positive and refresh shorter than the lifetime";
+		return NULL;
+	}
+	struct mint *mint = calloc(1, sizeof(*mint));
+	if (mint == NULL || ! mint_copy_identity(&mint->id, id)) {
+		free(mint);
+		*why = "Error allocating mint";
+		return NULL;
+	}
+	mint->ca = ca_ref(ca);
+	mint->profile = *profile;
+	mint->opts = *opts;
+	pthread_mutex_init(&mint->lock, NULL);
+	pthread_condattr_init(&mint->monotonic);
+	pthread_condattr_setclock(&mint->monotonic, CLOCK_MONOTONIC);
+	pthread_cond_init(&mint->wake, &mint->monotonic);
+
+	struct mint_item *first = mint_one(mint, why);
+	if (first == NULL) {
+		mint_release(mint);
+		return NULL;
+	}
+	mint->stats.minted++;
+	mint_append(mint, first);
+
+	if (pthread_create(&mint->thread, NULL, mint_run, mint) != 0) {
+		*why = "Error starting mint thread";
+		mint_release(mint);
+		return NULL;
+	}
+	return mint;
+}
+
+void mint_free(struct mint *mint) {
+	pthread_mutex_lock(&mint->lock);
+	mint->closing = 1;
+	pthread_cond_signal(&mint->wake);
+	pthread_mutex_unlock(&mint->lock);
+	pthread_join(mint->thread, NULL);
+	mint_release(mint);
+}
+
+struct mint_item *mint_take(struct mint *mint, const char **why) {
+	struct mint_item *item;
+
+	pthread_mutex_lock(&mint->lock);
+	mint_discard_stale(mint, time(NULL));
+	if ((item = mint->head) != NULL) {
+		mint->head = item->next;
+		if (mint->head == NULL) {
+			mint->tail = NULL;
+		}
+		item->next = NULL;
+		mint->stats.depth--;
+		mint->stats.hits++;
+	} else {
+		mint->stats.misses++;
+	}
+	pthread_cond_signal(&mint->wake);
+	pthread_mutex_unlock(&mint->lock);
+
+	if (item == NULL && (item = mint_one(mint, why)) == NULL) {
+		pthread_mutex_lock(&mint->lock);
+		mint->stats.errors++;
+		pthread_mutex_unlock(&mint->lock);
+	}
+	return item;
+}
+
+void mint_get_stats(struct mint *mint, struct mint_stats *stats) {
+	pthread_mutex_lock(&mint->lock);
+	*stats = mint->stats;
+	stats->oldest = mint->head != NULL ? mint->head->minted : 0;
+	pthread_mutex_unlock(&mint->lock);
+}
@@ -0,0 +1,83 @@
+#ifndef LUA_OPENSSL_MINT_H
+#define LUA_OPENSSL_MINT_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "ca.h"
+#include "csr.h"
+#include "policy.h"
+
+/* key types a mint generates */
+#define MINT_KEY_EC		0	/* NIST curve of bits 256, 384 or 521 */
+#define MINT_KEY_ED25519	1
+#define MINT_KEY_RSA		2
+
+struct mint_opts {
+	size_t depth;		/* pairs kept ready */
+	int key_type;		/* MINT_KEY_* */
+	int bits;		/* EC curve or RSA modulus size */
+	long refresh;		/* seconds before notAfter an item is re-minted */
+};
+
+/* one ready pair: PEM private key and certificate, back to back */
+struct mint_item {
+	struct mint_item *next;
+	time_t minted;
+	time_t stale_at;	/* notAfter - refresh */
+	char serial[2 * CA_SERIAL_MAX + 1];
+	size_t key_len;
+	size_t crt_len;
+	char pem[];
+};
+
+struct mint_stats {
+	size_t depth;		/* ready now */
+	time_t oldest;		/* minted time of the oldest ready item, 0 if none */
+	uint64_t hits;		/* taken from the pool */
+	uint64_t misses;	/* minted on the caller's thread, pool empty */
+	uint64_t minted;	/* by the background thread */
+	uint64_t discarded;	/* dropped for nearing expiry */
+	uint64_t errors;
+	char last_error[POLICY_WHY_MAX];	/* of the background thread, "" if none */
+};
+
+/* ------------------------------------------------------------ *
+ * Pre-minted key and certificate pairs for one identity        *
+ * template under one CA and profile. A background thread keeps *
+ * depth pairs ready, oldest handed out first, and replaces the *
+ * ones that come within refresh seconds of expiry. The thread  *
+ * does not survive fork(): make mints after forking.           *
+ * -------------------------------------------------------------*/
+struct mint {
+	struct ca *ca;
+	struct ca_profile profile;
+	struct mint_opts opts;
+	struct csr_identity id;		/* deep copy, one allocation */
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;		/* an item was taken, or closing */
+	pthread_condattr_t monotonic;
+	struct mint_item *head, *tail;
+	struct mint_stats stats;
+	int closing;
+	pthread_t thread;
+};
+
+/* the first pair is minted before returning, so a template the
+ * CA refuses fails here; *why explains a NULL return */
+struct mint *mint_new(struct ca *ca, const struct csr_identity *id, const struct ca_profile *profile,
+		const struct mint_opts *opts, const char **why);
+/* stops the thread, waiting out a mint in progress */
+void mint_free(struct mint *mint);
+
+/* a ready pair, or one minted right here when none is; the caller
+ * frees it. NULL with *why only when minting failed */
+struct mint_item *mint_take(struct mint *mint, const char **why);
+void mint_item_free(struct mint_item *item);
+
+void mint_get_stats(struct mint *mint, struct mint_stats *stats);
+
+#endif
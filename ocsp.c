@@ -0,0 +1,658 @@
+/*
+// OCSP responder answering from pre-signed responses. A response is
+// signed once per CertID and served until it nears nextUpdate, when a
+// background batch on the worker pool signs a replacement (RFC 5019
+// style: no nonces, so cached answers stay valid for every client).
+//
+// Readers never take a lock: they announce themselves in one of two
+// counters selected by the current epoch, load the table and response
+// pointers, copy the bytes out and leave. Writers serialize on
+// write_lock, retire what they replace and free it only after flipping
+// the epoch and waiting for the previous epoch's readers to drain.
+// https://tools.ietf.org/html/rfc6960
+// https://tools.ietf.org/html/rfc5019
+*/
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/err.h>
+#include <openssl/ocsp.h>
+#include <openssl/x509v3.h>
+
+#include "crl.h"
+#include "ocsp.h"
+#include "pool.h"
+
+/* serials signed per background job */
+#define OCSP_BATCH 64
+/* free retired responses once this much has piled up */
+#define OCSP_RETIRE_BYTES (256 * 1024)
+
+static const unsigned char RESP_MALFORMED[] = { 0x30, 0x03, 0x0a, 0x01, 0x01 };
+static const unsigned char RESP_INTERNAL[] = { 0x30, 0x03, 0x0a, 0x01, 0x02 };
+static const unsigned char RESP_UNAUTHORIZED[] = { 0x30, 0x03, 0x0a, 0x01, 0x06 };
+
+static const EVP_MD *ocsp_md(int hash) {
+	return hash == OCSP_HASH_SHA1 ? ca_sha1() : ca_sha256();
+}
+
+static void ocsp_crl_changed(void *arg, const unsigned char *serial, size_t len) {
+	ocsp_invalidate(arg, serial, len);
+}
+
+/* ------------------------------------------------------------ *
+ * Readers: lock-free entry into the current epoch              *
+ * -------------------------------------------------------------*/
+static unsigned long reader_enter(struct ocsp *ocsp) {
+	for (;;) {
+		unsigned long epoch = __atomic_load_n(&ocsp->epoch, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&ocsp->active[epoch & 1], 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ocsp->epoch, __ATOMIC_SEQ_CST) == epoch) {
+			return epoch;
+		}
+		__atomic_sub_fetch(&ocsp->active[epoch & 1], 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+static void reader_exit(struct ocsp *ocsp, unsigned long epoch) {
+	__atomic_sub_fetch(&ocsp->active[epoch & 1], 1, __ATOMIC_RELEASE);
+}
+
+/* ------------------------------------------------------------ *
+ * Writers (write_lock held): wait out the readers that could   *
+ * still see retired memory, then free it                       *
+ * -------------------------------------------------------------*/
+static void ocsp_reclaim(struct ocsp *ocsp) {
+	if (ocsp->retired == NULL && ocsp->retired_tables == NULL) {
+		return;
+	}
+
+	unsigned long epoch = ocsp->epoch;
+	__atomic_store_n(&ocsp->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&ocsp->active[epoch & 1], __ATOMIC_SEQ_CST) != 0) {
+		sched_yield();
+	}
+
+	while (ocsp->retired != NULL) {
+		struct ocsp_resp *resp = ocsp->retired;
+		ocsp->retired = resp->retired_next;
+		free(resp);
+	}
+	while (ocsp->retired_tables != NULL) {
+		struct ocsp_table *table = ocsp->retired_tables;
+		ocsp->retired_tables = table->retired_next;
+		free(table);
+	}
+	ocsp->retired_bytes = 0;
+}
+
+static size_t item_hash(int hash, const unsigned char *serial, size_t len) {
+	size_t h = 2166136261u ^ hash;
+	for (size_t idx = 0; idx < len; idx++) {
+		h = (h ^ serial[idx]) * 16777619u;
+	}
+	return h;
+}
+
+static struct ocsp_item *table_find(struct ocsp_table *table, int hash,
+		const unsigned char *serial, size_t len) {
+	for (size_t idx = item_hash(hash, serial, len) & table->mask;; idx = (idx + 1) & table->mask) {
+		struct ocsp_item *item = __atomic_load_n(&table->slots[idx], __ATOMIC_ACQUIRE);
+		if (item == NULL) {
+			return NULL;
+		}
+		if (item->hash == hash && item->serial_len == len && memcmp(item->serial, serial, len) == 0) {
+			return item;
+		}
+	}
+}
+
+static struct ocsp_table *table_new(size_t size) {
+	struct ocsp_table *table = calloc(1, sizeof(*table) + size * sizeof(table->slots[0]));
+	if (table != NULL) {
+		table->mask = size - 1;
+	}
+	return table;
+}
+
+static void table_put(struct ocsp_table *table, struct ocsp_item *item) {
+	size_t idx = item_hash(item->hash, item->serial, item->serial_len) & table->mask;
+	while (table->slots[idx] != NULL) {
+		idx = (idx + 1) & table->mask;
+	}
+	__atomic_store_n(&table->slots[idx], item, __ATOMIC_RELEASE);
+}
+
+/* find or add the item for a CertID, NULL when adding would take
+ * the table past limit items; write_lock held */
+static struct ocsp_item *ocsp_item_get(struct ocsp *ocsp, int hash,
+		const unsigned char *serial, size_t len, size_t limit) {
+	struct ocsp_item *item = table_find(ocsp->table, hash, serial, len);
+	if (item != NULL || ocsp->count >= limit) {
+		return item;
+	}
+
+	// keep the load under one half so probes stay short
+	if (2 * (ocsp->count + 1) > ocsp->table->mask + 1) {
+		struct ocsp_table *old = ocsp->table;
+		struct ocsp_table *table = table_new(2 * (old->mask + 1));
+		if (table == NULL) {
+			return NULL;
+		}
+		for (size_t idx = 0; idx <= old->mask; idx++) {
+			if (old->slots[idx] != NULL) {
+				table_put(table, old->slots[idx]);
+			}
+		}
+		__atomic_store_n(&ocsp->table, table, __ATOMIC_RELEASE);
+		old->retired_next = ocsp->retired_tables;
+		ocsp->retired_tables = old;
+	}
+
+	if ((item = calloc(1, sizeof(*item))) == NULL) {
+		return NULL;
+	}
+	item->hash = hash;
+	item->serial_len = len;
+	memcpy(item->serial, serial, len);
+	table_put(ocsp->table, item);
+	ocsp->count++;
+	return item;
+}
+
+static void ocsp_publish(struct ocsp *ocsp, struct ocsp_item *item, struct ocsp_resp *resp) {
+	struct ocsp_resp *old = __atomic_exchange_n(&item->resp, resp, __ATOMIC_ACQ_REL);
+	if (old != NULL) {
+		old->retired_next = ocsp->retired;
+		ocsp->retired = old;
+		ocsp->retired_bytes += sizeof(*old) + old->len;
+	}
+}
+
+struct ocsp *ocsp_new(struct ca *ca, long validity, long refresh_before, size_t max_entries) {
+	struct ocsp *ocsp = calloc(1, sizeof(*ocsp));
+	if (ocsp == NULL) {
+		return NULL;
+	}
+	ocsp->ca = ca;
+	ocsp->validity = validity;
+	ocsp->refresh_before = refresh_before;
+	ocsp->max_entries = max_entries;
+	pthread_mutex_init(&ocsp->write_lock, NULL);
+
+	if ((ocsp->table = table_new(1024)) == NULL) {
+		goto __error;
+	}
+
+	const ASN1_BIT_STRING *key = X509_get0_pubkey_bitstr(ca->crt);
+	for (int hash = 0; hash < OCSP_HASHES; hash++) {
+		if (! EVP_Digest(ca->issuer_der, ca->issuer_len, ocsp->name_hash[hash], NULL, ocsp_md(hash), NULL) ||
+				! EVP_Digest(key->data, key->length, ocsp->key_hash[hash], NULL, ocsp_md(hash), NULL)) {
+			err_descr_to_stderr("Error hashing OCSP issuer");
+			goto __error;
+		}
+	}
+	return ocsp;
+
+__error:
+	ocsp_free(ocsp);
+	return NULL;
+}
+
+void ocsp_free(struct ocsp *ocsp) {
+	if (ocsp->table != NULL) {
+		for (size_t idx = 0; idx <= ocsp->table->mask; idx++) {
+			struct ocsp_item *item = ocsp->table->slots[idx];
+			if (item != NULL) {
+				free(item->resp);
+				free(item);
+			}
+		}
+		free(ocsp->table);
+	}
+	ocsp_reclaim(ocsp);
+	pthread_mutex_destroy(&ocsp->write_lock);
+	free(ocsp);
+}
+
+struct ocsp *ca_ocsp(struct ca *ca, long validity, long refresh_before, size_t max_entries) {
+	struct crl *crl = ca_crl(ca);
+	if (crl == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&ca->lock);
+	if (ca->ocsp == NULL && (ca->ocsp = ocsp_new(ca, validity, refresh_before, max_entries)) != NULL) {
+		pthread_mutex_lock(&crl->lock);
+		crl->on_change = ocsp_crl_changed;
+		crl->on_change_arg = ca->ocsp;
+		pthread_mutex_unlock(&crl->lock);
+	}
+	pthread_mutex_unlock(&ca->lock);
+	return ca->ocsp;
+}
+
+/* ------------------------------------------------------------ *
+ * Sign one SingleResponse for serial under the CA key          *
+ * -------------------------------------------------------------*/
+static struct ocsp_resp *ocsp_sign(struct ocsp *ocsp, int hash,
+		const unsigned char *serial, size_t len) {
+	struct ca *ca = ocsp->ca;
+	struct ocsp_resp *out = NULL;
+	BIGNUM *bn = NULL;
+	ASN1_INTEGER *aserial = NULL;
+	OCSP_CERTID *cid = NULL;
+	OCSP_BASICRESP *bs = NULL;
+	OCSP_RESPONSE *resp = NULL;
+	ASN1_TIME *thisupd = NULL, *nextupd = NULL, *revtime = NULL;
+	time_t now = time(NULL), when = 0;
+	int status = V_OCSP_CERTSTATUS_GOOD, reason = CRL_REASON_NONE;
+
+	if (! (bn = BN_bin2bn(serial, len, NULL)) || ! (aserial = BN_to_ASN1_INTEGER(bn, NULL))) {
+		err_descr_to_stderr("Error converting OCSP serial");
+		goto __error;
+	}
+	if (! (cid = OCSP_cert_id_new(ocsp_md(hash), X509_get_subject_name(ca->crt),
+			X509_get0_pubkey_bitstr(ca->crt), aserial))) {
+		err_descr_to_stderr("Error building OCSP CertID");
+		goto __error;
+	}
+
+	if (ca->crl != NULL && crl_status(ca->crl, serial, len, &when, &reason)) {
+		status = V_OCSP_CERTSTATUS_REVOKED;
+		if (! (revtime = ASN1_TIME_set(NULL, when))) {
+			goto __error;
+		}
+	}
+
+	if (! (bs = OCSP_BASICRESP_new()) ||
+			! (thisupd = X509_gmtime_adj(NULL, 0)) ||
+			! (nextupd = X509_gmtime_adj(NULL, ocsp->validity))) {
+		err_descr_to_stderr("Error allocating OCSP response");
+		goto __error;
+	}
+	if (! OCSP_basic_add1_status(bs, cid, status,
+			reason == CRL_REASON_NONE ? OCSP_REVOKED_STATUS_NOSTATUS : reason,
+			revtime, thisupd, nextupd)) {
+		err_descr_to_stderr("Error adding OCSP status");
+		goto __error;
+	}
+	if (! OCSP_basic_sign(bs, ca->crt, ca->key, ca->md, NULL, OCSP_NOCERTS)) {
+		err_descr_to_stderr("Error signing OCSP response");
+		goto __error;
+	}
+	if (! (resp = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, bs))) {
+		err_descr_to_stderr("Error creating OCSP response");
+		goto __error;
+	}
+
+	int der_len = i2d_OCSP_RESPONSE(resp, NULL);
+	if (der_len <= 0 || ! (out = malloc(sizeof(*out) + der_len))) {
+		goto __error;
+	}
+	unsigned char *p = out->der;
+	i2d_OCSP_RESPONSE(resp, &p);
+	out->len = der_len;
+	out->next_update = now + ocsp->validity;
+	out->status = status == V_OCSP_CERTSTATUS_REVOKED ? OCSP_ANSWER_REVOKED : OCSP_ANSWER_GOOD;
+	__atomic_add_fetch(&ocsp->signs, 1, __ATOMIC_RELAXED);
+
+__error:
+	OCSP_RESPONSE_free(resp);
+	OCSP_BASICRESP_free(bs);
+	ASN1_TIME_free(thisupd);
+	ASN1_TIME_free(nextupd);
+	ASN1_TIME_free(revtime);
+	OCSP_CERTID_free(cid);
+	ASN1_INTEGER_free(aserial);
+	BN_free(bn);
+	return out;
+}
+
+/* ------------------------------------------------------------ *
+ * Miss path: sign now, cache it if there is room, hand back a  *
+ * copy                                                         *
+ * -------------------------------------------------------------*/
+static int ocsp_sign_cached(struct ocsp *ocsp, int hash, const unsigned char *serial, size_t len,
+		struct der *out) {
+	pthread_mutex_lock(&ocsp->write_lock);
+	struct ocsp_item *item = ocsp_item_get(ocsp, hash, serial, len, ocsp->max_entries / 2);
+	pthread_mutex_unlock(&ocsp->write_lock);
+	if (item != NULL) {
+		__atomic_store_n(&item->stale, 0, __ATOMIC_SEQ_CST);
+	} else {
+		__atomic_add_fetch(&ocsp->uncached, 1, __ATOMIC_RELAXED);
+	}
+
+	struct ocsp_resp *resp = ocsp_sign(ocsp, hash, serial, len);
+	if (resp == NULL) {
+		der_put(out, RESP_INTERNAL, sizeof(RESP_INTERNAL));
+		return OCSP_ANSWER_ERROR;
+	}
+	der_put(out, resp->der, resp->len);
+	int status = resp->status;
+
+	if (item == NULL) {
+		free(resp);
+		return status;
+	}
+	pthread_mutex_lock(&ocsp->write_lock);
+	ocsp_publish(ocsp, item, resp);
+	if (ocsp->retired_bytes > OCSP_RETIRE_BYTES) {
+		ocsp_reclaim(ocsp);
+	}
+	pthread_mutex_unlock(&ocsp->write_lock);
+	return status;
+}
+
+/* ------------------------------------------------------------ *
+ * Requests the cache can't serve: several CertIDs or other     *
+ * hash algorithms. One BasicOCSPResponse, signed on demand.    *
+ * -------------------------------------------------------------*/
+static int ocsp_respond_slow(struct ocsp *ocsp, OCSP_REQUEST *req, struct der *out) {
+	struct ca *ca = ocsp->ca;
+	int answer = OCSP_ANSWER_ERROR;
+	OCSP_BASICRESP *bs = OCSP_BASICRESP_new();
+	OCSP_RESPONSE *resp = NULL;
+	ASN1_TIME *thisupd = X509_gmtime_adj(NULL, 0);
+	ASN1_TIME *nextupd = X509_gmtime_adj(NULL, ocsp->validity);
+
+	if (bs == NULL || thisupd == NULL || nextupd == NULL) {
+		goto __error;
+	}
+
+	int count = OCSP_request_onereq_count(req);
+	for (int idx = 0; idx < count; idx++) {
+		OCSP_CERTID *cid = OCSP_onereq_get0_id(OCSP_request_onereq_get0(req, idx));
+		ASN1_OBJECT *md_obj = NULL;
+		ASN1_INTEGER *serial = NULL;
+		OCSP_id_get0_info(NULL, &md_obj, NULL, &serial, cid);
+
+		const EVP_MD *md = EVP_get_digestbyobj(md_obj);
+		OCSP_CERTID *ours = md != NULL ? OCSP_cert_id_new(md, X509_get_subject_name(ca->crt),
+				X509_get0_pubkey_bitstr(ca->crt), serial) : NULL;
+		int mine = ours != NULL && OCSP_id_issuer_cmp(ours, cid) == 0;
+		OCSP_CERTID_free(ours);
+		if (!mine) {
+			answer = OCSP_ANSWER_UNAUTHORIZED;
+			goto __error;
+		}
+
+		time_t when = 0;
+		int reason = CRL_REASON_NONE;
+		int status = V_OCSP_CERTSTATUS_GOOD;
+		ASN1_TIME *revtime = NULL;
+		if (ca->crl != NULL && serial->type == V_ASN1_INTEGER &&
+				crl_status(ca->crl, serial->data, serial->length, &when, &reason)) {
+			status = V_OCSP_CERTSTATUS_REVOKED;
+			revtime = ASN1_TIME_set(NULL, when);
+		}
+		int added = OCSP_basic_add1_status(bs, cid, status,
+				reason == CRL_REASON_NONE ? OCSP_REVOKED_STATUS_NOSTATUS : reason,
+				revtime, thisupd, nextupd) != NULL;
+		ASN1_TIME_free(revtime);
+		if (!added) {
+			answer = OCSP_ANSWER_ERROR;
+			goto __error;
+		}
+		answer = status == V_OCSP_CERTSTATUS_REVOKED ? OCSP_ANSWER_REVOKED :
+			(answer == OCSP_ANSWER_REVOKED ? answer : OCSP_ANSWER_GOOD);
+	}
+
+	if (! OCSP_basic_sign(bs, ca->crt, ca->key, ca->md, NULL, OCSP_NOCERTS) ||
+			! (resp = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, bs))) {
+		err_descr_to_stderr("Error signing OCSP response");
+		answer = OCSP_ANSWER_ERROR;
+		goto __error;
+	}
+	__atomic_add_fetch(&ocsp->signs, 1, __ATOMIC_RELAXED);
+
+	unsigned char *p;
+	int len = i2d_OCSP_RESPONSE(resp, NULL);
+	if (len <= 0 || ! der_reserve(out, len)) {
+		answer = OCSP_ANSWER_ERROR;
+		goto __error;
+	}
+	p = out->buf + out->len;
+	i2d_OCSP_RESPONSE(resp, &p);
+	out->len += len;
+
+__error:
+	if (answer == OCSP_ANSWER_UNAUTHORIZED) {
+		der_put(out, RESP_UNAUTHORIZED, sizeof(RESP_UNAUTHORIZED));
+	} else if (answer == OCSP_ANSWER_ERROR) {
+		der_put(out, RESP_INTERNAL, sizeof(RESP_INTERNAL));
+	}
+	OCSP_RESPONSE_free(resp);
+	OCSP_BASICRESP_free(bs);
+	ASN1_TIME_free(thisupd);
+	ASN1_TIME_free(nextupd);
+	return answer;
+}
+
+int ocsp_respond(struct ocsp *ocsp, const unsigned char *req_der, size_t req_len,
+		struct der *out, int *cached) {
+	const unsigned char *p = req_der;
+	int answer;
+
+	*cached = 0;
+	OCSP_REQUEST *req = d2i_OCSP_REQUEST(NULL, &p, req_len);
+	if (req == NULL || OCSP_request_onereq_count(req) < 1) {
+		ERR_clear_error();
+		OCSP_REQUEST_free(req);
+		der_put(out, RESP_MALFORMED, sizeof(RESP_MALFORMED));
+		return OCSP_ANSWER_MALFORMED;
+	}
+	if (OCSP_request_onereq_count(req) > 1) {
+		answer = ocsp_respond_slow(ocsp, req, out);
+		OCSP_REQUEST_free(req);
+		return answer;
+	}
+
+	ASN1_OCTET_STRING *name_hash = NULL, *key_hash = NULL;
+	ASN1_OBJECT *md_obj = NULL;
+	ASN1_INTEGER *serial = NULL;
+	OCSP_id_get0_info(&name_hash, &md_obj, &key_hash, &serial,
+			OCSP_onereq_get0_id(OCSP_request_onereq_get0(req, 0)));
+
+	int nid = OBJ_obj2nid(md_obj);
+	int hash = nid == NID_sha1 ? OCSP_HASH_SHA1 : nid == NID_sha256 ? OCSP_HASH_SHA256 : -1;
+	if (hash < 0 || serial->type != V_ASN1_INTEGER || serial->length > CA_SERIAL_MAX) {
+		answer = ocsp_respond_slow(ocsp, req, out);
+		OCSP_REQUEST_free(req);
+		return answer;
+	}
+
+	size_t md_len = EVP_MD_size(ocsp_md(hash));
+	if (name_hash->length != (int) md_len || key_hash->length != (int) md_len ||
+			memcmp(name_hash->data, ocsp->name_hash[hash], md_len) != 0 ||
+			memcmp(key_hash->data, ocsp->key_hash[hash], md_len) != 0) {
+		OCSP_REQUEST_free(req);
+		der_put(out, RESP_UNAUTHORIZED, sizeof(RESP_UNAUTHORIZED));
+		return OCSP_ANSWER_UNAUTHORIZED;
+	}
+
+	unsigned char key[CA_SERIAL_MAX];
+	size_t len = serial->length;
+	const unsigned char *mag = serial->data;
+	while (len > 1 && mag[0] == 0) {
+		mag++;
+		len--;
+	}
+	memcpy(key, mag, len);
+	OCSP_REQUEST_free(req);
+
+	// lock-free hit path
+	time_t now = time(NULL);
+	unsigned long epoch = reader_enter(ocsp);
+	struct ocsp_table *table = __atomic_load_n(&ocsp->table, __ATOMIC_ACQUIRE);
+	struct ocsp_item *item = table_find(table, hash, key, len);
+	struct ocsp_resp *resp = item != NULL ? __atomic_load_n(&item->resp, __ATOMIC_ACQUIRE) : NULL;
+	if (resp != NULL && now < resp->next_update && !__atomic_load_n(&item->stale, __ATOMIC_ACQUIRE)) {
+		der_put(out, resp->der, resp->len);
+		answer = resp->status;
+		reader_exit(ocsp, epoch);
+		__atomic_add_fetch(&ocsp->hits, 1, __ATOMIC_RELAXED);
+		*cached = 1;
+		return answer;
+	}
+	reader_exit(ocsp, epoch);
+
+	__atomic_add_fetch(&ocsp->misses, 1, __ATOMIC_RELAXED);
+	return ocsp_sign_cached(ocsp, hash, key, len, out);
+}
+
+void ocsp_invalidate(struct ocsp *ocsp, const unsigned char *serial, size_t len) {
+	while (len > 1 && serial[0] == 0) {
+		serial++;
+		len--;
+	}
+
+	unsigned long epoch = reader_enter(ocsp);
+	struct ocsp_table *table = __atomic_load_n(&ocsp->table, __ATOMIC_ACQUIRE);
+	for (int hash = 0; hash < OCSP_HASHES; hash++) {
+		struct ocsp_item *item = table_find(table, hash, serial, len);
+		if (item != NULL) {
+			__atomic_store_n(&item->stale, 1, __ATOMIC_SEQ_CST);
+		}
+	}
+	reader_exit(ocsp, epoch);
+}
+
+/* ------------------------------------------------------------ *
+ * Background re-signing, OCSP_BATCH items per pool job         *
+ * -------------------------------------------------------------*/
+struct ocsp_batch {
+	struct ocsp *ocsp;
+	size_t count;
+	struct ocsp_item *items[OCSP_BATCH];
+};
+
+static void ocsp_batch_run(void *arg) {
+	struct ocsp_batch *batch = arg;
+	struct ocsp *ocsp = batch->ocsp;
+
+	for (size_t idx = 0; idx < batch->count; idx++) {
+		struct ocsp_item *item = batch->items[idx];
+		// clear before reading the status so a revoke racing us re-marks it
+		__atomic_store_n(&item->stale, 0, __ATOMIC_SEQ_CST);
+		struct ocsp_resp *resp = ocsp_sign(ocsp, item->hash, item->serial, item->serial_len);
+
+		pthread_mutex_lock(&ocsp->write_lock);
+		if (resp != NULL) {
+			ocsp_publish(ocsp, item, resp);
+		}
+		item->queued = 0;
+		pthread_mutex_unlock(&ocsp->write_lock);
+	}
+
+	pthread_mutex_lock(&ocsp->write_lock);
+	ocsp_reclaim(ocsp);
+	ocsp->pending--;
+	pthread_mutex_unlock(&ocsp->write_lock);
+
+	ca_unref(ocsp->ca);
+	free(batch);
+}
+
+/* hand a filled batch to the pool; write_lock held */
+static int ocsp_batch_submit(struct ocsp *ocsp, struct ocsp_batch *batch) {
+	struct pool *pool = pool_default();
+	ca_ref(ocsp->ca);
+	if (pool == NULL || ! pool_submit(pool, ocsp_batch_run, batch)) {
+		for (size_t idx = 0; idx < batch->count; idx++) {
+			batch->items[idx]->queued = 0;
+		}
+		ca_unref(ocsp->ca);
+		free(batch);
+		return 0;
+	}
+	ocsp->pending++;
+	__atomic_add_fetch(&ocsp->batches, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/* queue item into *batch, submitting full batches; write_lock held */
+static int ocsp_batch_add(struct ocsp *ocsp, struct ocsp_batch **batch, struct ocsp_item *item) {
+	if (item->queued) {
+		return 0;
+	}
+	if (*batch == NULL) {
+		if ((*batch = calloc(1, sizeof(**batch))) == NULL) {
+			return 0;
+		}
+		(*batch)->ocsp = ocsp;
+	}
+	item->queued = 1;
+	(*batch)->items[(*batch)->count++] = item;
+	if ((*batch)->count == OCSP_BATCH) {
+		ocsp_batch_submit(ocsp, *batch);
+		*batch = NULL;
+	}
+	return 1;
+}
+
+size_t ocsp_presign(struct ocsp *ocsp, const unsigned char (*serials)[CA_SERIAL_MAX],
+		const size_t *lens, size_t count, int hash) {
+	struct ocsp_batch *batch = NULL;
+	size_t queued = 0;
+
+	pthread_mutex_lock(&ocsp->write_lock);
+	for (size_t idx = 0; idx < count; idx++) {
+		const unsigned char *serial = serials[idx];
+		size_t len = lens[idx];
+		while (len > 1 && serial[0] == 0) {
+			serial++;
+			len--;
+		}
+		struct ocsp_item *item = ocsp_item_get(ocsp, hash, serial, len, ocsp->max_entries);
+		if (item != NULL && item->resp == NULL) {
+			queued += ocsp_batch_add(ocsp, &batch, item);
+		}
+	}
+	if (batch != NULL) {
+		ocsp_batch_submit(ocsp, batch);
+	}
+	pthread_mutex_unlock(&ocsp->write_lock);
+	return queued;
+}
+
+void ocsp_forked(struct ocsp *ocsp) {
+	struct ocsp_table *table = ocsp->table;
+	for (size_t idx = 0; idx <= table->mask; idx++) {
+		if (table->slots[idx] != NULL) {
+			table->slots[idx]->queued = 0;
+		}
+	}
+	ocsp->active[0] = ocsp->active[1] = 0;
+	ocsp->pending = 0;
+}
+
+size_t ocsp_refresh(struct ocsp *ocsp) {
+	struct ocsp_batch *batch = NULL;
+	size_t queued = 0;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&ocsp->write_lock);
+	struct ocsp_table *table = ocsp->table;
+	for (size_t idx = 0; idx <= table->mask; idx++) {
+		struct ocsp_item *item = table->slots[idx];
+		if (item == NULL) {
+			continue;
+		}
+		struct ocsp_resp *resp = item->resp;
+		if (resp == NULL || __atomic_load_n(&item->stale, __ATOMIC_ACQUIRE) ||
+				resp->next_update - ocsp->refresh_before <= now) {
+			queued += ocsp_batch_add(ocsp, &batch, item);
+		}
+	}
+	if (batch != NULL) {
+		ocsp_batch_submit(ocsp, batch);
+	}
+	pthread_mutex_unlock(&ocsp->write_lock);
+	return queued;
+}
@@ -0,0 +1,110 @@
+#ifndef LUA_OPENSSL_OCSP_H
+#define LUA_OPENSSL_OCSP_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <openssl/sha.h>
+
+#include "ca.h"
+#include "der.h"
+
+/* CertID hash algorithms answered from the cache */
+#define OCSP_HASH_SHA1   0
+#define OCSP_HASH_SHA256 1
+#define OCSP_HASHES      2
+
+/* default cap on cached CertIDs */
+#define OCSP_MAX_ENTRIES 65536
+
+/* immutable once published; replaced, never edited */
+struct ocsp_resp {
+	time_t next_update;
+	int status;
+	size_t len;
+	struct ocsp_resp *retired_next;
+	unsigned char der[];
+};
+
+/* ------------------------------------------------------------ *
+ * One CertID (hash algorithm + serial). Items are never freed  *
+ * before the responder, only their response pointer swaps.     *
+ * -------------------------------------------------------------*/
+struct ocsp_item {
+	unsigned char hash;
+	unsigned char serial_len;
+	unsigned char serial[CA_SERIAL_MAX];
+	int stale;			/* status changed since last signed */
+	int queued;			/* sitting in a re-sign batch */
+	struct ocsp_resp *resp;
+};
+
+struct ocsp_table {
+	size_t mask;
+	struct ocsp_table *retired_next;
+	struct ocsp_item *slots[];
+};
+
+struct ocsp {
+	struct ca *ca;
+	long validity;			/* thisUpdate..nextUpdate, seconds */
+	long refresh_before;		/* re-sign this long before nextUpdate */
+
+	unsigned char name_hash[OCSP_HASHES][SHA256_DIGEST_LENGTH];
+	unsigned char key_hash[OCSP_HASHES][SHA256_DIGEST_LENGTH];
+
+	struct ocsp_table *table;	/* readers load it without locks */
+	size_t count;
+	size_t max_entries;		/* presign fills up to this, misses half of it */
+
+	/* readers announce themselves in active[epoch & 1] */
+	unsigned long epoch;
+	unsigned long active[2];
+
+	pthread_mutex_t write_lock;	/* writers, resize and reclamation */
+	struct ocsp_resp *retired;
+	struct ocsp_table *retired_tables;
+	size_t retired_bytes;
+
+	size_t hits, misses, uncached, signs, batches, pending;
+};
+
+/* ------------------------------------------------------------ *
+ * Anyone can ask about any serial, so what a miss may add to   *
+ * the cache is bounded: items are never evicted, and every one *
+ * is re-signed on refresh. Misses stop being cached at half of *
+ * max_entries, keeping the rest for presigned serials; past    *
+ * that they are signed and answered but not kept.              *
+ * -------------------------------------------------------------*/
+struct ocsp *ocsp_new(struct ca *ca, long validity, long refresh_before, size_t max_entries);
+void ocsp_free(struct ocsp *ocsp);
+
+/* the CA's responder, created on first use */
+struct ocsp *ca_ocsp(struct ca *ca, long validity, long refresh_before, size_t max_entries);
+
+#define OCSP_ANSWER_GOOD          0
+#define OCSP_ANSWER_REVOKED       1
+#define OCSP_ANSWER_UNKNOWN       2
+#define OCSP_ANSWER_MALFORMED     3
+#define OCSP_ANSWER_UNAUTHORIZED  4
+#define OCSP_ANSWER_ERROR         5
+
+/* answer a DER OCSPRequest into out; *cached says if it was pre-signed */
+int ocsp_respond(struct ocsp *ocsp, const unsigned char *req, size_t req_len,
+		struct der *out, int *cached);
+
+/* queue background signing of these serials / of expiring entries */
+size_t ocsp_presign(struct ocsp *ocsp, const unsigned char (*serials)[CA_SERIAL_MAX],
+		const size_t *lens, size_t count, int hash);
+size_t ocsp_refresh(struct ocsp *ocsp);
+
+/* status of serial changed: its cached response must not be served */
+void ocsp_invalidate(struct ocsp *ocsp, const unsigned char *serial, size_t len);
+
+/* in the child, write_lock held across fork(): forget the readers
+ * and queued batches that stayed in the parent, so their items are
+ * queued again on the next refresh */
+void ocsp_forked(struct ocsp *ocsp);
+
+#endif
@@ -29,6 +29,94 @@ local M = {
   --gen_crt     = openssl.gen_crt,
   init_crypto = openssl.init_crypto,
   csr_crt     = openssl.csr_crt,
+  memstats    = openssl.memstats,
+  ca_new      = openssl.ca_new,
+  ca_remote   = openssl.ca_remote,
+  ca_public   = openssl.ca_public,
+  cad_connect = openssl.cad_connect,
+  ca_register = openssl.ca_register,
+  ca_get      = openssl.ca_get,
+  ca_unregister = openssl.ca_unregister,
+  new_store   = openssl.new_store,
+  parse_cert  = openssl.parse_cert,
+  parse_csr   = openssl.parse_csr,
+  policy      = openssl.policy,
+  sign_queue  = openssl.sign_queue,
+  sign_multi  = openssl.sign_multi,
+  prefork     = openssl.prefork,
+  postfork    = openssl.postfork,
+  b64encode   = openssl.b64encode,
+  b64decode   = openssl.b64decode,
+  b64codec    = openssl.b64codec,
+  buffer      = openssl.buffer,
 }
 
+--[[
+Under LuaJIT ca:sign goes through the plain C ABI of core.so (capi.h):
+the certificate is written into one reused buffer and copied out once,
+with no Lua C API marshaling on the way. M.capi is the library handle
+for callers that want the ABI itself. Coroutines keep the classic
+method, which ca:coalesce hooks into.
+]]--
+
+local function load_capi()
+  local has_ffi, ffi = pcall(require, "ffi")
+  if not has_ffi or not package.searchpath or not debug or not debug.getregistry then
+    return nil
+  end
+  local path = package.searchpath("core", package.cpath)
+  local CA = debug.getregistry()["openssl.ca"]
+  if path == nil or CA == nil then
+    return nil
+  end
+
+  -- a reloaded module finds the declarations already there
+  pcall(ffi.cdef, [[
+    struct ca;
+    struct ca *core_ca_new(const char *key, size_t key_len, const char *crt, size_t crt_len,
+        const char *password);
+    struct ca *core_ca_get(const char *name);
+    void core_ca_free(struct ca *ca);
+    size_t core_ca_sign_size(const struct ca *ca, size_t csr_len);
+    size_t core_ca_sign(struct ca *ca, const char *csr, size_t csr_len, char *out, size_t out_len,
+        char *serial, const char **why);
+  ]])
+  local ok, C = pcall(ffi.load, path)
+  if not ok or not pcall(function() return C.core_ca_sign end) then
+    return nil
+  end
+
+  local classic_sign = CA.sign
+  local buf, buf_len = nil, 0
+  local serial = ffi.new("char[41]")
+  local why = ffi.new("const char *[1]")
+
+  CA.sign = function(...)
+    local ca, csr = ...
+    local co, main = coroutine.running()
+    if (co ~= nil and not main) or type(csr) ~= "string" or getmetatable(ca) ~= CA then
+      return classic_sign(...)
+    end
+    -- the userdata boxes the struct ca pointer, NULL once released
+    local handle = ffi.cast("struct ca **", ca)[0]
+    if handle == nil then
+      return classic_sign(...)
+    end
+    local need = tonumber(C.core_ca_sign_size(handle, #csr))
+    if need > buf_len then
+      buf, buf_len = ffi.new("char[?]", need), need
+    end
+    local len = tonumber(C.core_ca_sign(handle, csr, #csr, buf, buf_len, serial, why))
+    if len == 0 then
+      return nil, ffi.string(why[0])
+    end
+    return ffi.string(buf, len), ffi.string(serial)
+  end
+  return C
+end
+
+if jit then
+  M.capi = load_capi()
+end
+
 return M
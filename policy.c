@@ -0,0 +1,509 @@
+/*
+// Issuance policy compiled once from Lua tables, checked per request
+// before any signature work. Domain suffixes live in a trie walked from
+// the rightmost label, so a check costs one lookup per label whatever the
+// size of the allow list.
+// https://tools.ietf.org/html/rfc6125#section-6.4.3
+*/
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "policy.h"
+
+struct policy_node {
+	char *label;		/* lowercase, NULL at the root */
+	size_t label_len;
+	int terminal;		/* an allowed suffix ends here */
+	struct policy_node **children;	/* sorted by label_cmp */
+	size_t count;
+	size_t cap;
+};
+
+struct policy_cidr {
+	int len;		/* address bytes: 4 or 16 */
+	int bits;
+	unsigned char addr[16];
+};
+
+static struct policy_node *node_new(const char *label, size_t len) {
+	struct policy_node *node = calloc(1, sizeof(*node));
+	if (node == NULL) {
+		return NULL;
+	}
+	if (label != NULL) {
+		if (! (node->label = malloc(len))) {
+			free(node);
+			return NULL;
+		}
+		for (size_t idx = 0; idx < len; idx++) {
+			node->label[idx] = tolower((unsigned char) label[idx]);
+		}
+		node->label_len = len;
+	}
+	return node;
+}
+
+static void node_free(struct policy_node *node) {
+	if (node == NULL) {
+		return;
+	}
+	for (size_t idx = 0; idx < node->count; idx++) {
+		node_free(node->children[idx]);
+	}
+	free(node->children);
+	free(node->label);
+	free(node);
+}
+
+/* case-insensitive, then shorter first */
+static int label_cmp(const char *a, size_t a_len, const char *b, size_t b_len) {
+	size_t len = a_len < b_len ? a_len : b_len;
+	for (size_t idx = 0; idx < len; idx++) {
+		int diff = tolower((unsigned char) a[idx]) - tolower((unsigned char) b[idx]);
+		if (diff != 0) {
+			return diff;
+		}
+	}
+	return a_len < b_len ? -1 : a_len > b_len;
+}
+
+/* child holding label, or NULL with *pos set to where it would go */
+static struct policy_node *node_child(const struct policy_node *node, const char *label, size_t len, size_t *pos) {
+	size_t lo = 0, hi = node->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct policy_node *child = node->children[mid];
+		int cmp = label_cmp(child->label, child->label_len, label, len);
+		if (cmp == 0) {
+			*pos = mid;
+			return node->children[mid];
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	*pos = lo;
+	return NULL;
+}
+
+struct policy *policy_new(int wildcard, int check_cn, int rsa_min, int ec_min) {
+	struct policy *policy = calloc(1, sizeof(*policy));
+	if (policy == NULL) {
+		return NULL;
+	}
+	policy->refs = 1;
+	if (! (policy->domains = node_new(NULL, 0)) || ! (policy->email_domains = node_new(NULL, 0))
+			|| ! (policy->uri_domains = node_new(NULL, 0))) {
+		policy_unref(policy);
+		return NULL;
+	}
+	policy->wildcard = wildcard;
+	policy->check_cn = check_cn;
+	policy->rsa_min = rsa_min;
+	policy->ec_min = ec_min;
+	return policy;
+}
+
+struct policy *policy_ref(struct policy *policy) {
+	__atomic_add_fetch(&policy->refs, 1, __ATOMIC_RELAXED);
+	return policy;
+}
+
+void policy_unref(struct policy *policy) {
+	if (policy == NULL || __atomic_sub_fetch(&policy->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+	node_free(policy->domains);
+	node_free(policy->email_domains);
+	node_free(policy->uri_domains);
+	free(policy->cidrs);
+	free(policy);
+}
+
+static int trie_add(struct policy_node *node, const char *domain) {
+	size_t end = strlen(domain);
+
+	// ".example.com" and "example.com." mean the same suffix
+	while (*domain == '.') {
+		domain++;
+		end--;
+	}
+	while (end > 0 && domain[end - 1] == '.') {
+		end--;
+	}
+	if (end == 0) {
+		return 0;
+	}
+
+	while (end > 0) {
+		size_t start = end;
+		while (start > 0 && domain[start - 1] != '.') {
+			start--;
+		}
+		size_t len = end - start, pos;
+		if (len == 0) {
+			return 0;
+		}
+
+		struct policy_node *child = node_child(node, domain + start, len, &pos);
+		if (child == NULL) {
+			if (node->count == node->cap) {
+				size_t cap = node->cap ? node->cap * 2 : 4;
+				struct policy_node **children = realloc(node->children, cap * sizeof(*children));
+				if (children == NULL) {
+					return 0;
+				}
+				node->children = children;
+				node->cap = cap;
+			}
+			if (! (child = node_new(domain + start, len))) {
+				return 0;
+			}
+			memmove(&node->children[pos + 1], &node->children[pos],
+					(node->count - pos) * sizeof(node->children[0]));
+			node->children[pos] = child;
+			node->count++;
+		}
+		node = child;
+		end = start > 0 ? start - 1 : 0;
+	}
+	node->terminal = 1;
+	return 1;
+}
+
+int policy_add_domain(struct policy *policy, const char *domain) {
+	return trie_add(policy->domains, domain);
+}
+
+int policy_add_email_domain(struct policy *policy, const char *domain) {
+	return trie_add(policy->email_domains, domain);
+}
+
+int policy_add_uri_domain(struct policy *policy, const char *domain) {
+	return trie_add(policy->uri_domains, domain);
+}
+
+int policy_add_cidr(struct policy *policy, const char *cidr) {
+	struct policy_cidr entry;
+	char addr[INET6_ADDRSTRLEN];
+	const char *slash = strchr(cidr, '/');
+	size_t len = slash != NULL ? (size_t) (slash - cidr) : strlen(cidr);
+
+	if (len >= sizeof(addr)) {
+		return 0;
+	}
+	memcpy(addr, cidr, len);
+	addr[len] = '\0';
+
+	memset(&entry, 0, sizeof(entry));
+	if (inet_pton(AF_INET, addr, entry.addr) == 1) {
+		entry.len = 4;
+	} else if (inet_pton(AF_INET6, addr, entry.addr) == 1) {
+		entry.len = 16;
+	} else {
+		return 0;
+	}
+
+	entry.bits = entry.len * 8;
+	if (slash != NULL) {
+		char *end;
+		long bits = strtol(slash + 1, &end, 10);
+		if (end == slash + 1 || *end != '\0' || bits < 0 || bits > entry.bits) {
+			return 0;
+		}
+		entry.bits = bits;
+	}
+	// keep only the network part so matching is a plain compare
+	for (int bit = entry.bits; bit < entry.len * 8; bit++) {
+		entry.addr[bit / 8] &= ~(0x80 >> (bit % 8));
+	}
+
+	if (policy->cidr_count == policy->cidr_cap) {
+		size_t cap = policy->cidr_cap ? policy->cidr_cap * 2 : 8;
+		struct policy_cidr *cidrs = realloc(policy->cidrs, cap * sizeof(*cidrs));
+		if (cidrs == NULL) {
+			return 0;
+		}
+		policy->cidrs = cidrs;
+		policy->cidr_cap = cap;
+	}
+	policy->cidrs[policy->cidr_count++] = entry;
+	return 1;
+}
+
+/* ------------------------------------------------------------ *
+ * Checks. Each fills why with the first value that fails.      *
+ * -------------------------------------------------------------*/
+static int domain_allowed(const struct policy_node *node, const char *name, size_t end) {
+
+	while (end > 0) {
+		size_t start = end, pos;
+		while (start > 0 && name[start - 1] != '.') {
+			start--;
+		}
+		if (! (node = node_child(node, name + start, end - start, &pos))) {
+			return 0;
+		}
+		if (node->terminal) {
+			return 1;
+		}
+		end = start > 0 ? start - 1 : 0;
+	}
+	return 0;
+}
+
+/* letters, digits, '-' and '_' in non-empty dot-separated labels */
+static int host_valid(const char *host, size_t len) {
+	for (size_t idx = 0; idx < len; idx++) {
+		unsigned char c = host[idx];
+		int empty_label = c == '.' && (idx == 0 || host[idx - 1] == '.' || idx + 1 == len);
+		if (empty_label || ! (isalnum(c) || c == '-' || c == '.' || c == '_')) {
+			return 0;
+		}
+	}
+	return len > 0;
+}
+
+static int check_dns(const struct policy *policy, const char *name, size_t len, char *why, size_t why_len) {
+	const char *host = name;
+	size_t host_len = len;
+
+	if (host_len > 0 && host[host_len - 1] == '.') {
+		host_len--;
+	}
+	if (host_len > 2 && host[0] == '*' && host[1] == '.') {
+		if (! policy->wildcard) {
+			snprintf(why, why_len, "wildcard name %.*s not allowed", (int) (len > 128 ? 128 : len), name);
+			return 0;
+		}
+		host += 2;
+		host_len -= 2;
+	}
+
+	if (! host_valid(host, host_len)) {
+		snprintf(why, why_len, "malformed DNS name %.*s", (int) (len > 128 ? 128 : len), name);
+		return 0;
+	}
+	if (! domain_allowed(policy->domains, host, host_len)) {
+		snprintf(why, why_len, "DNS name %.*s not under an allowed domain", (int) (len > 128 ? 128 : len), name);
+		return 0;
+	}
+	return 1;
+}
+
+static int cidr_match(const struct policy_cidr *cidr, const unsigned char *addr, int len) {
+	if (cidr->len != len) {
+		return 0;
+	}
+	int bytes = cidr->bits / 8, rest = cidr->bits % 8;
+	if (memcmp(cidr->addr, addr, bytes) != 0) {
+		return 0;
+	}
+	return rest == 0 || ((addr[bytes] ^ cidr->addr[bytes]) & (0xff00 >> rest)) == 0;
+}
+
+static int check_ip(const struct policy *policy, const unsigned char *addr, int len, char *why, size_t why_len) {
+	char text[INET6_ADDRSTRLEN];
+
+	if (len == 4 || len == 16) {
+		for (size_t idx = 0; idx < policy->cidr_count; idx++) {
+			if (cidr_match(&policy->cidrs[idx], addr, len)) {
+				return 1;
+			}
+		}
+	}
+	if ((len != 4 && len != 16) || ! inet_ntop(len == 4 ? AF_INET : AF_INET6, addr, text, sizeof(text))) {
+		snprintf(why, why_len, "malformed IP address in request");
+		return 0;
+	}
+	snprintf(why, why_len, "IP address %s outside the allowed ranges", text);
+	return 0;
+}
+
+/* local@domain, the domain at or below an allowed email domain */
+static int check_email(const struct policy *policy, const char *email, size_t len, char *why, size_t why_len) {
+	const char *at = memchr(email, '@', len);
+	int shown = len > 128 ? 128 : len;
+
+	if (at == NULL || at == email || memchr(at + 1, '@', email + len - at - 1) != NULL
+			|| ! host_valid(at + 1, email + len - at - 1)) {
+		snprintf(why, why_len, "malformed email %.*s", shown, email);
+		return 0;
+	}
+	if (! domain_allowed(policy->email_domains, at + 1, email + len - at - 1)) {
+		snprintf(why, why_len, "email %.*s not under an allowed domain", shown, email);
+		return 0;
+	}
+	return 1;
+}
+
+/* scheme://[userinfo@]host[:port][/...], the host at or below an
+ * allowed URI domain; RFC 5280 4.2.1.6 asks for a host name */
+static int check_uri(const struct policy *policy, const char *uri, size_t len, char *why, size_t why_len) {
+	const char *end = uri + len, *colon = memchr(uri, ':', len);
+	int shown = len > 128 ? 128 : len;
+
+	if (colon == NULL || colon == uri || end - colon < 3 || colon[1] != '/' || colon[2] != '/') {
+		snprintf(why, why_len, "URI %.*s has no host name", shown, uri);
+		return 0;
+	}
+	const char *host = colon + 3, *stop = host;
+	while (stop < end && *stop != '/' && *stop != '?' && *stop != '#') {
+		stop++;
+	}
+	for (const char *at = host; at < stop; at++) {
+		if (*at == '@') {
+			host = at + 1;
+		}
+	}
+	const char *port = memchr(host, ':', stop - host);
+	if (port != NULL) {
+		stop = port;
+	}
+	if (! host_valid(host, stop - host)) {
+		snprintf(why, why_len, "URI %.*s has no host name", shown, uri);
+		return 0;
+	}
+	if (! domain_allowed(policy->uri_domains, host, stop - host)) {
+		snprintf(why, why_len, "URI %.*s not under an allowed domain", shown, uri);
+		return 0;
+	}
+	return 1;
+}
+
+static int check_key(const struct policy *policy, EVP_PKEY *pkey, char *why, size_t why_len) {
+	if (pkey == NULL) {
+		ERR_clear_error();
+		snprintf(why, why_len, "can't read the request public key");
+		return 0;
+	}
+
+	int bits = EVP_PKEY_bits(pkey);
+	switch (EVP_PKEY_base_id(pkey)) {
+	case EVP_PKEY_RSA:
+	case EVP_PKEY_RSA_PSS:
+		if (bits < policy->rsa_min) {
+			snprintf(why, why_len, "RSA key of %d bits below the %d bit minimum", bits, policy->rsa_min);
+			return 0;
+		}
+		break;
+	case EVP_PKEY_EC:
+		if (bits < policy->ec_min) {
+			snprintf(why, why_len, "EC key of %d bits below the %d bit minimum", bits, policy->ec_min);
+			return 0;
+		}
+		break;
+	case EVP_PKEY_ED25519:
+	case EVP_PKEY_ED448:
+		break;
+	default:
+		// DSA and the rest have no floor here to hold them to
+		snprintf(why, why_len, "%s keys not allowed", OBJ_nid2sn(EVP_PKEY_base_id(pkey)) != NULL
+				? OBJ_nid2sn(EVP_PKEY_base_id(pkey)) : "unknown");
+		return 0;
+	}
+	return 1;
+}
+
+static const char *const gen_type_names[] = {
+	"otherName", "email", "DNS", "x400Address", "dirName", "ediPartyName", "URI", "IP", "registeredID",
+};
+
+#define GEN_TYPE_COUNT (sizeof(gen_type_names) / sizeof(gen_type_names[0]))
+
+static int check_sans(const struct policy *policy, const STACK_OF(X509_EXTENSION) *exts, char *why, size_t why_len) {
+	int crit;
+	GENERAL_NAMES *names = X509V3_get_d2i(exts, NID_subject_alt_name, &crit, NULL);
+	ERR_clear_error();
+	// NULL also comes back for a repeated or broken extension: not "no names"
+	if (names == NULL && crit != -1) {
+		snprintf(why, why_len, crit == -2 ? "subjectAltName extension repeated"
+				: "subjectAltName extension can't be decoded");
+		return 0;
+	}
+	int ok = 1;
+
+	for (int idx = 0; ok && idx < sk_GENERAL_NAME_num(names); idx++) {
+		GENERAL_NAME *gen = sk_GENERAL_NAME_value(names, idx);
+		int type;
+		const ASN1_STRING *value = GENERAL_NAME_get0_value(gen, &type);
+
+		switch (type) {
+		case GEN_DNS:
+			ok = check_dns(policy, (const char *) ASN1_STRING_get0_data(value), ASN1_STRING_length(value), why, why_len);
+			break;
+		case GEN_IPADD:
+			ok = check_ip(policy, ASN1_STRING_get0_data(value), ASN1_STRING_length(value), why, why_len);
+			break;
+		case GEN_EMAIL:
+			ok = check_email(policy, (const char *) ASN1_STRING_get0_data(value), ASN1_STRING_length(value), why, why_len);
+			break;
+		case GEN_URI:
+			ok = check_uri(policy, (const char *) ASN1_STRING_get0_data(value), ASN1_STRING_length(value), why, why_len);
+			break;
+		default:
+			snprintf(why, why_len, "subjectAltName of type %s not allowed",
+					type >= 0 && type < (int) GEN_TYPE_COUNT ? gen_type_names[type] : "unknown");
+			ok = 0;
+			break;
+		}
+	}
+	GENERAL_NAMES_free(names);
+	return ok;
+}
+
+/* the last commonName is what name matching would pick */
+static int check_cn(const struct policy *policy, X509_NAME *name, char *why, size_t why_len) {
+	int idx = -1, last = -1;
+	unsigned char *utf8, addr[16];
+
+	while ((idx = X509_NAME_get_index_by_NID(name, NID_commonName, idx)) >= 0) {
+		last = idx;
+	}
+	if (last < 0) {
+		return 1;
+	}
+	int len = ASN1_STRING_to_UTF8(&utf8, X509_NAME_ENTRY_get_data(X509_NAME_get_entry(name, last)));
+	if (len < 0) {
+		ERR_clear_error();
+		snprintf(why, why_len, "malformed commonName");
+		return 0;
+	}
+
+	int ok;
+	if (inet_pton(AF_INET, (char *) utf8, addr) == 1) {
+		ok = check_ip(policy, addr, 4, why, why_len);
+	} else if (inet_pton(AF_INET6, (char *) utf8, addr) == 1) {
+		ok = check_ip(policy, addr, 16, why, why_len);
+	} else {
+		ok = check_dns(policy, (const char *) utf8, len, why, why_len);
+	}
+	OPENSSL_free(utf8);
+	return ok;
+}
+
+int policy_check_parts(const struct policy *policy, EVP_PKEY *pkey, X509_NAME *subject,
+		const STACK_OF(X509_EXTENSION) *exts, char *why, size_t why_len) {
+	return check_key(policy, pkey, why, why_len)
+		&& check_sans(policy, exts, why, why_len)
+		&& (! policy->check_cn || check_cn(policy, subject, why, why_len));
+}
+
+int policy_check(const struct policy *policy, X509_REQ *req, char *why, size_t why_len) {
+	STACK_OF(X509_EXTENSION) *exts = X509_REQ_get_extensions(req);
+	int ok = policy_check_parts(policy, X509_REQ_get0_pubkey(req), X509_REQ_get_subject_name(req),
+			exts, why, why_len);
+	sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);
+	return ok;
+}
@@ -0,0 +1,54 @@
+#ifndef LUA_OPENSSL_POLICY_H
+#define LUA_OPENSSL_POLICY_H
+
+#include <stddef.h>
+
+#include <openssl/x509.h>
+
+/* room for a rejection reason naming the offending value */
+#define POLICY_WHY_MAX 256
+
+struct policy_node;
+struct policy_cidr;
+
+/* ------------------------------------------------------------ *
+ * Issuance policy compiled from its Lua description: allowed   *
+ * domain suffixes in tries keyed by reversed labels, allowed   *
+ * address ranges as CIDR tables, and key size floors. Shared   *
+ * by refcount and never changed once built.                    *
+ * -------------------------------------------------------------*/
+struct policy {
+	int refs;
+	struct policy_node *domains;
+	struct policy_node *email_domains;	/* email SANs: the part after the @ */
+	struct policy_node *uri_domains;	/* URI SANs: the authority's host */
+	int wildcard;		/* "*.name" allowed as the leftmost label */
+	int check_cn;		/* commonName must pass as a DNS name too */
+
+	struct policy_cidr *cidrs;
+	size_t cidr_count;
+	size_t cidr_cap;
+
+	int rsa_min;		/* bits, 0 = no floor */
+	int ec_min;
+};
+
+struct policy *policy_new(int wildcard, int check_cn, int rsa_min, int ec_min);
+struct policy *policy_ref(struct policy *policy);
+void policy_unref(struct policy *policy);
+
+/* "example.com" allows the name and everything below it */
+int policy_add_domain(struct policy *policy, const char *domain);
+/* the same for the domain of email addresses and the host of URIs */
+int policy_add_email_domain(struct policy *policy, const char *domain);
+int policy_add_uri_domain(struct policy *policy, const char *domain);
+/* "10.0.0.0/8", "2001:db8::/32"; a bare address is a single host */
+int policy_add_cidr(struct policy *policy, const char *cidr);
+
+/* 1 when the request passes, else 0 with the reason in why */
+int policy_check(const struct policy *policy, X509_REQ *req, char *why, size_t why_len);
+/* policy_check over the parts of a request; exts may be NULL */
+int policy_check_parts(const struct policy *policy, EVP_PKEY *pkey, X509_NAME *subject,
+		const STACK_OF(X509_EXTENSION) *exts, char *why, size_t why_len);
+
+#endif
@@ -0,0 +1,266 @@
+/*
+// Worker pool for background work: OCSP re-signing batches, asynchronous
+// signing and other jobs that must not block the Lua state that queued
+// them. Jobs past their deadline are dropped at dequeue rather than run,
+// so a backlog sheds stale work instead of finishing it late.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+/* queued signing work allowed before callers are turned away */
+#define POOL_SIGN_LIMIT 1024
+
+uint64_t pool_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* first job of the highest non-empty lane; lock held */
+static struct pool_job *pool_take(struct pool *pool) {
+	for (int lane = 0; lane < POOL_LANES; lane++) {
+		struct pool_job *job = pool->head[lane];
+		if (job == NULL) {
+			continue;
+		}
+		pool->head[lane] = job->next;
+		if (pool->head[lane] == NULL) {
+			pool->tail[lane] = NULL;
+		}
+		pool->lane_queued[lane]--;
+		pool->queued--;
+		return job;
+	}
+	return NULL;
+}
+
+static void *pool_worker(void *arg) {
+	struct pool *pool = arg;
+	struct pool_job *job;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->queued == 0 && !pool->stopping) {
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		}
+		if ((job = pool_take(pool)) == NULL) {
+			break;
+		}
+		pool->active++;
+
+		uint64_t now = pool_now();
+		uint64_t wait = now - job->queued_at;
+		int expired = job->deadline != 0 && now > job->deadline;
+		pool->stats.wait_ns += wait;
+		if (wait > pool->stats.wait_max_ns) {
+			pool->stats.wait_max_ns = wait;
+		}
+		if (expired) {
+			pool->stats.expired++;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		if (!expired) {
+			job->run(job->arg);
+		} else if (job->expire != NULL) {
+			job->expire(job->arg);
+		}
+		free(job);
+
+		pthread_mutex_lock(&pool->lock);
+		if (!expired) {
+			pool->stats.completed++;
+		}
+		if (--pool->active == 0 && pool->queued == 0) {
+			pthread_cond_broadcast(&pool->idle);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+struct pool *pool_new(int nthreads) {
+	struct pool *pool = calloc(1, sizeof(*pool));
+	if (pool == NULL) {
+		return NULL;
+	}
+	if ((pool->threads = calloc(nthreads, sizeof(pthread_t))) == NULL) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+
+	for (int idx = 0; idx < nthreads; idx++) {
+		if (pthread_create(&pool->threads[idx], NULL, pool_worker, pool) != 0) {
+			fprintf(stderr, "Error starting worker thread %d\n", idx);
+			break;
+		}
+		pool->nthreads++;
+	}
+	if (pool->nthreads == 0) {
+		pool_free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+void pool_free(struct pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int idx = 0; idx < pool->nthreads; idx++) {
+		pthread_join(pool->threads[idx], NULL);
+	}
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+int pool_submit(struct pool *pool, pool_fn run, void *arg) {
+	return pool_submit_ex(pool, run, NULL, arg, POOL_LANE_NORMAL, 0);
+}
+
+int pool_submit_ex(struct pool *pool, pool_fn run, pool_fn expire, void *arg,
+		int lane, uint64_t deadline) {
+	struct pool_job *job = malloc(sizeof(*job));
+	if (job == NULL) {
+		return 0;
+	}
+	job->run = run;
+	job->expire = expire;
+	job->arg = arg;
+	job->deadline = deadline;
+	job->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->limit != 0 && pool->queued >= pool->limit) {
+		pool->stats.shed++;
+		pthread_mutex_unlock(&pool->lock);
+		free(job);
+		return 0;
+	}
+	job->queued_at = pool_now();
+	if (pool->tail[lane] != NULL) {
+		pool->tail[lane]->next = job;
+	} else {
+		pool->head[lane] = job;
+	}
+	pool->tail[lane] = job;
+	pool->lane_queued[lane]++;
+	pool->queued++;
+	pool->stats.submitted++;
+	pthread_cond_signal(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	return 1;
+}
+
+void pool_drain(struct pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->queued > 0 || pool->active > 0) {
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_set_limit(struct pool *pool, size_t limit) {
+	pthread_mutex_lock(&pool->lock);
+	pool->limit = limit;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_get_stats(struct pool *pool, struct pool_stats *stats, size_t queued[POOL_LANES], size_t *limit) {
+	pthread_mutex_lock(&pool->lock);
+	*stats = pool->stats;
+	for (int lane = 0; lane < POOL_LANES; lane++) {
+		queued[lane] = pool->lane_queued[lane];
+	}
+	*limit = pool->limit;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* the shared pools; started on first use and again after fork */
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+static struct pool *default_pool;
+static struct pool *sign_pool;
+static size_t sign_limit = POOL_SIGN_LIMIT;
+
+static int pool_cpus(void) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? cpus : 1;
+}
+
+static void pool_atfork_prepare(void) {
+	pthread_mutex_lock(&shared_lock);
+}
+
+static void pool_atfork_parent(void) {
+	pthread_mutex_unlock(&shared_lock);
+}
+
+/* the workers stayed in the parent: forget their pools, leaking them */
+static void pool_atfork_child(void) {
+	if (sign_pool != NULL) {
+		sign_limit = sign_pool->limit;
+	}
+	default_pool = NULL;
+	sign_pool = NULL;
+	pthread_mutex_init(&shared_lock, NULL);
+}
+
+static void pool_atfork_init(void) {
+	pthread_atfork(pool_atfork_prepare, pool_atfork_parent, pool_atfork_child);
+}
+
+void pool_atfork(void) {
+	pthread_once(&atfork_once, pool_atfork_init);
+}
+
+static struct pool *pool_shared(struct pool **slot, size_t limit) {
+	struct pool *pool = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (pool != NULL) {
+		return pool;
+	}
+
+	pool_atfork();
+	pthread_mutex_lock(&shared_lock);
+	if ((pool = *slot) == NULL && (pool = pool_new(pool_cpus())) != NULL) {
+		pool->limit = limit;
+		__atomic_store_n(slot, pool, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&shared_lock);
+	return pool;
+}
+
+struct pool *pool_default(void) {
+	return pool_shared(&default_pool, 0);
+}
+
+struct pool *pool_sign(void) {
+	return pool_shared(&sign_pool, sign_limit);
+}
+
+void pool_prefork(void) {
+	struct pool *pools[] = {
+		__atomic_load_n(&default_pool, __ATOMIC_ACQUIRE),
+		__atomic_load_n(&sign_pool, __ATOMIC_ACQUIRE),
+	};
+	for (size_t idx = 0; idx < sizeof(pools) / sizeof(pools[0]); idx++) {
+		if (pools[idx] != NULL) {
+			pool_drain(pools[idx]);
+		}
+	}
+}
@@ -0,0 +1,88 @@
+#ifndef LUA_OPENSSL_POOL_H
+#define LUA_OPENSSL_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void (*pool_fn)(void *arg);
+
+/* workers drain the high lane before looking at the normal one */
+enum {
+	POOL_LANE_HIGH,
+	POOL_LANE_NORMAL,
+	POOL_LANES
+};
+
+struct pool_job {
+	pool_fn run;
+	pool_fn expire;		/* called instead of run past the deadline */
+	void *arg;
+	uint64_t queued_at;	/* pool_now() */
+	uint64_t deadline;	/* pool_now() scale, 0 = none */
+	struct pool_job *next;
+};
+
+struct pool_stats {
+	uint64_t submitted;
+	uint64_t completed;
+	uint64_t expired;	/* dropped unrun past their deadline */
+	uint64_t shed;		/* refused because the queue was full */
+	uint64_t wait_ns;	/* total queue wait of dequeued jobs */
+	uint64_t wait_max_ns;
+};
+
+/* ------------------------------------------------------------ *
+ * Fixed set of worker threads draining FIFO lanes of jobs.     *
+ * limit bounds the jobs waiting across all lanes, 0 = none.    *
+ * -------------------------------------------------------------*/
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	struct pool_job *head[POOL_LANES];
+	struct pool_job *tail[POOL_LANES];
+	size_t lane_queued[POOL_LANES];
+	size_t queued;
+	size_t limit;
+	struct pool_stats stats;
+	pthread_cond_t idle;	/* signalled when nothing is queued or running */
+	int active;
+	int stopping;
+	int nthreads;
+	pthread_t *threads;
+};
+
+struct pool *pool_new(int nthreads);
+/* runs queued jobs to completion, then joins the workers */
+void pool_free(struct pool *pool);
+int pool_submit(struct pool *pool, pool_fn run, void *arg);
+/* 0 when the queue is at its limit (counted as shed) or out of memory */
+int pool_submit_ex(struct pool *pool, pool_fn run, pool_fn expire, void *arg,
+		int lane, uint64_t deadline);
+
+/* waits until no job is queued or running */
+void pool_drain(struct pool *pool);
+
+void pool_set_limit(struct pool *pool, size_t limit);
+void pool_get_stats(struct pool *pool, struct pool_stats *stats, size_t queued[POOL_LANES], size_t *limit);
+
+/* monotonic clock in nanoseconds, the scale of deadlines */
+uint64_t pool_now(void);
+
+/* process-wide pool sized to the online CPUs, started on first use */
+struct pool *pool_default(void);
+/* same, reserved for asynchronous signing and bounded by default */
+struct pool *pool_sign(void);
+
+/* ------------------------------------------------------------ *
+ * Worker threads don't survive fork(). pool_prefork() drains   *
+ * the shared pools so no job is half done when the child is    *
+ * cloned; in the child they are dropped and started again on   *
+ * next use (a pthread_atfork handler does this).               *
+ * -------------------------------------------------------------*/
+void pool_prefork(void);
+/* registers that handler; handlers registered after it take their
+ * locks before the pools' own, so jobs holding them can finish */
+void pool_atfork(void);
+
+#endif
@@ -0,0 +1,341 @@
+/*
+// Asynchronous signing on the bounded signing pool. Each job carries a
+// copy of the request; the worker leaves the PEM certificate or the
+// reason it failed in the job for the submitter to collect.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/err.h>
+
+#include "pool.h"
+#include "sign.h"
+
+struct sign_job *sign_job_new(struct ca *ca, const char *csr, size_t len) {
+	struct sign_job *job = calloc(1, sizeof(*job));
+	if (job == NULL) {
+		return NULL;
+	}
+	if (! (job->csr = malloc(len))) {
+		free(job);
+		return NULL;
+	}
+	memcpy(job->csr, csr, len);
+	job->csr_len = len;
+	job->refs = 1;
+	job->ca = ca_ref(ca);
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->finished, NULL);
+	return job;
+}
+
+struct sign_job *sign_renew_job_new(struct ca *ca, const char *crt, size_t len,
+		const struct ca_profile *profile, long grace) {
+	struct sign_job *job = sign_job_new(ca, crt, len);
+	if (job != NULL) {
+		job->renew = 1;
+		job->profile = profile != NULL ? *profile : ca_renew_profile;
+		job->grace = grace;
+	}
+	return job;
+}
+
+void sign_job_unref(struct sign_job *job) {
+	if (job == NULL || __atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+	ca_unref(job->ca);
+	pthread_cond_destroy(&job->finished);
+	pthread_mutex_destroy(&job->lock);
+	free(job->csr);
+	free(job->pem);
+	free(job);
+}
+
+static void sign_job_finish(struct sign_job *job) {
+	pthread_mutex_lock(&job->lock);
+	job->done = 1;
+	pthread_cond_broadcast(&job->finished);
+	pthread_mutex_unlock(&job->lock);
+}
+
+void sign_job_fail(struct sign_job *job, const char *why) {
+	snprintf(job->why, sizeof(job->why), "%s", why);
+	sign_job_finish(job);
+}
+
+void sign_job_run(struct sign_job *job) {
+	const char *why = NULL;
+	struct der pem;
+
+	der_init(&pem);
+	int ok = job->renew
+		? ca_renew_pem(job->ca, job->csr, job->csr_len, &job->profile, job->grace, &pem, job->serial, &why)
+		: ca_sign_pem(job->ca, job->csr, job->csr_len, NULL, &pem, job->serial, &why);
+	if (! ok) {
+		der_free(&pem);
+		ERR_clear_error();
+		// why may live in a per-thread buffer: copy before this thread moves on
+		sign_job_fail(job, why != NULL ? why : "signing failed");
+		return;
+	}
+	// the job takes the buffer over
+	job->pem = (char *) pem.buf;
+	job->pem_len = pem.len;
+	sign_job_finish(job);
+}
+
+static void sign_job_pool_run(void *arg) {
+	sign_job_run(arg);
+	sign_job_unref(arg);
+}
+
+static void sign_job_pool_expire(void *arg) {
+	sign_job_fail(arg, "deadline exceeded before signing");
+	sign_job_unref(arg);
+}
+
+int sign_submit(struct sign_job *job, int lane, uint64_t deadline, const char **why) {
+	struct pool *pool = pool_sign();
+	if (pool == NULL) {
+		*why = "can't start signing pool";
+		return 0;
+	}
+
+	// the worker's reference
+	__atomic_add_fetch(&job->refs, 1, __ATOMIC_RELAXED);
+	if (! pool_submit_ex(pool, sign_job_pool_run, sign_job_pool_expire, job, lane, deadline)) {
+		__atomic_sub_fetch(&job->refs, 1, __ATOMIC_RELAXED);
+		*why = "signing queue full";
+		return 0;
+	}
+	return 1;
+}
+
+struct sign_batch {
+	size_t count;
+	struct sign_job *jobs[];
+};
+
+static void sign_batch_run(void *arg) {
+	struct sign_batch *batch = arg;
+	for (size_t idx = 0; idx < batch->count; idx++) {
+		sign_job_run(batch->jobs[idx]);
+		sign_job_unref(batch->jobs[idx]);
+	}
+	free(batch);
+}
+
+static void sign_batch_expire(void *arg) {
+	struct sign_batch *batch = arg;
+	for (size_t idx = 0; idx < batch->count; idx++) {
+		sign_job_fail(batch->jobs[idx], "deadline exceeded before signing");
+		sign_job_unref(batch->jobs[idx]);
+	}
+	free(batch);
+}
+
+int sign_submit_batch(struct sign_job **jobs, size_t count, int lane, uint64_t deadline, const char **why) {
+	struct pool *pool = pool_sign();
+	if (pool == NULL) {
+		*why = "can't start signing pool";
+		return 0;
+	}
+	struct sign_batch *batch = malloc(sizeof(*batch) + count * sizeof(batch->jobs[0]));
+	if (batch == NULL) {
+		*why = "out of memory";
+		return 0;
+	}
+	batch->count = count;
+	for (size_t idx = 0; idx < count; idx++) {
+		batch->jobs[idx] = jobs[idx];
+		__atomic_add_fetch(&jobs[idx]->refs, 1, __ATOMIC_RELAXED);
+	}
+
+	if (! pool_submit_ex(pool, sign_batch_run, sign_batch_expire, batch, lane, deadline)) {
+		for (size_t idx = 0; idx < count; idx++) {
+			__atomic_sub_fetch(&jobs[idx]->refs, 1, __ATOMIC_RELAXED);
+		}
+		free(batch);
+		*why = "signing queue full";
+		return 0;
+	}
+	return 1;
+}
+
+int sign_job_done(struct sign_job *job) {
+	pthread_mutex_lock(&job->lock);
+	int done = job->done;
+	pthread_mutex_unlock(&job->lock);
+	return done;
+}
+
+void sign_job_wait(struct sign_job *job) {
+	pthread_mutex_lock(&job->lock);
+	while (!job->done) {
+		pthread_cond_wait(&job->finished, &job->lock);
+	}
+	pthread_mutex_unlock(&job->lock);
+}
+
+/* ------------------------------------------------------------ *
+ * Shared by sign_multi() and the pool jobs helping it. A CA is *
+ * claimed under lock before the request or results are         *
+ * touched, and the caller only waits for CAs claimed by jobs:  *
+ * a job dequeued after it returned finds nothing to claim and  *
+ * just drops its reference.                                    *
+ * -------------------------------------------------------------*/
+struct sign_multi {
+	int refs;
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	size_t next;		/* first CA not claimed yet */
+	size_t running;		/* claimed by jobs, not finished */
+
+	struct ca *const *cas;
+	size_t count;
+	struct ca_request *request;
+	const struct ca_profile *profile;
+	struct sign_multi_result *results;
+};
+
+static void sign_multi_unref(struct sign_multi *multi) {
+	if (__atomic_sub_fetch(&multi->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+	pthread_cond_destroy(&multi->idle);
+	pthread_mutex_destroy(&multi->lock);
+	free(multi);
+}
+
+/* lock held; count when every CA is taken. CAs refused at
+ * admission already have their why */
+static size_t sign_multi_claim(struct sign_multi *multi) {
+	while (multi->next < multi->count && multi->results[multi->next].why[0] != '\0') {
+		multi->next++;
+	}
+	return multi->next < multi->count ? multi->next++ : multi->count;
+}
+
+static void sign_multi_one(struct sign_multi *multi, size_t idx) {
+	struct sign_multi_result *result = &multi->results[idx];
+	const char *why = NULL;
+
+	if (ca_request_pem(multi->cas[idx], multi->request, multi->profile, &result->pem, result->serial, &why)) {
+		result->ok = 1;
+		return;
+	}
+	ERR_clear_error();
+	snprintf(result->why, sizeof(result->why), "%s", why != NULL ? why : "signing failed");
+}
+
+static void sign_multi_run(void *arg) {
+	struct sign_multi *multi = arg;
+	size_t idx;
+
+	pthread_mutex_lock(&multi->lock);
+	while ((idx = sign_multi_claim(multi)) < multi->count) {
+		multi->running++;
+		pthread_mutex_unlock(&multi->lock);
+		sign_multi_one(multi, idx);
+		pthread_mutex_lock(&multi->lock);
+		if (--multi->running == 0) {
+			pthread_cond_broadcast(&multi->idle);
+		}
+	}
+	pthread_mutex_unlock(&multi->lock);
+	sign_multi_unref(multi);
+}
+
+static void sign_multi_fail(struct sign_multi_result *results, size_t count, const char *why) {
+	for (size_t idx = 0; idx < count; idx++) {
+		if (results[idx].why[0] == '\0') {
+			snprintf(results[idx].why, sizeof(results[idx].why), "%s", why != NULL ? why : "signing failed");
+		}
+	}
+}
+
+size_t sign_multi(struct ca *const *cas, size_t count, const char *pem, size_t len,
+		const struct ca_profile *profile, struct sign_multi_result *results) {
+	struct ca_admission lim;
+	struct ca_request request;
+	const char *why = NULL;
+	size_t done = 0;
+
+	for (size_t idx = 0; idx < count; idx++) {
+		der_init(&results[idx].pem);
+		results[idx].serial[0] = '\0';
+		results[idx].why[0] = '\0';
+		results[idx].ok = 0;
+	}
+	if (count == 0) {
+		return 0;
+	}
+
+	ca_get_admission(cas[0], &lim);
+	if (! ca_request_admit(&request, &lim, &cas[0]->stats, pem, len, &why)) {
+		ERR_clear_error();
+		sign_multi_fail(results, count, why);
+		ca_request_free(&request);
+		return 0;
+	}
+	for (size_t idx = 1; idx < count; idx++) {
+		if (! ca_request_readmit(cas[idx], &request, len, &why)) {
+			ERR_clear_error();
+			sign_multi_fail(results + idx, 1, why);
+		}
+	}
+	if (! ca_request_share(&request, &why)) {
+		ERR_clear_error();
+		sign_multi_fail(results, count, why);
+		ca_request_free(&request);
+		return 0;
+	}
+
+	struct sign_multi *multi = calloc(1, sizeof(*multi));
+	if (multi == NULL) {
+		sign_multi_fail(results, count, "out of memory");
+		ca_request_free(&request);
+		return 0;
+	}
+	multi->refs = 1;
+	pthread_mutex_init(&multi->lock, NULL);
+	pthread_cond_init(&multi->idle, NULL);
+	multi->cas = cas;
+	multi->count = count;
+	multi->request = &request;
+	multi->profile = profile;
+	multi->results = results;
+
+	// one helper per CA beyond the caller's; a full queue just leaves more to the caller
+	struct pool *pool = count > 1 ? pool_sign() : NULL;
+	for (size_t idx = 1; pool != NULL && idx < count; idx++) {
+		__atomic_add_fetch(&multi->refs, 1, __ATOMIC_RELAXED);
+		if (! pool_submit_ex(pool, sign_multi_run, NULL, multi, POOL_LANE_NORMAL, 0)) {
+			__atomic_sub_fetch(&multi->refs, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&multi->lock);
+	for (size_t idx; (idx = sign_multi_claim(multi)) < count; ) {
+		pthread_mutex_unlock(&multi->lock);
+		sign_multi_one(multi, idx);
+		pthread_mutex_lock(&multi->lock);
+	}
+	while (multi->running > 0) {
+		pthread_cond_wait(&multi->idle, &multi->lock);
+	}
+	pthread_mutex_unlock(&multi->lock);
+	sign_multi_unref(multi);
+
+	ca_request_free(&request);
+	for (size_t idx = 0; idx < count; idx++) {
+		done += results[idx].ok;
+	}
+	return done;
+}
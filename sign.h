@@ -0,0 +1,77 @@
+#ifndef LUA_OPENSSL_SIGN_H
+#define LUA_OPENSSL_SIGN_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ca.h"
+#include "policy.h"
+
+/* ------------------------------------------------------------ *
+ * One asynchronous ca:sign or ca:renew. Owned by refcount      *
+ * between the submitter and the worker; the result fields are  *
+ * written once by the worker, then done is set under lock.     *
+ * -------------------------------------------------------------*/
+struct sign_job {
+	int refs;
+	struct ca *ca;
+	char *csr;		/* the certificate, for a renewal */
+	size_t csr_len;
+	int renew;		/* ca_renew_pem() under profile and grace */
+	struct ca_profile profile;
+	long grace;
+
+	pthread_mutex_t lock;
+	pthread_cond_t finished;
+	int done;
+
+	char *pem;		/* NULL on failure */
+	size_t pem_len;
+	char serial[2 * CA_SERIAL_MAX + 1];
+	char why[POLICY_WHY_MAX];
+};
+
+/* NULL with *why set when the job can't be queued */
+struct sign_job *sign_job_new(struct ca *ca, const char *csr, size_t len);
+/* the same for renewing crt; profile NULL is ca_renew_profile */
+struct sign_job *sign_renew_job_new(struct ca *ca, const char *crt, size_t len,
+		const struct ca_profile *profile, long grace);
+void sign_job_unref(struct sign_job *job);
+
+/* queue on pool_sign(); deadline in pool_now() scale, 0 = none */
+int sign_submit(struct sign_job *job, int lane, uint64_t deadline, const char **why);
+
+/* one pool job signing count jobs in turn; 0 with *why when refused */
+int sign_submit_batch(struct sign_job **jobs, size_t count, int lane, uint64_t deadline, const char **why);
+
+/* signs right here, on the calling thread */
+void sign_job_run(struct sign_job *job);
+/* completes the job with a failure */
+void sign_job_fail(struct sign_job *job, const char *why);
+
+int sign_job_done(struct sign_job *job);
+void sign_job_wait(struct sign_job *job);
+
+/* one CA's outcome in sign_multi() */
+struct sign_multi_result {
+	struct der pem;		/* the certificate, when ok */
+	char serial[2 * CA_SERIAL_MAX + 1];
+	char why[POLICY_WHY_MAX];
+	int ok;
+};
+
+/* ------------------------------------------------------------ *
+ * Cross-signing: a PEM request parsed and verified once, then  *
+ * signed under each of count CAs with the same profile. The    *
+ * first CA admits it as ca_sign_pem() would, and a request it  *
+ * refuses is refused for all. Signing is spread over           *
+ * pool_sign() with the caller taking its share, so nothing     *
+ * waits on a queued job and pool workers may call this too.    *
+ * results[] are initialised here and freed by the caller;      *
+ * returns how many CAs signed.                                 *
+ * -------------------------------------------------------------*/
+size_t sign_multi(struct ca *const *cas, size_t count, const char *pem, size_t len,
+		const struct ca_profile *profile, struct sign_multi_result *results);
+
+#endif
@@ -0,0 +1,333 @@
+/*
+// Client side of the signer protocol in signer.h. Callers on any thread
+// queue a frame and sleep on their own condition variable; a writer
+// thread sends whatever has queued up in one write, and a reader thread
+// hands each reply to the call with its id.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "signer.h"
+
+/* replies read per read() call, at least one frame of any size */
+#define SIGNER_READ_BUF (4 * (SIGNER_HEADER + SIGNER_PAYLOAD_MAX))
+
+void signer_put_frame(struct der *out, uint32_t id, unsigned char op, unsigned char status,
+		const void *data, size_t len) {
+	unsigned char header[SIGNER_HEADER] = {
+		id >> 24, id >> 16, id >> 8, id, op, status, len >> 8, len
+	};
+	der_put(out, header, sizeof(header));
+	der_put(out, data, len);
+}
+
+size_t signer_get_frame(const unsigned char *buf, size_t len, struct signer_frame *frame) {
+	if (len < SIGNER_HEADER) {
+		return 0;
+	}
+	size_t payload = (size_t) buf[6] << 8 | buf[7];
+	if (len < SIGNER_HEADER + payload) {
+		return 0;
+	}
+	frame->id = (uint32_t) buf[0] << 24 | (uint32_t) buf[1] << 16 | (uint32_t) buf[2] << 8 | buf[3];
+	frame->op = buf[4];
+	frame->status = buf[5];
+	frame->data = buf + SIGNER_HEADER;
+	frame->len = payload;
+	return SIGNER_HEADER + payload;
+}
+
+/* one sign in flight, on the caller's stack */
+struct signer_call {
+	uint32_t id;
+	int done;
+	const char *why;	/* NULL once answered with a signature */
+	unsigned char *sig;
+	size_t *sig_len;
+	pthread_cond_t answered;
+	struct signer_call *next;
+};
+
+struct signer {
+	struct ca_backend backend;	/* first: the CA holds a pointer to it */
+	int fd;
+	int timeout_ms;
+	pthread_condattr_t monotonic;	/* for the calls' condition variables */
+
+	pthread_mutex_t lock;
+	pthread_cond_t queued;		/* out went from empty to not */
+	struct der out;			/* frames for the next write */
+	struct der sending;		/* the batch being written, writer only */
+	struct signer_call *calls;	/* queued or sent, not yet answered */
+	uint32_t next_id;
+	int broken;
+	int closing;
+	struct signer_stats stats;
+
+	pthread_t reader;
+	pthread_t writer;
+};
+
+/* lock held */
+static void signer_answer(struct signer *signer, struct signer_call *call, const char *why) {
+	struct signer_call **link = &signer->calls;
+	while (*link != NULL && *link != call) {
+		link = &(*link)->next;
+	}
+	if (*link != NULL) {
+		*link = call->next;
+	}
+	if (why != NULL) {
+		signer->stats.failed++;
+	}
+	call->why = why;
+	call->done = 1;
+	pthread_cond_signal(&call->answered);
+}
+
+/* lock held; nothing more will be sent or received */
+static void signer_break(struct signer *signer) {
+	signer->broken = 1;
+	while (signer->calls != NULL) {
+		signer_answer(signer, signer->calls, "Signer connection lost");
+	}
+	pthread_cond_signal(&signer->queued);
+}
+
+static int send_all(int fd, const unsigned char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return 0;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static void *signer_write_run(void *arg) {
+	struct signer *signer = arg;
+
+	pthread_mutex_lock(&signer->lock);
+	for (;;) {
+		while (signer->out.len == 0 && ! signer->broken && ! signer->closing) {
+			pthread_cond_wait(&signer->queued, &signer->lock);
+		}
+		if (signer->broken || signer->closing) {
+			break;
+		}
+		// callers go on queueing into the other buffer while this one is sent
+		struct der batch = signer->out;
+		signer->out = signer->sending;
+		signer->out.len = 0;
+		signer->sending = batch;
+		signer->stats.writes++;
+		pthread_mutex_unlock(&signer->lock);
+
+		int ok = send_all(signer->fd, batch.buf, batch.len);
+
+		pthread_mutex_lock(&signer->lock);
+		if (! ok) {
+			signer_break(signer);
+		}
+	}
+	pthread_mutex_unlock(&signer->lock);
+	return NULL;
+}
+
+static void *signer_read_run(void *arg) {
+	struct signer *signer = arg;
+	unsigned char *buf = malloc(SIGNER_READ_BUF);
+	size_t have = 0;
+
+	while (buf != NULL) {
+		ssize_t n = read(signer->fd, buf + have, SIGNER_READ_BUF - have);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		have += n;
+
+		struct signer_frame frame;
+		size_t off = 0, used;
+		pthread_mutex_lock(&signer->lock);
+		while ((used = signer_get_frame(buf + off, have - off, &frame)) > 0) {
+			off += used;
+			struct signer_call *call = signer->calls;
+			while (call != NULL && call->id != frame.id) {
+				call = call->next;
+			}
+			if (call == NULL) {
+				continue;	// answered late, its caller has given up
+			}
+			if (frame.status != SIGNER_OK || frame.len > *call->sig_len) {
+				signer_answer(signer, call, "Signer refused to sign");
+				continue;
+			}
+			memcpy(call->sig, frame.data, frame.len);
+			*call->sig_len = frame.len;
+			signer_answer(signer, call, NULL);
+		}
+		pthread_mutex_unlock(&signer->lock);
+		memmove(buf, buf + off, have - off);
+		have -= off;
+	}
+
+	free(buf);
+	pthread_mutex_lock(&signer->lock);
+	signer_break(signer);
+	pthread_mutex_unlock(&signer->lock);
+	return NULL;
+}
+
+static int signer_sign(struct ca_backend *backend, const unsigned char *md, size_t md_len,
+		unsigned char *sig, size_t *sig_len) {
+	struct signer *signer = (struct signer *) backend;
+	struct signer_call call = { .sig = sig, .sig_len = sig_len };
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += signer->timeout_ms / 1000;
+	deadline.tv_nsec += (long) (signer->timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	pthread_cond_init(&call.answered, &signer->monotonic);
+
+	pthread_mutex_lock(&signer->lock);
+	if (signer->broken) {
+		signer->stats.failed++;
+		call.why = "Signer connection lost";
+		goto __done;
+	}
+	// room first, so a failed allocation leaves no partial frame behind
+	if (! der_reserve(&signer->out, SIGNER_HEADER + md_len)) {
+		signer->out.failed = 0;
+		signer->stats.failed++;
+		call.why = "Error queueing signer request";
+		goto __done;
+	}
+	if (signer->out.len == 0) {
+		pthread_cond_signal(&signer->queued);
+	}
+	call.id = signer->next_id++;
+	signer_put_frame(&signer->out, call.id, SIGNER_OP_SIGN, 0, md, md_len);
+	call.next = signer->calls;
+	signer->calls = &call;
+	signer->stats.requests++;
+
+	while (! call.done) {
+		if (signer->timeout_ms <= 0) {
+			pthread_cond_wait(&call.answered, &signer->lock);
+		} else if (pthread_cond_timedwait(&call.answered, &signer->lock, &deadline) == ETIMEDOUT &&
+				! call.done) {
+			signer_answer(signer, &call, "Signer timed out");
+		}
+	}
+
+__done:
+	pthread_mutex_unlock(&signer->lock);
+	pthread_cond_destroy(&call.answered);
+	if (call.why != NULL) {
+		fprintf(stderr, "%s\n", call.why);
+		return 0;
+	}
+	return 1;
+}
+
+static void signer_free(struct signer *signer) {
+	close(signer->fd);
+	der_free(&signer->out);
+	der_free(&signer->sending);
+	pthread_cond_destroy(&signer->queued);
+	pthread_mutex_destroy(&signer->lock);
+	pthread_condattr_destroy(&signer->monotonic);
+	free(signer);
+}
+
+/* no call is in flight: each holds a reference to the CA */
+static void signer_release(struct ca_backend *backend) {
+	struct signer *signer = (struct signer *) backend;
+
+	pthread_mutex_lock(&signer->lock);
+	signer->closing = 1;
+	pthread_cond_signal(&signer->queued);
+	pthread_mutex_unlock(&signer->lock);
+	// wakes the reader out of read()
+	shutdown(signer->fd, SHUT_RDWR);
+	pthread_join(signer->writer, NULL);
+	pthread_join(signer->reader, NULL);
+	signer_free(signer);
+}
+
+struct ca_backend *signer_connect(const char *path, int timeout_ms) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Signer socket path too long\n");
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+
+	struct signer *signer = calloc(1, sizeof(*signer));
+	if (signer == NULL) {
+		fprintf(stderr, "Error allocating signer connection\n");
+		return NULL;
+	}
+	signer->backend.sign = signer_sign;
+	signer->backend.release = signer_release;
+	signer->timeout_ms = timeout_ms;
+	pthread_condattr_init(&signer->monotonic);
+	pthread_condattr_setclock(&signer->monotonic, CLOCK_MONOTONIC);
+	pthread_mutex_init(&signer->lock, NULL);
+	pthread_cond_init(&signer->queued, NULL);
+	der_init(&signer->out);
+	der_init(&signer->sending);
+
+	signer->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (signer->fd < 0 || connect(signer->fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		fprintf(stderr, "Can't connect to signer at %s: %s\n", path, strerror(errno));
+		signer_free(signer);
+		return NULL;
+	}
+	if (pthread_create(&signer->reader, NULL, signer_read_run, signer) != 0) {
+		fprintf(stderr, "Error starting signer reader\n");
+		signer_free(signer);
+		return NULL;
+	}
+	if (pthread_create(&signer->writer, NULL, signer_write_run, signer) != 0) {
+		fprintf(stderr, "Error starting signer writer\n");
+		shutdown(signer->fd, SHUT_RDWR);
+		pthread_join(signer->reader, NULL);
+		signer_free(signer);
+		return NULL;
+	}
+	return &signer->backend;
+}
+
+int signer_get_stats(struct ca_backend *backend, struct signer_stats *stats) {
+	if (backend == NULL || backend->sign != signer_sign) {
+		return 0;
+	}
+	struct signer *signer = (struct signer *) backend;
+	pthread_mutex_lock(&signer->lock);
+	*stats = signer->stats;
+	pthread_mutex_unlock(&signer->lock);
+	return 1;
+}
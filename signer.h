@@ -0,0 +1,62 @@
+#ifndef LUA_OPENSSL_SIGNER_H
+#define LUA_OPENSSL_SIGNER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ca.h"
+#include "der.h"
+
+/* ------------------------------------------------------------ *
+ * Signing over a Unix domain socket, one connection shared by  *
+ * every thread. Frames, both ways, are an 8-byte header and a  *
+ * payload:                                                     *
+ *   u32 id      chosen by the client, echoed in the reply      *
+ *   u8  op      SIGNER_OP_*                                    *
+ *   u8  status  0 in requests, SIGNER_* in replies             *
+ *   u16 len     payload bytes, big-endian like id              *
+ * A sign request carries the digest, its hash told by its      *
+ * length; the reply carries the signature. Requests are        *
+ * pipelined and replies may come back in any order.            *
+ * -------------------------------------------------------------*/
+#define SIGNER_HEADER	8
+#define SIGNER_PAYLOAD_MAX	0xffff
+
+#define SIGNER_OP_SIGN	1
+
+#define SIGNER_OK	0
+#define SIGNER_EFAIL	1	/* the key wouldn't sign */
+#define SIGNER_EBADOP	2	/* unknown op or malformed payload */
+
+struct signer_frame {
+	uint32_t id;
+	unsigned char op;
+	unsigned char status;
+	const unsigned char *data;
+	size_t len;
+};
+
+/* appends one frame to out */
+void signer_put_frame(struct der *out, uint32_t id, unsigned char op, unsigned char status,
+		const void *data, size_t len);
+/* the frame at the start of buf; 0 until len covers a whole frame */
+size_t signer_get_frame(const unsigned char *buf, size_t len, struct signer_frame *frame);
+
+struct signer_stats {
+	uint64_t requests;
+	uint64_t writes;	/* write calls, each carrying every request queued */
+	uint64_t failed;	/* errors, timeouts and a lost connection */
+};
+
+/* ------------------------------------------------------------ *
+ * A backend for ca_new_backend() signing through the socket at *
+ * path. A call unanswered after timeout_ms (0: never) fails,   *
+ * and a lost connection fails every call from then on; nothing *
+ * is sent twice. Connections don't survive fork(), connect in  *
+ * the child. NULL when the signer can't be reached.            *
+ * -------------------------------------------------------------*/
+struct ca_backend *signer_connect(const char *path, int timeout_ms);
+/* 0 when backend isn't a signer connection */
+int signer_get_stats(struct ca_backend *backend, struct signer_stats *stats);
+
+#endif
@@ -0,0 +1,352 @@
+/*
+// Reference signer for the protocol in signer.h: holds the CA private
+// key and signs digests for CAs made with signer_connect(). A local
+// stand-in for an HSM front end, and the far end of `bench remote`.
+//   signerd <socket> <key.pem> [password] [threads]
+// Each connection has a reader queueing signatures on a shared worker
+// pool and a writer sending the replies that piled up in one write.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+#include "pool.h"
+#include "signer.h"
+
+/* ------------------------------------------------------------ *
+ * Backpressure: past either limit the reader stops reading     *
+ * until signatures finish and replies drain, so a client that  *
+ * pipelines without reading can't make the daemon buffer       *
+ * without bound. One that reads nothing for the send timeout   *
+ * is dropped.                                                  *
+ * -------------------------------------------------------------*/
+#define SIGNERD_OUT_MAX (1024 * 1024)	/* reply bytes not yet picked up */
+#define SIGNERD_INFLIGHT_MAX 256	/* signatures on the pool */
+#define SIGNERD_SEND_TIMEOUT 30	/* seconds without a byte taken */
+
+static EVP_PKEY *key;
+static struct pool *workers;
+
+struct conn {
+	int refs;		/* reader, writer and each queued signature */
+	int fd;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t room;	/* inflight or out went down, or closed */
+	struct der out;
+	struct der sending;
+	int inflight;
+	int closed;
+	pthread_t writer;
+};
+
+struct sign_req {
+	struct conn *conn;
+	uint32_t id;
+	size_t md_len;
+	unsigned char md[EVP_MAX_MD_SIZE];
+};
+
+static void conn_unref(struct conn *conn) {
+	if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+	close(conn->fd);
+	der_free(&conn->out);
+	der_free(&conn->sending);
+	pthread_cond_destroy(&conn->queued);
+	pthread_cond_destroy(&conn->room);
+	pthread_mutex_destroy(&conn->lock);
+	free(conn);
+}
+
+/* lock held */
+static void conn_shut(struct conn *conn) {
+	conn->closed = 1;
+	shutdown(conn->fd, SHUT_RDWR);
+	pthread_cond_signal(&conn->queued);
+	pthread_cond_signal(&conn->room);
+}
+
+static void conn_reply(struct conn *conn, uint32_t id, unsigned char status,
+		const unsigned char *data, size_t len) {
+	pthread_mutex_lock(&conn->lock);
+	if (! conn->closed) {
+		if (conn->out.len == 0) {
+			pthread_cond_signal(&conn->queued);
+		}
+		signer_put_frame(&conn->out, id, SIGNER_OP_SIGN, status, data, len);
+		if (conn->out.failed) {
+			// the client times the lost replies out
+			fprintf(stderr, "Error queueing reply, dropping connection\n");
+			conn_shut(conn);
+		}
+	}
+	pthread_mutex_unlock(&conn->lock);
+}
+
+static int send_all(int fd, const unsigned char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return 0;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static void *conn_write_run(void *arg) {
+	struct conn *conn = arg;
+
+	pthread_mutex_lock(&conn->lock);
+	for (;;) {
+		while (conn->out.len == 0 && ! conn->closed) {
+			pthread_cond_wait(&conn->queued, &conn->lock);
+		}
+		if (conn->closed) {
+			break;
+		}
+		struct der batch = conn->out;
+		conn->out = conn->sending;
+		conn->out.len = 0;
+		conn->sending = batch;
+		pthread_cond_signal(&conn->room);
+		pthread_mutex_unlock(&conn->lock);
+
+		int ok = send_all(conn->fd, batch.buf, batch.len);
+
+		pthread_mutex_lock(&conn->lock);
+		if (! ok) {
+			// gone, or not reading its replies for SIGNERD_SEND_TIMEOUT
+			conn_shut(conn);
+		}
+	}
+	pthread_mutex_unlock(&conn->lock);
+	conn_unref(conn);
+	return NULL;
+}
+
+/* the hash is told by the digest length, as in signer.h */
+static const EVP_MD *md_for_len(size_t len) {
+	switch (len) {
+	case 20: return EVP_sha1();
+	case 28: return EVP_sha224();
+	case 32: return EVP_sha256();
+	case 48: return EVP_sha384();
+	case 64: return EVP_sha512();
+	}
+	return NULL;
+}
+
+static void sign_run(void *arg) {
+	struct sign_req *req = arg;
+	unsigned char sig[SIGNER_PAYLOAD_MAX];
+	size_t sig_len = sizeof(sig);
+
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, NULL);
+	int ok = ctx != NULL
+		&& EVP_PKEY_sign_init(ctx) == 1
+		&& EVP_PKEY_CTX_set_signature_md(ctx, md_for_len(req->md_len)) == 1
+		&& EVP_PKEY_sign(ctx, sig, &sig_len, req->md, req->md_len) == 1;
+	EVP_PKEY_CTX_free(ctx);
+	if (! ok) {
+		ERR_print_errors_fp(stderr);
+	}
+
+	conn_reply(req->conn, req->id, ok ? SIGNER_OK : SIGNER_EFAIL, sig, ok ? sig_len : 0);
+	pthread_mutex_lock(&req->conn->lock);
+	req->conn->inflight--;
+	pthread_cond_signal(&req->conn->room);
+	pthread_mutex_unlock(&req->conn->lock);
+	conn_unref(req->conn);
+	free(req);
+}
+
+/* queues one request frame; 0 when the connection can't go on */
+static int conn_handle(struct conn *conn, const struct signer_frame *frame) {
+	if (frame->op != SIGNER_OP_SIGN || md_for_len(frame->len) == NULL) {
+		conn_reply(conn, frame->id, SIGNER_EBADOP, NULL, 0);
+		return 1;
+	}
+	struct sign_req *req = malloc(sizeof(*req));
+	if (req == NULL) {
+		return 0;
+	}
+	req->conn = conn;
+	req->id = frame->id;
+	req->md_len = frame->len;
+	memcpy(req->md, frame->data, frame->len);
+	__atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&conn->lock);
+	conn->inflight++;
+	pthread_mutex_unlock(&conn->lock);
+	if (! pool_submit(workers, sign_run, req)) {
+		pthread_mutex_lock(&conn->lock);
+		conn->inflight--;
+		pthread_mutex_unlock(&conn->lock);
+		conn_unref(conn);
+		free(req);
+		return 0;
+	}
+	return 1;
+}
+
+/* reader: waits until the connection is back under its limits;
+ * 0 once it is closed */
+static int conn_wait_room(struct conn *conn) {
+	pthread_mutex_lock(&conn->lock);
+	while (! conn->closed && (conn->inflight >= SIGNERD_INFLIGHT_MAX || conn->out.len >= SIGNERD_OUT_MAX)) {
+		pthread_cond_wait(&conn->room, &conn->lock);
+	}
+	int open = ! conn->closed;
+	pthread_mutex_unlock(&conn->lock);
+	return open;
+}
+
+static void *conn_read_run(void *arg) {
+	struct conn *conn = arg;
+	size_t cap = 4 * (SIGNER_HEADER + SIGNER_PAYLOAD_MAX), have = 0;
+	unsigned char *buf = malloc(cap);
+	int ok = buf != NULL;
+
+	while (ok && conn_wait_room(conn)) {
+		ssize_t n = read(conn->fd, buf + have, cap - have);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		have += n;
+
+		struct signer_frame frame;
+		size_t off = 0, used;
+		while (ok && (used = signer_get_frame(buf + off, have - off, &frame)) > 0) {
+			off += used;
+			ok = conn_handle(conn, &frame) && conn_wait_room(conn);
+		}
+		memmove(buf, buf + off, have - off);
+		have -= off;
+	}
+	free(buf);
+
+	pthread_mutex_lock(&conn->lock);
+	conn->closed = 1;
+	pthread_cond_signal(&conn->queued);
+	pthread_mutex_unlock(&conn->lock);
+	conn_unref(conn);
+	return NULL;
+}
+
+static int conn_start(int fd) {
+	struct conn *conn = calloc(1, sizeof(*conn));
+	pthread_t reader;
+
+	if (conn == NULL) {
+		close(fd);
+		return 0;
+	}
+	conn->refs = 2;
+	conn->fd = fd;
+	struct timeval timeout = { .tv_sec = SIGNERD_SEND_TIMEOUT };
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	pthread_mutex_init(&conn->lock, NULL);
+	pthread_cond_init(&conn->queued, NULL);
+	pthread_cond_init(&conn->room, NULL);
+	der_init(&conn->out);
+	der_init(&conn->sending);
+	if (pthread_create(&conn->writer, NULL, conn_write_run, conn) != 0) {
+		conn->refs = 1;
+		conn_unref(conn);
+		return 0;
+	}
+	pthread_detach(conn->writer);
+	if (pthread_create(&reader, NULL, conn_read_run, conn) != 0) {
+		pthread_mutex_lock(&conn->lock);
+		conn->closed = 1;
+		pthread_cond_signal(&conn->queued);
+		pthread_mutex_unlock(&conn->lock);
+		conn_unref(conn);
+		return 0;
+	}
+	pthread_detach(reader);
+	return 1;
+}
+
+static int password_cb(char *buf, int size, int rwflag, void *u) {
+	int len = strlen((const char *) u);
+	if (len > size) {
+		len = size;
+	}
+	memcpy(buf, u, len);
+	return len;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <socket> <key.pem> [password] [threads]\n", argv[0]);
+		return 2;
+	}
+	const char *password = argc > 3 ? argv[3] : "replace_me";
+	int threads = argc > 4 ? atoi(argv[4]) : 0;
+
+	FILE *fp = fopen(argv[2], "r");
+	if (fp == NULL || ! (key = PEM_read_PrivateKey(fp, NULL, password_cb, (void *) password))) {
+		fprintf(stderr, "Can't load signing key from %s\n", argv[2]);
+		ERR_print_errors_fp(stderr);
+		return 1;
+	}
+	fclose(fp);
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (! (workers = pool_new(threads > 0 ? threads : 1))) {
+		fprintf(stderr, "Can't start signing threads\n");
+		return 1;
+	}
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long\n");
+		return 1;
+	}
+	strcpy(addr.sun_path, argv[1]);
+	unlink(argv[1]);
+	int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(lfd, 64) != 0) {
+		fprintf(stderr, "Can't listen on %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	for (;;) {
+		int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			fprintf(stderr, "accept: %s\n", strerror(errno));
+			return 1;
+		}
+		if (! conn_start(fd)) {
+			fprintf(stderr, "Error starting connection\n");
+		}
+	}
+}
@@ -0,0 +1,491 @@
+/*
+// Certificate chain verification against a store built once. The
+// X509_STORE_CTX objects are kept in a small per-thread cache and only
+// cleaned up between verifications, so the hot path does no context
+// allocation. An optional cache remembers outcomes per presented chain
+// until the earliest notAfter, its TTL, or the next store change.
+// https://www.openssl.org/docs/man1.1.1/man3/X509_STORE_CTX_new.html
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+#include "b64.h"
+#include "ca.h"
+#include "store.h"
+
+/* contexts each thread keeps around */
+#define STORE_CTX_CACHE 4
+/* slots looked at from a key's home position */
+#define STORE_CACHE_PROBE 4
+
+struct store_cache_entry {
+	unsigned char key[STORE_KEY_LEN];
+	uint64_t generation;
+	time_t expires;		/* 0 = free */
+	struct store_result res;
+};
+
+struct store_cache {
+	pthread_mutex_t lock;
+	size_t mask;
+	long ttl;
+	size_t used;
+	uint64_t hits;
+	uint64_t misses;
+	struct store_cache_entry entries[];
+};
+
+struct ctx_cache {
+	int count;
+	X509_STORE_CTX *ctx[STORE_CTX_CACHE];
+};
+
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ctx_key;
+
+static void ctx_cache_free(void *arg) {
+	struct ctx_cache *cache = arg;
+	for (int idx = 0; idx < cache->count; idx++) {
+		X509_STORE_CTX_free(cache->ctx[idx]);
+	}
+	free(cache);
+}
+
+static void ctx_key_init(void) {
+	pthread_key_create(&ctx_key, ctx_cache_free);
+}
+
+static X509_STORE_CTX *ctx_get(void) {
+	pthread_once(&ctx_once, ctx_key_init);
+	struct ctx_cache *cache = pthread_getspecific(ctx_key);
+	if (cache != NULL && cache->count > 0) {
+		return cache->ctx[--cache->count];
+	}
+	return X509_STORE_CTX_new();
+}
+
+static void ctx_put(X509_STORE_CTX *ctx) {
+	X509_STORE_CTX_cleanup(ctx);
+
+	struct ctx_cache *cache = pthread_getspecific(ctx_key);
+	if (cache == NULL && (cache = calloc(1, sizeof(*cache))) != NULL) {
+		pthread_setspecific(ctx_key, cache);
+	}
+	if (cache == NULL || cache->count == STORE_CTX_CACHE) {
+		X509_STORE_CTX_free(ctx);
+		return;
+	}
+	cache->ctx[cache->count++] = ctx;
+}
+
+/* ------------------------------------------------------------ *
+ * Bundles of plain CERTIFICATE and X509 CRL blocks decode      *
+ * straight from base64; -2 sends anything else to the reader.  *
+ * -------------------------------------------------------------*/
+static int store_add_plain(struct store *store, const char *bundle, size_t len) {
+	const char *end = bundle + len;
+	struct pem_block block;
+	struct der der;
+	int added = 0;
+
+	// check the whole bundle first, so nothing is added twice
+	for (const char *p = bundle; pem_next(p, end, NULL, &block); p = block.next) {
+		if (block.body == NULL || ! (pem_is(&block, "CERTIFICATE") || pem_is(&block, "X509 CRL"))) {
+			return -2;
+		}
+	}
+
+	der_init(&der);
+	for (const char *p = bundle; pem_next(p, end, NULL, &block); p = block.next) {
+		if (! pem_decode(&block, &der)) {
+			added = -2;
+			break;
+		}
+		const unsigned char *in = der.buf;
+		if (pem_is(&block, "CERTIFICATE")) {
+			X509 *crt = d2i_X509(NULL, &in, der.len);
+			int ok = crt != NULL && X509_STORE_add_cert(store->x509, crt);
+			X509_free(crt);
+			if (! ok) {
+				err_descr_to_stderr("Error adding certificate to store");
+				added = -1;
+				break;
+			}
+		} else {
+			X509_CRL *crl = d2i_X509_CRL(NULL, &in, der.len);
+			int ok = crl != NULL && X509_STORE_add_crl(store->x509, crl);
+			X509_CRL_free(crl);
+			if (! ok) {
+				err_descr_to_stderr("Error adding CRL to store");
+				added = -1;
+				break;
+			}
+		}
+		added++;
+	}
+	der_free(&der);
+	return added;
+}
+
+static int store_add_reader(struct store *store, const char *bundle, size_t len) {
+	STACK_OF(X509_INFO) *infos = NULL;
+	int added = 0;
+
+	BIO *bio = BIO_new_mem_buf(bundle, len);
+	if (bio == NULL || ! (infos = PEM_X509_INFO_read_bio(bio, NULL, NULL, NULL))) {
+		err_descr_to_stderr("Error reading trust bundle");
+		BIO_free(bio);
+		return -1;
+	}
+	BIO_free(bio);
+
+	for (int idx = 0; idx < sk_X509_INFO_num(infos); idx++) {
+		X509_INFO *info = sk_X509_INFO_value(infos, idx);
+		if (info->x509 != NULL) {
+			if (! X509_STORE_add_cert(store->x509, info->x509)) {
+				err_descr_to_stderr("Error adding certificate to store");
+				added = -1;
+				break;
+			}
+			added++;
+		}
+		if (info->crl != NULL) {
+			if (! X509_STORE_add_crl(store->x509, info->crl)) {
+				err_descr_to_stderr("Error adding CRL to store");
+				added = -1;
+				break;
+			}
+			added++;
+		}
+	}
+	sk_X509_INFO_pop_free(infos, X509_INFO_free);
+	return added;
+}
+
+/* ------------------------------------------------------------ *
+ * Every certificate and CRL in a PEM bundle goes in the store  *
+ * -------------------------------------------------------------*/
+int store_add(struct store *store, const char *bundle, size_t len) {
+	int added = store_add_plain(store, bundle, len);
+	if (added == -2) {
+		added = store_add_reader(store, bundle, len);
+	}
+
+	// even a partial add may change outcomes
+	__atomic_add_fetch(&store->generation, 1, __ATOMIC_RELEASE);
+	return added;
+}
+
+struct store *store_new(const char *bundle, size_t len) {
+	ca_init();
+	struct store *store = calloc(1, sizeof(*store));
+
+	if (store == NULL) {
+		return NULL;
+	}
+	store->refs = 1;
+	if (! (store->x509 = X509_STORE_new())) {
+		err_descr_to_stderr("Error creating X509 store");
+		goto __error;
+	}
+	if (store_add(store, bundle, len) <= 0) {
+		fprintf(stderr, "Trust bundle holds no certificates\n");
+		goto __error;
+	}
+	return store;
+
+__error:
+	store_unref(store);
+	return NULL;
+}
+
+struct store *store_ref(struct store *store) {
+	__atomic_add_fetch(&store->refs, 1, __ATOMIC_RELAXED);
+	return store;
+}
+
+void store_unref(struct store *store) {
+	if (store == NULL || __atomic_sub_fetch(&store->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+	if (store->cache != NULL) {
+		pthread_mutex_destroy(&store->cache->lock);
+		free(store->cache);
+	}
+	X509_STORE_free(store->x509);
+	free(store);
+}
+
+int store_cache_enable(struct store *store, size_t entries, long ttl) {
+	size_t size = STORE_CACHE_PROBE;
+	while (size < entries) {
+		size *= 2;
+	}
+
+	struct store_cache *cache = calloc(1, sizeof(*cache) + size * sizeof(cache->entries[0]));
+	if (cache == NULL) {
+		return 0;
+	}
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->mask = size - 1;
+	cache->ttl = ttl;
+	store->cache = cache;
+	return 1;
+}
+
+void store_cache_stats(struct store *store, uint64_t *hits, uint64_t *misses, size_t *entries) {
+	struct store_cache *cache = store->cache;
+	*hits = *misses = *entries = 0;
+	if (cache != NULL) {
+		pthread_mutex_lock(&cache->lock);
+		*hits = cache->hits;
+		*misses = cache->misses;
+		*entries = cache->used;
+		pthread_mutex_unlock(&cache->lock);
+	}
+}
+
+static void key_put_int(EVP_MD_CTX *md, uint64_t value) {
+	EVP_DigestUpdate(md, &value, sizeof(value));
+}
+
+int store_key(const struct store_opts *opts, const char *const *parts, const size_t *lens,
+		size_t count, unsigned char key[STORE_KEY_LEN]) {
+	if (opts->at != 0) {
+		return 0;
+	}
+
+	EVP_MD_CTX *md = EVP_MD_CTX_new();
+	if (md == NULL || ! EVP_DigestInit_ex(md, ca_sha256(), NULL)) {
+		EVP_MD_CTX_free(md);
+		return 0;
+	}
+	// lengths first, so parts can't shift into each other
+	for (size_t idx = 0; idx < count; idx++) {
+		key_put_int(md, lens[idx]);
+		EVP_DigestUpdate(md, parts[idx], lens[idx]);
+	}
+	key_put_int(md, opts->depth);
+	key_put_int(md, opts->purpose);
+	key_put_int(md, opts->crl_check);
+	if (opts->host != NULL) {
+		key_put_int(md, strlen(opts->host));
+		EVP_DigestUpdate(md, opts->host, strlen(opts->host));
+	}
+	int rc = EVP_DigestFinal_ex(md, key, NULL);
+	EVP_MD_CTX_free(md);
+	return rc;
+}
+
+static struct store_cache_entry *cache_slot(struct store_cache *cache, const unsigned char *key, size_t probe) {
+	size_t home;
+	memcpy(&home, key, sizeof(home));
+	return &cache->entries[(home + probe) & cache->mask];
+}
+
+int store_lookup(struct store *store, const unsigned char key[STORE_KEY_LEN], struct store_result *res) {
+	struct store_cache *cache = store->cache;
+	uint64_t generation = __atomic_load_n(&store->generation, __ATOMIC_ACQUIRE);
+	time_t now = time(NULL);
+	int found = 0;
+
+	if (cache == NULL) {
+		return 0;
+	}
+	pthread_mutex_lock(&cache->lock);
+	for (size_t probe = 0; probe < STORE_CACHE_PROBE; probe++) {
+		struct store_cache_entry *e = cache_slot(cache, key, probe);
+		if (e->expires != 0 && memcmp(e->key, key, STORE_KEY_LEN) == 0) {
+			if (e->generation == generation && e->expires > now) {
+				*res = e->res;
+				found = 1;
+			} else {
+				e->expires = 0;
+				cache->used--;
+			}
+			break;
+		}
+	}
+	if (found) {
+		cache->hits++;
+	} else {
+		cache->misses++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return found;
+}
+
+static void cache_insert(struct store_cache *cache, const unsigned char *key, uint64_t generation,
+		time_t expires, const struct store_result *res) {
+	struct store_cache_entry *victim = NULL;
+
+	pthread_mutex_lock(&cache->lock);
+	for (size_t probe = 0; probe < STORE_CACHE_PROBE; probe++) {
+		struct store_cache_entry *e = cache_slot(cache, key, probe);
+		if (e->expires != 0 && memcmp(e->key, key, STORE_KEY_LEN) == 0) {
+			victim = e;
+			break;
+		}
+		// otherwise a free slot, or whatever would expire first
+		if (victim == NULL || e->expires < victim->expires) {
+			victim = e;
+		}
+	}
+	if (victim->expires == 0) {
+		cache->used++;
+	}
+	memcpy(victim->key, key, STORE_KEY_LEN);
+	victim->generation = generation;
+	victim->expires = expires;
+	victim->res = *res;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* earliest notAfter in the chain, capped at ttl from now */
+static time_t chain_expiry(STACK_OF(X509) *chain, time_t now, long ttl) {
+	time_t expires = now + ttl;
+	for (int idx = 0; idx < sk_X509_num(chain); idx++) {
+		int days, secs;
+		if (! ASN1_TIME_diff(&days, &secs, NULL, X509_get0_notAfter(sk_X509_value(chain, idx)))) {
+			return now;
+		}
+		time_t until = now + (time_t) days * 24 * 3600 + secs;
+		if (until < expires) {
+			expires = until;
+		}
+	}
+	return expires;
+}
+
+/* 0 when a block needs the PEM reader; certs is left empty then */
+static int store_chain_plain(const char *data, size_t len, STACK_OF(X509) *certs) {
+	const char *end = data + len;
+	struct pem_block block;
+	struct der der;
+	int ok = 1;
+
+	der_init(&der);
+	for (const char *p = data; ok && pem_next(p, end, "CERTIFICATE", &block); p = block.next) {
+		X509 *crt = NULL;
+		if ((ok = pem_decode(&block, &der))) {
+			const unsigned char *in = der.buf;
+			ok = (crt = d2i_X509(NULL, &in, der.len)) != NULL;
+		}
+		if (ok && ! sk_X509_push(certs, crt)) {
+			X509_free(crt);
+			break;
+		}
+	}
+	der_free(&der);
+	if (! ok) {
+		ERR_clear_error();
+		while (sk_X509_num(certs) > 0) {
+			X509_free(sk_X509_pop(certs));
+		}
+	}
+	return ok;
+}
+
+int store_parse_chain(const char *data, size_t len, X509 **leaf, STACK_OF(X509) **untrusted) {
+	STACK_OF(X509) *certs = sk_X509_new_null();
+	X509 *crt;
+
+	if (certs == NULL) {
+		return 0;
+	}
+
+	if (len > 10 && memcmp(data, "-----BEGIN", 10) == 0 && store_chain_plain(data, len, certs)) {
+		// every block decoded straight from base64
+	} else if (len > 10 && memcmp(data, "-----BEGIN", 10) == 0) {
+		BIO *bio = BIO_new_mem_buf(data, len);
+		while (bio != NULL && (crt = PEM_read_bio_X509(bio, NULL, NULL, NULL)) != NULL) {
+			if (! sk_X509_push(certs, crt)) {
+				X509_free(crt);
+				break;
+			}
+		}
+		BIO_free(bio);
+	} else {
+		const unsigned char *p = (const unsigned char *) data;
+		const unsigned char *end = p + len;
+		while (p < end && (crt = d2i_X509(NULL, &p, end - p)) != NULL) {
+			if (! sk_X509_push(certs, crt)) {
+				X509_free(crt);
+				break;
+			}
+		}
+	}
+	// the reader stops on the error it hits past the last certificate
+	ERR_clear_error();
+
+	if (sk_X509_num(certs) == 0) {
+		sk_X509_free(certs);
+		return 0;
+	}
+	*leaf = sk_X509_shift(certs);
+	*untrusted = certs;
+	return 1;
+}
+
+int store_verify(struct store *store, X509 *leaf, STACK_OF(X509) *untrusted,
+		const struct store_opts *opts, const unsigned char *key, struct store_result *res) {
+	uint64_t generation = __atomic_load_n(&store->generation, __ATOMIC_ACQUIRE);
+	memset(res, 0, sizeof(*res));
+
+	X509_STORE_CTX *ctx = ctx_get();
+	if (ctx == NULL || ! X509_STORE_CTX_init(ctx, store->x509, leaf, untrusted)) {
+		err_descr_to_stderr("Error initializing verification context");
+		if (ctx != NULL) {
+			X509_STORE_CTX_free(ctx);
+		}
+		res->error = X509_V_ERR_OUT_OF_MEM;
+		return 0;
+	}
+
+	X509_VERIFY_PARAM *param = X509_STORE_CTX_get0_param(ctx);
+	if (opts->at != 0) {
+		X509_VERIFY_PARAM_set_time(param, opts->at);
+	}
+	if (opts->depth > 0) {
+		X509_VERIFY_PARAM_set_depth(param, opts->depth);
+	}
+	if (opts->purpose > 0) {
+		X509_STORE_CTX_set_purpose(ctx, opts->purpose);
+	}
+	if (opts->crl_check > 0) {
+		X509_VERIFY_PARAM_set_flags(param, opts->crl_check > 1 ?
+				X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL : X509_V_FLAG_CRL_CHECK);
+	}
+	if (opts->host != NULL) {
+		X509_VERIFY_PARAM_set1_host(param, opts->host, 0);
+	}
+
+	res->ok = X509_verify_cert(ctx) == 1;
+	res->error = X509_STORE_CTX_get_error(ctx);
+	res->depth = X509_STORE_CTX_get_error_depth(ctx);
+	STACK_OF(X509) *chain = X509_STORE_CTX_get0_chain(ctx);
+	res->chain_len = chain != NULL ? sk_X509_num(chain) : 0;
+	ERR_clear_error();
+
+	// a certificate that is not valid yet will be, so that answer is not kept
+	if (key != NULL && store->cache != NULL && chain != NULL
+			&& res->error != X509_V_ERR_CERT_NOT_YET_VALID
+			&& res->error != X509_V_ERR_CRL_NOT_YET_VALID
+			&& res->error != X509_V_ERR_OUT_OF_MEM) {
+		time_t now = time(NULL);
+		time_t expires = chain_expiry(chain, now, store->cache->ttl);
+		if (expires > now) {
+			cache_insert(store->cache, key, generation, expires, res);
+		}
+	}
+
+	ctx_put(ctx);
+	return res->ok;
+}
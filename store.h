@@ -0,0 +1,71 @@
+#ifndef LUA_OPENSSL_STORE_H
+#define LUA_OPENSSL_STORE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <openssl/x509.h>
+
+#define STORE_KEY_LEN 32
+
+struct store_cache;
+
+/* ------------------------------------------------------------ *
+ * Trust anchors (and CRLs) parsed once into an X509_STORE and  *
+ * shared by refcount between everything that verifies.         *
+ * generation moves whenever the store contents change, which   *
+ * retires every cached verification result.                    *
+ * -------------------------------------------------------------*/
+struct store {
+	int refs;
+	X509_STORE *x509;
+	uint64_t generation;
+	struct store_cache *cache;	/* NULL unless enabled */
+};
+
+/* store_verify options; zeroed means library defaults */
+struct store_opts {
+	time_t at;		/* verification time, 0 = now */
+	int depth;		/* max chain depth, 0 = default */
+	int purpose;		/* X509_PURPOSE_*, 0 = any */
+	int crl_check;		/* 1 = leaf, 2 = whole chain */
+	const char *host;	/* expected DNS name, NULL = don't check */
+};
+
+struct store_result {
+	int ok;
+	int error;		/* X509_V_* */
+	int depth;		/* where the error was found */
+	int chain_len;		/* certificates in the verified chain */
+};
+
+struct store *store_new(const char *bundle, size_t len);
+struct store *store_ref(struct store *store);
+void store_unref(struct store *store);
+
+/* adds the certificates and CRLs of a PEM bundle, returns how many */
+int store_add(struct store *store, const char *bundle, size_t len);
+
+/* opt-in result cache; call before the store is shared */
+int store_cache_enable(struct store *store, size_t entries, long ttl);
+void store_cache_stats(struct store *store, uint64_t *hits, uint64_t *misses, size_t *entries);
+
+/* ------------------------------------------------------------ *
+ * Cache key: SHA-256 over the presented chain (leaf first, as  *
+ * sent) and every option that changes the outcome. Returns 0   *
+ * when the result must not be cached (explicit time).          *
+ * -------------------------------------------------------------*/
+int store_key(const struct store_opts *opts, const char *const *parts, const size_t *lens,
+		size_t count, unsigned char key[STORE_KEY_LEN]);
+int store_lookup(struct store *store, const unsigned char key[STORE_KEY_LEN], struct store_result *res);
+
+/* PEM (one or more certificates) or concatenated DER: leaf first */
+int store_parse_chain(const char *data, size_t len, X509 **leaf, STACK_OF(X509) **untrusted);
+
+/* key, when not NULL, stores the outcome in the cache */
+int store_verify(struct store *store, X509 *leaf, STACK_OF(X509) *untrusted,
+		const struct store_opts *opts, const unsigned char *key, struct store_result *res);
+
+#endif